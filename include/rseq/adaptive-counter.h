@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * adaptive-counter.h
+ *
+ * Counters which promote themselves from shared to per-CPU mode under
+ * contention.
+ *
+ * A counter starts in shared mode, where it is a single word updated
+ * with compare-and-swap. Failed compare-and-swap attempts are counted,
+ * and the counter allocates per-CPU slots updated with restartable
+ * sequences once they exceed a threshold. Per-CPU slots are released
+ * again (demotion) after the counter has been idle for a number of
+ * consecutive calls to rseq_adaptive_counter_poll(), so only contended
+ * counters use CPU_SETSIZE cache lines.
+ *
+ * Demotion relies on membarrier(2) MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ
+ * to abort in-flight critical sections which may still use the per-CPU
+ * slots. When it is unavailable, promoted counters stay per-CPU.
+ *
+ * Threads updating counters must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_ADAPTIVE_COUNTER_H
+#define RSEQ_ADAPTIVE_COUNTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <rseq/rseq.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Default number of failed compare-and-swap before promotion. */
+#define RSEQ_ADAPTIVE_COUNTER_PROMOTE_THRESHOLD	64
+/* Default maximum per-CPU change between polls for a poll to be idle. */
+#define RSEQ_ADAPTIVE_COUNTER_IDLE_THRESHOLD	16
+/* Default number of consecutive idle polls before demotion. */
+#define RSEQ_ADAPTIVE_COUNTER_IDLE_POLLS	8
+
+struct rseq_adaptive_counter_entry {
+	intptr_t count;
+	intptr_t poll_count;		/* Value seen by last poll. */
+} __attribute__((aligned(128)));
+
+struct rseq_adaptive_counter_percpu {
+	struct rseq_adaptive_counter_entry c[CPU_SETSIZE];
+};
+
+struct rseq_adaptive_counter {
+	/* Shared mode value. Also receives per-CPU slots on demotion. */
+	intptr_t shared;
+	/* Per-CPU slots, NULL in shared mode. */
+	struct rseq_adaptive_counter_percpu *percpu;
+	/* Failed compare-and-swap since last poll. */
+	intptr_t nr_contended;
+
+	/* Protects mode changes and the fields below. */
+	pthread_mutex_t lock;
+	unsigned int nr_idle_polls;
+	unsigned int promote_threshold;
+	unsigned int idle_threshold;
+	unsigned int idle_polls;
+};
+
+/*
+ * Initialize @counter in shared mode with value 0 and default
+ * thresholds. Returns 0 on success, -1 with errno set on error.
+ */
+int rseq_adaptive_counter_init(struct rseq_adaptive_counter *counter);
+
+/*
+ * Release the per-CPU slots of @counter, if any. Must only be invoked
+ * when there are no more concurrent users.
+ */
+void rseq_adaptive_counter_destroy(struct rseq_adaptive_counter *counter);
+
+/*
+ * Set the number of failed compare-and-swap between polls which
+ * promotes @counter, and the number of consecutive polls during which
+ * the per-CPU slots change by less than @idle_threshold in total which
+ * demotes it.
+ */
+void rseq_adaptive_counter_set_thresholds(struct rseq_adaptive_counter *counter,
+		unsigned int promote_threshold, unsigned int idle_threshold,
+		unsigned int idle_polls);
+
+/*
+ * Switch @counter to per-CPU mode regardless of contention. Returns 0
+ * on success, -1 with errno set on error.
+ */
+int rseq_adaptive_counter_promote(struct rseq_adaptive_counter *counter);
+
+/*
+ * Shared mode update, promoting @counter if it is contended. Called by
+ * rseq_adaptive_counter_add().
+ */
+void rseq_adaptive_counter_add_shared(struct rseq_adaptive_counter *counter,
+		intptr_t v);
+
+/*
+ * Return the current value of @counter. This is a sum over all CPUs
+ * in per-CPU mode.
+ */
+intptr_t rseq_adaptive_counter_read(struct rseq_adaptive_counter *counter);
+
+/*
+ * Periodic maintenance: reset the contention count, and demote
+ * @counter if its per-CPU slots have been idle for long enough.
+ * Returns true if @counter is in per-CPU mode after the call.
+ */
+bool rseq_adaptive_counter_poll(struct rseq_adaptive_counter *counter);
+
+static inline bool rseq_adaptive_counter_is_percpu(struct rseq_adaptive_counter *counter)
+{
+	return RSEQ_READ_ONCE(counter->percpu) != NULL;
+}
+
+static inline void rseq_adaptive_counter_add(struct rseq_adaptive_counter *counter,
+		intptr_t v)
+{
+	int cpu, ret;
+
+	if (rseq_adaptive_counter_is_percpu(counter)) {
+		/*
+		 * The per-CPU slots are dereferenced within the critical
+		 * section, so demotion only has to abort in-flight
+		 * sequences before folding and freeing them.
+		 */
+		do {
+			cpu = rseq_cpu_start();
+			ret = rseq_deref_addoffp((intptr_t *) &counter->percpu,
+				cpu * sizeof(struct rseq_adaptive_counter_entry),
+				v, cpu);
+		} while (rseq_unlikely(ret < 0));
+		if (rseq_likely(!ret))
+			return;
+		/* Demoted concurrently. */
+	}
+	rseq_adaptive_counter_add_shared(counter, v);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_ADAPTIVE_COUNTER_H */
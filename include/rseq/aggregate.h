@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * aggregate.h
+ *
+ * Per-CPU partial aggregation by key.
+ *
+ * Events are aggregated by 64-bit key into a sum, a count, a minimum
+ * and a maximum. Keys are resolved into a slot of an open addressing
+ * directory shared by all CPUs, which is only written when a key is
+ * first seen. Each possible CPU holds a row of partial aggregates
+ * indexed by slot, updated with rseq critical sections on the row of
+ * the current CPU, so updates never write shared cache lines.
+ *
+ * Rows are stored as columns, so merging CPUs combines each column of
+ * every row with a sequential loop over slots, which the compiler
+ * vectorizes. Minimums and maximums are stored with an order-preserving
+ * encoding for which zero is the neutral value, so rows of CPUs which
+ * never update the aggregation are never touched.
+ *
+ * Merges happen on demand with rseq_aggregate_merge(), or periodically
+ * on the ticks of a memory pressure monitor.
+ *
+ * Threads adding events must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_AGGREGATE_H
+#define RSEQ_AGGREGATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <rseq/mempressure.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rseq_aggregate;
+
+/*
+ * Merged aggregates, as columns of @nr_keys entries. The minimum and
+ * maximum of a key are only meaningful if its count is not zero.
+ */
+struct rseq_aggregate_snapshot {
+	size_t nr_keys;
+	uint64_t *keys;
+	intptr_t *sum;
+	intptr_t *count;
+	intptr_t *min;
+	intptr_t *max;
+	size_t alloc_keys;
+};
+
+/*
+ * Create an aggregation for up to @max_keys distinct keys. Returns NULL
+ * and sets errno on error.
+ */
+struct rseq_aggregate *rseq_aggregate_create(size_t max_keys);
+
+/*
+ * Stop periodic merges and free the aggregation.
+ */
+void rseq_aggregate_destroy(struct rseq_aggregate *aggr);
+
+/*
+ * Aggregate the value @v of an event for @key on the current CPU.
+ * Returns 0 on success, -1 with errno set to ENOSPC if @key is new and
+ * the aggregation already holds its maximum number of keys.
+ */
+int rseq_aggregate_add(struct rseq_aggregate *aggr, uint64_t key, intptr_t v);
+
+/* Number of distinct keys in @aggr. */
+size_t rseq_aggregate_nr_keys(struct rseq_aggregate *aggr);
+
+/*
+ * Combine the partial aggregates of all CPUs into @snapshot, in
+ * directory order. A zero-initialized @snapshot can be used for the
+ * first call. Events added concurrently may be partially accounted
+ * for, e.g. in the count but not yet in the sum. Returns 0 on success,
+ * -1 with errno set on error.
+ */
+int rseq_aggregate_merge(struct rseq_aggregate *aggr,
+		struct rseq_aggregate_snapshot *snapshot);
+
+/*
+ * Release the memory held by @snapshot.
+ */
+void rseq_aggregate_snapshot_fini(struct rseq_aggregate_snapshot *snapshot);
+
+/*
+ * Merge @aggr on each RSEQ_MEMPRESSURE_TICK event of @monitor, and
+ * invoke @cb with @priv and the merged aggregates from the monitor
+ * thread. A NULL @monitor stops periodic merges. Returns 0 on success,
+ * -1 with errno set on error.
+ */
+int rseq_aggregate_set_periodic(struct rseq_aggregate *aggr,
+		struct rseq_mempressure *monitor,
+		void (*cb)(void *priv, const struct rseq_aggregate_snapshot *snapshot),
+		void *priv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_AGGREGATE_H */
@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * channel.h
+ *
+ * Bounded blocking multi-producer multi-consumer channel with per-CPU
+ * lanes.
+ *
+ * Each possible CPU owns a lane, a ring of pointers. Senders enqueue
+ * into the lane of their current CPU with a restartable sequence.
+ * Receivers dequeue from the lane of their current CPU first, then
+ * steal from the other lanes, with a compare-and-swap on the head of
+ * the lane. Items are received in order within a lane, but there is no
+ * ordering between lanes.
+ *
+ * The capacity of the channel is accounted for with send credits,
+ * cached per CPU: receivers return the credit of an item to the cache
+ * of their current CPU, and senders take credits from the cache of
+ * their current CPU, refilling it in batches from a global pool. When
+ * the pool is empty, senders reclaim the credits cached by other CPUs
+ * by replacing the cached count with RSEQ_CHANNEL_LOCKED and issuing
+ * MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, so the channel requires rseq
+ * membarrier support from the kernel.
+ *
+ * Receivers only block on a futex when every lane is empty, and
+ * senders when no credit is left in the channel.
+ *
+ * Threads sending and receiving must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_CHANNEL_H
+#define RSEQ_CHANNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Credit count of a CPU being reclaimed by another CPU. */
+#define RSEQ_CHANNEL_LOCKED	((intptr_t) -1)
+
+/* Maximum capacity of a channel. */
+#define RSEQ_CHANNEL_MAX_CAPACITY	(1U << 20)
+
+struct rseq_channel;
+
+/*
+ * Create a channel holding up to @capacity items. Each lane can hold
+ * the whole capacity, and its memory is only backed once used. Returns
+ * NULL and sets errno on error (ENOSYS if rseq membarrier is not
+ * supported by the kernel).
+ */
+struct rseq_channel *rseq_channel_create(size_t capacity);
+
+/*
+ * Free the channel. Items left in the channel are discarded. No thread
+ * may use the channel concurrently.
+ */
+void rseq_channel_destroy(struct rseq_channel *chan);
+
+/*
+ * Send @item, waiting while the channel is full. Returns 0 on success,
+ * -1 with errno set to EPIPE if the channel is closed.
+ */
+int rseq_channel_send(struct rseq_channel *chan, void *item);
+
+/*
+ * Send @item if the channel is not full. Returns 0 on success, -1 with
+ * errno set to EAGAIN if the channel is full, or EPIPE if it is closed.
+ */
+int rseq_channel_try_send(struct rseq_channel *chan, void *item);
+
+/*
+ * Receive an item into @item, waiting while the channel is empty.
+ * Returns 0 on success, -1 with errno set to EPIPE once the channel is
+ * closed and empty.
+ */
+int rseq_channel_recv(struct rseq_channel *chan, void **item);
+
+/*
+ * Receive an item into @item if the channel is not empty. Returns 0 on
+ * success, -1 with errno set to EAGAIN if the channel is empty, or EPIPE
+ * if it is also closed.
+ */
+int rseq_channel_try_recv(struct rseq_channel *chan, void **item);
+
+/*
+ * Close the channel and wake up waiting threads. Later sends fail with
+ * EPIPE, and receives fail with EPIPE once the items sent before the
+ * channel was closed are received. Items of sends concurrent with the
+ * close may be left in the channel.
+ */
+void rseq_channel_close(struct rseq_channel *chan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_CHANNEL_H */
@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * counter-tree.h
+ *
+ * Hierarchical per-CPU counters.
+ *
+ * A counter tree accounts events against nested entities, e.g. tenant,
+ * service and endpoint. The value of a node includes the events added
+ * to all its descendants, so an event on an endpoint is also counted by
+ * its service and its tenant.
+ *
+ * Adding to a node is a single rseq_addv() on the slot of the current
+ * CPU, independently of the depth of the node. A restartable sequence
+ * commits with a single store, so the slots of the ancestors cannot be
+ * updated within the same sequence without counting events twice when
+ * the sequence is restarted. Instead, reads roll the slots of the
+ * subtree up across CPUs, which moves the cost of the hierarchy from
+ * the fast path to readers.
+ *
+ * Slots are laid out in chunks of RSEQ_COUNTER_TREE_CHUNK_NODES nodes,
+ * with one row of slots per possible CPU, as for the metrics registry.
+ *
+ * Threads adding to counters must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_COUNTER_TREE_H
+#define RSEQ_COUNTER_TREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <rseq/rseq.h>
+#include <rseq/op-prof.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Number of nodes per chunk, and stride between per-CPU slots. */
+#define RSEQ_COUNTER_TREE_CHUNK_NODES	1024
+
+struct rseq_counter_tree;
+
+/* Handle on a node, stable for the lifetime of the tree. */
+struct rseq_counter_tree_node {
+	intptr_t *slots;	/* Slot of CPU 0. */
+	uint32_t index;
+};
+
+/*
+ * Create a tree holding only its root node. Returns NULL and sets errno
+ * on error.
+ */
+struct rseq_counter_tree *rseq_counter_tree_create(void);
+
+/*
+ * Free the tree. Node handles must not be used anymore.
+ */
+void rseq_counter_tree_destroy(struct rseq_counter_tree *tree);
+
+/* Store the handle of the root node of @tree into @root. */
+void rseq_counter_tree_root(struct rseq_counter_tree *tree,
+		struct rseq_counter_tree_node *root);
+
+/*
+ * Create a child of @parent with value 0, and store its handle into
+ * @child. Returns 0 on success, -1 with errno set on error.
+ */
+int rseq_counter_tree_add_child(struct rseq_counter_tree *tree,
+		const struct rseq_counter_tree_node *parent,
+		struct rseq_counter_tree_node *child);
+
+/* Number of nodes in @tree, including the root. */
+size_t rseq_counter_tree_nr_nodes(struct rseq_counter_tree *tree);
+
+/*
+ * Return the sum of the events added to @node and to all its
+ * descendants, across all CPUs.
+ */
+intptr_t rseq_counter_tree_read(struct rseq_counter_tree *tree,
+		const struct rseq_counter_tree_node *node);
+
+/*
+ * Return the sum of the events added to @node itself, excluding its
+ * descendants, across all CPUs.
+ */
+intptr_t rseq_counter_tree_read_self(struct rseq_counter_tree *tree,
+		const struct rseq_counter_tree_node *node);
+
+static inline void rseq_counter_tree_add(const struct rseq_counter_tree_node *node,
+		intptr_t v)
+{
+	RSEQ_OP_PROF_BEGIN("counter_tree_add");
+	int cpu;
+
+	do {
+		cpu = rseq_cpu_start();
+	} while (rseq_unlikely(rseq_addv(node->slots +
+			(size_t) cpu * RSEQ_COUNTER_TREE_CHUNK_NODES, v, cpu)));
+	RSEQ_OP_PROF_END();
+}
+
+static inline void rseq_counter_tree_inc(const struct rseq_counter_tree_node *node)
+{
+	rseq_counter_tree_add(node, 1);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_COUNTER_TREE_H */
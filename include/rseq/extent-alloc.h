@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * extent-alloc.h
+ *
+ * Per-CPU extent allocator for on-disk space.
+ *
+ * An extent allocator hands out ranges of blocks, e.g. file offsets or
+ * device blocks, from a space of a fixed number of blocks. It only
+ * manages numbers: it never performs I/O.
+ *
+ * Free space is kept in a global list of free extents sorted by offset,
+ * protected by a mutex. Each CPU leases a contiguous range of
+ * lease_len free blocks from it, and carves allocations out of its
+ * lease with a single rseq_cmpeqv_storev() bumping the number of
+ * blocks used. When the lease cannot hold an allocation, the CPU takes
+ * a new lease, and returns the unused tail of the previous one to the
+ * global list. Allocations larger than a lease, and allocations made
+ * once no free extent can hold a whole lease, are served by the global
+ * list directly.
+ *
+ * Freed extents are appended to a batch of the current CPU. A full
+ * batch is sorted and merged into the global list, coalescing adjacent
+ * extents, in a single pass under the mutex. rseq_extent_alloc_flush()
+ * returns the batches and leases of every CPU to the global list; it
+ * is also invoked before an allocation fails for lack of space.
+ *
+ * Creating an allocator requires MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ,
+ * used to take leases and batches away from other CPUs. Threads
+ * allocating and freeing extents must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_EXTENT_ALLOC_H
+#define RSEQ_EXTENT_ALLOC_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Largest lease, in blocks. */
+#define RSEQ_EXTENT_ALLOC_MAX_LEASE	(1U << 20)
+
+struct rseq_extent_alloc;
+
+struct rseq_extent {
+	uint64_t offset;
+	uint64_t len;
+};
+
+/*
+ * Create an allocator for the blocks [0, @size), all free, leasing
+ * @lease_len blocks at a time to each CPU. @size must fit in an
+ * intptr_t. Returns NULL and sets errno on error, ENOSYS if rseq
+ * membarrier is unavailable.
+ */
+struct rseq_extent_alloc *rseq_extent_alloc_create(uint64_t size,
+		unsigned int lease_len);
+
+/*
+ * Free the allocator. Extents still allocated are forgotten.
+ */
+void rseq_extent_alloc_destroy(struct rseq_extent_alloc *ea);
+
+/*
+ * Allocate @len contiguous blocks, and store the offset of the first
+ * one into @offset. Returns 0 on success, -1 with errno set to EINVAL
+ * if @len is 0, or ENOSPC if no free extent can hold @len blocks.
+ */
+int rseq_extent_alloc_get(struct rseq_extent_alloc *ea, uint64_t len,
+		uint64_t *offset);
+
+/*
+ * Free the @len blocks starting at @offset, which must have been
+ * allocated, possibly as part of a larger extent.
+ */
+void rseq_extent_alloc_put(struct rseq_extent_alloc *ea, uint64_t offset,
+		uint64_t len);
+
+/*
+ * Return the leases and freed extents held by every CPU to the global
+ * list of free extents.
+ */
+void rseq_extent_alloc_flush(struct rseq_extent_alloc *ea);
+
+/*
+ * Number of blocks in the global list of free extents, excluding
+ * blocks held by CPUs, and number of extents they form if @nr_extents
+ * is not NULL.
+ */
+uint64_t rseq_extent_alloc_free_blocks(struct rseq_extent_alloc *ea,
+		uint64_t *nr_extents);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_EXTENT_ALLOC_H */
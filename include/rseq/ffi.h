@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * ffi.h
+ *
+ * Out-of-line restartable sequence entry points for foreign function
+ * interfaces.
+ *
+ * The primitives of rseq.h are static inline assembly, which languages
+ * binding to librseq through an FFI cannot use. These functions wrap
+ * each of them out of line, with the same arguments and return values.
+ * Since a foreign call costs more than the critical section itself, the
+ * batch entry points apply a whole array of operations per call, each
+ * one retried until it commits on the current CPU.
+ *
+ * All symbols declared here belong to the LIBRSEQ_FFI_1 symbol version,
+ * so JIT compilers can bind them with dlvsym(3).
+ */
+
+#ifndef RSEQ_FFI_H
+#define RSEQ_FFI_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <rseq/percpu-cache.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RSEQ_FFI_VERSION	"LIBRSEQ_FFI_1"
+
+int32_t rseq_ffi_current_cpu_raw(void);
+uint32_t rseq_ffi_cpu_start(void);
+uint32_t rseq_ffi_current_cpu(void);
+void rseq_ffi_prepare_unload(void);
+
+int rseq_ffi_cmpeqv_storev(intptr_t *v, intptr_t expect, intptr_t newv, int cpu);
+int rseq_ffi_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
+		off_t voffp, intptr_t *load, int cpu);
+int rseq_ffi_addv(intptr_t *v, intptr_t count, int cpu);
+int rseq_ffi_cmpeqv_trystorev_storev(intptr_t *v, intptr_t expect,
+		intptr_t *v2, intptr_t newv2, intptr_t newv, int cpu);
+int rseq_ffi_cmpeqv_trystorev_storev_release(intptr_t *v, intptr_t expect,
+		intptr_t *v2, intptr_t newv2, intptr_t newv, int cpu);
+int rseq_ffi_cmpeqv_cmpeqv_storev(intptr_t *v, intptr_t expect,
+		intptr_t *v2, intptr_t expect2, intptr_t newv, int cpu);
+int rseq_ffi_cmpeqv_cmpeqm_storev(intptr_t *v, intptr_t expect,
+		void *m, void *expectm, size_t len, intptr_t newv, int cpu);
+int rseq_ffi_cmpeqv_trymemcpy_storev(intptr_t *v, intptr_t expect,
+		void *dst, void *src, size_t len, intptr_t newv, int cpu);
+int rseq_ffi_cmpeqv_trymemcpy_storev_release(intptr_t *v, intptr_t expect,
+		void *dst, void *src, size_t len, intptr_t newv, int cpu);
+int rseq_ffi_deref_loadoffp(void *p, off_t voffp, intptr_t *load, int cpu);
+int rseq_ffi_deref_addoffp(intptr_t *p, off_t voffp, intptr_t count, int cpu);
+
+/*
+ * Add @counts[i] to the word at byte offset @offsets[i] of the row of
+ * the current CPU, for each i in [0, @n). Row of CPU c starts at byte
+ * c * @cpu_stride of @base.
+ */
+void rseq_ffi_percpu_add_batch(void *base, size_t cpu_stride,
+		const off_t *offsets, const intptr_t *counts, size_t n);
+
+/* Push @n objects of @objs to @cache. */
+void rseq_ffi_percpu_cache_push_batch(struct rseq_percpu_cache *cache,
+		void *const *objs, size_t n);
+
+/*
+ * Pop up to @n objects from @cache into @objs. Returns the number of
+ * objects popped, which is less than @n if the cache ran out of objects.
+ */
+size_t rseq_ffi_percpu_cache_pop_batch(struct rseq_percpu_cache *cache,
+		void **objs, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_FFI_H */
@@ -0,0 +1,116 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * file-counters.h
+ *
+ * Per-CPU counters mapped from a file, surviving process crashes.
+ *
+ * The file holds a header followed by one row of counter slots per CPU,
+ * and is mapped with MAP_SHARED. Adding to a counter is a single
+ * rseq_addv() on the slot of the current CPU, so the counter lives in
+ * the page cache: once an addition has committed, it survives a crash
+ * of the process without any write to a journal. Crashes never leave a
+ * counter half updated, since each addition is a single store.
+ *
+ * Opening an existing file recovers its counters: rows are never
+ * folded or cleared, and reading a counter sums its slots in every row
+ * of the file. A file is grown with zeroed rows when opened on a
+ * machine with more possible CPUs, and keeps the rows of CPUs which no
+ * longer exist. Several processes may map the same file and add to its
+ * counters concurrently.
+ *
+ * Surviving a crash of the machine requires writing the counters back
+ * to storage with rseq_file_counters_checkpoint(). Checkpoints take no
+ * lock and do not stop additions, so they do not capture the counters
+ * at a single point in time: after a crash of the machine, each slot
+ * holds a value at least as recent as the last checkpoint. Updaters
+ * never wait for a checkpoint, except for the page fault taken by the
+ * first addition to a page written back, which may wait for the write
+ * to complete on file systems requiring stable pages.
+ *
+ * Threads adding to counters must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_FILE_COUNTERS_H
+#define RSEQ_FILE_COUNTERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <rseq/rseq.h>
+#include <rseq/op-prof.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum number of counters in a file. */
+#define RSEQ_FILE_COUNTERS_MAX		(1U << 20)
+
+struct rseq_file_counters {
+	/* Row of CPU 0, the row of each CPU following at @stride slots. */
+	intptr_t *rows;
+	size_t stride;
+	unsigned int nr_counters;
+	/* Rows in the file, at least one per possible CPU. */
+	int nr_rows;
+	int fd;
+	void *map;
+	size_t map_len;
+};
+
+/*
+ * Open the file of @nr_counters counters at @path, creating it with
+ * zeroed counters if it does not exist. An existing file must hold
+ * @nr_counters counters. Returns NULL and sets errno on error (EINVAL
+ * if the file is not a counter file of @nr_counters counters).
+ */
+struct rseq_file_counters *rseq_file_counters_open(const char *path,
+		unsigned int nr_counters);
+
+/*
+ * Unmap and close the file. Counters are not written back to storage
+ * beforehand.
+ */
+void rseq_file_counters_close(struct rseq_file_counters *fc);
+
+/* Sum of the slots of counter @index in every row. */
+intptr_t rseq_file_counters_read(struct rseq_file_counters *fc,
+		unsigned int index);
+
+/*
+ * Write the counters back to storage with msync(2), without stopping
+ * concurrent additions. Returns 0 on success, -1 with errno set on
+ * error.
+ */
+int rseq_file_counters_checkpoint(struct rseq_file_counters *fc);
+
+/*
+ * Number of checkpoints completed on the file, by any process, since
+ * it was created.
+ */
+uint64_t rseq_file_counters_nr_checkpoints(struct rseq_file_counters *fc);
+
+static inline void rseq_file_counters_add(struct rseq_file_counters *fc,
+		unsigned int index, intptr_t v)
+{
+	RSEQ_OP_PROF_BEGIN("file_counters_add");
+	int cpu;
+
+	do {
+		cpu = rseq_cpu_start();
+	} while (rseq_unlikely(rseq_addv(fc->rows + (size_t) cpu * fc->stride +
+			index, v, cpu)));
+	RSEQ_OP_PROF_END();
+}
+
+static inline void rseq_file_counters_inc(struct rseq_file_counters *fc,
+		unsigned int index)
+{
+	rseq_file_counters_add(fc, index, 1);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_FILE_COUNTERS_H */
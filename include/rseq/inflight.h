@@ -0,0 +1,114 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * inflight.h
+ *
+ * Per-CPU tracking of in-flight requests for client-side load
+ * balancing.
+ *
+ * The number of outstanding requests of each backend is split into one
+ * row of per-CPU counters per possible CPU: sending a request and
+ * completing it are each a single rseq_addv() on the row of the current
+ * CPU, so requests never share cache lines across CPUs.
+ *
+ * Backend selection uses the power of two choices: two distinct backends
+ * are picked at random, and the one with the fewest estimated in-flight
+ * requests wins. Estimates come from a snapshot of all rows, refreshed
+ * by the selecting threads at most once per refresh period, corrected
+ * by the changes of the row of the current CPU since the snapshot. The
+ * random choice keeps clients from all picking the same backend between
+ * refreshes.
+ *
+ * Threads using the tracker must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_INFLIGHT_H
+#define RSEQ_INFLIGHT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <rseq/rseq.h>
+#include <rseq/op-prof.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Default period between snapshot refreshes. */
+#define RSEQ_INFLIGHT_REFRESH_US	1000
+
+struct rseq_inflight {
+	size_t nr_backends;
+	/* Distance between the rows of consecutive CPUs, in counters. */
+	size_t row_stride;
+	int nr_cpus;
+	/* One row of nr_backends counters per possible CPU. */
+	intptr_t *rows;
+	size_t rows_len;
+
+	/* Rows and per-backend totals as of the last refresh. */
+	intptr_t *snapshot_rows;
+	intptr_t *snapshot_totals;
+	uint64_t refresh_ns;
+	uint64_t last_refresh_ns;
+	pthread_mutex_t refresh_lock;
+};
+
+/*
+ * Create a tracker for @nr_backends backends, refreshing its snapshot
+ * at most every @refresh_us microseconds. Returns NULL and sets errno on
+ * error.
+ */
+struct rseq_inflight *rseq_inflight_create(size_t nr_backends,
+		unsigned int refresh_us);
+
+void rseq_inflight_destroy(struct rseq_inflight *inflight);
+
+/*
+ * Return the backend with the fewest estimated in-flight requests among
+ * two picked at random.
+ */
+size_t rseq_inflight_select(struct rseq_inflight *inflight);
+
+/* Refresh the snapshot used by rseq_inflight_select() now. */
+void rseq_inflight_refresh(struct rseq_inflight *inflight);
+
+/* Exact number of in-flight requests of @backend, summing all CPUs. */
+intptr_t rseq_inflight_read(struct rseq_inflight *inflight, size_t backend);
+
+static inline void rseq_inflight_add(struct rseq_inflight *inflight,
+		size_t backend, intptr_t count)
+{
+	RSEQ_OP_PROF_BEGIN("inflight_add");
+	int cpu;
+
+	do {
+		cpu = rseq_cpu_start();
+	} while (rseq_unlikely(rseq_addv(&inflight->rows[cpu * inflight->row_stride + backend],
+			count, cpu)));
+	RSEQ_OP_PROF_END();
+}
+
+/* Account a request sent to @backend. */
+static inline void rseq_inflight_begin(struct rseq_inflight *inflight,
+		size_t backend)
+{
+	rseq_inflight_add(inflight, backend, 1);
+}
+
+/*
+ * Account the completion of a request sent to @backend, possibly from
+ * another CPU than the one which sent it.
+ */
+static inline void rseq_inflight_end(struct rseq_inflight *inflight,
+		size_t backend)
+{
+	rseq_inflight_add(inflight, backend, -1);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_INFLIGHT_H */
@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * mempressure.h
+ *
+ * Memory pressure notifications.
+ *
+ * A monitor thread waits for memory pressure events and invokes the
+ * registered callbacks, so per-CPU caches sized for peak load can give
+ * memory back. Pressure is detected with a PSI trigger on
+ * /proc/pressure/memory, or on the memory.pressure file of the cgroup
+ * of the process, falling back to increases of the "high", "max" and
+ * "oom" counters of the cgroup memory.events file. The callbacks are
+ * also invoked periodically, which lets caches release memory held by
+ * idle CPUs.
+ */
+
+#ifndef RSEQ_MEMPRESSURE_H
+#define RSEQ_MEMPRESSURE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Default PSI trigger: 200ms of partial stall within a 2s window. */
+#define RSEQ_MEMPRESSURE_STALL_US	200000
+#define RSEQ_MEMPRESSURE_WINDOW_US	2000000
+/* Default period of RSEQ_MEMPRESSURE_TICK events. */
+#define RSEQ_MEMPRESSURE_TICK_MS	1000
+
+enum rseq_mempressure_event {
+	RSEQ_MEMPRESSURE_PRESSURE,	/* Memory pressure was detected. */
+	RSEQ_MEMPRESSURE_TICK,		/* Periodic event. */
+};
+
+enum rseq_mempressure_source {
+	RSEQ_MEMPRESSURE_SOURCE_NONE,	/* Only ticks and manual triggers. */
+	RSEQ_MEMPRESSURE_SOURCE_PSI,
+	RSEQ_MEMPRESSURE_SOURCE_CGROUP_PSI,
+	RSEQ_MEMPRESSURE_SOURCE_CGROUP_EVENTS,
+};
+
+struct rseq_mempressure;
+
+/*
+ * Create a monitor and start its thread. If @path is NULL, the first
+ * available source is used. Otherwise, @path is either a PSI file or a
+ * cgroup memory.events file. A PSI trigger fires when tasks stall on
+ * memory for @stall_us within @window_us. Callbacks are invoked with
+ * RSEQ_MEMPRESSURE_TICK every @tick_ms milliseconds, or never if
+ * @tick_ms is 0.
+ *
+ * Returns NULL and sets errno on error.
+ */
+struct rseq_mempressure *rseq_mempressure_create(const char *path,
+		unsigned int stall_us, unsigned int window_us, unsigned int tick_ms);
+
+/* Stop the monitor thread and free the monitor. */
+void rseq_mempressure_destroy(struct rseq_mempressure *monitor);
+
+enum rseq_mempressure_source rseq_mempressure_get_source(struct rseq_mempressure *monitor);
+
+/*
+ * Register @cb to be invoked from the monitor thread with @priv on each
+ * event. Callbacks of a monitor are serialized. Returns 0 on success,
+ * -1 with errno set on error.
+ */
+int rseq_mempressure_register(struct rseq_mempressure *monitor,
+		void (*cb)(void *priv, enum rseq_mempressure_event event), void *priv);
+
+/*
+ * Unregister a callback registered with the same @cb and @priv. Once
+ * this returns, the callback is not running and will not be invoked
+ * again. Must not be invoked from a callback.
+ */
+void rseq_mempressure_unregister(struct rseq_mempressure *monitor,
+		void (*cb)(void *priv, enum rseq_mempressure_event event), void *priv);
+
+/*
+ * Invoke the callbacks with RSEQ_MEMPRESSURE_PRESSURE from the monitor
+ * thread, for pressure signals known to the application.
+ */
+void rseq_mempressure_trigger(struct rseq_mempressure *monitor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_MEMPRESSURE_H */
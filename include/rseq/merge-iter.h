@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * merge-iter.h
+ *
+ * Timestamp-ordered merge of per-CPU event streams.
+ *
+ * The iterator performs a streaming k-way merge of per-CPU buffers,
+ * using a min-heap of the head event of each CPU keyed by their
+ * timestamp. Events are read in place through the source callbacks:
+ * an event returned by rseq_merge_iter_next() stays valid until the
+ * next call, which consumes it from its buffer.
+ *
+ * Events of each CPU must be in timestamp order. Across CPUs, an event
+ * may be appended to a buffer which was empty after a later event has
+ * been appended to another CPU buffer, either because of clock skew or
+ * because its producer was delayed. While some buffers are empty, the
+ * iterator therefore only returns events at least @window older than
+ * the most recent timestamp observed, leaving time for such events to
+ * show up. Events arriving later than that are returned out of order,
+ * and counted.
+ */
+
+#ifndef RSEQ_MERGE_ITER_H
+#define RSEQ_MERGE_ITER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rseq_merge_iter;
+
+struct rseq_merge_source {
+	/*
+	 * Return the oldest event of the buffer of @cpu and store its
+	 * timestamp into @timestamp, without consuming it. Return NULL
+	 * if the buffer is empty.
+	 */
+	const void *(*peek)(void *priv, int cpu, uint64_t *timestamp);
+	/* Consume the event last returned by peek() for @cpu. */
+	void (*consume)(void *priv, int cpu);
+};
+
+/*
+ * Create an iterator over the buffers of CPUs [0, @nr_cpus) of
+ * @source. Returns NULL and sets errno on error.
+ */
+struct rseq_merge_iter *rseq_merge_iter_create(const struct rseq_merge_source *source,
+		void *priv, int nr_cpus, uint64_t window);
+
+/*
+ * Free the iterator. The last event returned is not consumed.
+ */
+void rseq_merge_iter_destroy(struct rseq_merge_iter *iter);
+
+/*
+ * Consume the previously returned event, if any, and return the next
+ * event in timestamp order, along with its @cpu and @timestamp (both
+ * optional). Returns NULL if no event can be returned yet. If @flush is
+ * true, the lookahead window is ignored, which is meant to drain the
+ * buffers once producers have stopped.
+ */
+const void *rseq_merge_iter_next(struct rseq_merge_iter *iter, bool flush,
+		int *cpu, uint64_t *timestamp);
+
+/*
+ * Number of events returned with a timestamp older than an event
+ * returned before them.
+ */
+uint64_t rseq_merge_iter_nr_out_of_order(struct rseq_merge_iter *iter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_MERGE_ITER_H */
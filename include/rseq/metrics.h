@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * metrics.h
+ *
+ * Registry of per-CPU counters addressed by name and labels.
+ *
+ * A series, identified by a name and a set of (key, value) labels, is
+ * resolved once into a counter handle. Incrementing the handle is a
+ * single rseq_addv() on the slot of the current CPU, independently of
+ * the number of series in the registry.
+ *
+ * Counter slots are allocated in chunks of RSEQ_METRICS_CHUNK_SERIES
+ * series. Each chunk holds one row of slots per possible CPU, so the
+ * slot of a series for a given CPU is at a fixed stride from its slot
+ * for CPU 0, and rows of CPUs which never update a chunk are never
+ * touched. Snapshots sum the rows of each chunk sequentially.
+ *
+ * Threads incrementing counters must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_METRICS_H
+#define RSEQ_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <rseq/rseq.h>
+#include <rseq/op-prof.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Number of series per chunk, and stride between per-CPU slots. */
+#define RSEQ_METRICS_CHUNK_SERIES	1024
+
+struct rseq_metrics_registry;
+
+struct rseq_metrics_label {
+	const char *key;
+	const char *value;
+};
+
+/* Handle on a series, stable for the lifetime of the registry. */
+struct rseq_metrics_counter {
+	intptr_t *slots;	/* Slot of CPU 0. */
+};
+
+struct rseq_metrics_sample {
+	const char *name;
+	/* Labels sorted by key. */
+	const struct rseq_metrics_label *labels;
+	size_t nr_labels;
+	intptr_t value;
+	/* Change since the previous snapshot taken into the same object. */
+	intptr_t delta;
+};
+
+struct rseq_metrics_snapshot {
+	struct rseq_metrics_sample *samples;
+	size_t nr_samples;
+	size_t alloc_samples;
+};
+
+/*
+ * Create an empty registry. Returns NULL and sets errno on error.
+ */
+struct rseq_metrics_registry *rseq_metrics_registry_create(void);
+
+/*
+ * Free the registry and all its series. Counter handles must not be
+ * used anymore.
+ */
+void rseq_metrics_registry_destroy(struct rseq_metrics_registry *registry);
+
+/*
+ * Resolve the series identified by @name and @nr_labels @labels into
+ * @counter, creating the series with value 0 if it does not exist yet.
+ * Labels are matched regardless of their order. Returns 0 on success,
+ * -1 with errno set on error (EINVAL for duplicate or NULL label keys).
+ */
+int rseq_metrics_counter_get(struct rseq_metrics_registry *registry,
+		const char *name, const struct rseq_metrics_label *labels,
+		size_t nr_labels, struct rseq_metrics_counter *counter);
+
+/* Number of series in @registry. */
+size_t rseq_metrics_registry_nr_series(struct rseq_metrics_registry *registry);
+
+/*
+ * Fill @snapshot with the value of every series of @registry, in
+ * creation order, and their change since the previous call with the
+ * same @snapshot. A zero-initialized @snapshot can be used for the
+ * first call. Returns 0 on success, -1 with errno set on error.
+ */
+int rseq_metrics_snapshot_take(struct rseq_metrics_registry *registry,
+		struct rseq_metrics_snapshot *snapshot);
+
+/*
+ * Release the memory held by @snapshot.
+ */
+void rseq_metrics_snapshot_fini(struct rseq_metrics_snapshot *snapshot);
+
+static inline void rseq_metrics_counter_add(struct rseq_metrics_counter *counter,
+		intptr_t v)
+{
+	RSEQ_OP_PROF_BEGIN("metrics_counter_add");
+	int cpu;
+
+	do {
+		cpu = rseq_cpu_start();
+	} while (rseq_unlikely(rseq_addv(counter->slots +
+			(size_t) cpu * RSEQ_METRICS_CHUNK_SERIES, v, cpu)));
+	RSEQ_OP_PROF_END();
+}
+
+static inline void rseq_metrics_counter_inc(struct rseq_metrics_counter *counter)
+{
+	rseq_metrics_counter_add(counter, 1);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_METRICS_H */
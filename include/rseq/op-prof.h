@@ -0,0 +1,163 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * op-prof.h
+ *
+ * Sampled latency instrumentation of rseq operations.
+ *
+ * An operation site, e.g. the retry loop of rseq_metrics_counter_add(),
+ * is delimited with RSEQ_OP_PROF_BEGIN() and RSEQ_OP_PROF_END(). One in
+ * period operations of each site is timed with the time stamp counter
+ * (rdtsc on x86, cntvct_el0 on arm64, CLOCK_MONOTONIC nanoseconds
+ * elsewhere), including its retries, and recorded into a per-CPU
+ * log-linear histogram of the site with rseq_addv(). Other operations
+ * only decrement a per-CPU countdown of the site. Decrements are not
+ * atomic: a decrement lost to preemption only shifts the next sample.
+ *
+ * Instrumentation is opt-in twice. The site macros expand to nothing
+ * unless RSEQ_OP_PROF is defined when compiling the code using them,
+ * including the inline fast paths of librseq headers which use them.
+ * Instrumented sites then only sample once rseq_op_prof_enable() has
+ * been called; until then they only test a global pointer.
+ *
+ * Sites are identified by name: sites with the same name, e.g. copies
+ * of an inline function in several compilation units, share their
+ * histograms. Operations of threads not registered with rseq are never
+ * sampled.
+ */
+
+#ifndef RSEQ_OP_PROF_H
+#define RSEQ_OP_PROF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <rseq/rseq.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum number of distinct sites, further sites are never sampled. */
+#define RSEQ_OP_PROF_MAX_SITES		64
+
+/* Buckets of a histogram, the last one also counting longer operations. */
+#define RSEQ_OP_PROF_NR_BUCKETS		256
+
+struct rseq_op_prof_site {
+	const char *name;
+	/* Index of the site plus one, 0 before its first use, -1 if full. */
+	int id;
+};
+
+/*
+ * Merged histograms of every site, as rows of RSEQ_OP_PROF_NR_BUCKETS
+ * counts in registration order.
+ */
+struct rseq_op_prof_snapshot {
+	size_t nr_sites;
+	const char **names;
+	uint64_t (*buckets)[RSEQ_OP_PROF_NR_BUCKETS];
+	size_t alloc_sites;
+};
+
+/*
+ * Countdowns, one row of RSEQ_OP_PROF_MAX_SITES per possible CPU, or
+ * NULL while sampling is disabled.
+ */
+extern intptr_t *rseq_op_prof_countdowns;
+
+/*
+ * Sample one in @period operations of each site, or stop sampling if
+ * @period is 0. Histograms are kept across calls. Returns 0 on
+ * success, -1 with errno set on error.
+ */
+int rseq_op_prof_enable(unsigned int period);
+
+/* Lowest duration counted by @bucket, in time stamp counter ticks. */
+uint64_t rseq_op_prof_bucket_floor(unsigned int bucket);
+
+/*
+ * Sum the histograms of all CPUs into @snapshot. A zero-initialized
+ * @snapshot can be used for the first call. Returns 0 on success, -1
+ * with errno set on error.
+ */
+int rseq_op_prof_snapshot_take(struct rseq_op_prof_snapshot *snapshot);
+
+/*
+ * Release the memory held by @snapshot.
+ */
+void rseq_op_prof_snapshot_fini(struct rseq_op_prof_snapshot *snapshot);
+
+/* Slow paths of rseq_op_prof_begin() and rseq_op_prof_end(). */
+uint64_t rseq_op_prof_sample(struct rseq_op_prof_site *site, int cpu);
+void rseq_op_prof_record(struct rseq_op_prof_site *site, uint64_t start);
+
+static inline uint64_t rseq_op_prof_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t low, high;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
+	return ((uint64_t) high << 32) | low;
+#elif defined(__aarch64__)
+	uint64_t ticks;
+
+	__asm__ __volatile__ ("isb\n\tmrs %0, cntvct_el0" : "=r" (ticks) : : "memory");
+	return ticks;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Decrement the countdown of @site on the current CPU. Returns the start
+ * time stamp if the operation is sampled, or 0.
+ */
+static inline uint64_t rseq_op_prof_begin(struct rseq_op_prof_site *site)
+{
+	intptr_t *countdowns = RSEQ_READ_ONCE(rseq_op_prof_countdowns), *countdown, left;
+	int32_t cpu;
+	int id;
+
+	if (rseq_likely(!countdowns))
+		return 0;
+	cpu = rseq_current_cpu_raw();
+	id = RSEQ_READ_ONCE(site->id);
+	if (rseq_unlikely(cpu < 0 || id <= 0))
+		return cpu < 0 || id < 0 ? 0 : rseq_op_prof_sample(site, cpu);
+	countdown = &countdowns[(size_t) cpu * RSEQ_OP_PROF_MAX_SITES + id - 1];
+	left = RSEQ_READ_ONCE(*countdown) - 1;
+	RSEQ_WRITE_ONCE(*countdown, left);
+	if (rseq_likely(left > 0))
+		return 0;
+	return rseq_op_prof_sample(site, cpu);
+}
+
+static inline void rseq_op_prof_end(struct rseq_op_prof_site *site,
+		uint64_t start)
+{
+	if (rseq_unlikely(start))
+		rseq_op_prof_record(site, start);
+}
+
+#ifdef RSEQ_OP_PROF
+#define RSEQ_OP_PROF_BEGIN(site_name)					\
+	static struct rseq_op_prof_site __rseq_op_prof_site = {		\
+		.name = (site_name),					\
+	};								\
+	uint64_t __rseq_op_prof_start = rseq_op_prof_begin(&__rseq_op_prof_site)
+#define RSEQ_OP_PROF_END()						\
+	rseq_op_prof_end(&__rseq_op_prof_site, __rseq_op_prof_start)
+#else
+#define RSEQ_OP_PROF_BEGIN(site_name)
+#define RSEQ_OP_PROF_END()
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_OP_PROF_H */
@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * percpu-cache.h
+ *
+ * Per-CPU object caches.
+ *
+ * Each CPU caches objects in a bounded stack updated with restartable
+ * sequences. Misses (empty pops, full pushes) go to a shared depot
+ * protected by a mutex, moving objects in batches, and allocate objects
+ * with the cache alloc callback when the depot is empty.
+ *
+ * Caches sized for peak load keep holding objects after the load drops.
+ * rseq_percpu_cache_trim() releases cached objects above a floor on each
+ * CPU, and rseq_percpu_cache_trim_idle() releases the objects of CPUs
+ * which did not use their cache for a while. Both can be driven by a
+ * memory pressure monitor with rseq_percpu_cache_set_mempressure().
+ *
+ * With a budget set by rseq_percpu_cache_set_tuning(), the capacity and
+ * batch size of each CPU are tuned from runtime feedback by
+ * rseq_percpu_cache_tune(). CPUs start with a small capacity, which
+ * grows for CPUs which miss, taking capacity from CPUs which did not
+ * miss for the longest time once the total capacity reaches the budget.
+ * The batch size of a CPU doubles when it misses often, and halves when
+ * its critical sections are retried more often than it misses, since
+ * objects moved in batches then end up on other CPUs.
+ *
+ * Per-CPU stacks are drained remotely by replacing their offset with
+ * RSEQ_PERCPU_CACHE_LOCKED, which makes critical sections fail and take
+ * the slow path, then issuing MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ to
+ * abort critical sections which loaded the offset before. Trimming of
+ * per-CPU stacks is therefore only supported if the kernel supports
+ * rseq membarrier.
+ *
+ * Threads using the cache must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_PERCPU_CACHE_H
+#define RSEQ_PERCPU_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <rseq/rseq.h>
+#include <rseq/mempressure.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Offset of a per-CPU stack being drained. */
+#define RSEQ_PERCPU_CACHE_LOCKED	((intptr_t) -1)
+
+struct rseq_percpu_cache_entry {
+	/* Number of cached objects, or RSEQ_PERCPU_CACHE_LOCKED. */
+	intptr_t offset;
+	intptr_t capacity;
+	/* Array of max_capacity objects, allocated on first use. */
+	void **objects;
+
+	/* Failed or aborted critical sections. */
+	intptr_t nr_retries;
+
+	/* Protected by the cache lock. */
+	uint64_t nr_misses;
+	size_t batch;
+	/* State seen by the last idle scan. */
+	intptr_t idle_offset;
+	void *idle_top;
+	uint64_t idle_misses;
+	uint64_t idle_since_ms;
+	/* State seen by the last tuning pass. */
+	uint64_t tune_misses;
+	intptr_t tune_retries;
+	unsigned int tune_idle;		/* Consecutive passes without miss. */
+} __attribute__((aligned(128)));
+
+struct rseq_percpu_cache_ops {
+	/* Allocate an object on a miss. Optional. */
+	void *(*alloc)(void *priv);
+	/* Release a trimmed object. */
+	void (*free)(void *obj, void *priv);
+};
+
+struct rseq_percpu_cache {
+	struct rseq_percpu_cache_entry c[CPU_SETSIZE];
+	struct rseq_percpu_cache_ops ops;
+	void *priv;
+	size_t max_capacity;
+	size_t batch;
+	/* Total per-CPU capacity when tuning, 0 when disabled. */
+	size_t budget;
+
+	/* Protects the depot and the slow paths. */
+	pthread_mutex_t lock;
+	void **depot;
+	size_t depot_len;
+	size_t depot_size;
+
+	struct rseq_mempressure *monitor;
+	size_t trim_floor;
+	unsigned int idle_timeout_ms;
+};
+
+/*
+ * Create a cache holding up to @capacity objects per CPU, moving
+ * objects between per-CPU stacks and the depot @batch at a time.
+ * Returns NULL and sets errno on error.
+ */
+struct rseq_percpu_cache *rseq_percpu_cache_create(const struct rseq_percpu_cache_ops *ops,
+		void *priv, size_t capacity, size_t batch);
+
+/*
+ * Release all cached objects and free the cache. Must only be invoked
+ * when there are no more concurrent users.
+ */
+void rseq_percpu_cache_destroy(struct rseq_percpu_cache *cache);
+
+/* Slow paths of rseq_percpu_cache_pop() and rseq_percpu_cache_push(). */
+void *rseq_percpu_cache_pop_slow(struct rseq_percpu_cache *cache, int cpu);
+void rseq_percpu_cache_push_slow(struct rseq_percpu_cache *cache, void *obj, int cpu);
+
+/*
+ * Release the objects of the depot, and the objects above @floor of
+ * each per-CPU stack. Returns 0 on success, -1 with errno set to ENOSYS
+ * if per-CPU stacks cannot be drained.
+ */
+int rseq_percpu_cache_trim(struct rseq_percpu_cache *cache, size_t floor);
+
+/*
+ * Release the objects of per-CPU stacks which were not used since
+ * @timeout_ms. A stack is found unused if its offset, top object and
+ * number of misses did not change between calls, so this must be
+ * invoked periodically. Returns 0 on success, -1 with errno set to
+ * ENOSYS if per-CPU stacks cannot be drained.
+ */
+int rseq_percpu_cache_trim_idle(struct rseq_percpu_cache *cache,
+		unsigned int timeout_ms);
+
+/*
+ * Trim @cache to @floor on memory pressure reported by @monitor, and
+ * trim per-CPU stacks idle for @idle_timeout_ms (if not 0) on each of
+ * its ticks. A NULL @monitor detaches the cache. Returns 0 on success,
+ * -1 with errno set on error.
+ */
+int rseq_percpu_cache_set_mempressure(struct rseq_percpu_cache *cache,
+		struct rseq_mempressure *monitor, size_t floor,
+		unsigned int idle_timeout_ms);
+
+/*
+ * Enable tuning of per-CPU capacities and batch sizes within a total of
+ * @budget objects, or disable it if @budget is 0. CPUs which start
+ * using the cache afterwards start with a capacity of twice the initial
+ * batch size. Caches attached to a memory pressure monitor are tuned on
+ * each of its ticks.
+ */
+void rseq_percpu_cache_set_tuning(struct rseq_percpu_cache *cache, size_t budget);
+
+/*
+ * Adjust per-CPU capacities and batch sizes from the misses and retries
+ * since the previous call. Must be invoked periodically.
+ */
+void rseq_percpu_cache_tune(struct rseq_percpu_cache *cache);
+
+/* Number of cached objects, approximate under concurrent updates. */
+size_t rseq_percpu_cache_nr_cached(struct rseq_percpu_cache *cache);
+
+/*
+ * Pop an object from the cache of the current CPU, falling back to
+ * the depot and the alloc callback. Returns NULL if no object is
+ * available.
+ */
+static inline void *rseq_percpu_cache_pop(struct rseq_percpu_cache *cache)
+{
+	struct rseq_percpu_cache_entry *entry;
+	intptr_t offset;
+	void *obj;
+	int cpu;
+
+	for (;;) {
+		cpu = rseq_cpu_start();
+		entry = &cache->c[cpu];
+		offset = RSEQ_READ_ONCE(entry->offset);
+		/* Empty, locked, or not used yet. */
+		if (rseq_unlikely(offset <= 0))
+			return rseq_percpu_cache_pop_slow(cache, cpu);
+		obj = RSEQ_READ_ONCE(entry->objects[offset - 1]);
+		if (rseq_likely(!rseq_cmpeqv_cmpeqv_storev(&entry->offset, offset,
+				(intptr_t *) &entry->objects[offset - 1], (intptr_t) obj,
+				offset - 1, cpu)))
+			return obj;
+		__atomic_add_fetch(&entry->nr_retries, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* Push @obj to the cache of the current CPU, or to the depot if full. */
+static inline void rseq_percpu_cache_push(struct rseq_percpu_cache *cache, void *obj)
+{
+	struct rseq_percpu_cache_entry *entry;
+	intptr_t offset;
+	int cpu;
+
+	for (;;) {
+		cpu = rseq_cpu_start();
+		entry = &cache->c[cpu];
+		offset = RSEQ_READ_ONCE(entry->offset);
+		/* Full, locked, or not used yet. */
+		if (rseq_unlikely((uintptr_t) offset >=
+				(uintptr_t) rseq_smp_load_acquire(&entry->capacity))) {
+			rseq_percpu_cache_push_slow(cache, obj, cpu);
+			return;
+		}
+		if (rseq_likely(!rseq_cmpeqv_trystorev_storev(&entry->offset, offset,
+				(intptr_t *) &entry->objects[offset], (intptr_t) obj,
+				offset + 1, cpu)))
+			return;
+		__atomic_add_fetch(&entry->nr_retries, 1, __ATOMIC_RELAXED);
+	}
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_PERCPU_CACHE_H */
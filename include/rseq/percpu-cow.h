@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * percpu-cow.h
+ *
+ * Per-CPU copy-on-write records.
+ *
+ * Each CPU owns a pointer to an immutable record. Updates prepare a new
+ * version of the record outside of any critical section, and publish it
+ * by swapping the per-CPU pointer within a single short restartable
+ * sequence which validates that the old pointer is still current. The
+ * critical section length is therefore independent of the record size.
+ *
+ * Old versions are retired after a grace period. Readers delimit their
+ * accesses with rseq_percpu_cow_read_lock()/rseq_percpu_cow_read_unlock(),
+ * which only increment per-CPU counters. The update side waits for
+ * pre-existing readers by comparing the lock and unlock counts of the
+ * inactive phase, using membarrier(2) to order memory accesses of
+ * readers when available.
+ *
+ * Threads using these functions must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_PERCPU_COW_H
+#define RSEQ_PERCPU_COW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <rseq/rseq.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rseq_percpu_cow_entry {
+	void *record;
+	intptr_t lock_count[2];
+	intptr_t unlock_count[2];
+} __attribute__((aligned(128)));
+
+struct rseq_percpu_cow {
+	struct rseq_percpu_cow_entry c[CPU_SETSIZE];
+	/* Low bit selects the reader counters used by new readers. */
+	unsigned long phase;
+	/* Readers issue a memory barrier if membarrier is unavailable. */
+	int reader_mb;
+	void (*free_record)(void *record);
+	pthread_mutex_t gp_lock;
+};
+
+/*
+ * Allocate a set of per-CPU records. All per-CPU records are initially
+ * NULL. Retired records are freed with @free_record, or with free(3) if
+ * @free_record is NULL.
+ *
+ * Returns NULL and sets errno on error.
+ */
+struct rseq_percpu_cow *rseq_percpu_cow_create(void (*free_record)(void *record));
+
+/*
+ * Free all per-CPU records and the set itself. Must only be invoked
+ * when there are no more concurrent readers nor updaters.
+ */
+void rseq_percpu_cow_destroy(struct rseq_percpu_cow *cow);
+
+/*
+ * Wait for all readers which hold a read-side lock on @cow at the
+ * beginning of the call to release it.
+ */
+void rseq_percpu_cow_synchronize(struct rseq_percpu_cow *cow);
+
+/*
+ * Replace the record of the current CPU by a copy of @size bytes of
+ * the current record (zero-filled if there is none yet), modified by
+ * @update(record, priv). The copy and @update run outside of any
+ * critical section, and may therefore be invoked more than once if a
+ * concurrent update or a migration happens before the publication.
+ * The old record is freed after a grace period.
+ *
+ * Must not be invoked within a read-side critical section. Returns 0 on
+ * success, -1 with errno set on error.
+ */
+int rseq_percpu_cow_update(struct rseq_percpu_cow *cow, size_t size,
+		void (*update)(void *record, void *priv), void *priv);
+
+/*
+ * Enter a read-side critical section. Returns the reader phase, which
+ * must be passed to rseq_percpu_cow_read_unlock(). Records loaded with
+ * rseq_percpu_cow_deref() stay valid until then, even if the reader
+ * migrates.
+ */
+static inline int rseq_percpu_cow_read_lock(struct rseq_percpu_cow *cow)
+{
+	int phase, cpu;
+
+	phase = RSEQ_READ_ONCE(cow->phase) & 1;
+	do {
+		cpu = rseq_cpu_start();
+	} while (rseq_unlikely(rseq_addv(&cow->c[cpu].lock_count[phase], 1, cpu)));
+	if (rseq_unlikely(cow->reader_mb))
+		rseq_smp_mb();
+	else
+		rseq_barrier();
+	return phase;
+}
+
+static inline void rseq_percpu_cow_read_unlock(struct rseq_percpu_cow *cow,
+		int phase)
+{
+	int cpu;
+
+	if (rseq_unlikely(cow->reader_mb))
+		rseq_smp_mb();
+	else
+		rseq_barrier();
+	do {
+		cpu = rseq_cpu_start();
+	} while (rseq_unlikely(rseq_addv(&cow->c[cpu].unlock_count[phase], 1, cpu)));
+}
+
+/*
+ * Load the current record of @cpu. Must be invoked within a read-side
+ * critical section.
+ */
+static inline void *rseq_percpu_cow_deref(struct rseq_percpu_cow *cow,
+		int cpu)
+{
+	return RSEQ_READ_ONCE(cow->c[cpu].record);
+}
+
+/*
+ * Publish @newrec as the record of @cpu if its current record is still
+ * @oldrec. The stores initializing @newrec are ordered before its
+ * publication. On success (0), the caller owns @oldrec and should retire
+ * it after a grace period. Returns 1 if the record changed, and -1 if
+ * the sequence was aborted (e.g. the thread migrated away from @cpu).
+ */
+static inline int rseq_percpu_cow_publish(struct rseq_percpu_cow *cow,
+		void *oldrec, void *newrec, int cpu)
+{
+	rseq_smp_wmb();
+	return rseq_cmpeqv_storev((intptr_t *) &cow->c[cpu].record,
+				  (intptr_t) oldrec, (intptr_t) newrec, cpu);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_PERCPU_COW_H */
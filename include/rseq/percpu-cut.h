@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * percpu-cut.h
+ *
+ * Consistent snapshots (cuts) of a set of per-CPU counters.
+ *
+ * Summing per-CPU counters one CPU at a time while writers keep
+ * updating them does not observe a state which existed at any point in
+ * time: with separate "allocated" and "freed" counters, a reader may
+ * see more frees than allocations. A cut domain provides snapshots of
+ * all its counters taken as of a single instant, without stopping
+ * writers longer than one membarrier(2) fence.
+ *
+ * Each per-CPU slot is split into two halves, selected by the parity
+ * of the domain epoch. Writers add to the half of the current epoch
+ * with a restartable sequence which also checks that the epoch is
+ * unchanged. A snapshot sums the halves of the previous epoch, which
+ * are stable, flips the epoch, and issues
+ * MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ: critical sections still using
+ * the old epoch are aborted and restart on the new one, so the halves
+ * of the old epoch are stable as well once membarrier returns. Sums of
+ * both halves form the cut.
+ *
+ * The cut is consistent with the order of updates: if an update
+ * happens before another one, the cut never includes the second
+ * without the first.
+ *
+ * Threads updating counters must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_PERCPU_CUT_H
+#define RSEQ_PERCPU_CUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <rseq/rseq.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rseq_percpu_cut_entry {
+	intptr_t count[2];		/* Indexed by epoch parity. */
+} __attribute__((aligned(128)));
+
+struct rseq_percpu_cut_counter {
+	struct rseq_percpu_cut_entry c[CPU_SETSIZE];
+};
+
+struct rseq_percpu_cut {
+	intptr_t epoch;
+	pthread_mutex_t lock;		/* Serializes snapshots. */
+};
+
+/*
+ * Initialize @cut. Returns 0 on success, -1 with errno set on error.
+ * Fails with ENOSYS if MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ is not
+ * supported by the kernel.
+ */
+int rseq_percpu_cut_init(struct rseq_percpu_cut *cut);
+
+void rseq_percpu_cut_destroy(struct rseq_percpu_cut *cut);
+
+/*
+ * Allocate a counter with value 0, for use with a single cut domain.
+ * Returns NULL and sets errno on error.
+ */
+struct rseq_percpu_cut_counter *rseq_percpu_cut_counter_create(void);
+
+void rseq_percpu_cut_counter_destroy(struct rseq_percpu_cut_counter *counter);
+
+/*
+ * Take a snapshot of @nr_counters @counters of @cut, storing their
+ * values into @values.
+ */
+void rseq_percpu_cut_snapshot(struct rseq_percpu_cut *cut,
+		struct rseq_percpu_cut_counter *const *counters, size_t nr_counters,
+		intptr_t *values);
+
+/* Add @count to @counter, which belongs to @cut. */
+static inline
+void rseq_percpu_cut_counter_add(struct rseq_percpu_cut *cut,
+		struct rseq_percpu_cut_counter *counter, intptr_t count)
+{
+	intptr_t epoch, *slot, old;
+	int cpu;
+
+	do {
+		cpu = rseq_cpu_start();
+		epoch = RSEQ_READ_ONCE(cut->epoch);
+		slot = &counter->c[cpu].count[epoch & 1];
+		old = RSEQ_READ_ONCE(*slot);
+	} while (rseq_unlikely(rseq_cmpeqv_cmpeqv_storev(slot, old,
+			&cut->epoch, epoch, old + count, cpu)));
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_PERCPU_CUT_H */
@@ -0,0 +1,77 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * percpu-seq.h
+ *
+ * Per-CPU records with a sequence counter, for consistent reads of
+ * multi-field per-CPU data from other CPUs.
+ *
+ * Each possible CPU holds a record of a fixed size, e.g. a (sum, count)
+ * pair, which is only updated by threads running on that CPU. A remote
+ * reader copying the record field by field could see it torn between
+ * two updates. Pairing the record with a sequence counter lets readers
+ * detect concurrent updates and retry, without locks on the update
+ * side.
+ *
+ * A restartable sequence commits with a single store, so the sequence
+ * counter cannot be made odd by one store and even again by another
+ * within the same sequence: an abort between both would leave it odd
+ * and the record half updated. Instead each CPU holds two copies of its
+ * record, and the parity of the sequence counter selects the current
+ * one, as a latch. Updates copy the new record into the other copy with
+ * rseq_cmpeqv_trymemcpy_storev_release(), and increment the sequence
+ * counter as the commit store. An aborted update only ever wrote the
+ * copy which readers do not use.
+ *
+ * Threads updating records must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_PERCPU_SEQ_H
+#define RSEQ_PERCPU_SEQ_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum size of a record. */
+#define RSEQ_PERCPU_SEQ_MAX_LEN		256
+
+struct rseq_percpu_seq;
+
+/*
+ * Create zero-filled records of @len bytes for every possible CPU.
+ * Returns NULL and sets errno on error, EINVAL if @len is 0 or larger
+ * than RSEQ_PERCPU_SEQ_MAX_LEN.
+ */
+struct rseq_percpu_seq *rseq_percpu_seq_create(size_t len);
+
+/*
+ * Free the records.
+ */
+void rseq_percpu_seq_destroy(struct rseq_percpu_seq *ps);
+
+/* Number of possible CPUs, i.e. of records of @ps. */
+int rseq_percpu_seq_nr_cpus(struct rseq_percpu_seq *ps);
+
+/*
+ * Update the record of the current CPU. @update is invoked with a copy
+ * of the current record and @priv, and modifies it in place; the copy
+ * is then committed. @update is invoked again on a fresh copy if the
+ * commit fails, so it must not have side effects.
+ */
+void rseq_percpu_seq_update(struct rseq_percpu_seq *ps,
+		void (*update)(void *data, void *priv), void *priv);
+
+/*
+ * Copy a consistent snapshot of the record of @cpu into @data, retrying
+ * while it is updated concurrently. May be called from any CPU.
+ */
+void rseq_percpu_seq_read(struct rseq_percpu_seq *ps, int cpu, void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_PERCPU_SEQ_H */
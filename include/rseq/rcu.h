@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * rcu.h
+ *
+ * Read-copy-update with per-CPU reader counters.
+ *
+ * Readers are tracked by per-CPU counters instead of per-thread state,
+ * so there is no list of registered reader threads to scan, and the
+ * cost of a grace period depends on the number of possible CPUs rather
+ * than on the number of threads. Entering a read-side critical section
+ * is a single rseq_addv() incrementing the lock counter of the current
+ * CPU, and leaving it increments the unlock counter of the CPU it ends
+ * on. Grace periods compare the lock and unlock counts of each phase as
+ * rseq_percpu_cow_synchronize() does, using membarrier(2) to order the
+ * memory accesses of readers, which then issue no memory barrier. If
+ * membarrier is unavailable, readers issue memory barriers instead.
+ *
+ * Grace periods run on a helper thread owned by the domain. Callbacks
+ * queued with rseq_rcu_call() while a grace period is in progress are
+ * batched behind a single following grace period, and so are
+ * concurrent rseq_rcu_synchronize() calls.
+ *
+ * Threads entering read-side critical sections must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_RCU_H
+#define RSEQ_RCU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <rseq/rseq.h>
+#include <rseq/op-prof.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rseq_rcu_head {
+	struct rseq_rcu_head *next;
+	void (*func)(struct rseq_rcu_head *head);
+};
+
+struct rseq_rcu_cpu {
+	intptr_t lock_count[2];
+	intptr_t unlock_count[2];
+} __attribute__((aligned(128)));
+
+struct rseq_rcu {
+	/* One entry per possible CPU. */
+	struct rseq_rcu_cpu *c;
+	int nr_cpus;
+	/* Low bit selects the reader counters used by new readers. */
+	unsigned long phase;
+	/* Readers issue a memory barrier if membarrier is unavailable. */
+	int reader_mb;
+
+	/* Callbacks waiting for a grace period, in queuing order. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct rseq_rcu_head *head;
+	struct rseq_rcu_head **tail;
+	uint64_t nr_queued;
+	uint64_t nr_invoked;
+	uint64_t nr_grace_periods;
+	bool stop;
+	pthread_t helper;
+};
+
+/*
+ * Create an RCU domain and start its helper thread. Returns NULL and
+ * sets errno on error.
+ */
+struct rseq_rcu *rseq_rcu_create(void);
+
+/*
+ * Invoke the callbacks still queued after a grace period, stop the
+ * helper thread and free the domain. No reader may be in a read-side
+ * critical section of @rcu.
+ */
+void rseq_rcu_destroy(struct rseq_rcu *rcu);
+
+/*
+ * Wait until every read-side critical section of @rcu which started
+ * before the call has ended.
+ */
+void rseq_rcu_synchronize(struct rseq_rcu *rcu);
+
+/*
+ * Queue @func to be invoked with @head from the helper thread after a
+ * grace period. Callbacks are invoked in queuing order, and must not
+ * wait for grace periods or callbacks of @rcu themselves.
+ */
+void rseq_rcu_call(struct rseq_rcu *rcu, struct rseq_rcu_head *head,
+		void (*func)(struct rseq_rcu_head *head));
+
+/*
+ * Wait until every callback queued before the call has been invoked.
+ */
+void rseq_rcu_barrier(struct rseq_rcu *rcu);
+
+/* Number of grace periods completed by @rcu. */
+uint64_t rseq_rcu_nr_grace_periods(struct rseq_rcu *rcu);
+
+/*
+ * Enter a read-side critical section. Returns the reader phase, which
+ * must be passed to rseq_rcu_read_unlock(). Critical sections may nest,
+ * and readers may migrate within them.
+ */
+static inline int rseq_rcu_read_lock(struct rseq_rcu *rcu)
+{
+	RSEQ_OP_PROF_BEGIN("rcu_read_lock");
+	int phase, cpu;
+
+	phase = RSEQ_READ_ONCE(rcu->phase) & 1;
+	do {
+		cpu = rseq_cpu_start();
+	} while (rseq_unlikely(rseq_addv(&rcu->c[cpu].lock_count[phase], 1, cpu)));
+	RSEQ_OP_PROF_END();
+	if (rseq_unlikely(rcu->reader_mb))
+		rseq_smp_mb();
+	else
+		rseq_barrier();
+	return phase;
+}
+
+static inline void rseq_rcu_read_unlock(struct rseq_rcu *rcu, int phase)
+{
+	RSEQ_OP_PROF_BEGIN("rcu_read_unlock");
+	int cpu;
+
+	if (rseq_unlikely(rcu->reader_mb))
+		rseq_smp_mb();
+	else
+		rseq_barrier();
+	do {
+		cpu = rseq_cpu_start();
+	} while (rseq_unlikely(rseq_addv(&rcu->c[cpu].unlock_count[phase], 1, cpu)));
+	RSEQ_OP_PROF_END();
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_RCU_H */
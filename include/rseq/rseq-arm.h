@@ -219,6 +219,10 @@ static inline __attribute__((always_inline))
 int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 			       off_t voffp, intptr_t *load, int cpu)
 {
+#if RSEQ_ASM_GOTO_OUTPUT
+	intptr_t loadv;
+#endif
+
 	RSEQ_INJECT_C(9)
 
 	rseq_workaround_gcc_asm_size_guess();
@@ -243,7 +247,11 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		"cmp %[expectnot], r0\n\t"
 		"beq %l[error2]\n\t"
 #endif
+#if RSEQ_ASM_GOTO_OUTPUT
+		"mov %[load], r0\n\t"
+#else
 		"str r0, %[load]\n\t"
+#endif
 		"add r0, %[voffp]\n\t"
 		"ldr r0, [r0]\n\t"
 		/* final store */
@@ -253,15 +261,21 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		"b 5f\n\t"
 		RSEQ_ASM_DEFINE_ABORT(3, 4, "", abort, 1b, 2b, 4f)
 		"5:\n\t"
+#if RSEQ_ASM_GOTO_OUTPUT
+		: [load]		"=&r" (loadv)
+#else
 		: /* gcc asm goto does not allow outputs */
+#endif
 		: [cpu_id]		"r" (cpu),
 		  [current_cpu_id]	"m" (__rseq_abi.cpu_id),
 		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
 		  /* final store input */
 		  [v]			"m" (*v),
 		  [expectnot]		"r" (expectnot),
-		  [voffp]		"Ir" (voffp),
-		  [load]		"m" (*load)
+		  [voffp]		"Ir" (voffp)
+#if !RSEQ_ASM_GOTO_OUTPUT
+		  , [load]		"m" (*load)
+#endif
 		  RSEQ_INJECT_INPUT
 		: "r0", "memory", "cc"
 		  RSEQ_INJECT_CLOBBER
@@ -271,6 +285,9 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 #endif
 	);
 	rseq_workaround_gcc_asm_size_guess();
+#if RSEQ_ASM_GOTO_OUTPUT
+	*load = loadv;
+#endif
 	return 0;
 abort:
 	rseq_workaround_gcc_asm_size_guess();
@@ -573,6 +590,101 @@ error3:
 #endif
 }
 
+/*
+ * Compare @v against @expect, and the @len bytes at @m against the
+ * snapshot at @expectm. When everything matches, store @newv into @v.
+ * @len must be a multiple of sizeof(intptr_t), and @m and @expectm must
+ * be word-aligned.
+ */
+static inline __attribute__((always_inline))
+int rseq_cmpeqv_cmpeqm_storev(intptr_t *v, intptr_t expect,
+			      void *m, void *expectm, size_t len,
+			      intptr_t newv, int cpu)
+{
+	RSEQ_INJECT_C(9)
+
+	rseq_workaround_gcc_asm_size_guess();
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(9, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[cmpfail])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error2])
+#endif
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3f, rseq_cs)
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, 4f)
+		RSEQ_INJECT_ASM(3)
+		"ldr r0, %[v]\n\t"
+		"cmp %[expect], r0\n\t"
+		"bne %l[cmpfail]\n\t"
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, %l[error1])
+		"ldr r0, %[v]\n\t"
+		"cmp %[expect], r0\n\t"
+		"bne %l[error2]\n\t"
+#endif
+		/* compare memory region */
+		"cmp %[len], #0\n\t"
+		"beq 333f\n\t"
+		"mov r1, #0\n\t"
+		"222:\n\t"
+		"ldr r0, [%[m], r1]\n\t"
+		"ldr r2, [%[expectm], r1]\n\t"
+		"cmp r0, r2\n\t"
+		"bne %l[cmpfail]\n\t"
+		"add r1, r1, #4\n\t"
+		"cmp r1, %[len]\n\t"
+		"bne 222b\n\t"
+		"333:\n\t"
+		RSEQ_INJECT_ASM(5)
+		/* final store */
+		"str %[newv], %[v]\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(6)
+		"b 5f\n\t"
+		RSEQ_ASM_DEFINE_ABORT(3, 4, "", abort, 1b, 2b, 4f)
+		"5:\n\t"
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [current_cpu_id]	"m" (__rseq_abi.cpu_id),
+		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
+		  /* final store input */
+		  [v]			"m" (*v),
+		  [expect]		"r" (expect),
+		  [newv]		"r" (newv),
+		  /* compare memory region input */
+		  [m]			"r" (m),
+		  [expectm]		"r" (expectm),
+		  [len]			"r" (len)
+		  RSEQ_INJECT_INPUT
+		: "r0", "r1", "r2", "memory", "cc"
+		  RSEQ_INJECT_CLOBBER
+		: abort, cmpfail
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1, error2
+#endif
+	);
+	rseq_workaround_gcc_asm_size_guess();
+	return 0;
+abort:
+	rseq_workaround_gcc_asm_size_guess();
+	RSEQ_INJECT_FAILED
+	return -1;
+cmpfail:
+	rseq_workaround_gcc_asm_size_guess();
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_workaround_gcc_asm_size_guess();
+	rseq_bug("cpu_id comparison failed");
+error2:
+	rseq_workaround_gcc_asm_size_guess();
+	rseq_bug("expected value comparison failed");
+#endif
+}
+
 static inline __attribute__((always_inline))
 int rseq_cmpeqv_trymemcpy_storev(intptr_t *v, intptr_t expect,
 				 void *dst, void *src, size_t len,
@@ -829,4 +941,71 @@ int rseq_deref_loadoffp(void *p, off_t voffp, intptr_t *load, int cpu)
 	return -1;
 }
 
+/*
+ * Dereference @p. If the pointer is NULL, fail with 1. Otherwise add
+ * @voffp to the dereferenced pointer, and add @count to its content.
+ */
+static inline __attribute__((always_inline))
+int rseq_deref_addoffp(intptr_t *p, off_t voffp, intptr_t count, int cpu)
+{
+	RSEQ_INJECT_C(9)
+
+	rseq_workaround_gcc_asm_size_guess();
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(9, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[cmpfail])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+#endif
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3f, rseq_cs)
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, 4f)
+		RSEQ_INJECT_ASM(3)
+		"ldr r0, %[p]\n\t"
+		"cmp r0, #0\n\t"
+		"beq %l[cmpfail]\n\t"
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, %l[error1])
+#endif
+		"add r0, %[voffp]\n\t"
+		"ldr r1, [r0]\n\t"
+		"add r1, %[count]\n\t"
+		/* final store */
+		"str r1, [r0]\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(5)
+		"b 5f\n\t"
+		RSEQ_ASM_DEFINE_ABORT(3, 4, "", abort, 1b, 2b, 4f)
+		"5:\n\t"
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [current_cpu_id]	"m" (__rseq_abi.cpu_id),
+		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
+		  [p]			"m" (*p),
+		  [voffp]		"Ir" (voffp),
+		  [count]		"Ir" (count)
+		  RSEQ_INJECT_INPUT
+		: "r0", "r1", "memory", "cc"
+		  RSEQ_INJECT_CLOBBER
+		: abort, cmpfail
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1
+#endif
+	);
+	rseq_workaround_gcc_asm_size_guess();
+	return 0;
+abort:
+	rseq_workaround_gcc_asm_size_guess();
+	RSEQ_INJECT_FAILED
+	return -1;
+cmpfail:
+	rseq_workaround_gcc_asm_size_guess();
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_bug("cpu_id comparison failed");
+#endif
+}
+
 #endif /* !RSEQ_SKIP_FASTPATH */
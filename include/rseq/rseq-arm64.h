@@ -92,6 +92,7 @@ do {										\
 #define RSEQ_ASM_TMP_REG32	"w15"
 #define RSEQ_ASM_TMP_REG	"x15"
 #define RSEQ_ASM_TMP_REG_2	"x14"
+#define RSEQ_ASM_TMP_REG_3	"x13"
 
 #define __RSEQ_ASM_DEFINE_TABLE(label, version, flags, start_ip,		\
 				post_commit_offset, abort_ip)			\
@@ -204,6 +205,20 @@ do {										\
 	"	cbnz	" RSEQ_ASM_TMP_REG_2 ", 222b\n"				\
 	"333:\n"
 
+#define RSEQ_ASM_OP_R_CMPEQM(m, expectm, len, label)				\
+	"	cbz	%[" __rseq_str(len) "], 333f\n"				\
+	"	mov	" RSEQ_ASM_TMP_REG_2 ", %[" __rseq_str(len) "]\n"	\
+	"222:	sub	" RSEQ_ASM_TMP_REG_2 ", " RSEQ_ASM_TMP_REG_2 ", #8\n"	\
+	"	ldr	" RSEQ_ASM_TMP_REG ", [%[" __rseq_str(m) "]"		\
+			", " RSEQ_ASM_TMP_REG_2 "]\n"				\
+	"	ldr	" RSEQ_ASM_TMP_REG_3 ", [%[" __rseq_str(expectm) "]"	\
+			", " RSEQ_ASM_TMP_REG_2 "]\n"				\
+	"	sub	" RSEQ_ASM_TMP_REG ", " RSEQ_ASM_TMP_REG		\
+			", " RSEQ_ASM_TMP_REG_3 "\n"				\
+	"	cbnz	" RSEQ_ASM_TMP_REG ", " __rseq_str(label) "\n"		\
+	"	cbnz	" RSEQ_ASM_TMP_REG_2 ", 222b\n"				\
+	"333:\n"
+
 static inline __attribute__((always_inline))
 int rseq_cmpeqv_storev(intptr_t *v, intptr_t expect, intptr_t newv, int cpu)
 {
@@ -261,6 +276,10 @@ static inline __attribute__((always_inline))
 int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 			       off_t voffp, intptr_t *load, int cpu)
 {
+#if RSEQ_ASM_GOTO_OUTPUT
+	intptr_t loadv;
+#endif
+
 	RSEQ_INJECT_C(9)
 
 	__asm__ __volatile__ goto (
@@ -280,19 +299,29 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		RSEQ_ASM_OP_CMPNE(v, expectnot, %l[error2])
 #endif
 		RSEQ_ASM_OP_R_LOAD(v)
+#if RSEQ_ASM_GOTO_OUTPUT
+		"	mov	%[load], " RSEQ_ASM_TMP_REG "\n"
+#else
 		RSEQ_ASM_OP_R_STORE(load)
+#endif
 		RSEQ_ASM_OP_R_LOAD_OFF(voffp)
 		RSEQ_ASM_OP_R_FINAL_STORE(v, 3)
 		RSEQ_INJECT_ASM(5)
 		RSEQ_ASM_DEFINE_ABORT(4, abort)
+#if RSEQ_ASM_GOTO_OUTPUT
+		: [load]		"=&r" (loadv)
+#else
 		: /* gcc asm goto does not allow outputs */
+#endif
 		: [cpu_id]		"r" (cpu),
 		  [current_cpu_id]	"Qo" (__rseq_abi.cpu_id),
 		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
 		  [v]			"Qo" (*v),
 		  [expectnot]		"r" (expectnot),
-		  [load]		"Qo" (*load),
 		  [voffp]		"r" (voffp)
+#if !RSEQ_ASM_GOTO_OUTPUT
+		  , [load]		"Qo" (*load)
+#endif
 		  RSEQ_INJECT_INPUT
 		: "memory", RSEQ_ASM_TMP_REG
 		: abort, cmpfail
@@ -300,6 +329,9 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		  , error1, error2
 #endif
 	);
+#if RSEQ_ASM_GOTO_OUTPUT
+	*load = loadv;
+#endif
 	return 0;
 abort:
 	RSEQ_INJECT_FAILED
@@ -539,6 +571,73 @@ error3:
 #endif
 }
 
+/*
+ * Compare @v against @expect, and the @len bytes at @m against the
+ * snapshot at @expectm. When everything matches, store @newv into @v.
+ * @len must be a multiple of sizeof(intptr_t), and @m and @expectm must
+ * be word-aligned.
+ */
+static inline __attribute__((always_inline))
+int rseq_cmpeqv_cmpeqm_storev(intptr_t *v, intptr_t expect,
+			      void *m, void *expectm, size_t len,
+			      intptr_t newv, int cpu)
+{
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(1, 2f, 3f, 4f)
+		RSEQ_ASM_DEFINE_EXIT_POINT(2f, %l[cmpfail])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(2f, %l[error1])
+		RSEQ_ASM_DEFINE_EXIT_POINT(2f, %l[error2])
+#endif
+		RSEQ_ASM_STORE_RSEQ_CS(2, 1b, rseq_cs)
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, 4f)
+		RSEQ_INJECT_ASM(3)
+		RSEQ_ASM_OP_CMPEQ(v, expect, %l[cmpfail])
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, %l[error1])
+		RSEQ_ASM_OP_CMPEQ(v, expect, %l[error2])
+#endif
+		RSEQ_ASM_OP_R_CMPEQM(m, expectm, len, %l[cmpfail])
+		RSEQ_INJECT_ASM(5)
+		RSEQ_ASM_OP_FINAL_STORE(newv, v, 3)
+		RSEQ_INJECT_ASM(6)
+		RSEQ_ASM_DEFINE_ABORT(4, abort)
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [current_cpu_id]	"Qo" (__rseq_abi.cpu_id),
+		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
+		  [expect]		"r" (expect),
+		  [v]			"Qo" (*v),
+		  [newv]		"r" (newv),
+		  [m]			"r" (m),
+		  [expectm]		"r" (expectm),
+		  [len]			"r" (len)
+		  RSEQ_INJECT_INPUT
+		: "memory", RSEQ_ASM_TMP_REG, RSEQ_ASM_TMP_REG_2,
+		  RSEQ_ASM_TMP_REG_3
+		: abort, cmpfail
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1, error2
+#endif
+	);
+
+	return 0;
+abort:
+	RSEQ_INJECT_FAILED
+	return -1;
+cmpfail:
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_bug("cpu_id comparison failed");
+error2:
+	rseq_bug("expected value comparison failed");
+#endif
+}
+
 static inline __attribute__((always_inline))
 int rseq_cmpeqv_trymemcpy_storev(intptr_t *v, intptr_t expect,
 				 void *dst, void *src, size_t len,
@@ -666,4 +765,62 @@ int rseq_deref_loadoffp(void *p, off_t voffp, intptr_t *load, int cpu)
 	return -1;
 }
 
+/*
+ * Dereference @p. If the pointer is NULL, fail with 1. Otherwise add
+ * @voffp to the dereferenced pointer, and add @count to its content.
+ */
+static inline __attribute__((always_inline))
+int rseq_deref_addoffp(intptr_t *p, off_t voffp, intptr_t count, int cpu)
+{
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(1, 2f, 3f, 4f)
+		RSEQ_ASM_DEFINE_EXIT_POINT(2f, %l[cmpfail])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(2f, %l[error1])
+#endif
+		RSEQ_ASM_STORE_RSEQ_CS(2, 1b, rseq_cs)
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, 4f)
+		RSEQ_INJECT_ASM(3)
+		"	ldr	" RSEQ_ASM_TMP_REG_2 ", %[p]\n"
+		"	cbz	" RSEQ_ASM_TMP_REG_2 ", %l[cmpfail]\n"
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, %l[error1])
+#endif
+		"	add	" RSEQ_ASM_TMP_REG_2 ", " RSEQ_ASM_TMP_REG_2
+			", %[voffp]\n"
+		"	ldr	" RSEQ_ASM_TMP_REG ", [" RSEQ_ASM_TMP_REG_2 "]\n"
+		RSEQ_ASM_OP_R_ADD(count)
+		"	str	" RSEQ_ASM_TMP_REG ", [" RSEQ_ASM_TMP_REG_2 "]\n"
+		"3:\n"
+		RSEQ_INJECT_ASM(5)
+		RSEQ_ASM_DEFINE_ABORT(4, abort)
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [current_cpu_id]	"Qo" (__rseq_abi.cpu_id),
+		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
+		  [p]			"Qo" (*p),
+		  [voffp]		"r" (voffp),
+		  [count]		"r" (count)
+		  RSEQ_INJECT_INPUT
+		: "memory", RSEQ_ASM_TMP_REG, RSEQ_ASM_TMP_REG_2
+		: abort, cmpfail
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1
+#endif
+	);
+	return 0;
+abort:
+	RSEQ_INJECT_FAILED
+	return -1;
+cmpfail:
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_bug("cpu_id comparison failed");
+#endif
+}
+
 #endif /* !RSEQ_SKIP_FASTPATH */
@@ -70,6 +70,7 @@ do {									\
 # define LONG_L			"ld"
 # define LONG_S			"sd"
 # define LONG_ADDI		"daddiu"
+# define LONG_SIZE		"8"
 # define U32_U64_PAD(x)		x
 #elif _MIPS_SZLONG == 32
 # define LONG			".word"
@@ -77,6 +78,7 @@ do {									\
 # define LONG_L			"lw"
 # define LONG_S			"sw"
 # define LONG_ADDI		"addiu"
+# define LONG_SIZE		"4"
 # ifdef __BIG_ENDIAN
 #  define U32_U64_PAD(x)	"0x0, " x
 # else
@@ -224,6 +226,10 @@ static inline __attribute__((always_inline))
 int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 			       off_t voffp, intptr_t *load, int cpu)
 {
+#if RSEQ_ASM_GOTO_OUTPUT
+	intptr_t loadv;
+#endif
+
 	RSEQ_INJECT_C(9)
 
 	rseq_workaround_gcc_asm_size_guess();
@@ -246,7 +252,11 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		LONG_L " $4, %[v]\n\t"
 		"beq $4, %[expectnot], %l[error2]\n\t"
 #endif
+#if RSEQ_ASM_GOTO_OUTPUT
+		"move %[load], $4\n\t"
+#else
 		LONG_S " $4, %[load]\n\t"
+#endif
 		LONG_ADDI " $4, %[voffp]\n\t"
 		LONG_L " $4, 0($4)\n\t"
 		/* final store */
@@ -256,15 +266,21 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		"b 5f\n\t"
 		RSEQ_ASM_DEFINE_ABORT(3, 4, "", abort, 1b, 2b, 4f)
 		"5:\n\t"
+#if RSEQ_ASM_GOTO_OUTPUT
+		: [load]		"=&r" (loadv)
+#else
 		: /* gcc asm goto does not allow outputs */
+#endif
 		: [cpu_id]		"r" (cpu),
 		  [current_cpu_id]	"m" (__rseq_abi.cpu_id),
 		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
 		  /* final store input */
 		  [v]			"m" (*v),
 		  [expectnot]		"r" (expectnot),
-		  [voffp]		"Ir" (voffp),
-		  [load]		"m" (*load)
+		  [voffp]		"Ir" (voffp)
+#if !RSEQ_ASM_GOTO_OUTPUT
+		  , [load]		"m" (*load)
+#endif
 		  RSEQ_INJECT_INPUT
 		: "$4", "memory"
 		  RSEQ_INJECT_CLOBBER
@@ -274,6 +290,9 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 #endif
 	);
 	rseq_workaround_gcc_asm_size_guess();
+#if RSEQ_ASM_GOTO_OUTPUT
+	*load = loadv;
+#endif
 	return 0;
 abort:
 	rseq_workaround_gcc_asm_size_guess();
@@ -568,6 +587,134 @@ error3:
 #endif
 }
 
+/*
+ * Compare @v against @expect, and the @len bytes at @m against the
+ * snapshot at @expectm. When everything matches, store @newv into @v.
+ * @len must be a multiple of sizeof(intptr_t), and @m and @expectm must
+ * be word-aligned.
+ */
+static inline __attribute__((always_inline))
+int rseq_cmpeqv_cmpeqm_storev(intptr_t *v, intptr_t expect,
+			      void *m, void *expectm, size_t len,
+			      intptr_t newv, int cpu)
+{
+	uintptr_t rseq_scratch[3];
+
+	RSEQ_INJECT_C(9)
+
+	rseq_workaround_gcc_asm_size_guess();
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(9, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[cmpfail])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error2])
+#endif
+		LONG_S " %[m], %[rseq_scratch0]\n\t"
+		LONG_S " %[expectm], %[rseq_scratch1]\n\t"
+		LONG_S " %[len], %[rseq_scratch2]\n\t"
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3f, rseq_cs)
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, 4f)
+		RSEQ_INJECT_ASM(3)
+		LONG_L " $4, %[v]\n\t"
+		"bne $4, %[expect], 5f\n\t"
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, 6f)
+		LONG_L " $4, %[v]\n\t"
+		"bne $4, %[expect], 7f\n\t"
+#endif
+		/* compare memory region */
+		"beqz %[len], 333f\n\t"
+		"222:\n\t"
+		LONG_L " $4, 0(%[m])\n\t"
+		LONG_L " $6, 0(%[expectm])\n\t"
+		"bne $4, $6, 5f\n\t"
+		LONG_ADDI " %[m], " LONG_SIZE "\n\t"
+		LONG_ADDI " %[expectm], " LONG_SIZE "\n\t"
+		LONG_ADDI " %[len], -" LONG_SIZE "\n\t"
+		"bnez %[len], 222b\n\t"
+		"333:\n\t"
+		RSEQ_INJECT_ASM(5)
+		/* final store */
+		LONG_S " %[newv], %[v]\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(6)
+		/* teardown */
+		LONG_L " %[len], %[rseq_scratch2]\n\t"
+		LONG_L " %[expectm], %[rseq_scratch1]\n\t"
+		LONG_L " %[m], %[rseq_scratch0]\n\t"
+		"b 8f\n\t"
+		RSEQ_ASM_DEFINE_ABORT(3, 4,
+				      /* teardown */
+				      LONG_L " %[len], %[rseq_scratch2]\n\t"
+				      LONG_L " %[expectm], %[rseq_scratch1]\n\t"
+				      LONG_L " %[m], %[rseq_scratch0]\n\t",
+				      abort, 1b, 2b, 4f)
+		RSEQ_ASM_DEFINE_CMPFAIL(5,
+					/* teardown */
+					LONG_L " %[len], %[rseq_scratch2]\n\t"
+					LONG_L " %[expectm], %[rseq_scratch1]\n\t"
+					LONG_L " %[m], %[rseq_scratch0]\n\t",
+					cmpfail)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_CMPFAIL(6,
+					/* teardown */
+					LONG_L " %[len], %[rseq_scratch2]\n\t"
+					LONG_L " %[expectm], %[rseq_scratch1]\n\t"
+					LONG_L " %[m], %[rseq_scratch0]\n\t",
+					error1)
+		RSEQ_ASM_DEFINE_CMPFAIL(7,
+					/* teardown */
+					LONG_L " %[len], %[rseq_scratch2]\n\t"
+					LONG_L " %[expectm], %[rseq_scratch1]\n\t"
+					LONG_L " %[m], %[rseq_scratch0]\n\t",
+					error2)
+#endif
+		"8:\n\t"
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [current_cpu_id]	"m" (__rseq_abi.cpu_id),
+		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
+		  /* final store input */
+		  [v]			"m" (*v),
+		  [expect]		"r" (expect),
+		  [newv]		"r" (newv),
+		  /* compare memory region input */
+		  [m]			"r" (m),
+		  [expectm]		"r" (expectm),
+		  [len]			"r" (len),
+		  [rseq_scratch0]	"m" (rseq_scratch[0]),
+		  [rseq_scratch1]	"m" (rseq_scratch[1]),
+		  [rseq_scratch2]	"m" (rseq_scratch[2])
+		  RSEQ_INJECT_INPUT
+		: "$4", "$6", "memory"
+		  RSEQ_INJECT_CLOBBER
+		: abort, cmpfail
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1, error2
+#endif
+	);
+	rseq_workaround_gcc_asm_size_guess();
+	return 0;
+abort:
+	rseq_workaround_gcc_asm_size_guess();
+	RSEQ_INJECT_FAILED
+	return -1;
+cmpfail:
+	rseq_workaround_gcc_asm_size_guess();
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_workaround_gcc_asm_size_guess();
+	rseq_bug("cpu_id comparison failed");
+error2:
+	rseq_workaround_gcc_asm_size_guess();
+	rseq_bug("expected value comparison failed");
+#endif
+}
+
 static inline __attribute__((always_inline))
 int rseq_cmpeqv_trymemcpy_storev(intptr_t *v, intptr_t expect,
 				 void *dst, void *src, size_t len,
@@ -818,4 +965,70 @@ int rseq_deref_loadoffp(void *p, off_t voffp, intptr_t *load, int cpu)
 	return -1;
 }
 
+/*
+ * Dereference @p. If the pointer is NULL, fail with 1. Otherwise add
+ * @voffp to the dereferenced pointer, and add @count to its content.
+ */
+static inline __attribute__((always_inline))
+int rseq_deref_addoffp(intptr_t *p, off_t voffp, intptr_t count, int cpu)
+{
+	RSEQ_INJECT_C(9)
+
+	rseq_workaround_gcc_asm_size_guess();
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(9, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[cmpfail])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+#endif
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3f, rseq_cs)
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, 4f)
+		RSEQ_INJECT_ASM(3)
+		LONG_L " $4, %[p]\n\t"
+		"beqz $4, %l[cmpfail]\n\t"
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, %l[error1])
+#endif
+		LONG_ADDI " $4, %[voffp]\n\t"
+		LONG_L " $6, 0($4)\n\t"
+		LONG_ADDI " $6, %[count]\n\t"
+		/* final store */
+		LONG_S " $6, 0($4)\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(5)
+		"b 5f\n\t"
+		RSEQ_ASM_DEFINE_ABORT(3, 4, "", abort, 1b, 2b, 4f)
+		"5:\n\t"
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [current_cpu_id]	"m" (__rseq_abi.cpu_id),
+		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
+		  [p]			"m" (*p),
+		  [voffp]		"Ir" (voffp),
+		  [count]		"Ir" (count)
+		  RSEQ_INJECT_INPUT
+		: "$4", "$6", "memory"
+		  RSEQ_INJECT_CLOBBER
+		: abort, cmpfail
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1
+#endif
+	);
+	rseq_workaround_gcc_asm_size_guess();
+	return 0;
+abort:
+	rseq_workaround_gcc_asm_size_guess();
+	RSEQ_INJECT_FAILED
+	return -1;
+cmpfail:
+	rseq_workaround_gcc_asm_size_guess();
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_bug("cpu_id comparison failed");
+#endif
+}
+
 #endif /* !RSEQ_SKIP_FASTPATH */
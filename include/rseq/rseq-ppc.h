@@ -52,7 +52,10 @@ do {									\
 #define RSEQ_LOAD_LONG(arg)	"ld%U[" __rseq_str(arg) "]%X[" __rseq_str(arg) "] "	/* From memory ("m" constraint) */
 #define RSEQ_LOAD_INT(arg)	"lwz%U[" __rseq_str(arg) "]%X[" __rseq_str(arg) "] "	/* From memory ("m" constraint) */
 #define RSEQ_LOADX_LONG		"ldx "							/* From base register ("b" constraint) */
+#define RSEQ_STOREX_LONG	"stdx "							/* To base register ("b" constraint) */
 #define RSEQ_CMP_LONG		"cmpd "
+#define RSEQ_CMPI_LONG		"cmpdi "
+#define RSEQ_LONG_SIZE		"8"
 
 #define __RSEQ_ASM_DEFINE_TABLE(label, version, flags,				\
 			start_ip, post_commit_offset, abort_ip)			\
@@ -96,7 +99,10 @@ do {									\
 #define RSEQ_LOAD_LONG(arg)	"lwz%U[" __rseq_str(arg) "]%X[" __rseq_str(arg) "] "	/* From memory ("m" constraint) */
 #define RSEQ_LOAD_INT(arg)	RSEQ_LOAD_LONG(arg)					/* From memory ("m" constraint) */
 #define RSEQ_LOADX_LONG		"lwzx "							/* From base register ("b" constraint) */
+#define RSEQ_STOREX_LONG	"stwx "							/* To base register ("b" constraint) */
 #define RSEQ_CMP_LONG		"cmpw "
+#define RSEQ_CMPI_LONG		"cmpwi "
+#define RSEQ_LONG_SIZE		"4"
 
 #define __RSEQ_ASM_DEFINE_TABLE(label, version, flags,				\
 			start_ip, post_commit_offset, abort_ip)			\
@@ -199,6 +205,23 @@ do {									\
 		"bne 222b\n\t" \
 		"333:\n\t" \
 
+/*
+ * Compare the r19 bytes at @m and @expectm word by word, from the end of
+ * the region, and branch to @label on mismatch. Uses r17, r18 and r19.
+ */
+#define RSEQ_ASM_OP_R_CMPEQM(m, expectm, label) \
+		RSEQ_CMPI_LONG "cr7, %%r19, 0\n\t" \
+		"beq- cr7, 333f\n\t" \
+		"222:\n\t" \
+		"addi %%r19, %%r19, -" RSEQ_LONG_SIZE "\n\t" \
+		RSEQ_LOADX_LONG "%%r17, %[" __rseq_str(m) "], %%r19\n\t" \
+		RSEQ_LOADX_LONG "%%r18, %[" __rseq_str(expectm) "], %%r19\n\t" \
+		RSEQ_CMP_LONG "cr7, %%r17, %%r18\n\t" \
+		"bne- cr7, " __rseq_str(label) "\n\t" \
+		RSEQ_CMPI_LONG "cr7, %%r19, 0\n\t" \
+		"bne- cr7, 222b\n\t" \
+		"333:\n\t"
+
 #define RSEQ_ASM_OP_R_FINAL_STORE(var, post_commit_label)			\
 		RSEQ_STORE_LONG(var) "%%r17, %[" __rseq_str(var) "]\n\t"			\
 		__rseq_str(post_commit_label) ":\n\t"
@@ -270,6 +293,10 @@ static inline __attribute__((always_inline))
 int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 			       off_t voffp, intptr_t *load, int cpu)
 {
+#if RSEQ_ASM_GOTO_OUTPUT
+	intptr_t loadv;
+#endif
+
 	RSEQ_INJECT_C(9)
 
 	__asm__ __volatile__ goto (
@@ -296,22 +323,32 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		/* load the value of @v */
 		RSEQ_ASM_OP_R_LOAD(v)
 		/* store it in @load */
+#if RSEQ_ASM_GOTO_OUTPUT
+		"mr %[load], %%r17\n\t"
+#else
 		RSEQ_ASM_OP_R_STORE(load)
+#endif
 		/* dereference voffp(v) */
 		RSEQ_ASM_OP_R_LOADX(voffp)
 		/* final store the value at voffp(v) */
 		RSEQ_ASM_OP_R_FINAL_STORE(v, 2)
 		RSEQ_INJECT_ASM(5)
 		RSEQ_ASM_DEFINE_ABORT(4, abort)
+#if RSEQ_ASM_GOTO_OUTPUT
+		: [load]		"=&r" (loadv)
+#else
 		: /* gcc asm goto does not allow outputs */
+#endif
 		: [cpu_id]		"r" (cpu),
 		  [current_cpu_id]	"m" (__rseq_abi.cpu_id),
 		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
 		  /* final store input */
 		  [v]			"m" (*v),
 		  [expectnot]		"r" (expectnot),
-		  [voffp]		"b" (voffp),
-		  [load]		"m" (*load)
+		  [voffp]		"b" (voffp)
+#if !RSEQ_ASM_GOTO_OUTPUT
+		  , [load]		"m" (*load)
+#endif
 		  RSEQ_INJECT_INPUT
 		: "memory", "cc", "r17"
 		  RSEQ_INJECT_CLOBBER
@@ -320,6 +357,9 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		  , error1, error2
 #endif
 	);
+#if RSEQ_ASM_GOTO_OUTPUT
+	*load = loadv;
+#endif
 	return 0;
 abort:
 	RSEQ_INJECT_FAILED
@@ -597,6 +637,83 @@ error3:
 #endif
 }
 
+/*
+ * Compare @v against @expect, and the @len bytes at @m against the
+ * snapshot at @expectm. When everything matches, store @newv into @v.
+ * @len must be a multiple of sizeof(intptr_t), and @m and @expectm must
+ * be word-aligned.
+ */
+static inline __attribute__((always_inline))
+int rseq_cmpeqv_cmpeqm_storev(intptr_t *v, intptr_t expect,
+			      void *m, void *expectm, size_t len,
+			      intptr_t newv, int cpu)
+{
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[cmpfail])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error2])
+#endif
+		/* setup for region compare */
+		"mr %%r19, %[len]\n\t"
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, rseq_cs)
+		/* cmp cpuid */
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, 4f)
+		RSEQ_INJECT_ASM(3)
+		/* cmp @v equal to @expect */
+		RSEQ_ASM_OP_CMPEQ(v, expect, %l[cmpfail])
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		/* cmp cpuid */
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, %l[error1])
+		/* cmp @v equal to @expect */
+		RSEQ_ASM_OP_CMPEQ(v, expect, %l[error2])
+#endif
+		/* cmp region @m equal to @expectm */
+		RSEQ_ASM_OP_R_CMPEQM(m, expectm, %l[cmpfail])
+		RSEQ_INJECT_ASM(5)
+		/* final store */
+		RSEQ_ASM_OP_FINAL_STORE(newv, v, 2)
+		RSEQ_INJECT_ASM(6)
+		RSEQ_ASM_DEFINE_ABORT(4, abort)
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [current_cpu_id]	"m" (__rseq_abi.cpu_id),
+		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
+		  /* final store input */
+		  [v]			"m" (*v),
+		  [expect]		"r" (expect),
+		  [newv]		"r" (newv),
+		  /* region compare input */
+		  [m]			"b" (m),
+		  [expectm]		"b" (expectm),
+		  [len]			"r" (len)
+		  RSEQ_INJECT_INPUT
+		: "memory", "cc", "r17", "r18", "r19"
+		  RSEQ_INJECT_CLOBBER
+		: abort, cmpfail
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1, error2
+#endif
+	);
+	return 0;
+abort:
+	RSEQ_INJECT_FAILED
+	return -1;
+cmpfail:
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_bug("cpu_id comparison failed");
+error2:
+	rseq_bug("expected value comparison failed");
+#endif
+}
+
 static inline __attribute__((always_inline))
 int rseq_cmpeqv_trymemcpy_storev(intptr_t *v, intptr_t expect,
 				 void *dst, void *src, size_t len,
@@ -754,9 +871,74 @@ int rseq_deref_loadoffp(void *p, off_t voffp, intptr_t *load, int cpu)
 	return -1;
 }
 
+/*
+ * Dereference @p. If the pointer is NULL, fail with 1. Otherwise add
+ * @voffp to the dereferenced pointer, and add @count to its content.
+ */
+static inline __attribute__((always_inline))
+int rseq_deref_addoffp(intptr_t *p, off_t voffp, intptr_t count, int cpu)
+{
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[cmpfail])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+#endif
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, rseq_cs)
+		/* cmp cpuid */
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, 4f)
+		RSEQ_INJECT_ASM(3)
+		/* load the pointer at @p, fail if NULL */
+		RSEQ_ASM_OP_R_LOAD(p)
+		RSEQ_CMPI_LONG "cr7, %%r17, 0\n\t"
+		"beq- cr7, %l[cmpfail]\n\t"
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		/* cmp cpuid */
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, %l[error1])
+#endif
+		/* load voffp(pointer), add @count */
+		RSEQ_LOADX_LONG "%%r18, %[voffp], %%r17\n\t"
+		"add %%r18, %[count], %%r18\n\t"
+		/* final store */
+		RSEQ_STOREX_LONG "%%r18, %[voffp], %%r17\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(5)
+		RSEQ_ASM_DEFINE_ABORT(4, abort)
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [current_cpu_id]	"m" (__rseq_abi.cpu_id),
+		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
+		  [p]			"m" (*p),
+		  [voffp]		"b" (voffp),
+		  [count]		"r" (count)
+		  RSEQ_INJECT_INPUT
+		: "memory", "cc", "r17", "r18"
+		  RSEQ_INJECT_CLOBBER
+		: abort, cmpfail
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1
+#endif
+	);
+	return 0;
+abort:
+	RSEQ_INJECT_FAILED
+	return -1;
+cmpfail:
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_bug("cpu_id comparison failed");
+#endif
+}
+
 #undef RSEQ_STORE_LONG
 #undef RSEQ_LOAD_LONG
 #undef RSEQ_LOADX_LONG
+#undef RSEQ_STOREX_LONG
 #undef RSEQ_CMP_LONG
 
 #endif /* !RSEQ_SKIP_FASTPATH */
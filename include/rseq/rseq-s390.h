@@ -41,6 +41,8 @@ do {									\
 #define LONG_CMP_R		"cgr"
 #define LONG_ADDI		"aghi"
 #define LONG_ADD_R		"agr"
+#define LONG_LR			"lgr"
+#define LONG_SIZE		"8"
 
 #define __RSEQ_ASM_DEFINE_TABLE(label, version, flags,			\
 				start_ip, post_commit_offset, abort_ip)	\
@@ -101,6 +103,8 @@ do {									\
 #define LONG_CMP_R		"cr"
 #define LONG_ADDI		"ahi"
 #define LONG_ADD_R		"ar"
+#define LONG_LR			"lr"
+#define LONG_SIZE		"4"
 
 #endif
 
@@ -200,6 +204,10 @@ static inline __attribute__((always_inline))
 int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 			       off_t voffp, intptr_t *load, int cpu)
 {
+#if RSEQ_ASM_GOTO_OUTPUT
+	intptr_t loadv;
+#endif
+
 	RSEQ_INJECT_C(9)
 
 	__asm__ __volatile__ goto (
@@ -223,7 +231,11 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		LONG_CMP_R " %%r1, %[expectnot]\n\t"
 		"je %l[error2]\n\t"
 #endif
+#if RSEQ_ASM_GOTO_OUTPUT
+		LONG_LR " %[load], %%r1\n\t"
+#else
 		LONG_S " %%r1, %[load]\n\t"
+#endif
 		LONG_ADD_R " %%r1, %[voffp]\n\t"
 		LONG_L " %%r1, 0(%%r1)\n\t"
 		/* final store */
@@ -231,15 +243,21 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		"2:\n\t"
 		RSEQ_INJECT_ASM(5)
 		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+#if RSEQ_ASM_GOTO_OUTPUT
+		: [load]		"=&r" (loadv)
+#else
 		: /* gcc asm goto does not allow outputs */
+#endif
 		: [cpu_id]		"r" (cpu),
 		  [current_cpu_id]	"m" (__rseq_abi.cpu_id),
 		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
 		  /* final store input */
 		  [v]			"m" (*v),
 		  [expectnot]		"r" (expectnot),
-		  [voffp]		"r" (voffp),
-		  [load]		"m" (*load)
+		  [voffp]		"r" (voffp)
+#if !RSEQ_ASM_GOTO_OUTPUT
+		  , [load]		"m" (*load)
+#endif
 		  RSEQ_INJECT_INPUT
 		: "memory", "cc", "r0", "r1"
 		  RSEQ_INJECT_CLOBBER
@@ -248,6 +266,9 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		  , error1, error2
 #endif
 	);
+#if RSEQ_ASM_GOTO_OUTPUT
+	*load = loadv;
+#endif
 	return 0;
 abort:
 	RSEQ_INJECT_FAILED
@@ -459,6 +480,123 @@ error3:
 #endif
 }
 
+/*
+ * Compare @v against @expect, and the @len bytes at @m against the
+ * snapshot at @expectm. When everything matches, store @newv into @v.
+ * @len must be a multiple of sizeof(intptr_t), and @m and @expectm must
+ * be word-aligned.
+ */
+static inline __attribute__((always_inline))
+int rseq_cmpeqv_cmpeqm_storev(intptr_t *v, intptr_t expect,
+			      void *m, void *expectm, size_t len,
+			      intptr_t newv, int cpu)
+{
+	uint64_t rseq_scratch[3];
+
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[cmpfail])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error2])
+#endif
+		LONG_S " %[m], %[rseq_scratch0]\n\t"
+		LONG_S " %[expectm], %[rseq_scratch1]\n\t"
+		LONG_S " %[len], %[rseq_scratch2]\n\t"
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, rseq_cs)
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, 4f)
+		RSEQ_INJECT_ASM(3)
+		LONG_CMP " %[expect], %[v]\n\t"
+		"jnz 5f\n\t"
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, 6f)
+		LONG_CMP " %[expect], %[v]\n\t"
+		"jnz 7f\n\t"
+#endif
+		/* compare memory region */
+		LONG_LT_R " %[len], %[len]\n\t"
+		"jz 333f\n\t"
+		"222:\n\t"
+		LONG_L " %%r0, 0(%[m])\n\t"
+		LONG_CMP " %%r0, 0(%[expectm])\n\t"
+		"jnz 5f\n\t"
+		LONG_ADDI " %[m], " LONG_SIZE "\n\t"
+		LONG_ADDI " %[expectm], " LONG_SIZE "\n\t"
+		LONG_ADDI " %[len], -" LONG_SIZE "\n\t"
+		"jnz 222b\n\t"
+		"333:\n\t"
+		RSEQ_INJECT_ASM(5)
+		/* final store */
+		LONG_S " %[newv], %[v]\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(6)
+		/* teardown */
+		LONG_L " %[len], %[rseq_scratch2]\n\t"
+		LONG_L " %[expectm], %[rseq_scratch1]\n\t"
+		LONG_L " %[m], %[rseq_scratch0]\n\t"
+		RSEQ_ASM_DEFINE_ABORT(4,
+			LONG_L " %[len], %[rseq_scratch2]\n\t"
+			LONG_L " %[expectm], %[rseq_scratch1]\n\t"
+			LONG_L " %[m], %[rseq_scratch0]\n\t",
+			abort)
+		RSEQ_ASM_DEFINE_CMPFAIL(5,
+			LONG_L " %[len], %[rseq_scratch2]\n\t"
+			LONG_L " %[expectm], %[rseq_scratch1]\n\t"
+			LONG_L " %[m], %[rseq_scratch0]\n\t",
+			cmpfail)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_CMPFAIL(6,
+			LONG_L " %[len], %[rseq_scratch2]\n\t"
+			LONG_L " %[expectm], %[rseq_scratch1]\n\t"
+			LONG_L " %[m], %[rseq_scratch0]\n\t",
+			error1)
+		RSEQ_ASM_DEFINE_CMPFAIL(7,
+			LONG_L " %[len], %[rseq_scratch2]\n\t"
+			LONG_L " %[expectm], %[rseq_scratch1]\n\t"
+			LONG_L " %[m], %[rseq_scratch0]\n\t",
+			error2)
+#endif
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [current_cpu_id]	"m" (__rseq_abi.cpu_id),
+		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
+		  /* final store input */
+		  [v]			"m" (*v),
+		  [expect]		"r" (expect),
+		  [newv]		"r" (newv),
+		  /* compare memory region input */
+		  [m]			"a" (m),
+		  [expectm]		"a" (expectm),
+		  [len]			"r" (len),
+		  [rseq_scratch0]	"m" (rseq_scratch[0]),
+		  [rseq_scratch1]	"m" (rseq_scratch[1]),
+		  [rseq_scratch2]	"m" (rseq_scratch[2])
+		  RSEQ_INJECT_INPUT
+		: "memory", "cc", "r0"
+		  RSEQ_INJECT_CLOBBER
+		: abort, cmpfail
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1, error2
+#endif
+	);
+	return 0;
+abort:
+	RSEQ_INJECT_FAILED
+	return -1;
+cmpfail:
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_bug("cpu_id comparison failed");
+error2:
+	rseq_bug("expected value comparison failed");
+#endif
+}
+
 static inline __attribute__((always_inline))
 int rseq_cmpeqv_trymemcpy_storev(intptr_t *v, intptr_t expect,
 				 void *dst, void *src, size_t len,
@@ -586,4 +724,65 @@ int rseq_deref_loadoffp(void *p, off_t voffp, intptr_t *load, int cpu)
 	return -1;
 }
 
+/*
+ * Dereference @p. If the pointer is NULL, fail with 1. Otherwise add
+ * @voffp to the dereferenced pointer, and add @count to its content.
+ */
+static inline __attribute__((always_inline))
+int rseq_deref_addoffp(intptr_t *p, off_t voffp, intptr_t count, int cpu)
+{
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[cmpfail])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+#endif
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, rseq_cs)
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, 4f)
+		RSEQ_INJECT_ASM(3)
+		LONG_L " %%r1, %[p]\n\t"
+		LONG_LT_R " %%r1, %%r1\n\t"
+		"jz %l[cmpfail]\n\t"
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, current_cpu_id, %l[error1])
+#endif
+		LONG_ADD_R " %%r1, %[voffp]\n\t"
+		LONG_L " %%r0, 0(%%r1)\n\t"
+		LONG_ADD_R " %%r0, %[count]\n\t"
+		/* final store */
+		LONG_S " %%r0, 0(%%r1)\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(5)
+		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [current_cpu_id]	"m" (__rseq_abi.cpu_id),
+		  [rseq_cs]		"m" (__rseq_abi.rseq_cs),
+		  [p]			"m" (*p),
+		  [voffp]		"r" (voffp),
+		  [count]		"r" (count)
+		  RSEQ_INJECT_INPUT
+		: "memory", "cc", "r0", "r1"
+		  RSEQ_INJECT_CLOBBER
+		: abort, cmpfail
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1
+#endif
+	);
+	return 0;
+abort:
+	RSEQ_INJECT_FAILED
+	return -1;
+cmpfail:
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_bug("cpu_id comparison failed");
+#endif
+}
+
 #endif /* !RSEQ_SKIP_FASTPATH */
@@ -174,6 +174,10 @@ static inline __attribute__((always_inline))
 int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 			       off_t voffp, intptr_t *load, int cpu)
 {
+#if RSEQ_ASM_GOTO_OUTPUT
+	intptr_t loadv;
+#endif
+
 	RSEQ_INJECT_C(9)
 
 	__asm__ __volatile__ goto (
@@ -205,14 +209,20 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		"2:\n\t"
 		RSEQ_INJECT_ASM(5)
 		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+#if RSEQ_ASM_GOTO_OUTPUT
+		: [load]		"=&r" (loadv)
+#else
 		: /* gcc asm goto does not allow outputs */
+#endif
 		: [cpu_id]		"r" (cpu),
 		  [rseq_abi]		"r" (&__rseq_abi),
 		  /* final store input */
 		  [v]			"m" (*v),
 		  [expectnot]		"r" (expectnot),
-		  [voffp]		"er" (voffp),
-		  [load]		"m" (*load)
+		  [voffp]		"er" (voffp)
+#if !RSEQ_ASM_GOTO_OUTPUT
+		  , [load]		"m" (*load)
+#endif
 		: "memory", "cc", "rax", "rbx"
 		  RSEQ_INJECT_CLOBBER
 		: abort, cmpfail
@@ -220,6 +230,9 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		  , error1, error2
 #endif
 	);
+#if RSEQ_ASM_GOTO_OUTPUT
+	*load = loadv;
+#endif
 	return 0;
 abort:
 	RSEQ_INJECT_FAILED
@@ -423,6 +436,89 @@ error3:
 #endif
 }
 
+/*
+ * Compare @v against @expect, and the @len bytes at @m against the
+ * snapshot at @expectm. When everything matches, store @newv into @v.
+ * @len must be a multiple of sizeof(intptr_t), and @m and @expectm must
+ * be word-aligned. The region is compared word by word within the
+ * critical section, so @len should be kept small (e.g. one cache line).
+ */
+static inline __attribute__((always_inline))
+int rseq_cmpeqv_cmpeqm_storev(intptr_t *v, intptr_t expect,
+			      void *m, void *expectm, size_t len,
+			      intptr_t newv, int cpu)
+{
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[cmpfail])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error2])
+#endif
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, RSEQ_CS_OFFSET(%[rseq_abi]))
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, RSEQ_CPU_ID_OFFSET(%[rseq_abi]), 4f)
+		RSEQ_INJECT_ASM(3)
+		"cmpq %[v], %[expect]\n\t"
+		"jnz %l[cmpfail]\n\t"
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, RSEQ_CPU_ID_OFFSET(%[rseq_abi]), %l[error1])
+		"cmpq %[v], %[expect]\n\t"
+		"jnz %l[error2]\n\t"
+#endif
+		/* compare memory region */
+		"xorl %%ebx, %%ebx\n\t"
+		"test %[len], %[len]\n\t"
+		"jz 333f\n\t"
+		"222:\n\t"
+		"movq (%[m], %%rbx), %%rax\n\t"
+		"cmpq (%[expectm], %%rbx), %%rax\n\t"
+		"jnz %l[cmpfail]\n\t"
+		"addq $8, %%rbx\n\t"
+		"cmpq %%rbx, %[len]\n\t"
+		"jnz 222b\n\t"
+		"333:\n\t"
+		RSEQ_INJECT_ASM(5)
+		/* final store */
+		"movq %[newv], %[v]\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(6)
+		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [rseq_abi]		"r" (&__rseq_abi),
+		  /* final store input */
+		  [v]			"m" (*v),
+		  [expect]		"r" (expect),
+		  [newv]		"r" (newv),
+		  /* compare memory region input */
+		  [m]			"r" (m),
+		  [expectm]		"r" (expectm),
+		  [len]			"r" (len)
+		: "memory", "cc", "rax", "rbx"
+		  RSEQ_INJECT_CLOBBER
+		: abort, cmpfail
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1, error2
+#endif
+	);
+	return 0;
+abort:
+	RSEQ_INJECT_FAILED
+	return -1;
+cmpfail:
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_bug("cpu_id comparison failed");
+error2:
+	rseq_bug("expected value comparison failed");
+#endif
+}
+
 static inline __attribute__((always_inline))
 int rseq_cmpeqv_trymemcpy_storev(intptr_t *v, intptr_t expect,
 				 void *dst, void *src, size_t len,
@@ -548,6 +644,10 @@ int rseq_cmpeqv_trymemcpy_storev_release(intptr_t *v, intptr_t expect,
 static inline __attribute__((always_inline))
 int rseq_deref_loadoffp(intptr_t *p, off_t voffp, intptr_t *load, int cpu)
 {
+#if RSEQ_ASM_GOTO_OUTPUT
+	intptr_t loadv;
+#endif
+
 	RSEQ_INJECT_C(9)
 
 	__asm__ __volatile__ goto (
@@ -570,13 +670,19 @@ int rseq_deref_loadoffp(intptr_t *p, off_t voffp, intptr_t *load, int cpu)
 		"2:\n\t"
 		RSEQ_INJECT_ASM(5)
 		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+#if RSEQ_ASM_GOTO_OUTPUT
+		: [load]		"=&r" (loadv)
+#else
 		: /* gcc asm goto does not allow outputs */
+#endif
 		: [cpu_id]		"r" (cpu),
 		  [rseq_abi]		"r" (&__rseq_abi),
 		  /* final store input */
 		  [p]			"m" (*p),
-		  [voffp]		"er" (voffp),
-		  [load]		"m" (*load)
+		  [voffp]		"er" (voffp)
+#if !RSEQ_ASM_GOTO_OUTPUT
+		  , [load]		"m" (*load)
+#endif
 		: "memory", "cc", "rax", "rbx"
 		  RSEQ_INJECT_CLOBBER
 		: abort
@@ -584,6 +690,9 @@ int rseq_deref_loadoffp(intptr_t *p, off_t voffp, intptr_t *load, int cpu)
 		  , error1
 #endif
 	);
+#if RSEQ_ASM_GOTO_OUTPUT
+	*load = loadv;
+#endif
 	return 0;
 abort:
 	RSEQ_INJECT_FAILED
@@ -594,21 +703,79 @@ error1:
 #endif
 }
 
+/*
+ * Dereference @p. If the pointer is NULL, fail with 1. Otherwise add
+ * @voffp to the dereferenced pointer, and add @count to its content.
+ */
+static inline __attribute__((always_inline))
+int rseq_deref_addoffp(intptr_t *p, off_t voffp, intptr_t count, int cpu)
+{
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[cmpfail])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+#endif
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, RSEQ_CS_OFFSET(%[rseq_abi]))
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, RSEQ_CPU_ID_OFFSET(%[rseq_abi]), 4f)
+		RSEQ_INJECT_ASM(3)
+		"movq %[p], %%rbx\n\t"
+		"testq %%rbx, %%rbx\n\t"
+		"jz %l[cmpfail]\n\t"
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, RSEQ_CPU_ID_OFFSET(%[rseq_abi]), %l[error1])
+#endif
+		"addq %[voffp], %%rbx\n\t"
+		/* final store */
+		"addq %[count], (%%rbx)\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(5)
+		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [rseq_abi]		"r" (&__rseq_abi),
+		  [p]			"m" (*p),
+		  [voffp]		"er" (voffp),
+		  [count]		"er" (count)
+		: "memory", "cc", "rax", "rbx"
+		  RSEQ_INJECT_CLOBBER
+		: abort, cmpfail
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1
+#endif
+	);
+	return 0;
+abort:
+	RSEQ_INJECT_FAILED
+	return -1;
+cmpfail:
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_bug("cpu_id comparison failed");
+#endif
+}
+
 #endif /* !RSEQ_SKIP_FASTPATH */
 
 #elif __i386__
 
+/*
+ * x86-32 is TSO like x86-64: only store-load ordering needs a fence.
+ */
 #define rseq_smp_mb()	\
 	__asm__ __volatile__ ("lock; addl $0,-128(%%esp)" ::: "memory", "cc")
-#define rseq_smp_rmb()	\
-	__asm__ __volatile__ ("lock; addl $0,-128(%%esp)" ::: "memory", "cc")
-#define rseq_smp_wmb()	\
-	__asm__ __volatile__ ("lock; addl $0,-128(%%esp)" ::: "memory", "cc")
+#define rseq_smp_rmb()	rseq_barrier()
+#define rseq_smp_wmb()	rseq_barrier()
 
 #define rseq_smp_load_acquire(p)					\
 __extension__ ({							\
 	__typeof(*p) ____p1 = RSEQ_READ_ONCE(*p);			\
-	rseq_smp_mb();							\
+	rseq_barrier();							\
 	____p1;								\
 })
 
@@ -616,7 +783,7 @@ __extension__ ({							\
 
 #define rseq_smp_store_release(p, v)					\
 do {									\
-	rseq_smp_mb();							\
+	rseq_barrier();							\
 	RSEQ_WRITE_ONCE(*p, v);						\
 } while (0)
 
@@ -625,8 +792,10 @@ do {									\
 #else /* !RSEQ_SKIP_FASTPATH */
 
 /*
- * Use eax as scratch register and take memory operands as input to
- * lessen register pressure. Especially needed when compiling in O0.
+ * Use eax as scratch register to lessen register pressure. Scalar inputs
+ * which are only moved through eax use "rm" constraints, so they stay in
+ * registers when enough are available, and are taken as memory operands
+ * otherwise, especially when compiling in O0.
  */
 #define __RSEQ_ASM_DEFINE_TABLE(label, version, flags,			\
 				start_ip, post_commit_offset, abort_ip)	\
@@ -748,6 +917,10 @@ static inline __attribute__((always_inline))
 int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 			       off_t voffp, intptr_t *load, int cpu)
 {
+#if RSEQ_ASM_GOTO_OUTPUT
+	intptr_t loadv;
+#endif
+
 	RSEQ_INJECT_C(9)
 
 	__asm__ __volatile__ goto (
@@ -779,14 +952,20 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		"2:\n\t"
 		RSEQ_INJECT_ASM(5)
 		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+#if RSEQ_ASM_GOTO_OUTPUT
+		: [load]		"=&rm" (loadv)
+#else
 		: /* gcc asm goto does not allow outputs */
+#endif
 		: [cpu_id]		"r" (cpu),
 		  [rseq_abi]		"r" (&__rseq_abi),
 		  /* final store input */
 		  [v]			"m" (*v),
 		  [expectnot]		"r" (expectnot),
-		  [voffp]		"ir" (voffp),
-		  [load]		"m" (*load)
+		  [voffp]		"ir" (voffp)
+#if !RSEQ_ASM_GOTO_OUTPUT
+		  , [load]		"m" (*load)
+#endif
 		: "memory", "cc", "eax", "ebx"
 		  RSEQ_INJECT_CLOBBER
 		: abort, cmpfail
@@ -794,6 +973,9 @@ int rseq_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
 		  , error1, error2
 #endif
 	);
+#if RSEQ_ASM_GOTO_OUTPUT
+	*load = loadv;
+#endif
 	return 0;
 abort:
 	RSEQ_INJECT_FAILED
@@ -893,7 +1075,7 @@ int rseq_cmpeqv_trystorev_storev(intptr_t *v, intptr_t expect,
 		  [rseq_abi]		"r" (&__rseq_abi),
 		  /* try store input */
 		  [v2]			"m" (*v2),
-		  [newv2]		"m" (newv2),
+		  [newv2]		"rm" (newv2),
 		  /* final store input */
 		  [v]			"m" (*v),
 		  [expect]		"r" (expect),
@@ -950,7 +1132,6 @@ int rseq_cmpeqv_trystorev_storev_release(intptr_t *v, intptr_t expect,
 		/* try store */
 		"movl %[newv2], %[v2]\n\t"
 		RSEQ_INJECT_ASM(5)
-		"lock; addl $0,-128(%%esp)\n\t"
 		/* final store */
 		"movl %[newv], %[v]\n\t"
 		"2:\n\t"
@@ -964,7 +1145,7 @@ int rseq_cmpeqv_trystorev_storev_release(intptr_t *v, intptr_t expect,
 		  [newv2]		"r" (newv2),
 		  /* final store input */
 		  [v]			"m" (*v),
-		  [expect]		"m" (expect),
+		  [expect]		"rm" (expect),
 		  [newv]		"r" (newv)
 		: "memory", "cc", "eax"
 		  RSEQ_INJECT_CLOBBER
@@ -1035,7 +1216,7 @@ int rseq_cmpeqv_cmpeqv_storev(intptr_t *v, intptr_t expect,
 		  /* final store input */
 		  [v]			"m" (*v),
 		  [expect]		"r" (expect),
-		  [newv]		"m" (newv)
+		  [newv]		"rm" (newv)
 		: "memory", "cc", "eax"
 		  RSEQ_INJECT_CLOBBER
 		: abort, cmpfail
@@ -1059,6 +1240,109 @@ error3:
 #endif
 }
 
+/*
+ * Compare @v against @expect, and the @len bytes at @m against the
+ * snapshot at @expectm. When everything matches, store @newv into @v.
+ * @len must be a multiple of sizeof(intptr_t), and @m and @expectm must
+ * be word-aligned. @len is used as a decreasing index, and restored from
+ * scratch memory on every exit path.
+ */
+static inline __attribute__((always_inline))
+int rseq_cmpeqv_cmpeqm_storev(intptr_t *v, intptr_t expect,
+			      void *m, void *expectm, size_t len,
+			      intptr_t newv, int cpu)
+{
+	uint32_t rseq_scratch[1];
+
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[cmpfail])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error2])
+#endif
+		"movl %[len], %[rseq_scratch0]\n\t"
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, RSEQ_CS_OFFSET(%[rseq_abi]))
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, RSEQ_CPU_ID_OFFSET(%[rseq_abi]), 4f)
+		RSEQ_INJECT_ASM(3)
+		"movl %[expect], %%eax\n\t"
+		"cmpl %%eax, %[v]\n\t"
+		"jnz 5f\n\t"
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, RSEQ_CPU_ID_OFFSET(%[rseq_abi]), 6f)
+		"movl %[expect], %%eax\n\t"
+		"cmpl %%eax, %[v]\n\t"
+		"jnz 7f\n\t"
+#endif
+		/* compare memory region */
+		"test %[len], %[len]\n\t"
+		"jz 333f\n\t"
+		"222:\n\t"
+		"movl -4(%[m], %[len]), %%eax\n\t"
+		"cmpl -4(%[expectm], %[len]), %%eax\n\t"
+		"jnz 5f\n\t"
+		"subl $4, %[len]\n\t"
+		"jnz 222b\n\t"
+		"333:\n\t"
+		RSEQ_INJECT_ASM(5)
+		"movl %[newv], %%eax\n\t"
+		/* final store */
+		"movl %%eax, %[v]\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(6)
+		/* teardown */
+		"movl %[rseq_scratch0], %[len]\n\t"
+		RSEQ_ASM_DEFINE_ABORT(4,
+			"movl %[rseq_scratch0], %[len]\n\t",
+			abort)
+		RSEQ_ASM_DEFINE_CMPFAIL(5,
+			"movl %[rseq_scratch0], %[len]\n\t",
+			cmpfail)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_CMPFAIL(6,
+			"movl %[rseq_scratch0], %[len]\n\t",
+			error1)
+		RSEQ_ASM_DEFINE_CMPFAIL(7,
+			"movl %[rseq_scratch0], %[len]\n\t",
+			error2)
+#endif
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [rseq_abi]		"r" (&__rseq_abi),
+		  /* final store input */
+		  [v]			"m" (*v),
+		  [expect]		"rm" (expect),
+		  [newv]		"rm" (newv),
+		  /* compare memory region input */
+		  [m]			"r" (m),
+		  [expectm]		"r" (expectm),
+		  [len]			"r" (len),
+		  [rseq_scratch0]	"m" (rseq_scratch[0])
+		: "memory", "cc", "eax"
+		  RSEQ_INJECT_CLOBBER
+		: abort, cmpfail
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1, error2
+#endif
+	);
+	return 0;
+abort:
+	RSEQ_INJECT_FAILED
+	return -1;
+cmpfail:
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_bug("cpu_id comparison failed");
+error2:
+	rseq_bug("expected value comparison failed");
+#endif
+}
+
 /* TODO: implement a faster memcpy. */
 static inline __attribute__((always_inline))
 int rseq_cmpeqv_trymemcpy_storev(intptr_t *v, intptr_t expect,
@@ -1141,8 +1425,8 @@ int rseq_cmpeqv_trymemcpy_storev(intptr_t *v, intptr_t expect,
 		  [rseq_abi]		"r" (&__rseq_abi),
 		  /* final store input */
 		  [v]			"m" (*v),
-		  [expect]		"m" (expect),
-		  [newv]		"m" (newv),
+		  [expect]		"rm" (expect),
+		  [newv]		"rm" (newv),
 		  /* try memcpy input */
 		  [dst]			"r" (dst),
 		  [src]			"r" (src),
@@ -1217,7 +1501,6 @@ int rseq_cmpeqv_trymemcpy_storev_release(intptr_t *v, intptr_t expect,
 		"jnz 222b\n\t" \
 		"333:\n\t" \
 		RSEQ_INJECT_ASM(5)
-		"lock; addl $0,-128(%%esp)\n\t"
 		"movl %[newv], %%eax\n\t"
 		/* final store */
 		"movl %%eax, %[v]\n\t"
@@ -1254,8 +1537,8 @@ int rseq_cmpeqv_trymemcpy_storev_release(intptr_t *v, intptr_t expect,
 		  [rseq_abi]		"r" (&__rseq_abi),
 		  /* final store input */
 		  [v]			"m" (*v),
-		  [expect]		"m" (expect),
-		  [newv]		"m" (newv),
+		  [expect]		"rm" (expect),
+		  [newv]		"rm" (newv),
 		  /* try memcpy input */
 		  [dst]			"r" (dst),
 		  [src]			"r" (src),
@@ -1291,6 +1574,10 @@ error2:
 static inline __attribute__((always_inline))
 int rseq_deref_loadoffp(intptr_t *p, off_t voffp, intptr_t *load, int cpu)
 {
+#if RSEQ_ASM_GOTO_OUTPUT
+	intptr_t loadv;
+#endif
+
 	RSEQ_INJECT_C(9)
 
 	__asm__ __volatile__ goto (
@@ -1313,13 +1600,19 @@ int rseq_deref_loadoffp(intptr_t *p, off_t voffp, intptr_t *load, int cpu)
 		"2:\n\t"
 		RSEQ_INJECT_ASM(5)
 		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+#if RSEQ_ASM_GOTO_OUTPUT
+		: [load]		"=&rm" (loadv)
+#else
 		: /* gcc asm goto does not allow outputs */
+#endif
 		: [cpu_id]		"r" (cpu),
 		  [rseq_abi]		"r" (&__rseq_abi),
 		  /* final store input */
 		  [p]			"m" (*p),
-		  [voffp]		"ir" (voffp),
-		  [load]		"m" (*load)
+		  [voffp]		"ir" (voffp)
+#if !RSEQ_ASM_GOTO_OUTPUT
+		  , [load]		"m" (*load)
+#endif
 		: "memory", "cc", "eax", "ebx"
 		  RSEQ_INJECT_CLOBBER
 		: abort
@@ -1327,6 +1620,9 @@ int rseq_deref_loadoffp(intptr_t *p, off_t voffp, intptr_t *load, int cpu)
 		  , error1
 #endif
 	);
+#if RSEQ_ASM_GOTO_OUTPUT
+	*load = loadv;
+#endif
 	return 0;
 abort:
 	RSEQ_INJECT_FAILED
@@ -1337,6 +1633,63 @@ error1:
 #endif
 }
 
+/*
+ * Dereference @p. If the pointer is NULL, fail with 1. Otherwise add
+ * @voffp to the dereferenced pointer, and add @count to its content.
+ */
+static inline __attribute__((always_inline))
+int rseq_deref_addoffp(intptr_t *p, off_t voffp, intptr_t count, int cpu)
+{
+	RSEQ_INJECT_C(9)
+
+	__asm__ __volatile__ goto (
+		RSEQ_ASM_DEFINE_TABLE(3, 1f, 2f, 4f) /* start, commit, abort */
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[cmpfail])
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_DEFINE_EXIT_POINT(1f, %l[error1])
+#endif
+		/* Start rseq by storing table entry pointer into rseq_cs. */
+		RSEQ_ASM_STORE_RSEQ_CS(1, 3b, RSEQ_CS_OFFSET(%[rseq_abi]))
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, RSEQ_CPU_ID_OFFSET(%[rseq_abi]), 4f)
+		RSEQ_INJECT_ASM(3)
+		"movl %[p], %%ebx\n\t"
+		"testl %%ebx, %%ebx\n\t"
+		"jz %l[cmpfail]\n\t"
+		RSEQ_INJECT_ASM(4)
+#ifdef RSEQ_COMPARE_TWICE
+		RSEQ_ASM_CMP_CPU_ID(cpu_id, RSEQ_CPU_ID_OFFSET(%[rseq_abi]), %l[error1])
+#endif
+		"addl %[voffp], %%ebx\n\t"
+		/* final store */
+		"addl %[count], (%%ebx)\n\t"
+		"2:\n\t"
+		RSEQ_INJECT_ASM(5)
+		RSEQ_ASM_DEFINE_ABORT(4, "", abort)
+		: /* gcc asm goto does not allow outputs */
+		: [cpu_id]		"r" (cpu),
+		  [rseq_abi]		"r" (&__rseq_abi),
+		  [p]			"m" (*p),
+		  [voffp]		"ir" (voffp),
+		  [count]		"ir" (count)
+		: "memory", "cc", "eax", "ebx"
+		  RSEQ_INJECT_CLOBBER
+		: abort, cmpfail
+#ifdef RSEQ_COMPARE_TWICE
+		  , error1
+#endif
+	);
+	return 0;
+abort:
+	RSEQ_INJECT_FAILED
+	return -1;
+cmpfail:
+	return 1;
+#ifdef RSEQ_COMPARE_TWICE
+error1:
+	rseq_bug("cpu_id comparison failed");
+#endif
+}
+
 #endif /* !RSEQ_SKIP_FASTPATH */
 
 #endif
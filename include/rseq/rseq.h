@@ -75,6 +75,26 @@ extern __thread struct rseq __rseq_abi;
 		abort();		\
 	} while (0)
 
+/*
+ * When asm goto accepts output operands, critical sections which load a
+ * value return it in a register instead of storing it through memory.
+ * The library build sets RSEQ_ASM_GOTO_OUTPUT from configure, otherwise
+ * it is derived from the compiler version. Define it to 0 to force the
+ * memory operand variants.
+ */
+#ifndef RSEQ_ASM_GOTO_OUTPUT
+# if defined(__clang__) && defined(__has_extension)
+#  if __has_extension(gnu_asm_goto_with_outputs)
+#   define RSEQ_ASM_GOTO_OUTPUT	1
+#  endif
+# elif !defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 11
+#  define RSEQ_ASM_GOTO_OUTPUT	1
+# endif
+#endif
+#ifndef RSEQ_ASM_GOTO_OUTPUT
+# define RSEQ_ASM_GOTO_OUTPUT	0
+#endif
+
 #if defined(__x86_64__) || defined(__i386__)
 #include <rseq/rseq-x86.h>
 #elif defined(__ARMEL__) || defined(__ARMEB__)
@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * slotmap.h
+ *
+ * Generation-tagged slot map with per-CPU free lists.
+ *
+ * A slot map stores pointers in slots, and hands out 64-bit handles
+ * made of the index of the slot and of its generation. The generation
+ * of a slot changes when its value is removed, so lookups of stale
+ * handles fail instead of returning the value of a later insertion.
+ *
+ * Slots are allocated in chunks appended as the map grows, and never
+ * freed before the map is destroyed. Each chunk is handed to the CPU
+ * which needed it, which becomes the home of its slots. Free slots are
+ * kept in a per-CPU stack, linked through the slots as in the
+ * percpu_list pattern, and pushed and popped with restartable
+ * sequences. A slot removed from another CPU than its home is pushed on
+ * an inbox of the home CPU with a compare-and-swap, which the home CPU
+ * takes in a single exchange once its stack is empty. A CPU with an
+ * empty stack and inbox steals the inbox of another CPU before growing
+ * the map.
+ *
+ * Threads inserting and removing values must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_SLOTMAP_H
+#define RSEQ_SLOTMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Never returned as the handle of a slot. */
+#define RSEQ_SLOTMAP_INVALID		((uint64_t) 0)
+
+#define rseq_slotmap_handle_index(handle)	((uint32_t) (handle))
+#define rseq_slotmap_handle_generation(handle)	((uint32_t) ((handle) >> 32))
+
+struct rseq_slotmap;
+
+/*
+ * Create a slot map growing by chunks of @chunk_slots slots, a power of
+ * two, up to @max_slots slots, which must fit in 32 bits. Returns NULL
+ * and sets errno on error.
+ */
+struct rseq_slotmap *rseq_slotmap_create(size_t chunk_slots, size_t max_slots);
+
+/*
+ * Free the slot map. Values left in the map are not freed.
+ */
+void rseq_slotmap_destroy(struct rseq_slotmap *map);
+
+/*
+ * Store @value into a free slot, and its handle into @handle. Returns 0
+ * on success, -1 with errno set to ENOSPC if the map holds its maximum
+ * number of slots, or ENOMEM.
+ */
+int rseq_slotmap_insert(struct rseq_slotmap *map, void *value,
+		uint64_t *handle);
+
+/*
+ * Return the value of @handle, or NULL if the handle is stale. Lookups
+ * may run concurrently with insertions and removals, and do not need
+ * the calling thread to be registered.
+ */
+void *rseq_slotmap_get(struct rseq_slotmap *map, uint64_t handle);
+
+/*
+ * Remove the value of @handle, and store it into @value if not NULL.
+ * Returns 0 on success, -1 with errno set to ENOENT if the handle is
+ * stale.
+ */
+int rseq_slotmap_remove(struct rseq_slotmap *map, uint64_t handle,
+		void **value);
+
+/* Number of slots allocated by the map, free or not. */
+size_t rseq_slotmap_nr_slots(struct rseq_slotmap *map);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_SLOTMAP_H */
@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * splice-export.h
+ *
+ * Zero-copy export of completed buffers with vmsplice(2) and splice(2).
+ *
+ * An exporter owns a pipe. Submitting a buffer maps its pages into the
+ * pipe with vmsplice(2), without copying them, then splices them from
+ * the pipe to the destination file descriptor. Submissions return once
+ * the pipe is empty again, so the pipe no longer references the buffer.
+ *
+ * Whether the destination still references the pages afterwards
+ * depends on its type. Files and pipes copy the data when it is spliced
+ * in, but stream sockets transmit from the pages themselves, and keep
+ * them until the peer acknowledges or consumes the data. Each submitted
+ * byte has a position in the stream of exported bytes, and
+ * rseq_splice_export_released() returns the position below which the
+ * kernel has released every page: a buffer may only be overwritten or
+ * freed once its end position is released. For stream sockets, it is
+ * derived from the SIOCOUTQ ioctl(2), so the exporter must be the only
+ * writer of the socket.
+ *
+ * Destinations which do not support splice(2), such as files opened
+ * with O_APPEND, are written with write(2) instead, and their
+ * submissions are released immediately.
+ */
+
+#ifndef RSEQ_SPLICE_EXPORT_H
+#define RSEQ_SPLICE_EXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rseq_splice_export;
+
+/*
+ * Create an exporter to @fd, with a pipe of at least @pipe_size bytes,
+ * or of the default size if 0. Larger pipes take fewer system calls per
+ * buffer. Returns NULL and sets errno on error.
+ */
+struct rseq_splice_export *rseq_splice_export_create(int fd, size_t pipe_size);
+
+/*
+ * Free the exporter and its pipe. @fd is not closed.
+ */
+void rseq_splice_export_destroy(struct rseq_splice_export *exp);
+
+/*
+ * Export the @len bytes at @buf, and store the position following them
+ * into @end if not NULL. Concurrent submissions are serialized. Returns
+ * 0 on success, -1 with errno set on error, in which case part of the
+ * buffer may have been exported.
+ */
+int rseq_splice_export_submit(struct rseq_splice_export *exp,
+		const void *buf, size_t len, uint64_t *end);
+
+/*
+ * Position below which the kernel has released the pages of every
+ * submitted buffer.
+ */
+uint64_t rseq_splice_export_released(struct rseq_splice_export *exp);
+
+/* Number of bytes written with write(2) instead of being spliced. */
+uint64_t rseq_splice_export_nr_copied(struct rseq_splice_export *exp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_SPLICE_EXPORT_H */
@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * syscall-prof.h
+ *
+ * System call latency profiler, interposed with LD_PRELOAD.
+ *
+ * librseq-syscall-prof.so wraps read(2), write(2), recvmsg(2),
+ * sendmsg(2), epoll_wait(2) and futex(2) calls made through syscall(2),
+ * and records the latency of each call into a per-CPU log-linear
+ * histogram with a single rseq_addv(), so recording never writes cache
+ * lines shared with other CPUs. Calls made internally by the C library
+ * are not interposed.
+ *
+ * Histograms have 8 buckets per power of two of nanoseconds, for a
+ * relative error below 12.5%. Threads are registered with rseq on their
+ * first interposed call. When registration fails, for instance because
+ * rseq is unavailable, calls are recorded with an atomic increment on
+ * the histogram of the current CPU instead.
+ *
+ * If the RSEQ_SYSCALL_PROF_OUTPUT environment variable is set, the
+ * histograms are written to the file it names, or to the standard error
+ * for "-", when the process exits. Programs aware of the profiler can
+ * also dump or export the histograms on demand with the functions
+ * below, resolved with dlsym(3) when the profiler may not be loaded.
+ */
+
+#ifndef RSEQ_SYSCALL_PROF_H
+#define RSEQ_SYSCALL_PROF_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum rseq_syscall_prof_call {
+	RSEQ_SYSCALL_PROF_READ,
+	RSEQ_SYSCALL_PROF_WRITE,
+	RSEQ_SYSCALL_PROF_RECVMSG,
+	RSEQ_SYSCALL_PROF_SENDMSG,
+	RSEQ_SYSCALL_PROF_EPOLL_WAIT,
+	RSEQ_SYSCALL_PROF_FUTEX,
+	RSEQ_SYSCALL_PROF_NR_CALLS,
+};
+
+/* Buckets of a histogram, the last one also counting longer calls. */
+#define RSEQ_SYSCALL_PROF_NR_BUCKETS	320
+
+/* Name of @call, e.g. "epoll_wait". */
+const char *rseq_syscall_prof_call_name(enum rseq_syscall_prof_call call);
+
+/* Lowest latency counted by @bucket, in nanoseconds. */
+uint64_t rseq_syscall_prof_bucket_floor(unsigned int bucket);
+
+/*
+ * Sum the histograms of all CPUs into @buckets, indexed by call and
+ * bucket.
+ */
+void rseq_syscall_prof_snapshot(
+		uint64_t buckets[RSEQ_SYSCALL_PROF_NR_CALLS][RSEQ_SYSCALL_PROF_NR_BUCKETS]);
+
+/*
+ * Write the count and percentiles of each call, followed by its
+ * non-empty buckets, to @fd. Returns 0 on success, -1 with errno set
+ * on error.
+ */
+int rseq_syscall_prof_dump(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_SYSCALL_PROF_H */
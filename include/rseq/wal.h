@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: LGPL-2.1-only OR MIT */
+/*
+ * wal.h
+ *
+ * Write-ahead log with per-CPU staging buffers and group commit.
+ *
+ * Appending a record copies it into the staging buffer of the current
+ * CPU with a restartable sequence, which also assigns the record a log
+ * sequence number (LSN) from a range leased by the CPU. Only refilling
+ * a lease touches state shared by all CPUs, once per @lease_size
+ * records of a CPU.
+ *
+ * rseq_wal_sync() writes every record appended before it was called to
+ * the log file, in LSN order, followed by a single fdatasync(2). Threads
+ * syncing concurrently share the same write and fdatasync: one of them
+ * flushes the records of all CPUs while the others wait for it.
+ *
+ * Each CPU has two staging buffers. A flush switches the CPUs to their
+ * other buffer by replacing the state word of each CPU, then issues
+ * MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ to abort appends which loaded
+ * the state before, so the previous buffers are stable while they are
+ * written. The log therefore requires rseq membarrier support from the
+ * kernel.
+ *
+ * LSNs are unique, but a thread migrating between CPUs may obtain a
+ * lower LSN for a later record when the lease of the new CPU is older.
+ * Records synced by a thread are written before records it appends
+ * after the sync.
+ *
+ * Threads appending records must be registered with
+ * rseq_register_current_thread().
+ */
+
+#ifndef RSEQ_WAL_H
+#define RSEQ_WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum size of a record, header and padding included. */
+#define RSEQ_WAL_MAX_RECORD	4096
+/* Maximum size of a per-CPU staging buffer. */
+#define RSEQ_WAL_MAX_BUFFER	(1U << 20)
+/* Maximum number of LSNs leased by a CPU at once. */
+#define RSEQ_WAL_MAX_LEASE	511
+
+/*
+ * Header of each record in the log file, followed by @len bytes of
+ * payload, padded to a multiple of 8 bytes.
+ */
+struct rseq_wal_record {
+	uint64_t lsn;
+	uint32_t len;
+	uint32_t reserved;
+};
+
+struct rseq_wal;
+
+/*
+ * Create a log appending to @fd, with two staging buffers of @buf_size
+ * bytes per possible CPU, each CPU leasing @lease_size LSNs at once.
+ * @buf_size must be between RSEQ_WAL_MAX_RECORD and RSEQ_WAL_MAX_BUFFER,
+ * and @lease_size between 1 and RSEQ_WAL_MAX_LEASE. Returns NULL and
+ * sets errno on error (ENOSYS if rseq membarrier is not supported by
+ * the kernel).
+ */
+struct rseq_wal *rseq_wal_create(int fd, size_t buf_size,
+		unsigned int lease_size);
+
+/*
+ * Free the log. Records appended since the last rseq_wal_sync() are
+ * discarded. @fd is not closed.
+ */
+void rseq_wal_destroy(struct rseq_wal *wal);
+
+/*
+ * Append the record of @len bytes at @data, and store its LSN into @lsn
+ * if not NULL. The record is durable once a subsequent rseq_wal_sync()
+ * returns. If the staging buffer of the current CPU is full, the log is
+ * synced first. Returns 0 on success, -1 with errno set on error
+ * (EINVAL if the record does not fit in RSEQ_WAL_MAX_RECORD).
+ */
+int rseq_wal_append(struct rseq_wal *wal, const void *data, size_t len,
+		uint64_t *lsn);
+
+/*
+ * Write and fdatasync(2) all records appended before this call.
+ * Returns 0 on success, -1 with errno set on error. Once a write or
+ * fdatasync fails, records may have been lost, and all later syncs
+ * fail with the same error.
+ */
+int rseq_wal_sync(struct rseq_wal *wal);
+
+/* Number of fdatasync(2) issued on the log file. */
+uint64_t rseq_wal_nr_syncs(struct rseq_wal *wal);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RSEQ_WAL_H */
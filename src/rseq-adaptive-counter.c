@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-adaptive-counter.c
+ *
+ * Counters which promote themselves from shared to per-CPU mode under
+ * contention.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rseq/adaptive-counter.h>
+
+#include "rseq-membarrier.h"
+
+int rseq_adaptive_counter_init(struct rseq_adaptive_counter *counter)
+{
+	int ret;
+
+	memset(counter, 0, sizeof(*counter));
+	counter->promote_threshold = RSEQ_ADAPTIVE_COUNTER_PROMOTE_THRESHOLD;
+	counter->idle_threshold = RSEQ_ADAPTIVE_COUNTER_IDLE_THRESHOLD;
+	counter->idle_polls = RSEQ_ADAPTIVE_COUNTER_IDLE_POLLS;
+	ret = pthread_mutex_init(&counter->lock, NULL);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+void rseq_adaptive_counter_destroy(struct rseq_adaptive_counter *counter)
+{
+	free(counter->percpu);
+	counter->percpu = NULL;
+	(void) pthread_mutex_destroy(&counter->lock);
+}
+
+void rseq_adaptive_counter_set_thresholds(struct rseq_adaptive_counter *counter,
+		unsigned int promote_threshold, unsigned int idle_threshold,
+		unsigned int idle_polls)
+{
+	if (pthread_mutex_lock(&counter->lock))
+		abort();
+	counter->promote_threshold = promote_threshold;
+	counter->idle_threshold = idle_threshold;
+	counter->idle_polls = idle_polls;
+	if (pthread_mutex_unlock(&counter->lock))
+		abort();
+}
+
+/* Called with counter lock held. */
+static int adaptive_counter_promote_locked(struct rseq_adaptive_counter *counter)
+{
+	struct rseq_adaptive_counter_percpu *percpu;
+	int ret;
+
+	if (counter->percpu)
+		return 0;
+	ret = posix_memalign((void **) &percpu, __alignof__(*percpu),
+			     sizeof(*percpu));
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	memset(percpu, 0, sizeof(*percpu));
+	counter->nr_idle_polls = 0;
+	/* Publish zeroed slots. */
+	rseq_smp_store_release(&counter->percpu, percpu);
+	return 0;
+}
+
+int rseq_adaptive_counter_promote(struct rseq_adaptive_counter *counter)
+{
+	int ret;
+
+	if (pthread_mutex_lock(&counter->lock))
+		abort();
+	ret = adaptive_counter_promote_locked(counter);
+	if (pthread_mutex_unlock(&counter->lock))
+		abort();
+	return ret;
+}
+
+void rseq_adaptive_counter_add_shared(struct rseq_adaptive_counter *counter,
+		intptr_t v)
+{
+	intptr_t old;
+
+	old = __atomic_load_n(&counter->shared, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&counter->shared, &old, old + v,
+			false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		if ((uintptr_t) __atomic_add_fetch(&counter->nr_contended, 1,
+				__ATOMIC_RELAXED) < RSEQ_READ_ONCE(counter->promote_threshold))
+			continue;
+		/*
+		 * Promotion is best-effort: skip it if another thread is
+		 * changing the mode, and keep updating the shared value
+		 * on allocation failure. Updates of the shared value
+		 * remain valid after promotion.
+		 */
+		if (pthread_mutex_trylock(&counter->lock))
+			continue;
+		(void) adaptive_counter_promote_locked(counter);
+		__atomic_store_n(&counter->nr_contended, 0, __ATOMIC_RELAXED);
+		if (pthread_mutex_unlock(&counter->lock))
+			abort();
+	}
+}
+
+intptr_t rseq_adaptive_counter_read(struct rseq_adaptive_counter *counter)
+{
+	intptr_t sum;
+	int i;
+
+	if (pthread_mutex_lock(&counter->lock))
+		abort();
+	sum = __atomic_load_n(&counter->shared, __ATOMIC_RELAXED);
+	if (counter->percpu) {
+		for (i = 0; i < CPU_SETSIZE; i++)
+			sum += RSEQ_READ_ONCE(counter->percpu->c[i].count);
+	}
+	if (pthread_mutex_unlock(&counter->lock))
+		abort();
+	return sum;
+}
+
+/*
+ * Called with counter lock held. Unpublish the per-CPU slots, wait for
+ * critical sections which may still update them, and fold them into the
+ * shared value.
+ */
+static void adaptive_counter_demote_locked(struct rseq_adaptive_counter *counter)
+{
+	struct rseq_adaptive_counter_percpu *percpu = counter->percpu;
+	intptr_t sum = 0;
+	int i;
+
+	RSEQ_WRITE_ONCE(counter->percpu, NULL);
+	/*
+	 * Abort all critical sections in progress: they reload the slots
+	 * pointer when restarted. Critical sections which have committed
+	 * are visible once membarrier returns.
+	 */
+	if (rseq_sys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0))
+		abort();
+	for (i = 0; i < CPU_SETSIZE; i++)
+		sum += percpu->c[i].count;
+	__atomic_add_fetch(&counter->shared, sum, __ATOMIC_RELAXED);
+	free(percpu);
+}
+
+bool rseq_adaptive_counter_poll(struct rseq_adaptive_counter *counter)
+{
+	struct rseq_adaptive_counter_percpu *percpu;
+	uintptr_t change = 0;
+	bool is_percpu;
+	int i;
+
+	if (pthread_mutex_lock(&counter->lock))
+		abort();
+	__atomic_store_n(&counter->nr_contended, 0, __ATOMIC_RELAXED);
+	percpu = counter->percpu;
+	if (!percpu || !rseq_membarrier_rseq_available())
+		goto end;
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		struct rseq_adaptive_counter_entry *entry = &percpu->c[i];
+		intptr_t count = RSEQ_READ_ONCE(entry->count);
+
+		change += count > entry->poll_count ?
+			(uintptr_t) count - (uintptr_t) entry->poll_count :
+			(uintptr_t) entry->poll_count - (uintptr_t) count;
+		entry->poll_count = count;
+	}
+	if (change >= counter->idle_threshold) {
+		counter->nr_idle_polls = 0;
+		goto end;
+	}
+	if (++counter->nr_idle_polls >= counter->idle_polls)
+		adaptive_counter_demote_locked(counter);
+end:
+	is_percpu = counter->percpu != NULL;
+	if (pthread_mutex_unlock(&counter->lock))
+		abort();
+	return is_percpu;
+}
@@ -0,0 +1,417 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-aggregate.c
+ *
+ * Per-CPU partial aggregation by key.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <rseq/rseq.h>
+#include <rseq/aggregate.h>
+
+#include "rseq-cpu.h"
+
+#define AGGREGATE_MIN_SLOTS	64
+
+/* Columns of a per-CPU row. */
+enum aggregate_column {
+	AGGREGATE_SUM,
+	AGGREGATE_COUNT,
+	AGGREGATE_MIN,
+	AGGREGATE_MAX,
+	AGGREGATE_NR_COLUMNS,
+};
+
+/* Directory slot states. */
+enum aggregate_slot_state {
+	AGGREGATE_SLOT_EMPTY,
+	AGGREGATE_SLOT_BUSY,	/* Claimed, key not published yet. */
+	AGGREGATE_SLOT_USED,
+};
+
+#define AGGREGATE_SIGN	((uintptr_t) 1 << (sizeof(uintptr_t) * 8 - 1))
+
+struct rseq_aggregate {
+	pthread_mutex_t lock;	/* Serializes merges. */
+	int nr_cpus;
+	size_t max_keys;
+	size_t nr_keys;		/* Keys published or being inserted. */
+	/* Directory, at most half full. */
+	size_t nr_slots;
+	int *state;
+	uint64_t *keys;
+	/* AGGREGATE_NR_COLUMNS columns of nr_slots per possible CPU. */
+	intptr_t *rows;
+	size_t rows_len;
+
+	struct rseq_mempressure *monitor;
+	void (*cb)(void *priv, const struct rseq_aggregate_snapshot *snapshot);
+	void *priv;
+	struct rseq_aggregate_snapshot periodic;
+};
+
+/*
+ * Order-preserving encodings of maximums and order-reversing encodings
+ * of minimums, both mapping the neutral value to 0, so both are
+ * combined by unsigned maximum.
+ */
+static inline uintptr_t aggregate_encode_max(intptr_t v)
+{
+	return (uintptr_t) v ^ AGGREGATE_SIGN;
+}
+
+static inline intptr_t aggregate_decode_max(uintptr_t v)
+{
+	return (intptr_t) (v ^ AGGREGATE_SIGN);
+}
+
+static inline uintptr_t aggregate_encode_min(intptr_t v)
+{
+	return ~((uintptr_t) v ^ AGGREGATE_SIGN);
+}
+
+static inline intptr_t aggregate_decode_min(uintptr_t v)
+{
+	return (intptr_t) (~v ^ AGGREGATE_SIGN);
+}
+
+/* Finalizer of splitmix64. */
+static inline uint64_t aggregate_hash(uint64_t key)
+{
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebULL;
+	key ^= key >> 31;
+	return key;
+}
+
+static inline intptr_t *aggregate_column(struct rseq_aggregate *aggr, int cpu,
+		enum aggregate_column column)
+{
+	return aggr->rows + ((size_t) cpu * AGGREGATE_NR_COLUMNS + column) *
+		aggr->nr_slots;
+}
+
+struct rseq_aggregate *rseq_aggregate_create(size_t max_keys)
+{
+	struct rseq_aggregate *aggr;
+	size_t nr_slots = AGGREGATE_MIN_SLOTS;
+	int ret;
+
+	if (!max_keys || max_keys > SIZE_MAX / 4) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (nr_slots < 2 * max_keys)
+		nr_slots <<= 1;
+	aggr = calloc(1, sizeof(*aggr));
+	if (!aggr)
+		return NULL;
+	aggr->nr_cpus = rseq_nr_possible_cpus();
+	aggr->max_keys = max_keys;
+	aggr->nr_slots = nr_slots;
+	aggr->state = calloc(nr_slots, sizeof(*aggr->state));
+	aggr->keys = calloc(nr_slots, sizeof(*aggr->keys));
+	if (!aggr->state || !aggr->keys)
+		goto error;
+	/* Rows are only backed by memory once a CPU touches them. */
+	aggr->rows_len = (size_t) aggr->nr_cpus * AGGREGATE_NR_COLUMNS *
+		nr_slots * sizeof(intptr_t);
+	aggr->rows = mmap(NULL, aggr->rows_len, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (aggr->rows == MAP_FAILED)
+		goto error;
+	ret = pthread_mutex_init(&aggr->lock, NULL);
+	if (ret) {
+		munmap(aggr->rows, aggr->rows_len);
+		errno = ret;
+		goto error;
+	}
+	return aggr;
+
+error:
+	ret = errno;
+	free(aggr->keys);
+	free(aggr->state);
+	free(aggr);
+	errno = ret;
+	return NULL;
+}
+
+void rseq_aggregate_destroy(struct rseq_aggregate *aggr)
+{
+	if (!aggr)
+		return;
+	(void) rseq_aggregate_set_periodic(aggr, NULL, NULL, NULL);
+	(void) pthread_mutex_destroy(&aggr->lock);
+	munmap(aggr->rows, aggr->rows_len);
+	free(aggr->keys);
+	free(aggr->state);
+	free(aggr);
+}
+
+size_t rseq_aggregate_nr_keys(struct rseq_aggregate *aggr)
+{
+	return __atomic_load_n(&aggr->nr_keys, __ATOMIC_RELAXED);
+}
+
+/*
+ * Find the directory slot of @key, inserting it if needed. Returns -1
+ * if the directory holds max_keys keys already.
+ */
+static ssize_t aggregate_slot(struct rseq_aggregate *aggr, uint64_t key)
+{
+	size_t mask = aggr->nr_slots - 1, i, n;
+	bool reserved = false;
+
+	i = aggregate_hash(key) & mask;
+	for (n = 0; n < aggr->nr_slots; n++, i = (i + 1) & mask) {
+		int state = __atomic_load_n(&aggr->state[i], __ATOMIC_ACQUIRE);
+
+		if (state == AGGREGATE_SLOT_EMPTY) {
+			int expected = AGGREGATE_SLOT_EMPTY;
+
+			if (!reserved) {
+				reserved = true;
+				if (__atomic_add_fetch(&aggr->nr_keys, 1,
+						__ATOMIC_RELAXED) > aggr->max_keys)
+					break;
+			}
+			if (__atomic_compare_exchange_n(&aggr->state[i], &expected,
+					AGGREGATE_SLOT_BUSY, false,
+					__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+				aggr->keys[i] = key;
+				__atomic_store_n(&aggr->state[i], AGGREGATE_SLOT_USED,
+						 __ATOMIC_RELEASE);
+				return i;
+			}
+			state = expected;
+		}
+		/* Wait for a concurrent insertion to publish its key. */
+		while (state == AGGREGATE_SLOT_BUSY)
+			state = __atomic_load_n(&aggr->state[i], __ATOMIC_ACQUIRE);
+		if (aggr->keys[i] == key) {
+			if (reserved)
+				__atomic_sub_fetch(&aggr->nr_keys, 1, __ATOMIC_RELAXED);
+			return i;
+		}
+	}
+	if (reserved)
+		__atomic_sub_fetch(&aggr->nr_keys, 1, __ATOMIC_RELAXED);
+	errno = ENOSPC;
+	return -1;
+}
+
+static void aggregate_addv(struct rseq_aggregate *aggr,
+		enum aggregate_column column, size_t slot, intptr_t v)
+{
+	int cpu;
+
+	do {
+		cpu = rseq_cpu_start();
+	} while (rseq_unlikely(rseq_addv(aggregate_column(aggr, cpu, column) + slot,
+			v, cpu)));
+}
+
+/* Raise the encoded value of @slot in @column of the current CPU to @v. */
+static void aggregate_maxv(struct rseq_aggregate *aggr,
+		enum aggregate_column column, size_t slot, uintptr_t v)
+{
+	for (;;) {
+		int cpu = rseq_cpu_start();
+		intptr_t *p = aggregate_column(aggr, cpu, column) + slot;
+		uintptr_t cur = (uintptr_t) RSEQ_READ_ONCE(*p);
+
+		if (v <= cur)
+			break;
+		if (rseq_likely(!rseq_cmpeqv_storev(p, (intptr_t) cur,
+				(intptr_t) v, cpu)))
+			break;
+		/* Retry if comparison fails or rseq aborts. */
+	}
+}
+
+int rseq_aggregate_add(struct rseq_aggregate *aggr, uint64_t key, intptr_t v)
+{
+	ssize_t slot;
+
+	slot = aggregate_slot(aggr, key);
+	if (slot < 0)
+		return -1;
+	aggregate_addv(aggr, AGGREGATE_SUM, slot, v);
+	aggregate_addv(aggr, AGGREGATE_COUNT, slot, 1);
+	aggregate_maxv(aggr, AGGREGATE_MIN, slot, aggregate_encode_min(v));
+	aggregate_maxv(aggr, AGGREGATE_MAX, slot, aggregate_encode_max(v));
+	return 0;
+}
+
+static int aggregate_snapshot_reserve(struct rseq_aggregate_snapshot *snapshot,
+		size_t nr_keys)
+{
+	struct rseq_aggregate_snapshot s;
+
+	if (nr_keys <= snapshot->alloc_keys)
+		return 0;
+	memset(&s, 0, sizeof(s));
+	s.keys = malloc(nr_keys * sizeof(*s.keys));
+	s.sum = malloc(nr_keys * sizeof(*s.sum));
+	s.count = malloc(nr_keys * sizeof(*s.count));
+	s.min = malloc(nr_keys * sizeof(*s.min));
+	s.max = malloc(nr_keys * sizeof(*s.max));
+	if (!s.keys || !s.sum || !s.count || !s.min || !s.max) {
+		rseq_aggregate_snapshot_fini(&s);
+		return -1;
+	}
+	s.alloc_keys = nr_keys;
+	rseq_aggregate_snapshot_fini(snapshot);
+	*snapshot = s;
+	return 0;
+}
+
+/*
+ * Column combines are plain loops over contiguous columns, in blocks of
+ * AGGREGATE_COMBINE_BLOCK slots, which the compiler vectorizes without
+ * remainder loop since the number of slots is a multiple of the block
+ * size. Sums wrap around like the per-CPU counters.
+ */
+#define AGGREGATE_COMBINE_BLOCK	8
+
+static void aggregate_combine_add(uintptr_t *restrict acc,
+		const uintptr_t *restrict col, size_t n)
+{
+	size_t i, j;
+
+	for (i = 0; i < n; i += AGGREGATE_COMBINE_BLOCK) {
+		for (j = 0; j < AGGREGATE_COMBINE_BLOCK; j++)
+			acc[i + j] += col[i + j];
+	}
+}
+
+static void aggregate_combine_max(uintptr_t *restrict acc,
+		const uintptr_t *restrict col, size_t n)
+{
+	size_t i, j;
+
+	for (i = 0; i < n; i += AGGREGATE_COMBINE_BLOCK) {
+		for (j = 0; j < AGGREGATE_COMBINE_BLOCK; j++)
+			acc[i + j] = col[i + j] > acc[i + j] ?
+				col[i + j] : acc[i + j];
+	}
+}
+
+int rseq_aggregate_merge(struct rseq_aggregate *aggr,
+		struct rseq_aggregate_snapshot *snapshot)
+{
+	size_t n = aggr->nr_slots, i, nr_keys = 0;
+	uintptr_t *sum, *count, *min, *max;
+	int cpu, ret = -1;
+
+	if (pthread_mutex_lock(&aggr->lock))
+		abort();
+	if (aggregate_snapshot_reserve(snapshot, n))
+		goto unlock;
+	sum = (uintptr_t *) snapshot->sum;
+	count = (uintptr_t *) snapshot->count;
+	min = (uintptr_t *) snapshot->min;
+	max = (uintptr_t *) snapshot->max;
+	memset(sum, 0, n * sizeof(*sum));
+	memset(count, 0, n * sizeof(*count));
+	memset(min, 0, n * sizeof(*min));
+	memset(max, 0, n * sizeof(*max));
+	for (cpu = 0; cpu < aggr->nr_cpus; cpu++) {
+		aggregate_combine_add(sum,
+			(uintptr_t *) aggregate_column(aggr, cpu, AGGREGATE_SUM), n);
+		aggregate_combine_add(count,
+			(uintptr_t *) aggregate_column(aggr, cpu, AGGREGATE_COUNT), n);
+		aggregate_combine_max(min,
+			(uintptr_t *) aggregate_column(aggr, cpu, AGGREGATE_MIN), n);
+		aggregate_combine_max(max,
+			(uintptr_t *) aggregate_column(aggr, cpu, AGGREGATE_MAX), n);
+	}
+	/*
+	 * Compact the slots holding a key in place. Slots without a
+	 * published key have never been updated.
+	 */
+	for (i = 0; i < n; i++) {
+		if (__atomic_load_n(&aggr->state[i], __ATOMIC_ACQUIRE) !=
+				AGGREGATE_SLOT_USED)
+			continue;
+		snapshot->keys[nr_keys] = aggr->keys[i];
+		snapshot->sum[nr_keys] = (intptr_t) sum[i];
+		snapshot->count[nr_keys] = (intptr_t) count[i];
+		snapshot->min[nr_keys] = aggregate_decode_min(min[i]);
+		snapshot->max[nr_keys] = aggregate_decode_max(max[i]);
+		nr_keys++;
+	}
+	snapshot->nr_keys = nr_keys;
+	ret = 0;
+unlock:
+	if (pthread_mutex_unlock(&aggr->lock))
+		abort();
+	return ret;
+}
+
+void rseq_aggregate_snapshot_fini(struct rseq_aggregate_snapshot *snapshot)
+{
+	free(snapshot->keys);
+	free(snapshot->sum);
+	free(snapshot->count);
+	free(snapshot->min);
+	free(snapshot->max);
+	memset(snapshot, 0, sizeof(*snapshot));
+}
+
+static void aggregate_mempressure_cb(void *priv, enum rseq_mempressure_event event)
+{
+	struct rseq_aggregate *aggr = priv;
+
+	if (event != RSEQ_MEMPRESSURE_TICK)
+		return;
+	if (rseq_aggregate_merge(aggr, &aggr->periodic))
+		return;
+	aggr->cb(aggr->priv, &aggr->periodic);
+}
+
+int rseq_aggregate_set_periodic(struct rseq_aggregate *aggr,
+		struct rseq_mempressure *monitor,
+		void (*cb)(void *priv, const struct rseq_aggregate_snapshot *snapshot),
+		void *priv)
+{
+	if (aggr->monitor) {
+		rseq_mempressure_unregister(aggr->monitor, aggregate_mempressure_cb, aggr);
+		aggr->monitor = NULL;
+		rseq_aggregate_snapshot_fini(&aggr->periodic);
+	}
+	if (!monitor)
+		return 0;
+	if (!cb) {
+		errno = EINVAL;
+		return -1;
+	}
+	aggr->cb = cb;
+	aggr->priv = priv;
+	if (rseq_mempressure_register(monitor, aggregate_mempressure_cb, aggr))
+		return -1;
+	aggr->monitor = monitor;
+	return 0;
+}
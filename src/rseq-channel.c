@@ -0,0 +1,445 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-channel.c
+ *
+ * Bounded blocking multi-producer multi-consumer channel with per-CPU
+ * lanes.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include <rseq/rseq.h>
+#include <rseq/channel.h>
+
+#include "rseq-cpu.h"
+#include "rseq-membarrier.h"
+
+/* Largest number of credits moved between a CPU and the pool at once. */
+#define CHANNEL_MAX_BATCH	64
+
+struct channel_lane {
+	/* Written by senders on the owner CPU. */
+	uintptr_t tail;
+	/* Send credits cached by the CPU, or RSEQ_CHANNEL_LOCKED. */
+	intptr_t credits;
+	/* Advanced by receivers of any CPU. */
+	uintptr_t head __attribute__((aligned(128)));
+} __attribute__((aligned(128)));
+
+struct rseq_channel {
+	int nr_cpus;
+	uintptr_t lane_mask;
+	intptr_t batch;
+	struct channel_lane *lanes;
+	/* Ring of lane_mask + 1 items per possible CPU. */
+	intptr_t *slots;
+	size_t slots_len;
+	/* Serializes reclaims of the credits cached by CPUs. */
+	pthread_mutex_t reclaim_lock;
+	intptr_t *reclaimed;
+
+	intptr_t credits __attribute__((aligned(128)));
+	int closed;
+
+	/* Futex words, and the number of threads waiting on them. */
+	int32_t recv_seq __attribute__((aligned(128)));
+	int nr_recv_waiters;
+	int32_t send_seq __attribute__((aligned(128)));
+	int nr_send_waiters;
+};
+
+static int futex_wait(int32_t *uaddr, int32_t val)
+{
+	return syscall(__NR_futex, uaddr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static int futex_wake(int32_t *uaddr, int nr_wake)
+{
+	return syscall(__NR_futex, uaddr, FUTEX_WAKE_PRIVATE, nr_wake, NULL, NULL, 0);
+}
+
+struct rseq_channel *rseq_channel_create(size_t capacity)
+{
+	struct rseq_channel *chan;
+	size_t lane_size = 1;
+	int cpu, ret;
+
+	if (!capacity || capacity > RSEQ_CHANNEL_MAX_CAPACITY) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!rseq_membarrier_rseq_available()) {
+		errno = ENOSYS;
+		return NULL;
+	}
+	ret = posix_memalign((void **) &chan, __alignof__(*chan), sizeof(*chan));
+	if (ret) {
+		errno = ret;
+		return NULL;
+	}
+	memset(chan, 0, sizeof(*chan));
+	chan->nr_cpus = rseq_nr_possible_cpus();
+	while (lane_size < capacity)
+		lane_size <<= 1;
+	chan->lane_mask = lane_size - 1;
+	chan->batch = capacity / (2 * chan->nr_cpus);
+	if (chan->batch < 1)
+		chan->batch = 1;
+	if (chan->batch > CHANNEL_MAX_BATCH)
+		chan->batch = CHANNEL_MAX_BATCH;
+	chan->credits = capacity;
+	ret = posix_memalign((void **) &chan->lanes, __alignof__(*chan->lanes),
+			     chan->nr_cpus * sizeof(*chan->lanes));
+	if (ret) {
+		errno = ret;
+		goto error;
+	}
+	for (cpu = 0; cpu < chan->nr_cpus; cpu++)
+		memset(&chan->lanes[cpu], 0, sizeof(chan->lanes[cpu]));
+	chan->reclaimed = calloc(chan->nr_cpus, sizeof(*chan->reclaimed));
+	if (!chan->reclaimed)
+		goto error_lanes;
+	/* Lanes are only backed by memory once a CPU sends. */
+	chan->slots_len = (size_t) chan->nr_cpus * lane_size * sizeof(*chan->slots);
+	chan->slots = mmap(NULL, chan->slots_len, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (chan->slots == MAP_FAILED)
+		goto error_lanes;
+	ret = pthread_mutex_init(&chan->reclaim_lock, NULL);
+	if (ret) {
+		munmap(chan->slots, chan->slots_len);
+		errno = ret;
+		goto error_lanes;
+	}
+	return chan;
+
+error_lanes:
+	free(chan->reclaimed);
+	free(chan->lanes);
+error:
+	free(chan);
+	return NULL;
+}
+
+void rseq_channel_destroy(struct rseq_channel *chan)
+{
+	if (!chan)
+		return;
+	(void) pthread_mutex_destroy(&chan->reclaim_lock);
+	munmap(chan->slots, chan->slots_len);
+	free(chan->reclaimed);
+	free(chan->lanes);
+	free(chan);
+}
+
+/*
+ * Add @nr credits to the cache of the current CPU. Beyond two batches,
+ * a batch goes back to the pool, so credits returned by receivers are
+ * available to senders of other CPUs.
+ */
+static void channel_credits_put(struct rseq_channel *chan, intptr_t nr)
+{
+	for (;;) {
+		struct channel_lane *lane;
+		intptr_t credits;
+		int cpu;
+
+		cpu = rseq_cpu_start();
+		lane = &chan->lanes[cpu];
+		credits = RSEQ_READ_ONCE(lane->credits);
+		if (rseq_unlikely(credits == RSEQ_CHANNEL_LOCKED)) {
+			__atomic_add_fetch(&chan->credits, nr, __ATOMIC_RELAXED);
+			return;
+		}
+		if (rseq_unlikely(credits + nr > 2 * chan->batch)) {
+			if (rseq_likely(!rseq_cmpeqv_storev(&lane->credits, credits,
+					credits + nr - chan->batch, cpu))) {
+				__atomic_add_fetch(&chan->credits, chan->batch,
+						   __ATOMIC_RELAXED);
+				return;
+			}
+		} else if (rseq_likely(!rseq_cmpeqv_storev(&lane->credits, credits,
+				credits + nr, cpu))) {
+			return;
+		}
+		/* Retry if comparison fails or rseq aborts. */
+	}
+}
+
+/* Take a credit from the current CPU, or a batch from the pool. */
+static int channel_credit_get(struct rseq_channel *chan)
+{
+	intptr_t pool;
+
+	for (;;) {
+		struct channel_lane *lane;
+		intptr_t credits;
+		int cpu;
+
+		cpu = rseq_cpu_start();
+		lane = &chan->lanes[cpu];
+		credits = RSEQ_READ_ONCE(lane->credits);
+		/* Also skips locked counts. */
+		if (credits <= 0)
+			break;
+		if (rseq_likely(!rseq_cmpeqv_storev(&lane->credits, credits,
+				credits - 1, cpu)))
+			return 0;
+		/* Retry if comparison fails or rseq aborts. */
+	}
+	pool = __atomic_load_n(&chan->credits, __ATOMIC_RELAXED);
+	while (pool > 0) {
+		intptr_t nr = pool < chan->batch ? pool : chan->batch;
+
+		if (__atomic_compare_exchange_n(&chan->credits, &pool, pool - nr,
+				false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			if (nr > 1)
+				channel_credits_put(chan, nr - 1);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Move the credits cached by every CPU back to the pool. */
+static void channel_credits_reclaim(struct rseq_channel *chan)
+{
+	intptr_t *locked = chan->reclaimed, total = 0;
+	bool retry;
+	int cpu;
+
+	if (pthread_mutex_lock(&chan->reclaim_lock))
+		abort();
+	do {
+		bool any = false;
+
+		for (cpu = 0; cpu < chan->nr_cpus; cpu++) {
+			struct channel_lane *lane = &chan->lanes[cpu];
+			intptr_t credits = RSEQ_READ_ONCE(lane->credits);
+
+			locked[cpu] = 0;
+			do {
+				if (credits <= 0)
+					break;
+			} while (!__atomic_compare_exchange_n(&lane->credits, &credits,
+					RSEQ_CHANNEL_LOCKED, false,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+			if (credits <= 0)
+				continue;
+			locked[cpu] = credits;
+			any = true;
+		}
+		if (!any)
+			break;
+		/*
+		 * Abort critical sections which loaded the count before it
+		 * was locked. A critical section which committed in the
+		 * meantime has overwritten the lock: retry for that CPU.
+		 */
+		if (rseq_sys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0))
+			abort();
+		retry = false;
+		for (cpu = 0; cpu < chan->nr_cpus; cpu++) {
+			struct channel_lane *lane = &chan->lanes[cpu];
+
+			if (!locked[cpu])
+				continue;
+			if (RSEQ_READ_ONCE(lane->credits) != RSEQ_CHANNEL_LOCKED) {
+				retry = true;
+				continue;
+			}
+			total += locked[cpu];
+			rseq_smp_store_release(&lane->credits, 0);
+		}
+	} while (retry);
+	if (total)
+		__atomic_add_fetch(&chan->credits, total, __ATOMIC_RELAXED);
+	if (pthread_mutex_unlock(&chan->reclaim_lock))
+		abort();
+}
+
+/* Enqueue @item into the lane of the current CPU. */
+static void channel_lane_push(struct rseq_channel *chan, void *item)
+{
+	for (;;) {
+		struct channel_lane *lane;
+		uintptr_t tail;
+		intptr_t *slot;
+		int cpu;
+
+		cpu = rseq_cpu_start();
+		lane = &chan->lanes[cpu];
+		tail = RSEQ_READ_ONCE(lane->tail);
+		/*
+		 * The credit held by the sender guarantees the slot is
+		 * free: a lane never holds more items than the capacity.
+		 */
+		slot = &chan->slots[(size_t) cpu * (chan->lane_mask + 1) +
+				    (tail & chan->lane_mask)];
+		if (rseq_likely(!rseq_cmpeqv_trystorev_storev_release(
+				(intptr_t *) &lane->tail, (intptr_t) tail,
+				slot, (intptr_t) item, (intptr_t) (tail + 1), cpu)))
+			return;
+		/* Retry if comparison fails or rseq aborts. */
+	}
+}
+
+/*
+ * Dequeue an item from the lane of the current CPU, then from the lanes
+ * of the other CPUs.
+ */
+static int channel_lane_pop(struct rseq_channel *chan, void **item)
+{
+	int start = rseq_current_cpu_raw(), i;
+
+	if (start < 0 || start >= chan->nr_cpus)
+		start = 0;
+	for (i = 0; i < chan->nr_cpus; i++) {
+		int cpu = start + i < chan->nr_cpus ? start + i : start + i - chan->nr_cpus;
+		struct channel_lane *lane = &chan->lanes[cpu];
+		intptr_t *slots = &chan->slots[(size_t) cpu * (chan->lane_mask + 1)];
+		uintptr_t head;
+
+		head = __atomic_load_n(&lane->head, __ATOMIC_RELAXED);
+		while (head != rseq_smp_load_acquire(&lane->tail)) {
+			intptr_t v = RSEQ_READ_ONCE(slots[head & chan->lane_mask]);
+
+			/*
+			 * The slot is only reused once its item is received,
+			 * which moves the head past it and fails this exchange.
+			 */
+			if (__atomic_compare_exchange_n(&lane->head, &head, head + 1,
+					false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+				*item = (void *) v;
+				return 0;
+			}
+		}
+	}
+	return -1;
+}
+
+static void channel_wake(int32_t *seq, int *nr_waiters)
+{
+	/* Order the update of the channel before the load of waiters. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(nr_waiters, __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+		futex_wake(seq, 1);
+	}
+}
+
+static int channel_send(struct rseq_channel *chan, void *item, bool wait)
+{
+	for (;;) {
+		int32_t seq;
+
+		if (__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE)) {
+			errno = EPIPE;
+			return -1;
+		}
+		if (rseq_likely(!channel_credit_get(chan)))
+			break;
+		if (wait)
+			__atomic_add_fetch(&chan->nr_send_waiters, 1, __ATOMIC_SEQ_CST);
+		seq = __atomic_load_n(&chan->send_seq, __ATOMIC_SEQ_CST);
+		channel_credits_reclaim(chan);
+		if (!channel_credit_get(chan)) {
+			if (wait)
+				__atomic_sub_fetch(&chan->nr_send_waiters, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		if (!wait) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (!__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE))
+			futex_wait(&chan->send_seq, seq);
+		__atomic_sub_fetch(&chan->nr_send_waiters, 1, __ATOMIC_RELAXED);
+	}
+	channel_lane_push(chan, item);
+	channel_wake(&chan->recv_seq, &chan->nr_recv_waiters);
+	return 0;
+}
+
+static int channel_recv(struct rseq_channel *chan, void **item, bool wait)
+{
+	for (;;) {
+		int closed;
+		int32_t seq;
+
+		/* Items sent before the close are visible once it is. */
+		closed = __atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE);
+		if (rseq_likely(!channel_lane_pop(chan, item)))
+			break;
+		if (closed) {
+			errno = EPIPE;
+			return -1;
+		}
+		if (!wait) {
+			errno = EAGAIN;
+			return -1;
+		}
+		__atomic_add_fetch(&chan->nr_recv_waiters, 1, __ATOMIC_SEQ_CST);
+		seq = __atomic_load_n(&chan->recv_seq, __ATOMIC_SEQ_CST);
+		if (!channel_lane_pop(chan, item)) {
+			__atomic_sub_fetch(&chan->nr_recv_waiters, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		if (!__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE))
+			futex_wait(&chan->recv_seq, seq);
+		__atomic_sub_fetch(&chan->nr_recv_waiters, 1, __ATOMIC_RELAXED);
+	}
+	channel_credits_put(chan, 1);
+	channel_wake(&chan->send_seq, &chan->nr_send_waiters);
+	return 0;
+}
+
+int rseq_channel_send(struct rseq_channel *chan, void *item)
+{
+	return channel_send(chan, item, true);
+}
+
+int rseq_channel_try_send(struct rseq_channel *chan, void *item)
+{
+	return channel_send(chan, item, false);
+}
+
+int rseq_channel_recv(struct rseq_channel *chan, void **item)
+{
+	return channel_recv(chan, item, true);
+}
+
+int rseq_channel_try_recv(struct rseq_channel *chan, void **item)
+{
+	return channel_recv(chan, item, false);
+}
+
+void rseq_channel_close(struct rseq_channel *chan)
+{
+	__atomic_store_n(&chan->closed, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&chan->recv_seq, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&chan->send_seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&chan->recv_seq, INT_MAX);
+	futex_wake(&chan->send_seq, INT_MAX);
+}
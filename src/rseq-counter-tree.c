@@ -0,0 +1,257 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-counter-tree.c
+ *
+ * Hierarchical per-CPU counters.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <rseq/counter-tree.h>
+
+#include "rseq-cpu.h"
+
+#define COUNTER_TREE_NONE	UINT32_MAX
+
+struct counter_tree_link {
+	uint32_t parent;
+	uint32_t first_child;
+	uint32_t next_sibling;
+};
+
+struct counter_tree_chunk {
+	/* One row of RSEQ_COUNTER_TREE_CHUNK_NODES slots per possible CPU. */
+	intptr_t *rows;
+	size_t rows_len;
+	struct counter_tree_link links[RSEQ_COUNTER_TREE_CHUNK_NODES];
+};
+
+struct rseq_counter_tree {
+	/* Serializes growth and reads of the links. */
+	pthread_mutex_t lock;
+	int nr_cpus;
+	/* Slot of the root for CPU 0, as chunks may be reallocated. */
+	intptr_t *root_slots;
+	struct counter_tree_chunk **chunks;
+	size_t nr_chunks;
+	size_t alloc_chunks;
+	size_t nr_nodes;
+};
+
+static struct counter_tree_link *counter_tree_link(struct rseq_counter_tree *tree,
+		uint32_t index)
+{
+	return &tree->chunks[index / RSEQ_COUNTER_TREE_CHUNK_NODES]->links[
+		index % RSEQ_COUNTER_TREE_CHUNK_NODES];
+}
+
+/* Append a node to @tree, and fill its handle. */
+static struct counter_tree_link *counter_tree_node_alloc(struct rseq_counter_tree *tree,
+		struct rseq_counter_tree_node *node)
+{
+	size_t index = tree->nr_nodes % RSEQ_COUNTER_TREE_CHUNK_NODES;
+	struct counter_tree_chunk *chunk;
+	struct counter_tree_link *link;
+
+	if (tree->nr_nodes == COUNTER_TREE_NONE) {
+		errno = ENOSPC;
+		return NULL;
+	}
+	if (!index) {
+		if (tree->nr_chunks == tree->alloc_chunks) {
+			size_t alloc = tree->alloc_chunks ? 2 * tree->alloc_chunks : 16;
+			struct counter_tree_chunk **chunks;
+
+			chunks = realloc(tree->chunks, alloc * sizeof(*chunks));
+			if (!chunks)
+				return NULL;
+			tree->chunks = chunks;
+			tree->alloc_chunks = alloc;
+		}
+		chunk = calloc(1, sizeof(*chunk));
+		if (!chunk)
+			return NULL;
+		/* Rows are only backed by memory once a CPU touches them. */
+		chunk->rows_len = (size_t) tree->nr_cpus *
+			RSEQ_COUNTER_TREE_CHUNK_NODES * sizeof(intptr_t);
+		chunk->rows = mmap(NULL, chunk->rows_len, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (chunk->rows == MAP_FAILED) {
+			free(chunk);
+			return NULL;
+		}
+		tree->chunks[tree->nr_chunks++] = chunk;
+	}
+	chunk = tree->chunks[tree->nr_chunks - 1];
+	link = &chunk->links[index];
+	link->first_child = COUNTER_TREE_NONE;
+	link->next_sibling = COUNTER_TREE_NONE;
+	node->slots = &chunk->rows[index];
+	node->index = (uint32_t) tree->nr_nodes++;
+	return link;
+}
+
+struct rseq_counter_tree *rseq_counter_tree_create(void)
+{
+	struct rseq_counter_tree_node root;
+	struct rseq_counter_tree *tree;
+	struct counter_tree_link *link;
+	int ret;
+
+	tree = calloc(1, sizeof(*tree));
+	if (!tree)
+		return NULL;
+	tree->nr_cpus = rseq_nr_possible_cpus();
+	link = counter_tree_node_alloc(tree, &root);
+	if (!link)
+		goto error;
+	link->parent = COUNTER_TREE_NONE;
+	tree->root_slots = root.slots;
+	ret = pthread_mutex_init(&tree->lock, NULL);
+	if (ret) {
+		errno = ret;
+		goto error;
+	}
+	return tree;
+
+error:
+	if (tree->nr_chunks) {
+		munmap(tree->chunks[0]->rows, tree->chunks[0]->rows_len);
+		free(tree->chunks[0]);
+	}
+	free(tree->chunks);
+	free(tree);
+	return NULL;
+}
+
+void rseq_counter_tree_destroy(struct rseq_counter_tree *tree)
+{
+	size_t i;
+
+	if (!tree)
+		return;
+	for (i = 0; i < tree->nr_chunks; i++) {
+		munmap(tree->chunks[i]->rows, tree->chunks[i]->rows_len);
+		free(tree->chunks[i]);
+	}
+	free(tree->chunks);
+	(void) pthread_mutex_destroy(&tree->lock);
+	free(tree);
+}
+
+void rseq_counter_tree_root(struct rseq_counter_tree *tree,
+		struct rseq_counter_tree_node *root)
+{
+	root->slots = tree->root_slots;
+	root->index = 0;
+}
+
+int rseq_counter_tree_add_child(struct rseq_counter_tree *tree,
+		const struct rseq_counter_tree_node *parent,
+		struct rseq_counter_tree_node *child)
+{
+	struct counter_tree_link *link, *parent_link;
+	int ret = -1;
+
+	if (pthread_mutex_lock(&tree->lock))
+		abort();
+	if (parent->index >= tree->nr_nodes) {
+		errno = EINVAL;
+		goto unlock;
+	}
+	link = counter_tree_node_alloc(tree, child);
+	if (!link)
+		goto unlock;
+	parent_link = counter_tree_link(tree, parent->index);
+	link->parent = parent->index;
+	link->next_sibling = parent_link->first_child;
+	parent_link->first_child = child->index;
+	ret = 0;
+unlock:
+	if (pthread_mutex_unlock(&tree->lock))
+		abort();
+	return ret;
+}
+
+size_t rseq_counter_tree_nr_nodes(struct rseq_counter_tree *tree)
+{
+	size_t nr_nodes;
+
+	if (pthread_mutex_lock(&tree->lock))
+		abort();
+	nr_nodes = tree->nr_nodes;
+	if (pthread_mutex_unlock(&tree->lock))
+		abort();
+	return nr_nodes;
+}
+
+/* Sum the slots of node @index across CPUs. */
+static intptr_t counter_tree_sum(struct rseq_counter_tree *tree, uint32_t index)
+{
+	const intptr_t *slot = tree->chunks[index / RSEQ_COUNTER_TREE_CHUNK_NODES]->rows +
+		index % RSEQ_COUNTER_TREE_CHUNK_NODES;
+	intptr_t sum = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < tree->nr_cpus; cpu++)
+		sum += RSEQ_READ_ONCE(slot[(size_t) cpu * RSEQ_COUNTER_TREE_CHUNK_NODES]);
+	return sum;
+}
+
+intptr_t rseq_counter_tree_read(struct rseq_counter_tree *tree,
+		const struct rseq_counter_tree_node *node)
+{
+	uint32_t index = node->index;
+	intptr_t sum = 0;
+
+	if (pthread_mutex_lock(&tree->lock))
+		abort();
+	/* Walk the subtree in depth-first order through the links. */
+	for (;;) {
+		struct counter_tree_link *link = counter_tree_link(tree, index);
+
+		sum += counter_tree_sum(tree, index);
+		if (link->first_child != COUNTER_TREE_NONE) {
+			index = link->first_child;
+			continue;
+		}
+		while (index != node->index && link->next_sibling == COUNTER_TREE_NONE) {
+			index = link->parent;
+			link = counter_tree_link(tree, index);
+		}
+		if (index == node->index)
+			break;
+		index = link->next_sibling;
+	}
+	if (pthread_mutex_unlock(&tree->lock))
+		abort();
+	return sum;
+}
+
+intptr_t rseq_counter_tree_read_self(struct rseq_counter_tree *tree,
+		const struct rseq_counter_tree_node *node)
+{
+	intptr_t sum;
+
+	if (pthread_mutex_lock(&tree->lock))
+		abort();
+	sum = counter_tree_sum(tree, node->index);
+	if (pthread_mutex_unlock(&tree->lock))
+		abort();
+	return sum;
+}
@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-cpu.c
+ *
+ * Internal CPU enumeration helpers shared by the library modules.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "rseq-cpu.h"
+
+int rseq_nr_possible_cpus(void)
+{
+	int nr_cpus = 0, c, v = 0;
+	bool in_number = false;
+	FILE *f;
+
+	f = fopen("/sys/devices/system/cpu/possible", "r");
+	if (f) {
+		while ((c = fgetc(f)) != EOF) {
+			if (c >= '0' && c <= '9') {
+				v = v * 10 + (c - '0');
+				in_number = true;
+				continue;
+			}
+			if (in_number && v + 1 > nr_cpus)
+				nr_cpus = v + 1;
+			v = 0;
+			in_number = false;
+		}
+		if (in_number && v + 1 > nr_cpus)
+			nr_cpus = v + 1;
+		fclose(f);
+	}
+	if (nr_cpus <= 0)
+		nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (nr_cpus <= 0 || nr_cpus > CPU_SETSIZE)
+		nr_cpus = CPU_SETSIZE;
+	return nr_cpus;
+}
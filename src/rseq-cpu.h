@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * rseq-cpu.h
+ *
+ * Internal CPU enumeration helpers shared by the library modules.
+ */
+
+#ifndef _RSEQ_CPU_H
+#define _RSEQ_CPU_H
+
+#ifndef __rseq_hidden
+#define __rseq_hidden	__attribute__((visibility("hidden")))
+#endif
+
+/*
+ * Number of possible CPU numbers, from the highest CPU listed in
+ * /sys/devices/system/cpu/possible, at most CPU_SETSIZE.
+ */
+__rseq_hidden
+int rseq_nr_possible_cpus(void);
+
+#endif /* _RSEQ_CPU_H */
@@ -0,0 +1,465 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-extent-alloc.c
+ *
+ * Per-CPU extent allocator for on-disk space.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/extent-alloc.h>
+
+#include "rseq-cpu.h"
+#include "rseq-membarrier.h"
+
+/*
+ * The lease state word of a CPU holds the number of blocks used from
+ * the active lease, the active lease slot, and a generation incremented
+ * by each refill, so a state word read before two refills never
+ * matches the current one.
+ */
+#define EXTENT_USED_BITS	21
+#define EXTENT_USED_MASK	(((uintptr_t) 1 << EXTENT_USED_BITS) - 1)
+#define EXTENT_SLOT		((uintptr_t) 1 << EXTENT_USED_BITS)
+#define EXTENT_GEN_ONE		((uintptr_t) 1 << (EXTENT_USED_BITS + 1))
+
+#define extent_state_used(w)	((uintptr_t) (w) & EXTENT_USED_MASK)
+#define extent_state_slot(w)	(!!((uintptr_t) (w) & EXTENT_SLOT))
+
+/*
+ * The batch state word of a CPU holds the number of extents in its
+ * batch, and a generation incremented each time the batch is emptied.
+ */
+#define EXTENT_BATCH		64
+#define EXTENT_COUNT_MASK	(((uintptr_t) 1 << 16) - 1)
+#define EXTENT_BATCH_GEN_ONE	((uintptr_t) 1 << 16)
+
+/* State of a word taken over by a flush. */
+#define EXTENT_LOCKED		((intptr_t) -1)
+
+struct extent_cpu {
+	intptr_t state;
+	/*
+	 * Lease offsets. Refills write the inactive slot, so a refill
+	 * aborted after its try store leaves the active lease intact.
+	 */
+	intptr_t lease[2];
+	intptr_t batch_state;
+	struct rseq_extent batch[EXTENT_BATCH];
+} __attribute__((aligned(128)));
+
+struct rseq_extent_alloc {
+	int nr_cpus;
+	uintptr_t lease_len;
+	struct extent_cpu *cpus;
+
+	/* Free extents sorted by offset. */
+	pthread_mutex_t lock;
+	struct rseq_extent *free;
+	size_t nr_free;
+	size_t alloc_free;
+	uint64_t free_blocks;
+	/* Destination of merges, swapped with the free extents. */
+	struct rseq_extent *merged;
+	size_t alloc_merged;
+
+	/* Serializes flushes. */
+	pthread_mutex_t flush_lock;
+};
+
+struct rseq_extent_alloc *rseq_extent_alloc_create(uint64_t size,
+		unsigned int lease_len)
+{
+	struct rseq_extent_alloc *ea;
+	int cpu, ret;
+
+	if (!size || size > INTPTR_MAX || !lease_len ||
+			lease_len > RSEQ_EXTENT_ALLOC_MAX_LEASE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!rseq_membarrier_rseq_available()) {
+		errno = ENOSYS;
+		return NULL;
+	}
+	ea = calloc(1, sizeof(*ea));
+	if (!ea)
+		return NULL;
+	ea->nr_cpus = rseq_nr_possible_cpus();
+	ea->lease_len = lease_len;
+	ret = posix_memalign((void **) &ea->cpus, __alignof__(*ea->cpus),
+			     ea->nr_cpus * sizeof(*ea->cpus));
+	if (ret) {
+		ea->cpus = NULL;
+		errno = ret;
+		goto error;
+	}
+	/* Leases start exhausted, so the first allocation of a CPU refills. */
+	for (cpu = 0; cpu < ea->nr_cpus; cpu++) {
+		memset(&ea->cpus[cpu], 0, sizeof(ea->cpus[cpu]));
+		ea->cpus[cpu].state = (intptr_t) ea->lease_len;
+	}
+	ea->free = malloc(sizeof(*ea->free));
+	if (!ea->free)
+		goto error;
+	ea->free[0].offset = 0;
+	ea->free[0].len = size;
+	ea->nr_free = 1;
+	ea->alloc_free = 1;
+	ea->free_blocks = size;
+	ret = pthread_mutex_init(&ea->lock, NULL);
+	if (ret) {
+		errno = ret;
+		goto error;
+	}
+	ret = pthread_mutex_init(&ea->flush_lock, NULL);
+	if (ret) {
+		pthread_mutex_destroy(&ea->lock);
+		errno = ret;
+		goto error;
+	}
+	return ea;
+
+error:
+	free(ea->free);
+	free(ea->cpus);
+	free(ea);
+	return NULL;
+}
+
+void rseq_extent_alloc_destroy(struct rseq_extent_alloc *ea)
+{
+	if (!ea)
+		return;
+	(void) pthread_mutex_destroy(&ea->flush_lock);
+	(void) pthread_mutex_destroy(&ea->lock);
+	free(ea->merged);
+	free(ea->free);
+	free(ea->cpus);
+	free(ea);
+}
+
+static int extent_cmp(const void *a, const void *b)
+{
+	const struct rseq_extent *ea = a, *eb = b;
+
+	if (ea->offset != eb->offset)
+		return ea->offset < eb->offset ? -1 : 1;
+	return 0;
+}
+
+/* Append @e to the @nr extents at @out, coalescing it with the last one. */
+static void extent_append(struct rseq_extent *out, size_t *nr,
+		const struct rseq_extent *e)
+{
+	if (*nr && out[*nr - 1].offset + out[*nr - 1].len == e->offset)
+		out[*nr - 1].len += e->len;
+	else
+		out[(*nr)++] = *e;
+}
+
+/*
+ * Sort the @nr extents at @in, and merge them into the free extents in
+ * a single pass. Called with the lock held.
+ */
+static void extent_list_merge(struct rseq_extent_alloc *ea,
+		struct rseq_extent *in, size_t nr)
+{
+	size_t i = 0, j = 0, nr_merged = 0;
+
+	if (nr > 1)
+		qsort(in, nr, sizeof(*in), extent_cmp);
+	if (ea->alloc_merged < ea->nr_free + nr) {
+		size_t alloc = 2 * (ea->nr_free + nr);
+		struct rseq_extent *merged;
+
+		merged = realloc(ea->merged, alloc * sizeof(*merged));
+		if (!merged)
+			return;		/* Leak the extents. */
+		ea->merged = merged;
+		ea->alloc_merged = alloc;
+	}
+	while (i < ea->nr_free || j < nr) {
+		if (j == nr || (i < ea->nr_free && ea->free[i].offset < in[j].offset)) {
+			extent_append(ea->merged, &nr_merged, &ea->free[i++]);
+		} else {
+			if (in[j].len) {
+				ea->free_blocks += in[j].len;
+				extent_append(ea->merged, &nr_merged, &in[j]);
+			}
+			j++;
+		}
+	}
+	in = ea->free;
+	ea->free = ea->merged;
+	ea->merged = in;
+	i = ea->alloc_free;
+	ea->alloc_free = ea->alloc_merged;
+	ea->alloc_merged = i;
+	ea->nr_free = nr_merged;
+}
+
+static void extent_list_put(struct rseq_extent_alloc *ea, uint64_t offset,
+		uint64_t len)
+{
+	struct rseq_extent e = { .offset = offset, .len = len };
+
+	if (pthread_mutex_lock(&ea->lock))
+		abort();
+	extent_list_merge(ea, &e, 1);
+	if (pthread_mutex_unlock(&ea->lock))
+		abort();
+}
+
+/* Carve @len blocks out of the first free extent which can hold them. */
+static int extent_list_take(struct rseq_extent_alloc *ea, uint64_t len,
+		uint64_t *offset)
+{
+	int ret = -1;
+	size_t i;
+
+	if (pthread_mutex_lock(&ea->lock))
+		abort();
+	for (i = 0; i < ea->nr_free; i++) {
+		struct rseq_extent *e = &ea->free[i];
+
+		if (e->len < len)
+			continue;
+		*offset = e->offset;
+		e->offset += len;
+		e->len -= len;
+		if (!e->len) {
+			memmove(e, e + 1, (ea->nr_free - i - 1) * sizeof(*e));
+			ea->nr_free--;
+		}
+		ea->free_blocks -= len;
+		ret = 0;
+		break;
+	}
+	if (pthread_mutex_unlock(&ea->lock))
+		abort();
+	return ret;
+}
+
+/* Return the unused tail of the lease of @c to the free extents. */
+static void extent_reclaim_lease(struct rseq_extent_alloc *ea, struct extent_cpu *c)
+{
+	intptr_t state = RSEQ_READ_ONCE(c->state);
+	uintptr_t used;
+
+	for (;;) {
+		used = extent_state_used(state);
+		if (used >= ea->lease_len)
+			return;
+		if (!__atomic_compare_exchange_n(&c->state, &state, EXTENT_LOCKED,
+				false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+		/*
+		 * Abort critical sections which loaded the state before it
+		 * was locked. A critical section which committed in the
+		 * meantime has overwritten the lock: retry.
+		 */
+		if (rseq_sys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0))
+			abort();
+		if (RSEQ_READ_ONCE(c->state) == EXTENT_LOCKED)
+			break;
+		state = RSEQ_READ_ONCE(c->state);
+	}
+	extent_list_put(ea, (uint64_t) RSEQ_READ_ONCE(c->lease[extent_state_slot(state)]) + used,
+			ea->lease_len - used);
+	rseq_smp_store_release(&c->state, (intptr_t) ((((uintptr_t) state &
+			~EXTENT_USED_MASK) | ea->lease_len) + EXTENT_GEN_ONE));
+}
+
+/* Merge the batch of @c into the free extents. */
+static void extent_reclaim_batch(struct rseq_extent_alloc *ea, struct extent_cpu *c)
+{
+	intptr_t bstate = RSEQ_READ_ONCE(c->batch_state);
+	size_t nr;
+
+	for (;;) {
+		nr = (uintptr_t) bstate & EXTENT_COUNT_MASK;
+		if (!nr)
+			return;
+		if (!__atomic_compare_exchange_n(&c->batch_state, &bstate, EXTENT_LOCKED,
+				false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			continue;
+		/* As for leases. */
+		if (rseq_sys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0))
+			abort();
+		if (RSEQ_READ_ONCE(c->batch_state) == EXTENT_LOCKED)
+			break;
+		bstate = RSEQ_READ_ONCE(c->batch_state);
+	}
+	if (pthread_mutex_lock(&ea->lock))
+		abort();
+	extent_list_merge(ea, c->batch, nr);
+	if (pthread_mutex_unlock(&ea->lock))
+		abort();
+	rseq_smp_store_release(&c->batch_state, (intptr_t) (((uintptr_t) bstate &
+			~EXTENT_COUNT_MASK) + EXTENT_BATCH_GEN_ONE));
+}
+
+void rseq_extent_alloc_flush(struct rseq_extent_alloc *ea)
+{
+	int cpu;
+
+	if (pthread_mutex_lock(&ea->flush_lock))
+		abort();
+	for (cpu = 0; cpu < ea->nr_cpus; cpu++) {
+		extent_reclaim_batch(ea, &ea->cpus[cpu]);
+		extent_reclaim_lease(ea, &ea->cpus[cpu]);
+	}
+	if (pthread_mutex_unlock(&ea->flush_lock))
+		abort();
+}
+
+int rseq_extent_alloc_get(struct rseq_extent_alloc *ea, uint64_t len,
+		uint64_t *offset)
+{
+	intptr_t spare = -1;
+	int ret = -1;
+
+	if (!len) {
+		errno = EINVAL;
+		return -1;
+	}
+	while (len <= ea->lease_len) {
+		struct extent_cpu *c;
+		intptr_t state, newstate, start;
+		uintptr_t used;
+		int cpu, slot;
+
+		cpu = rseq_cpu_start();
+		c = &ea->cpus[cpu];
+		state = RSEQ_READ_ONCE(c->state);
+		if (rseq_unlikely(state == EXTENT_LOCKED)) {
+			/* A flush is taking the lease. */
+			sched_yield();
+			continue;
+		}
+		used = extent_state_used(state);
+		slot = extent_state_slot(state);
+		start = RSEQ_READ_ONCE(c->lease[slot]);
+		if (rseq_unlikely(used + len > ea->lease_len)) {
+			if (spare < 0) {
+				uint64_t lease;
+
+				if (extent_list_take(ea, ea->lease_len, &lease))
+					break;	/* No room for a lease. */
+				spare = (intptr_t) lease;
+			}
+			newstate = (intptr_t) ((((uintptr_t) state & ~EXTENT_USED_MASK) ^
+						EXTENT_SLOT) + EXTENT_GEN_ONE);
+			if (rseq_likely(!rseq_cmpeqv_trystorev_storev(&c->state, state,
+					&c->lease[!slot], spare, newstate, cpu))) {
+				spare = -1;
+				if (used < ea->lease_len)
+					extent_list_put(ea, (uint64_t) start + used,
+							ea->lease_len - used);
+			}
+			/* Retry if comparison fails or rseq aborts. */
+			continue;
+		}
+		if (rseq_likely(!rseq_cmpeqv_storev(&c->state, state,
+				(intptr_t) ((uintptr_t) state + len), cpu))) {
+			*offset = (uint64_t) start + used;
+			ret = 0;
+			goto end;
+		}
+		/* Retry if comparison fails or rseq aborts. */
+	}
+	ret = extent_list_take(ea, len, offset);
+	if (ret) {
+		/* Take back the space held by CPUs before giving up. */
+		rseq_extent_alloc_flush(ea);
+		ret = extent_list_take(ea, len, offset);
+		if (ret)
+			errno = ENOSPC;
+	}
+end:
+	if (spare >= 0)
+		extent_list_put(ea, (uint64_t) spare, ea->lease_len);
+	return ret;
+}
+
+void rseq_extent_alloc_put(struct rseq_extent_alloc *ea, uint64_t offset,
+		uint64_t len)
+{
+	struct rseq_extent e = { .offset = offset, .len = len };
+	struct rseq_extent drained[EXTENT_BATCH];
+
+	if (!len)
+		return;
+	for (;;) {
+		struct extent_cpu *c;
+		intptr_t bstate;
+		size_t nr;
+		int cpu;
+
+		cpu = rseq_cpu_start();
+		c = &ea->cpus[cpu];
+		bstate = rseq_smp_load_acquire(&c->batch_state);
+		if (rseq_unlikely(bstate == EXTENT_LOCKED)) {
+			/* A flush is taking the batch. */
+			sched_yield();
+			continue;
+		}
+		nr = (uintptr_t) bstate & EXTENT_COUNT_MASK;
+		if (rseq_unlikely(nr == EXTENT_BATCH)) {
+			/*
+			 * Extents of a full batch are not written before its
+			 * generation changes, which fails the commit below.
+			 */
+			memcpy(drained, c->batch, sizeof(drained));
+			if (rseq_likely(!rseq_cmpeqv_storev(&c->batch_state, bstate,
+					(intptr_t) (((uintptr_t) bstate & ~EXTENT_COUNT_MASK) +
+						    EXTENT_BATCH_GEN_ONE), cpu))) {
+				if (pthread_mutex_lock(&ea->lock))
+					abort();
+				extent_list_merge(ea, drained, EXTENT_BATCH);
+				if (pthread_mutex_unlock(&ea->lock))
+					abort();
+			}
+			/* Retry if comparison fails or rseq aborts. */
+			continue;
+		}
+		if (rseq_likely(!rseq_cmpeqv_trymemcpy_storev_release(&c->batch_state,
+				bstate, &c->batch[nr], &e, sizeof(e), bstate + 1, cpu)))
+			return;
+		/* Retry if comparison fails or rseq aborts. */
+	}
+}
+
+uint64_t rseq_extent_alloc_free_blocks(struct rseq_extent_alloc *ea,
+		uint64_t *nr_extents)
+{
+	uint64_t free_blocks;
+
+	if (pthread_mutex_lock(&ea->lock))
+		abort();
+	free_blocks = ea->free_blocks;
+	if (nr_extents)
+		*nr_extents = ea->nr_free;
+	if (pthread_mutex_unlock(&ea->lock))
+		abort();
+	return free_blocks;
+}
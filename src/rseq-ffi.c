@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-ffi.c
+ *
+ * Out-of-line restartable sequence entry points for foreign function
+ * interfaces.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#include <rseq/rseq.h>
+#include <rseq/ffi.h>
+
+int32_t rseq_ffi_current_cpu_raw(void)
+{
+	return rseq_current_cpu_raw();
+}
+
+uint32_t rseq_ffi_cpu_start(void)
+{
+	return rseq_cpu_start();
+}
+
+uint32_t rseq_ffi_current_cpu(void)
+{
+	return rseq_current_cpu();
+}
+
+void rseq_ffi_prepare_unload(void)
+{
+	rseq_prepare_unload();
+}
+
+int rseq_ffi_cmpeqv_storev(intptr_t *v, intptr_t expect, intptr_t newv, int cpu)
+{
+	return rseq_cmpeqv_storev(v, expect, newv, cpu);
+}
+
+int rseq_ffi_cmpnev_storeoffp_load(intptr_t *v, intptr_t expectnot,
+		off_t voffp, intptr_t *load, int cpu)
+{
+	return rseq_cmpnev_storeoffp_load(v, expectnot, voffp, load, cpu);
+}
+
+int rseq_ffi_addv(intptr_t *v, intptr_t count, int cpu)
+{
+	return rseq_addv(v, count, cpu);
+}
+
+int rseq_ffi_cmpeqv_trystorev_storev(intptr_t *v, intptr_t expect,
+		intptr_t *v2, intptr_t newv2, intptr_t newv, int cpu)
+{
+	return rseq_cmpeqv_trystorev_storev(v, expect, v2, newv2, newv, cpu);
+}
+
+int rseq_ffi_cmpeqv_trystorev_storev_release(intptr_t *v, intptr_t expect,
+		intptr_t *v2, intptr_t newv2, intptr_t newv, int cpu)
+{
+	return rseq_cmpeqv_trystorev_storev_release(v, expect, v2, newv2, newv, cpu);
+}
+
+int rseq_ffi_cmpeqv_cmpeqv_storev(intptr_t *v, intptr_t expect,
+		intptr_t *v2, intptr_t expect2, intptr_t newv, int cpu)
+{
+	return rseq_cmpeqv_cmpeqv_storev(v, expect, v2, expect2, newv, cpu);
+}
+
+int rseq_ffi_cmpeqv_cmpeqm_storev(intptr_t *v, intptr_t expect,
+		void *m, void *expectm, size_t len, intptr_t newv, int cpu)
+{
+	return rseq_cmpeqv_cmpeqm_storev(v, expect, m, expectm, len, newv, cpu);
+}
+
+int rseq_ffi_cmpeqv_trymemcpy_storev(intptr_t *v, intptr_t expect,
+		void *dst, void *src, size_t len, intptr_t newv, int cpu)
+{
+	return rseq_cmpeqv_trymemcpy_storev(v, expect, dst, src, len, newv, cpu);
+}
+
+int rseq_ffi_cmpeqv_trymemcpy_storev_release(intptr_t *v, intptr_t expect,
+		void *dst, void *src, size_t len, intptr_t newv, int cpu)
+{
+	return rseq_cmpeqv_trymemcpy_storev_release(v, expect, dst, src, len, newv, cpu);
+}
+
+int rseq_ffi_deref_loadoffp(void *p, off_t voffp, intptr_t *load, int cpu)
+{
+	return rseq_deref_loadoffp(p, voffp, load, cpu);
+}
+
+int rseq_ffi_deref_addoffp(intptr_t *p, off_t voffp, intptr_t count, int cpu)
+{
+	return rseq_deref_addoffp(p, voffp, count, cpu);
+}
+
+void rseq_ffi_percpu_add_batch(void *base, size_t cpu_stride,
+		const off_t *offsets, const intptr_t *counts, size_t n)
+{
+	size_t i = 0;
+
+	while (i < n) {
+		int cpu = rseq_cpu_start();
+		char *row = (char *) base + cpu * cpu_stride;
+
+		/* Keep going on the same row until an add fails. */
+		for (; i < n; i++) {
+			if (rseq_unlikely(rseq_addv((intptr_t *) (row + offsets[i]),
+					counts[i], cpu)))
+				break;
+		}
+	}
+}
+
+void rseq_ffi_percpu_cache_push_batch(struct rseq_percpu_cache *cache,
+		void *const *objs, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		rseq_percpu_cache_push(cache, objs[i]);
+}
+
+size_t rseq_ffi_percpu_cache_pop_batch(struct rseq_percpu_cache *cache,
+		void **objs, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		objs[i] = rseq_percpu_cache_pop(cache);
+		if (!objs[i])
+			break;
+	}
+	return i;
+}
@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-file-counters.c
+ *
+ * Per-CPU counters mapped from a file, surviving process crashes.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <rseq/rseq.h>
+#include <rseq/file-counters.h>
+
+#include "rseq-cpu.h"
+
+/* "RSEQCNTR" in little-endian byte order. */
+#define FILE_COUNTERS_MAGIC		0x52544e4351455352ULL
+#define FILE_COUNTERS_VERSION		1
+/* Rows start after the header page, and are aligned on cache lines. */
+#define FILE_COUNTERS_HEADER_LEN	4096
+#define FILE_COUNTERS_ROW_ALIGN		128
+
+struct file_counters_header {
+	uint64_t magic;
+	uint32_t version;
+	/* Size of a slot, which differs between 32-bit and 64-bit ABIs. */
+	uint32_t slot_size;
+	uint32_t nr_counters;
+	uint32_t nr_rows;
+	uint64_t nr_checkpoints;
+};
+
+static inline struct file_counters_header *file_counters_header(
+		struct rseq_file_counters *fc)
+{
+	return fc->map;
+}
+
+static off_t file_counters_len(struct rseq_file_counters *fc, int nr_rows)
+{
+	return FILE_COUNTERS_HEADER_LEN +
+		(off_t) nr_rows * fc->stride * sizeof(intptr_t);
+}
+
+/*
+ * Read the header of an existing file into @header, or leave it zeroed
+ * for an empty file or one whose creation did not complete.
+ */
+static int file_counters_read_header(struct rseq_file_counters *fc,
+		struct file_counters_header *header)
+{
+	struct stat st;
+	ssize_t ret;
+
+	memset(header, 0, sizeof(*header));
+	if (fstat(fc->fd, &st))
+		return -1;
+	if (!st.st_size)
+		return 0;
+	if (st.st_size < FILE_COUNTERS_HEADER_LEN) {
+		errno = EINVAL;
+		return -1;
+	}
+	do {
+		ret = pread(fc->fd, header, sizeof(*header), 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -1;
+	if (ret != sizeof(*header))
+		goto invalid;
+	/* The magic is written last when creating the file. */
+	if (!header->magic) {
+		memset(header, 0, sizeof(*header));
+		return 0;
+	}
+	if (header->magic != FILE_COUNTERS_MAGIC ||
+			header->version != FILE_COUNTERS_VERSION ||
+			header->slot_size != sizeof(intptr_t) ||
+			header->nr_counters != fc->nr_counters ||
+			header->nr_rows > INT32_MAX ||
+			st.st_size < file_counters_len(fc, header->nr_rows))
+		goto invalid;
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Write the header up to the checkpoint count, which processes with the
+ * file mapped may be updating.
+ */
+static int file_counters_write_header(struct rseq_file_counters *fc,
+		const struct file_counters_header *header)
+{
+	size_t len = offsetof(struct file_counters_header, nr_checkpoints);
+	ssize_t ret;
+
+	do {
+		ret = pwrite(fc->fd, header, len, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -1;
+	if ((size_t) ret != len) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Add zeroed rows up to one per possible CPU. The new size is durable
+ * before the header accounts for the new rows, so the header never
+ * refers to rows missing from the file.
+ */
+static int file_counters_grow(struct rseq_file_counters *fc,
+		struct file_counters_header *header, int nr_cpus)
+{
+	if (ftruncate(fc->fd, file_counters_len(fc, nr_cpus)) || fdatasync(fc->fd))
+		return -1;
+	if (!header->magic) {
+		header->version = FILE_COUNTERS_VERSION;
+		header->slot_size = sizeof(intptr_t);
+		header->nr_counters = fc->nr_counters;
+	}
+	header->nr_rows = nr_cpus;
+	if (!header->magic) {
+		/* Complete the header before marking the file created. */
+		if (file_counters_write_header(fc, header) || fdatasync(fc->fd))
+			return -1;
+		header->magic = FILE_COUNTERS_MAGIC;
+	}
+	if (file_counters_write_header(fc, header) || fdatasync(fc->fd))
+		return -1;
+	return 0;
+}
+
+struct rseq_file_counters *rseq_file_counters_open(const char *path,
+		unsigned int nr_counters)
+{
+	struct file_counters_header header;
+	struct rseq_file_counters *fc;
+	int nr_cpus, ret;
+
+	if (!nr_counters || nr_counters > RSEQ_FILE_COUNTERS_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	fc = calloc(1, sizeof(*fc));
+	if (!fc)
+		return NULL;
+	fc->nr_counters = nr_counters;
+	fc->stride = (((size_t) nr_counters * sizeof(intptr_t) +
+		       FILE_COUNTERS_ROW_ALIGN - 1) &
+		      ~(size_t) (FILE_COUNTERS_ROW_ALIGN - 1)) / sizeof(intptr_t);
+	fc->map = MAP_FAILED;
+	fc->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fc->fd < 0)
+		goto error;
+	/* Serialize creation and growth with other processes. */
+	while (flock(fc->fd, LOCK_EX)) {
+		if (errno != EINTR)
+			goto error;
+	}
+	if (file_counters_read_header(fc, &header))
+		goto error;
+	nr_cpus = rseq_nr_possible_cpus();
+	if (header.nr_rows < (uint32_t) nr_cpus &&
+			file_counters_grow(fc, &header, nr_cpus))
+		goto error;
+	fc->nr_rows = header.nr_rows;
+	fc->map_len = file_counters_len(fc, fc->nr_rows);
+	fc->map = mmap(NULL, fc->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       fc->fd, 0);
+	if (fc->map == MAP_FAILED)
+		goto error;
+	fc->rows = (intptr_t *) ((char *) fc->map + FILE_COUNTERS_HEADER_LEN);
+	if (flock(fc->fd, LOCK_UN))
+		goto error;
+	return fc;
+
+error:
+	ret = errno;
+	if (fc->map != MAP_FAILED)
+		munmap(fc->map, fc->map_len);
+	if (fc->fd >= 0)
+		close(fc->fd);
+	free(fc);
+	errno = ret;
+	return NULL;
+}
+
+void rseq_file_counters_close(struct rseq_file_counters *fc)
+{
+	if (!fc)
+		return;
+	munmap(fc->map, fc->map_len);
+	close(fc->fd);
+	free(fc);
+}
+
+intptr_t rseq_file_counters_read(struct rseq_file_counters *fc,
+		unsigned int index)
+{
+	intptr_t sum = 0;
+	int row;
+
+	for (row = 0; row < fc->nr_rows; row++)
+		sum += RSEQ_READ_ONCE(fc->rows[(size_t) row * fc->stride + index]);
+	return sum;
+}
+
+int rseq_file_counters_checkpoint(struct rseq_file_counters *fc)
+{
+	struct file_counters_header *header = file_counters_header(fc);
+
+	if (msync(fc->map, fc->map_len, MS_SYNC))
+		return -1;
+	__atomic_add_fetch(&header->nr_checkpoints, 1, __ATOMIC_RELAXED);
+	return msync(fc->map, FILE_COUNTERS_HEADER_LEN, MS_SYNC);
+}
+
+uint64_t rseq_file_counters_nr_checkpoints(struct rseq_file_counters *fc)
+{
+	return __atomic_load_n(&file_counters_header(fc)->nr_checkpoints,
+			       __ATOMIC_RELAXED);
+}
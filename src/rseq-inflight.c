@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-inflight.c
+ *
+ * Per-CPU tracking of in-flight requests for client-side load
+ * balancing.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <rseq/inflight.h>
+
+#include "rseq-cpu.h"
+
+/* Rows are padded to whole cache lines. */
+#define INFLIGHT_ROW_ALIGN	(128 / sizeof(intptr_t))
+
+static __thread uint64_t inflight_rand_state;
+
+/* xorshift64*, seeded per thread. */
+static uint64_t inflight_rand(void)
+{
+	uint64_t x = inflight_rand_state;
+
+	if (rseq_unlikely(!x)) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		x = ((uint64_t) ts.tv_nsec << 32) ^ (uintptr_t) &inflight_rand_state;
+		if (!x)
+			x = 1;
+	}
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	inflight_rand_state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t inflight_now_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts))
+		abort();
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct rseq_inflight *rseq_inflight_create(size_t nr_backends,
+		unsigned int refresh_us)
+{
+	struct rseq_inflight *inflight;
+	int ret;
+
+	if (!nr_backends) {
+		errno = EINVAL;
+		return NULL;
+	}
+	inflight = calloc(1, sizeof(*inflight));
+	if (!inflight)
+		return NULL;
+	inflight->nr_backends = nr_backends;
+	inflight->row_stride = (nr_backends + INFLIGHT_ROW_ALIGN - 1) &
+		~(INFLIGHT_ROW_ALIGN - 1);
+	inflight->nr_cpus = rseq_nr_possible_cpus();
+	inflight->refresh_ns = (uint64_t) refresh_us * 1000;
+	/* Rows of CPUs which never send requests are never touched. */
+	inflight->rows_len = (size_t) inflight->nr_cpus * inflight->row_stride *
+		sizeof(intptr_t);
+	inflight->rows = mmap(NULL, inflight->rows_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (inflight->rows == MAP_FAILED) {
+		free(inflight);
+		return NULL;
+	}
+	inflight->snapshot_rows = calloc((size_t) inflight->nr_cpus * nr_backends,
+			sizeof(*inflight->snapshot_rows));
+	inflight->snapshot_totals = calloc(nr_backends,
+			sizeof(*inflight->snapshot_totals));
+	if (!inflight->snapshot_rows || !inflight->snapshot_totals) {
+		ret = ENOMEM;
+		goto error;
+	}
+	ret = pthread_mutex_init(&inflight->refresh_lock, NULL);
+	if (ret)
+		goto error;
+	return inflight;
+
+error:
+	free(inflight->snapshot_rows);
+	free(inflight->snapshot_totals);
+	munmap(inflight->rows, inflight->rows_len);
+	free(inflight);
+	errno = ret;
+	return NULL;
+}
+
+void rseq_inflight_destroy(struct rseq_inflight *inflight)
+{
+	if (pthread_mutex_destroy(&inflight->refresh_lock))
+		abort();
+	free(inflight->snapshot_rows);
+	free(inflight->snapshot_totals);
+	munmap(inflight->rows, inflight->rows_len);
+	free(inflight);
+}
+
+/* Refresh lock held. */
+static void inflight_refresh_locked(struct rseq_inflight *inflight)
+{
+	size_t b;
+	int cpu;
+
+	for (b = 0; b < inflight->nr_backends; b++) {
+		intptr_t total = 0;
+
+		for (cpu = 0; cpu < inflight->nr_cpus; cpu++) {
+			intptr_t v = RSEQ_READ_ONCE(inflight->rows[cpu * inflight->row_stride + b]);
+
+			RSEQ_WRITE_ONCE(inflight->snapshot_rows[cpu * inflight->nr_backends + b], v);
+			total += v;
+		}
+		RSEQ_WRITE_ONCE(inflight->snapshot_totals[b], total);
+	}
+	RSEQ_WRITE_ONCE(inflight->last_refresh_ns, inflight_now_ns());
+}
+
+void rseq_inflight_refresh(struct rseq_inflight *inflight)
+{
+	if (pthread_mutex_lock(&inflight->refresh_lock))
+		abort();
+	inflight_refresh_locked(inflight);
+	if (pthread_mutex_unlock(&inflight->refresh_lock))
+		abort();
+}
+
+/* Snapshot total of @backend, corrected by the row of @cpu. */
+static intptr_t inflight_estimate(struct rseq_inflight *inflight,
+		size_t backend, int cpu)
+{
+	intptr_t estimate = RSEQ_READ_ONCE(inflight->snapshot_totals[backend]);
+
+	if (cpu < 0 || cpu >= inflight->nr_cpus)
+		return estimate;
+	return estimate +
+		RSEQ_READ_ONCE(inflight->rows[cpu * inflight->row_stride + backend]) -
+		RSEQ_READ_ONCE(inflight->snapshot_rows[cpu * inflight->nr_backends + backend]);
+}
+
+size_t rseq_inflight_select(struct rseq_inflight *inflight)
+{
+	size_t a, b;
+	int cpu;
+
+	if (inflight->nr_backends == 1)
+		return 0;
+	/* Only one thread refreshes, the others use the current snapshot. */
+	if (inflight_now_ns() - RSEQ_READ_ONCE(inflight->last_refresh_ns) >=
+			inflight->refresh_ns &&
+			!pthread_mutex_trylock(&inflight->refresh_lock)) {
+		inflight_refresh_locked(inflight);
+		if (pthread_mutex_unlock(&inflight->refresh_lock))
+			abort();
+	}
+	a = inflight_rand() % inflight->nr_backends;
+	b = inflight_rand() % (inflight->nr_backends - 1);
+	if (b >= a)
+		b++;
+	cpu = rseq_current_cpu_raw();
+	return inflight_estimate(inflight, b, cpu) < inflight_estimate(inflight, a, cpu) ?
+		b : a;
+}
+
+intptr_t rseq_inflight_read(struct rseq_inflight *inflight, size_t backend)
+{
+	intptr_t sum = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < inflight->nr_cpus; cpu++)
+		sum += RSEQ_READ_ONCE(inflight->rows[cpu * inflight->row_stride + backend]);
+	return sum;
+}
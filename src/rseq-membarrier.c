@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-membarrier.c
+ *
+ * Internal membarrier(2) helpers shared by the library modules.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syscall.h>
+
+#include "rseq-membarrier.h"
+
+static pthread_once_t membarrier_expedited_once = PTHREAD_ONCE_INIT;
+static pthread_once_t membarrier_rseq_once = PTHREAD_ONCE_INIT;
+static int membarrier_expedited;
+static int membarrier_rseq;
+
+int rseq_sys_membarrier(int cmd, int flags)
+{
+	return syscall(__NR_membarrier, cmd, flags);
+}
+
+static int membarrier_register(int cmd, int register_cmd)
+{
+	int mask;
+
+	mask = rseq_sys_membarrier(MEMBARRIER_CMD_QUERY, 0);
+	if (mask < 0 || !(mask & cmd))
+		return 0;
+	return !rseq_sys_membarrier(register_cmd, 0);
+}
+
+static void membarrier_expedited_init(void)
+{
+	membarrier_expedited = membarrier_register(MEMBARRIER_CMD_PRIVATE_EXPEDITED,
+			MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED);
+}
+
+static void membarrier_rseq_init(void)
+{
+	membarrier_rseq = membarrier_register(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ,
+			MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ);
+}
+
+int rseq_membarrier_expedited_available(void)
+{
+	if (pthread_once(&membarrier_expedited_once, membarrier_expedited_init))
+		abort();
+	return membarrier_expedited;
+}
+
+int rseq_membarrier_rseq_available(void)
+{
+	if (pthread_once(&membarrier_rseq_once, membarrier_rseq_init))
+		abort();
+	return membarrier_rseq;
+}
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: LGPL-2.1-only */
+/*
+ * rseq-membarrier.h
+ *
+ * Internal membarrier(2) helpers shared by the library modules.
+ */
+
+#ifndef _RSEQ_MEMBARRIER_H
+#define _RSEQ_MEMBARRIER_H
+
+#include <linux/membarrier.h>
+
+#ifndef MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ
+#define MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ		(1 << 7)
+#define MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ	(1 << 8)
+#endif
+
+#ifndef __rseq_hidden
+#define __rseq_hidden	__attribute__((visibility("hidden")))
+#endif
+
+__rseq_hidden
+int rseq_sys_membarrier(int cmd, int flags);
+
+/*
+ * Register the process for private expedited membarrier, once.
+ * Returns 1 if MEMBARRIER_CMD_PRIVATE_EXPEDITED can be used, else 0.
+ */
+__rseq_hidden
+int rseq_membarrier_expedited_available(void);
+
+/*
+ * Register the process for private expedited rseq membarrier, once.
+ * Returns 1 if MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ can be used, else 0.
+ */
+__rseq_hidden
+int rseq_membarrier_rseq_available(void);
+
+#endif /* _RSEQ_MEMBARRIER_H */
@@ -0,0 +1,401 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-mempressure.c
+ *
+ * Memory pressure notifications.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <rseq/mempressure.h>
+
+#define MEMPRESSURE_PSI_PATH	"/proc/pressure/memory"
+#define MEMPRESSURE_CGROUP_ROOT	"/sys/fs/cgroup"
+
+struct mempressure_callback {
+	void (*cb)(void *priv, enum rseq_mempressure_event event);
+	void *priv;
+	struct mempressure_callback *next;
+};
+
+struct rseq_mempressure {
+	enum rseq_mempressure_source source;
+	int source_fd;
+	int wake_fd;
+	unsigned int tick_ms;
+	/* Sum of the memory.events counters, for the events source. */
+	uint64_t nr_events;
+
+	bool stop;
+	unsigned int nr_triggers;
+	pthread_t thread;
+
+	/* Protects the callback list, held while callbacks run. */
+	pthread_mutex_t lock;
+	struct mempressure_callback *callbacks;
+};
+
+/* Open @path and arm a PSI trigger on it. Returns the fd, or -1. */
+static int mempressure_open_psi(const char *path, unsigned int stall_us,
+		unsigned int window_us)
+{
+	char trigger[64];
+	int fd, len;
+
+	fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = snprintf(trigger, sizeof(trigger), "some %u %u", stall_us, window_us);
+	/* The trigger string is written with its terminating null byte. */
+	if (write(fd, trigger, len + 1) < 0) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+/* Sum the "high", "max" and "oom" counters of a memory.events file. */
+static int mempressure_read_events(int fd, uint64_t *nr_events)
+{
+	char buf[512], *line, *saveptr;
+	unsigned long long value;
+	char key[32];
+	ssize_t len;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len < 0)
+		return -1;
+	buf[len] = '\0';
+	*nr_events = 0;
+	for (line = strtok_r(buf, "\n", &saveptr); line;
+			line = strtok_r(NULL, "\n", &saveptr)) {
+		if (sscanf(line, "%31s %llu", key, &value) != 2)
+			continue;
+		if (!strcmp(key, "high") || !strcmp(key, "max") || !strcmp(key, "oom"))
+			*nr_events += value;
+	}
+	return 0;
+}
+
+/* Build the path of @file in the cgroup v2 directory of the process. */
+static int mempressure_cgroup_path(const char *file, char *path, size_t len)
+{
+	char line[PATH_MAX];
+	FILE *f;
+	int ret = -1;
+
+	f = fopen("/proc/self/cgroup", "re");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "0::", 3))
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		if (snprintf(path, len, "%s%s/%s", MEMPRESSURE_CGROUP_ROOT,
+				!strcmp(line + 3, "/") ? "" : line + 3, file) < (int) len)
+			ret = 0;
+		break;
+	}
+	fclose(f);
+	return ret;
+}
+
+static int mempressure_open_events(struct rseq_mempressure *monitor, const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (mempressure_read_events(fd, &monitor->nr_events)) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+static bool mempressure_is_events_file(const char *path)
+{
+	const char *base = strrchr(path, '/');
+
+	return !strcmp(base ? base + 1 : path, "memory.events");
+}
+
+static int mempressure_open_source(struct rseq_mempressure *monitor,
+		const char *path, unsigned int stall_us, unsigned int window_us)
+{
+	char cgroup_path[PATH_MAX];
+
+	if (path) {
+		if (mempressure_is_events_file(path)) {
+			monitor->source_fd = mempressure_open_events(monitor, path);
+			monitor->source = RSEQ_MEMPRESSURE_SOURCE_CGROUP_EVENTS;
+		} else {
+			monitor->source_fd = mempressure_open_psi(path, stall_us, window_us);
+			monitor->source = RSEQ_MEMPRESSURE_SOURCE_PSI;
+		}
+		return monitor->source_fd < 0 ? -1 : 0;
+	}
+
+	monitor->source_fd = mempressure_open_psi(MEMPRESSURE_PSI_PATH, stall_us, window_us);
+	if (monitor->source_fd >= 0) {
+		monitor->source = RSEQ_MEMPRESSURE_SOURCE_PSI;
+		return 0;
+	}
+	if (!mempressure_cgroup_path("memory.pressure", cgroup_path, sizeof(cgroup_path))) {
+		monitor->source_fd = mempressure_open_psi(cgroup_path, stall_us, window_us);
+		if (monitor->source_fd >= 0) {
+			monitor->source = RSEQ_MEMPRESSURE_SOURCE_CGROUP_PSI;
+			return 0;
+		}
+	}
+	if (!mempressure_cgroup_path("memory.events", cgroup_path, sizeof(cgroup_path))) {
+		monitor->source_fd = mempressure_open_events(monitor, cgroup_path);
+		if (monitor->source_fd >= 0) {
+			monitor->source = RSEQ_MEMPRESSURE_SOURCE_CGROUP_EVENTS;
+			return 0;
+		}
+	}
+	monitor->source = RSEQ_MEMPRESSURE_SOURCE_NONE;
+	return 0;
+}
+
+static void mempressure_notify(struct rseq_mempressure *monitor,
+		enum rseq_mempressure_event event)
+{
+	struct mempressure_callback *callback;
+
+	if (pthread_mutex_lock(&monitor->lock))
+		abort();
+	for (callback = monitor->callbacks; callback; callback = callback->next)
+		callback->cb(callback->priv, event);
+	if (pthread_mutex_unlock(&monitor->lock))
+		abort();
+}
+
+static uint64_t mempressure_now_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		abort();
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Returns true if the source reports pressure. */
+static bool mempressure_source_event(struct rseq_mempressure *monitor, short revents)
+{
+	uint64_t nr_events;
+
+	if (monitor->source != RSEQ_MEMPRESSURE_SOURCE_CGROUP_EVENTS)
+		return revents & POLLPRI;
+	/* kernfs notifies memory.events changes with POLLPRI | POLLERR. */
+	if (mempressure_read_events(monitor->source_fd, &nr_events))
+		return false;
+	if (nr_events == monitor->nr_events)
+		return false;
+	monitor->nr_events = nr_events;
+	return true;
+}
+
+static void *mempressure_thread(void *arg)
+{
+	struct rseq_mempressure *monitor = arg;
+	uint64_t next_tick = mempressure_now_ms() + monitor->tick_ms;
+	struct pollfd fds[2];
+	nfds_t nfds = 1;
+
+	fds[0].fd = monitor->wake_fd;
+	fds[0].events = POLLIN;
+	if (monitor->source_fd >= 0) {
+		fds[1].fd = monitor->source_fd;
+		fds[1].events = POLLPRI;
+		nfds = 2;
+	}
+	for (;;) {
+		int timeout = -1;
+		bool pressure;
+		uint64_t now;
+
+		if (monitor->tick_ms) {
+			now = mempressure_now_ms();
+			timeout = next_tick > now ? (int) (next_tick - now) : 0;
+		}
+		if (poll(fds, nfds, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			abort();
+		}
+		if (fds[0].revents & POLLIN) {
+			uint64_t count;
+
+			if (read(monitor->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				abort();
+		}
+		if (__atomic_load_n(&monitor->stop, __ATOMIC_ACQUIRE))
+			break;
+		pressure = __atomic_exchange_n(&monitor->nr_triggers, 0, __ATOMIC_RELAXED);
+		if (nfds == 2 && fds[1].revents) {
+			if (mempressure_source_event(monitor, fds[1].revents))
+				pressure = true;
+			/* The PSI trigger is gone, e.g. the cgroup was removed. */
+			else if (monitor->source != RSEQ_MEMPRESSURE_SOURCE_CGROUP_EVENTS &&
+					(fds[1].revents & (POLLERR | POLLNVAL)))
+				nfds = 1;
+		}
+		if (pressure)
+			mempressure_notify(monitor, RSEQ_MEMPRESSURE_PRESSURE);
+		if (monitor->tick_ms && mempressure_now_ms() >= next_tick) {
+			mempressure_notify(monitor, RSEQ_MEMPRESSURE_TICK);
+			next_tick = mempressure_now_ms() + monitor->tick_ms;
+		}
+	}
+	return NULL;
+}
+
+static void mempressure_wake(struct rseq_mempressure *monitor)
+{
+	uint64_t one = 1;
+
+	if (write(monitor->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		abort();
+}
+
+struct rseq_mempressure *rseq_mempressure_create(const char *path,
+		unsigned int stall_us, unsigned int window_us, unsigned int tick_ms)
+{
+	struct rseq_mempressure *monitor;
+	int ret;
+
+	monitor = calloc(1, sizeof(*monitor));
+	if (!monitor)
+		return NULL;
+	monitor->source_fd = -1;
+	monitor->tick_ms = tick_ms;
+	monitor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (monitor->wake_fd < 0)
+		goto error_free;
+	if (mempressure_open_source(monitor, path, stall_us, window_us))
+		goto error_wake;
+	ret = pthread_mutex_init(&monitor->lock, NULL);
+	if (ret)
+		goto error_source;
+	ret = pthread_create(&monitor->thread, NULL, mempressure_thread, monitor);
+	if (ret) {
+		pthread_mutex_destroy(&monitor->lock);
+		goto error_source;
+	}
+	return monitor;
+
+error_source:
+	if (monitor->source_fd >= 0)
+		close(monitor->source_fd);
+	errno = ret;
+error_wake:
+	ret = errno;
+	close(monitor->wake_fd);
+	errno = ret;
+error_free:
+	ret = errno;
+	free(monitor);
+	errno = ret;
+	return NULL;
+}
+
+void rseq_mempressure_destroy(struct rseq_mempressure *monitor)
+{
+	struct mempressure_callback *callback, *next;
+
+	__atomic_store_n(&monitor->stop, true, __ATOMIC_RELEASE);
+	mempressure_wake(monitor);
+	if (pthread_join(monitor->thread, NULL))
+		abort();
+	for (callback = monitor->callbacks; callback; callback = next) {
+		next = callback->next;
+		free(callback);
+	}
+	if (pthread_mutex_destroy(&monitor->lock))
+		abort();
+	if (monitor->source_fd >= 0)
+		close(monitor->source_fd);
+	close(monitor->wake_fd);
+	free(monitor);
+}
+
+enum rseq_mempressure_source rseq_mempressure_get_source(struct rseq_mempressure *monitor)
+{
+	return monitor->source;
+}
+
+int rseq_mempressure_register(struct rseq_mempressure *monitor,
+		void (*cb)(void *priv, enum rseq_mempressure_event event), void *priv)
+{
+	struct mempressure_callback *callback;
+
+	callback = malloc(sizeof(*callback));
+	if (!callback)
+		return -1;
+	callback->cb = cb;
+	callback->priv = priv;
+	if (pthread_mutex_lock(&monitor->lock))
+		abort();
+	callback->next = monitor->callbacks;
+	monitor->callbacks = callback;
+	if (pthread_mutex_unlock(&monitor->lock))
+		abort();
+	return 0;
+}
+
+void rseq_mempressure_unregister(struct rseq_mempressure *monitor,
+		void (*cb)(void *priv, enum rseq_mempressure_event event), void *priv)
+{
+	struct mempressure_callback **p, *callback;
+
+	if (pthread_mutex_lock(&monitor->lock))
+		abort();
+	for (p = &monitor->callbacks; (callback = *p); p = &callback->next) {
+		if (callback->cb == cb && callback->priv == priv) {
+			*p = callback->next;
+			free(callback);
+			break;
+		}
+	}
+	if (pthread_mutex_unlock(&monitor->lock))
+		abort();
+}
+
+void rseq_mempressure_trigger(struct rseq_mempressure *monitor)
+{
+	__atomic_add_fetch(&monitor->nr_triggers, 1, __ATOMIC_RELAXED);
+	mempressure_wake(monitor);
+}
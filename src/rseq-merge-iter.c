@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-merge-iter.c
+ *
+ * Timestamp-ordered merge of per-CPU event streams.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#include <errno.h>
+#include <stdlib.h>
+
+#include <rseq/merge-iter.h>
+
+struct merge_head {
+	uint64_t timestamp;
+	const void *event;
+	int cpu;
+};
+
+struct rseq_merge_iter {
+	struct rseq_merge_source source;
+	void *priv;
+	int nr_cpus;
+	uint64_t window;
+
+	/* Min-heap of the head event of non-empty buffers. */
+	struct merge_head *heap;
+	int heap_len;
+	/* Buffers found empty, polled at each call. */
+	int *empty;
+	int nr_empty;
+	/* CPU of the last returned event, consumed at the next call. */
+	int pending_cpu;
+
+	uint64_t watermark;	/* Most recent timestamp observed. */
+	uint64_t last;		/* Most recent timestamp returned. */
+	uint64_t nr_out_of_order;
+};
+
+static bool merge_head_before(const struct merge_head *a, const struct merge_head *b)
+{
+	if (a->timestamp != b->timestamp)
+		return a->timestamp < b->timestamp;
+	return a->cpu < b->cpu;
+}
+
+static void merge_heap_push(struct rseq_merge_iter *iter, const struct merge_head *head)
+{
+	int i = iter->heap_len++;
+
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+
+		if (!merge_head_before(head, &iter->heap[parent]))
+			break;
+		iter->heap[i] = iter->heap[parent];
+		i = parent;
+	}
+	iter->heap[i] = *head;
+}
+
+static void merge_heap_pop(struct rseq_merge_iter *iter)
+{
+	struct merge_head *last = &iter->heap[--iter->heap_len];
+	int i = 0;
+
+	for (;;) {
+		int child = 2 * i + 1;
+
+		if (child >= iter->heap_len)
+			break;
+		if (child + 1 < iter->heap_len &&
+				merge_head_before(&iter->heap[child + 1], &iter->heap[child]))
+			child++;
+		if (!merge_head_before(&iter->heap[child], last))
+			break;
+		iter->heap[i] = iter->heap[child];
+		i = child;
+	}
+	iter->heap[i] = *last;
+}
+
+/* Push the head of @cpu in the heap. Returns false if it is empty. */
+static bool merge_iter_poll(struct rseq_merge_iter *iter, int cpu)
+{
+	struct merge_head head;
+
+	head.event = iter->source.peek(iter->priv, cpu, &head.timestamp);
+	if (!head.event)
+		return false;
+	head.cpu = cpu;
+	if (head.timestamp > iter->watermark)
+		iter->watermark = head.timestamp;
+	merge_heap_push(iter, &head);
+	return true;
+}
+
+struct rseq_merge_iter *rseq_merge_iter_create(const struct rseq_merge_source *source,
+		void *priv, int nr_cpus, uint64_t window)
+{
+	struct rseq_merge_iter *iter;
+	int i;
+
+	if (nr_cpus <= 0 || !source->peek || !source->consume) {
+		errno = EINVAL;
+		return NULL;
+	}
+	iter = calloc(1, sizeof(*iter));
+	if (!iter)
+		return NULL;
+	iter->heap = calloc(nr_cpus, sizeof(*iter->heap));
+	iter->empty = calloc(nr_cpus, sizeof(*iter->empty));
+	if (!iter->heap || !iter->empty) {
+		rseq_merge_iter_destroy(iter);
+		return NULL;
+	}
+	iter->source = *source;
+	iter->priv = priv;
+	iter->nr_cpus = nr_cpus;
+	iter->window = window;
+	iter->pending_cpu = -1;
+	for (i = 0; i < nr_cpus; i++)
+		iter->empty[iter->nr_empty++] = i;
+	return iter;
+}
+
+void rseq_merge_iter_destroy(struct rseq_merge_iter *iter)
+{
+	if (!iter)
+		return;
+	free(iter->heap);
+	free(iter->empty);
+	free(iter);
+}
+
+const void *rseq_merge_iter_next(struct rseq_merge_iter *iter, bool flush,
+		int *cpu, uint64_t *timestamp)
+{
+	struct merge_head head;
+	int i;
+
+	if (iter->pending_cpu >= 0) {
+		iter->source.consume(iter->priv, iter->pending_cpu);
+		if (!merge_iter_poll(iter, iter->pending_cpu))
+			iter->empty[iter->nr_empty++] = iter->pending_cpu;
+		iter->pending_cpu = -1;
+	}
+	for (i = iter->nr_empty - 1; i >= 0; i--) {
+		if (merge_iter_poll(iter, iter->empty[i]))
+			iter->empty[i] = iter->empty[--iter->nr_empty];
+	}
+	if (!iter->heap_len)
+		return NULL;
+	head = iter->heap[0];
+	/*
+	 * With every buffer non-empty, the oldest head is the oldest
+	 * event. Otherwise, an empty buffer may still receive an older
+	 * event: wait until the oldest head is out of the window.
+	 */
+	if (!flush && iter->nr_empty &&
+			iter->watermark - head.timestamp < iter->window)
+		return NULL;
+	merge_heap_pop(iter);
+	iter->pending_cpu = head.cpu;
+	if (head.timestamp < iter->last)
+		iter->nr_out_of_order++;
+	else
+		iter->last = head.timestamp;
+	if (cpu)
+		*cpu = head.cpu;
+	if (timestamp)
+		*timestamp = head.timestamp;
+	return head.event;
+}
+
+uint64_t rseq_merge_iter_nr_out_of_order(struct rseq_merge_iter *iter)
+{
+	return iter->nr_out_of_order;
+}
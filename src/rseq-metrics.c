@@ -0,0 +1,383 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-metrics.c
+ *
+ * Registry of per-CPU counters addressed by name and labels.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <rseq/metrics.h>
+
+#include "rseq-cpu.h"
+
+#define METRICS_INIT_BUCKETS	1024
+
+struct metrics_series {
+	struct metrics_series *hash_next;
+	uint64_t hash;
+	/* Name and sorted labels, as consecutive NUL-terminated strings. */
+	char *key;
+	size_t key_len;
+	struct rseq_metrics_label *labels;
+	size_t nr_labels;
+	intptr_t *slots;
+};
+
+struct metrics_chunk {
+	/* One row of RSEQ_METRICS_CHUNK_SERIES slots per possible CPU. */
+	intptr_t *rows;
+	size_t rows_len;
+	struct metrics_series series[RSEQ_METRICS_CHUNK_SERIES];
+};
+
+struct rseq_metrics_registry {
+	pthread_mutex_t lock;
+	int nr_cpus;
+	struct metrics_chunk **chunks;
+	size_t nr_chunks;
+	size_t alloc_chunks;
+	size_t nr_series;
+	struct metrics_series **buckets;
+	size_t nr_buckets;
+};
+
+/* FNV-1a. */
+static uint64_t metrics_hash(const char *key, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char) key[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static int metrics_label_cmp(const void *a, const void *b)
+{
+	const struct rseq_metrics_label *la = a, *lb = b;
+
+	return strcmp(la->key, lb->key);
+}
+
+struct rseq_metrics_registry *rseq_metrics_registry_create(void)
+{
+	struct rseq_metrics_registry *registry;
+	int ret;
+
+	registry = calloc(1, sizeof(*registry));
+	if (!registry)
+		return NULL;
+	registry->nr_cpus = rseq_nr_possible_cpus();
+	registry->nr_buckets = METRICS_INIT_BUCKETS;
+	registry->buckets = calloc(registry->nr_buckets, sizeof(*registry->buckets));
+	if (!registry->buckets) {
+		free(registry);
+		return NULL;
+	}
+	ret = pthread_mutex_init(&registry->lock, NULL);
+	if (ret) {
+		free(registry->buckets);
+		free(registry);
+		errno = ret;
+		return NULL;
+	}
+	return registry;
+}
+
+void rseq_metrics_registry_destroy(struct rseq_metrics_registry *registry)
+{
+	size_t i, j;
+
+	if (!registry)
+		return;
+	for (i = 0; i < registry->nr_chunks; i++) {
+		struct metrics_chunk *chunk = registry->chunks[i];
+
+		for (j = 0; j < RSEQ_METRICS_CHUNK_SERIES; j++) {
+			free(chunk->series[j].key);
+			free(chunk->series[j].labels);
+		}
+		munmap(chunk->rows, chunk->rows_len);
+		free(chunk);
+	}
+	free(registry->chunks);
+	free(registry->buckets);
+	(void) pthread_mutex_destroy(&registry->lock);
+	free(registry);
+}
+
+size_t rseq_metrics_registry_nr_series(struct rseq_metrics_registry *registry)
+{
+	size_t nr_series;
+
+	if (pthread_mutex_lock(&registry->lock))
+		abort();
+	nr_series = registry->nr_series;
+	if (pthread_mutex_unlock(&registry->lock))
+		abort();
+	return nr_series;
+}
+
+static struct metrics_series *metrics_series_lookup(struct rseq_metrics_registry *registry,
+		const char *key, size_t key_len, uint64_t hash)
+{
+	struct metrics_series *series;
+
+	for (series = registry->buckets[hash & (registry->nr_buckets - 1)];
+			series; series = series->hash_next) {
+		if (series->hash == hash && series->key_len == key_len &&
+				!memcmp(series->key, key, key_len))
+			return series;
+	}
+	return NULL;
+}
+
+/* Double the number of buckets when the load factor exceeds 1. */
+static void metrics_hash_grow(struct rseq_metrics_registry *registry)
+{
+	struct metrics_series **buckets, *series, *next;
+	size_t nr_buckets = registry->nr_buckets * 2, i;
+
+	buckets = calloc(nr_buckets, sizeof(*buckets));
+	if (!buckets)
+		return;		/* Keep the current table. */
+	for (i = 0; i < registry->nr_buckets; i++) {
+		for (series = registry->buckets[i]; series; series = next) {
+			next = series->hash_next;
+			series->hash_next = buckets[series->hash & (nr_buckets - 1)];
+			buckets[series->hash & (nr_buckets - 1)] = series;
+		}
+	}
+	free(registry->buckets);
+	registry->buckets = buckets;
+	registry->nr_buckets = nr_buckets;
+}
+
+static struct metrics_series *metrics_series_alloc(struct rseq_metrics_registry *registry)
+{
+	size_t index = registry->nr_series % RSEQ_METRICS_CHUNK_SERIES;
+	struct metrics_chunk *chunk;
+
+	if (!index) {
+		if (registry->nr_chunks == registry->alloc_chunks) {
+			size_t alloc = registry->alloc_chunks ? 2 * registry->alloc_chunks : 16;
+			struct metrics_chunk **chunks;
+
+			chunks = realloc(registry->chunks, alloc * sizeof(*chunks));
+			if (!chunks)
+				return NULL;
+			registry->chunks = chunks;
+			registry->alloc_chunks = alloc;
+		}
+		chunk = calloc(1, sizeof(*chunk));
+		if (!chunk)
+			return NULL;
+		/* Rows are only backed by memory once a CPU touches them. */
+		chunk->rows_len = (size_t) registry->nr_cpus *
+			RSEQ_METRICS_CHUNK_SERIES * sizeof(intptr_t);
+		chunk->rows = mmap(NULL, chunk->rows_len, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (chunk->rows == MAP_FAILED) {
+			free(chunk);
+			return NULL;
+		}
+		registry->chunks[registry->nr_chunks++] = chunk;
+	}
+	chunk = registry->chunks[registry->nr_chunks - 1];
+	chunk->series[index].slots = &chunk->rows[index];
+	return &chunk->series[index];
+}
+
+/*
+ * Encode the name and sorted labels into @key, or compute the required
+ * length if @key is NULL.
+ */
+static size_t metrics_key_encode(char *key, const char *name,
+		const struct rseq_metrics_label *labels, size_t nr_labels)
+{
+	size_t len = 0, i;
+
+#define METRICS_KEY_APPEND(str)					\
+	do {							\
+		size_t _l = strlen(str) + 1;			\
+								\
+		if (key)					\
+			memcpy(key + len, str, _l);		\
+		len += _l;					\
+	} while (0)
+
+	METRICS_KEY_APPEND(name);
+	for (i = 0; i < nr_labels; i++) {
+		METRICS_KEY_APPEND(labels[i].key);
+		METRICS_KEY_APPEND(labels[i].value);
+	}
+#undef METRICS_KEY_APPEND
+	return len;
+}
+
+int rseq_metrics_counter_get(struct rseq_metrics_registry *registry,
+		const char *name, const struct rseq_metrics_label *labels,
+		size_t nr_labels, struct rseq_metrics_counter *counter)
+{
+	struct rseq_metrics_label *sorted = NULL, *series_labels = NULL;
+	struct metrics_series *series;
+	char *key = NULL, *p;
+	size_t key_len, i;
+	uint64_t hash;
+	int ret = -1;
+
+	if (!name) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (nr_labels) {
+		sorted = malloc(nr_labels * sizeof(*sorted));
+		if (!sorted)
+			return -1;
+		memcpy(sorted, labels, nr_labels * sizeof(*sorted));
+		for (i = 0; i < nr_labels; i++) {
+			if (!sorted[i].key || !sorted[i].value) {
+				errno = EINVAL;
+				goto end;
+			}
+		}
+		qsort(sorted, nr_labels, sizeof(*sorted), metrics_label_cmp);
+		for (i = 1; i < nr_labels; i++) {
+			if (!strcmp(sorted[i - 1].key, sorted[i].key)) {
+				errno = EINVAL;
+				goto end;
+			}
+		}
+	}
+	key_len = metrics_key_encode(NULL, name, sorted, nr_labels);
+	key = malloc(key_len);
+	if (!key)
+		goto end;
+	metrics_key_encode(key, name, sorted, nr_labels);
+	hash = metrics_hash(key, key_len);
+
+	if (pthread_mutex_lock(&registry->lock))
+		abort();
+	series = metrics_series_lookup(registry, key, key_len, hash);
+	if (series) {
+		counter->slots = series->slots;
+		ret = 0;
+		goto unlock;
+	}
+	if (nr_labels) {
+		series_labels = malloc(nr_labels * sizeof(*series_labels));
+		if (!series_labels)
+			goto unlock;
+	}
+	series = metrics_series_alloc(registry);
+	if (!series) {
+		free(series_labels);
+		goto unlock;
+	}
+	/* Labels of the series point into its key. */
+	p = key + strlen(key) + 1;
+	for (i = 0; i < nr_labels; i++) {
+		series_labels[i].key = p;
+		p += strlen(p) + 1;
+		series_labels[i].value = p;
+		p += strlen(p) + 1;
+	}
+	series->hash = hash;
+	series->key = key;
+	series->key_len = key_len;
+	series->labels = series_labels;
+	series->nr_labels = nr_labels;
+	series->hash_next = registry->buckets[hash & (registry->nr_buckets - 1)];
+	registry->buckets[hash & (registry->nr_buckets - 1)] = series;
+	key = NULL;	/* Owned by the series. */
+	if (++registry->nr_series > registry->nr_buckets)
+		metrics_hash_grow(registry);
+	counter->slots = series->slots;
+	ret = 0;
+unlock:
+	if (pthread_mutex_unlock(&registry->lock))
+		abort();
+end:
+	free(key);
+	free(sorted);
+	return ret;
+}
+
+int rseq_metrics_snapshot_take(struct rseq_metrics_registry *registry,
+		struct rseq_metrics_snapshot *snapshot)
+{
+	intptr_t sums[RSEQ_METRICS_CHUNK_SERIES];
+	size_t nr_series, prev_nr_samples, i, j;
+	int cpu, ret = -1;
+
+	if (pthread_mutex_lock(&registry->lock))
+		abort();
+	nr_series = registry->nr_series;
+	if (nr_series > snapshot->alloc_samples) {
+		struct rseq_metrics_sample *samples;
+
+		samples = realloc(snapshot->samples, nr_series * sizeof(*samples));
+		if (!samples)
+			goto unlock;
+		snapshot->samples = samples;
+		snapshot->alloc_samples = nr_series;
+	}
+	prev_nr_samples = snapshot->nr_samples;
+	for (i = 0; i < registry->nr_chunks; i++) {
+		struct metrics_chunk *chunk = registry->chunks[i];
+		size_t base = i * RSEQ_METRICS_CHUNK_SERIES;
+		size_t n = nr_series - base;
+
+		if (n > RSEQ_METRICS_CHUNK_SERIES)
+			n = RSEQ_METRICS_CHUNK_SERIES;
+		memset(sums, 0, n * sizeof(sums[0]));
+		for (cpu = 0; cpu < registry->nr_cpus; cpu++) {
+			const intptr_t *row = chunk->rows +
+				(size_t) cpu * RSEQ_METRICS_CHUNK_SERIES;
+
+			for (j = 0; j < n; j++)
+				sums[j] += RSEQ_READ_ONCE(row[j]);
+		}
+		for (j = 0; j < n; j++) {
+			struct rseq_metrics_sample *sample = &snapshot->samples[base + j];
+			struct metrics_series *series = &chunk->series[j];
+			intptr_t prev = base + j < prev_nr_samples ? sample->value : 0;
+
+			sample->name = series->key;
+			sample->labels = series->labels;
+			sample->nr_labels = series->nr_labels;
+			sample->value = sums[j];
+			sample->delta = sums[j] - prev;
+		}
+	}
+	snapshot->nr_samples = nr_series;
+	ret = 0;
+unlock:
+	if (pthread_mutex_unlock(&registry->lock))
+		abort();
+	return ret;
+}
+
+void rseq_metrics_snapshot_fini(struct rseq_metrics_snapshot *snapshot)
+{
+	free(snapshot->samples);
+	memset(snapshot, 0, sizeof(*snapshot));
+}
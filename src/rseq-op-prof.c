@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-op-prof.c
+ *
+ * Sampled latency instrumentation of rseq operations.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <rseq/op-prof.h>
+
+#include "rseq-cpu.h"
+
+/* Log-linear buckets with 8 sub-buckets per power of two. */
+#define OP_PROF_SUB_BITS	3
+#define OP_PROF_SUB_BUCKETS	(1U << OP_PROF_SUB_BITS)
+
+/* Histograms of a CPU, one row per site. */
+#define OP_PROF_ROW_LEN		(RSEQ_OP_PROF_MAX_SITES * RSEQ_OP_PROF_NR_BUCKETS)
+
+intptr_t *rseq_op_prof_countdowns;
+
+static struct {
+	pthread_mutex_t lock;
+	int nr_cpus;
+	intptr_t period;
+	/* Allocated by the first enable, and never freed. */
+	intptr_t *countdowns;
+	intptr_t *histograms;
+	const char *names[RSEQ_OP_PROF_MAX_SITES];
+	int nr_sites;
+} op_prof = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static unsigned int op_prof_bucket(uint64_t ticks)
+{
+	unsigned int order, bucket;
+
+	if (ticks < OP_PROF_SUB_BUCKETS)
+		return (unsigned int) ticks;
+	order = 63 - __builtin_clzll(ticks);
+	bucket = (order - OP_PROF_SUB_BITS + 1) * OP_PROF_SUB_BUCKETS +
+		(unsigned int) (ticks >> (order - OP_PROF_SUB_BITS)) - OP_PROF_SUB_BUCKETS;
+	if (bucket >= RSEQ_OP_PROF_NR_BUCKETS)
+		bucket = RSEQ_OP_PROF_NR_BUCKETS - 1;
+	return bucket;
+}
+
+uint64_t rseq_op_prof_bucket_floor(unsigned int bucket)
+{
+	unsigned int order;
+
+	if (bucket < OP_PROF_SUB_BUCKETS)
+		return bucket;
+	order = bucket / OP_PROF_SUB_BUCKETS + OP_PROF_SUB_BITS - 1;
+	return (uint64_t) (bucket % OP_PROF_SUB_BUCKETS + OP_PROF_SUB_BUCKETS) <<
+		(order - OP_PROF_SUB_BITS);
+}
+
+int rseq_op_prof_enable(unsigned int period)
+{
+	int ret = -1;
+
+	if (pthread_mutex_lock(&op_prof.lock))
+		abort();
+	if (!period) {
+		RSEQ_WRITE_ONCE(rseq_op_prof_countdowns, NULL);
+		ret = 0;
+		goto unlock;
+	}
+	if (!op_prof.countdowns) {
+		size_t len;
+
+		op_prof.nr_cpus = rseq_nr_possible_cpus();
+		/* Rows are only backed by memory once a CPU touches them. */
+		len = (size_t) op_prof.nr_cpus * RSEQ_OP_PROF_MAX_SITES * sizeof(intptr_t);
+		op_prof.countdowns = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (op_prof.countdowns == MAP_FAILED) {
+			op_prof.countdowns = NULL;
+			goto unlock;
+		}
+		len = (size_t) op_prof.nr_cpus * OP_PROF_ROW_LEN * sizeof(intptr_t);
+		op_prof.histograms = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (op_prof.histograms == MAP_FAILED) {
+			munmap(op_prof.countdowns, (size_t) op_prof.nr_cpus *
+			       RSEQ_OP_PROF_MAX_SITES * sizeof(intptr_t));
+			op_prof.countdowns = NULL;
+			op_prof.histograms = NULL;
+			goto unlock;
+		}
+	}
+	RSEQ_WRITE_ONCE(op_prof.period, (intptr_t) period);
+	rseq_smp_store_release(&rseq_op_prof_countdowns, op_prof.countdowns);
+	ret = 0;
+unlock:
+	if (pthread_mutex_unlock(&op_prof.lock))
+		abort();
+	return ret;
+}
+
+/* Give @site the id of the registered site of the same name, or a new one. */
+static int op_prof_register(struct rseq_op_prof_site *site)
+{
+	int id = -1, i;
+
+	if (pthread_mutex_lock(&op_prof.lock))
+		abort();
+	for (i = 0; i < op_prof.nr_sites; i++) {
+		if (!strcmp(op_prof.names[i], site->name)) {
+			id = i + 1;
+			break;
+		}
+	}
+	if (id < 0 && op_prof.nr_sites < RSEQ_OP_PROF_MAX_SITES) {
+		op_prof.names[op_prof.nr_sites++] = site->name;
+		id = op_prof.nr_sites;
+	}
+	RSEQ_WRITE_ONCE(site->id, id);
+	if (pthread_mutex_unlock(&op_prof.lock))
+		abort();
+	return id;
+}
+
+uint64_t rseq_op_prof_sample(struct rseq_op_prof_site *site, int cpu)
+{
+	int id = RSEQ_READ_ONCE(site->id);
+	uint64_t start;
+
+	if (!id) {
+		/* Sample the first operation of a site. */
+		id = op_prof_register(site);
+		if (id < 0)
+			return 0;
+	}
+	RSEQ_WRITE_ONCE(op_prof.countdowns[(size_t) cpu * RSEQ_OP_PROF_MAX_SITES + id - 1],
+			RSEQ_READ_ONCE(op_prof.period));
+	start = rseq_op_prof_ticks();
+	return start ? start : 1;
+}
+
+void rseq_op_prof_record(struct rseq_op_prof_site *site, uint64_t start)
+{
+	unsigned int bucket = op_prof_bucket(rseq_op_prof_ticks() - start);
+	size_t index = (size_t) (site->id - 1) * RSEQ_OP_PROF_NR_BUCKETS + bucket;
+	int cpu;
+
+	do {
+		cpu = rseq_cpu_start();
+	} while (rseq_unlikely(rseq_addv(&op_prof.histograms[(size_t) cpu *
+			OP_PROF_ROW_LEN + index], 1, cpu)));
+}
+
+int rseq_op_prof_snapshot_take(struct rseq_op_prof_snapshot *snapshot)
+{
+	size_t nr_sites, i, j;
+	int cpu, ret = -1;
+
+	if (pthread_mutex_lock(&op_prof.lock))
+		abort();
+	nr_sites = op_prof.nr_sites;
+	if (nr_sites > snapshot->alloc_sites) {
+		uint64_t (*buckets)[RSEQ_OP_PROF_NR_BUCKETS];
+		const char **names;
+
+		names = realloc(snapshot->names, nr_sites * sizeof(*names));
+		if (!names)
+			goto unlock;
+		snapshot->names = names;
+		buckets = realloc(snapshot->buckets, nr_sites * sizeof(*buckets));
+		if (!buckets)
+			goto unlock;
+		snapshot->buckets = buckets;
+		snapshot->alloc_sites = nr_sites;
+	}
+	for (i = 0; i < nr_sites; i++) {
+		snapshot->names[i] = op_prof.names[i];
+		memset(snapshot->buckets[i], 0, sizeof(snapshot->buckets[i]));
+		for (cpu = 0; cpu < op_prof.nr_cpus; cpu++) {
+			const intptr_t *row = op_prof.histograms + (size_t) cpu * OP_PROF_ROW_LEN +
+				i * RSEQ_OP_PROF_NR_BUCKETS;
+
+			for (j = 0; j < RSEQ_OP_PROF_NR_BUCKETS; j++)
+				snapshot->buckets[i][j] += (uint64_t) RSEQ_READ_ONCE(row[j]);
+		}
+	}
+	snapshot->nr_sites = nr_sites;
+	ret = 0;
+unlock:
+	if (pthread_mutex_unlock(&op_prof.lock))
+		abort();
+	return ret;
+}
+
+void rseq_op_prof_snapshot_fini(struct rseq_op_prof_snapshot *snapshot)
+{
+	free(snapshot->names);
+	free(snapshot->buckets);
+	memset(snapshot, 0, sizeof(*snapshot));
+}
@@ -0,0 +1,535 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-percpu-cache.c
+ *
+ * Per-CPU object caches.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <rseq/percpu-cache.h>
+
+#include "rseq-membarrier.h"
+
+/* Misses per tuning pass above which the batch size of a CPU doubles. */
+#define RSEQ_PERCPU_CACHE_TUNE_BATCH_MISSES	16
+
+/* Pop from the current CPU stack, without falling back to the depot. */
+static void *cache_trypop(struct rseq_percpu_cache *cache)
+{
+	struct rseq_percpu_cache_entry *entry;
+	intptr_t offset;
+	void *obj;
+	int cpu;
+
+	for (;;) {
+		cpu = rseq_cpu_start();
+		entry = &cache->c[cpu];
+		offset = RSEQ_READ_ONCE(entry->offset);
+		if (offset <= 0)
+			return NULL;
+		obj = RSEQ_READ_ONCE(entry->objects[offset - 1]);
+		if (!rseq_cmpeqv_cmpeqv_storev(&entry->offset, offset,
+				(intptr_t *) &entry->objects[offset - 1], (intptr_t) obj,
+				offset - 1, cpu))
+			return obj;
+	}
+}
+
+/* Push to the current CPU stack, without falling back to the depot. */
+static bool cache_trypush(struct rseq_percpu_cache *cache, void *obj)
+{
+	struct rseq_percpu_cache_entry *entry;
+	intptr_t offset;
+	int cpu;
+
+	for (;;) {
+		cpu = rseq_cpu_start();
+		entry = &cache->c[cpu];
+		offset = RSEQ_READ_ONCE(entry->offset);
+		if ((uintptr_t) offset >= (uintptr_t) rseq_smp_load_acquire(&entry->capacity))
+			return false;
+		if (!rseq_cmpeqv_trystorev_storev(&entry->offset, offset,
+				(intptr_t *) &entry->objects[offset], (intptr_t) obj,
+				offset + 1, cpu))
+			return true;
+	}
+}
+
+/* Allocate the stack of @entry on first use. Cache lock held. */
+static void cache_init_cpu(struct rseq_percpu_cache *cache,
+		struct rseq_percpu_cache_entry *entry)
+{
+	if (entry->objects)
+		return;
+	/* On failure, the CPU keeps using the depot. */
+	entry->objects = calloc(cache->max_capacity, sizeof(*entry->objects));
+	if (!entry->objects)
+		return;
+	entry->batch = cache->batch;
+	if (cache->budget && 2 * cache->batch < cache->max_capacity)
+		rseq_smp_store_release(&entry->capacity, (intptr_t) (2 * cache->batch));
+	else
+		rseq_smp_store_release(&entry->capacity, (intptr_t) cache->max_capacity);
+}
+
+/* Cache lock held. */
+static void cache_depot_push(struct rseq_percpu_cache *cache, void *obj)
+{
+	if (cache->depot_len == cache->depot_size) {
+		size_t size = cache->depot_size ? 2 * cache->depot_size : cache->batch;
+		void **depot;
+
+		depot = realloc(cache->depot, size * sizeof(*depot));
+		if (!depot) {
+			cache->ops.free(obj, cache->priv);
+			return;
+		}
+		cache->depot = depot;
+		cache->depot_size = size;
+	}
+	cache->depot[cache->depot_len++] = obj;
+}
+
+/* Cache lock held. */
+static void *cache_depot_pop(struct rseq_percpu_cache *cache)
+{
+	if (cache->depot_len)
+		return cache->depot[--cache->depot_len];
+	return cache->ops.alloc ? cache->ops.alloc(cache->priv) : NULL;
+}
+
+void *rseq_percpu_cache_pop_slow(struct rseq_percpu_cache *cache, int cpu)
+{
+	struct rseq_percpu_cache_entry *entry = &cache->c[cpu];
+	void *obj, *refill;
+	size_t i;
+
+	if (pthread_mutex_lock(&cache->lock))
+		abort();
+	entry->nr_misses++;
+	cache_init_cpu(cache, entry);
+	obj = cache_depot_pop(cache);
+	/* Refill the stack of the current CPU for the next pops. */
+	for (i = 1; obj && i < entry->batch; i++) {
+		refill = cache_depot_pop(cache);
+		if (!refill)
+			break;
+		if (!cache_trypush(cache, refill)) {
+			cache_depot_push(cache, refill);
+			break;
+		}
+	}
+	if (pthread_mutex_unlock(&cache->lock))
+		abort();
+	return obj;
+}
+
+void rseq_percpu_cache_push_slow(struct rseq_percpu_cache *cache, void *obj, int cpu)
+{
+	struct rseq_percpu_cache_entry *entry = &cache->c[cpu];
+	void *spill;
+	size_t i;
+
+	if (pthread_mutex_lock(&cache->lock))
+		abort();
+	entry->nr_misses++;
+	cache_init_cpu(cache, entry);
+	if (cache_trypush(cache, obj))
+		goto end;
+	cache_depot_push(cache, obj);
+	/* Make room in the stack of the current CPU for the next pushes. */
+	for (i = 1; i < entry->batch; i++) {
+		spill = cache_trypop(cache);
+		if (!spill)
+			break;
+		cache_depot_push(cache, spill);
+	}
+end:
+	if (pthread_mutex_unlock(&cache->lock))
+		abort();
+}
+
+static uint64_t cache_now_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		abort();
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Release the objects above floor[cpu] of the stacks of CPUs with a
+ * non-negative floor. Cache lock held.
+ */
+static int cache_drain(struct rseq_percpu_cache *cache, intptr_t *floor)
+{
+	intptr_t *count;
+	bool retry;
+	int cpu;
+
+	if (!rseq_membarrier_rseq_available()) {
+		errno = ENOSYS;
+		return -1;
+	}
+	count = malloc(CPU_SETSIZE * sizeof(*count));
+	if (!count)
+		return -1;
+	do {
+		bool locked = false;
+
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			struct rseq_percpu_cache_entry *entry = &cache->c[cpu];
+			intptr_t offset;
+
+			if (floor[cpu] < 0)
+				continue;
+			offset = RSEQ_READ_ONCE(entry->offset);
+			do {
+				if (offset <= floor[cpu]) {
+					floor[cpu] = -1;
+					break;
+				}
+			} while (!__atomic_compare_exchange_n(&entry->offset, &offset,
+					RSEQ_PERCPU_CACHE_LOCKED, false,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+			if (floor[cpu] < 0)
+				continue;
+			count[cpu] = offset;
+			locked = true;
+		}
+		if (!locked)
+			break;
+		/*
+		 * Abort critical sections which loaded the offset before it
+		 * was locked. A critical section which committed in the
+		 * meantime has overwritten the lock: retry for that CPU.
+		 */
+		if (rseq_sys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0))
+			abort();
+		retry = false;
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			struct rseq_percpu_cache_entry *entry = &cache->c[cpu];
+			intptr_t i;
+
+			if (floor[cpu] < 0)
+				continue;
+			if (RSEQ_READ_ONCE(entry->offset) != RSEQ_PERCPU_CACHE_LOCKED) {
+				retry = true;
+				continue;
+			}
+			for (i = floor[cpu]; i < count[cpu]; i++)
+				cache->ops.free(entry->objects[i], cache->priv);
+			rseq_smp_store_release(&entry->offset, floor[cpu]);
+			floor[cpu] = -1;
+		}
+	} while (retry);
+	free(count);
+	return 0;
+}
+
+int rseq_percpu_cache_trim(struct rseq_percpu_cache *cache, size_t floor)
+{
+	intptr_t *floors;
+	int cpu, ret;
+
+	floors = malloc(CPU_SETSIZE * sizeof(*floors));
+	if (!floors)
+		return -1;
+	if (pthread_mutex_lock(&cache->lock))
+		abort();
+	while (cache->depot_len)
+		cache->ops.free(cache->depot[--cache->depot_len], cache->priv);
+	free(cache->depot);
+	cache->depot = NULL;
+	cache->depot_size = 0;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		floors[cpu] = cache->c[cpu].objects ? (intptr_t) floor : -1;
+	ret = cache_drain(cache, floors);
+	if (pthread_mutex_unlock(&cache->lock))
+		abort();
+	free(floors);
+	return ret;
+}
+
+int rseq_percpu_cache_trim_idle(struct rseq_percpu_cache *cache,
+		unsigned int timeout_ms)
+{
+	uint64_t now = cache_now_ms();
+	intptr_t *floors;
+	int cpu, ret;
+
+	floors = malloc(CPU_SETSIZE * sizeof(*floors));
+	if (!floors)
+		return -1;
+	if (pthread_mutex_lock(&cache->lock))
+		abort();
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		struct rseq_percpu_cache_entry *entry = &cache->c[cpu];
+		intptr_t offset;
+		void *top;
+
+		floors[cpu] = -1;
+		if (!entry->objects)
+			continue;
+		offset = RSEQ_READ_ONCE(entry->offset);
+		top = offset > 0 ? RSEQ_READ_ONCE(entry->objects[offset - 1]) : NULL;
+		if (offset != entry->idle_offset || top != entry->idle_top ||
+				entry->nr_misses != entry->idle_misses) {
+			entry->idle_offset = offset;
+			entry->idle_top = top;
+			entry->idle_misses = entry->nr_misses;
+			entry->idle_since_ms = now;
+			continue;
+		}
+		if (offset > 0 && now - entry->idle_since_ms >= timeout_ms)
+			floors[cpu] = 0;
+	}
+	ret = cache_drain(cache, floors);
+	if (pthread_mutex_unlock(&cache->lock))
+		abort();
+	free(floors);
+	return ret;
+}
+
+void rseq_percpu_cache_set_tuning(struct rseq_percpu_cache *cache, size_t budget)
+{
+	if (pthread_mutex_lock(&cache->lock))
+		abort();
+	cache->budget = budget;
+	if (pthread_mutex_unlock(&cache->lock))
+		abort();
+}
+
+/* CPU with the most misses in @misses, or -1 if none missed. */
+static int cache_tune_hottest(const uint64_t *misses)
+{
+	uint64_t max = 0;
+	int cpu, hottest = -1;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (misses[cpu] > max) {
+			max = misses[cpu];
+			hottest = cpu;
+		}
+	}
+	return hottest;
+}
+
+/*
+ * CPU which did not miss for the most tuning passes among those with
+ * capacity to give, or -1 if there is none. Cache lock held.
+ */
+static int cache_tune_coldest(struct rseq_percpu_cache *cache)
+{
+	unsigned int max = 0;
+	int cpu, coldest = -1;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		struct rseq_percpu_cache_entry *entry = &cache->c[cpu];
+
+		if (!entry->objects || entry->capacity <= (intptr_t) cache->batch)
+			continue;
+		if (entry->tune_idle > max) {
+			max = entry->tune_idle;
+			coldest = cpu;
+		}
+	}
+	return coldest;
+}
+
+void rseq_percpu_cache_tune(struct rseq_percpu_cache *cache)
+{
+	intptr_t *floors = NULL;
+	uint64_t *misses = NULL;
+	size_t total = 0;
+	int cpu;
+
+	if (pthread_mutex_lock(&cache->lock))
+		abort();
+	if (!cache->budget)
+		goto end;
+	floors = malloc(CPU_SETSIZE * sizeof(*floors));
+	misses = malloc(CPU_SETSIZE * sizeof(*misses));
+	if (!floors || !misses)
+		goto end;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		struct rseq_percpu_cache_entry *entry = &cache->c[cpu];
+		intptr_t nr_retries;
+		uint64_t retries;
+
+		floors[cpu] = -1;
+		misses[cpu] = 0;
+		if (!entry->objects)
+			continue;
+		nr_retries = __atomic_load_n(&entry->nr_retries, __ATOMIC_RELAXED);
+		misses[cpu] = entry->nr_misses - entry->tune_misses;
+		retries = (uintptr_t) nr_retries - (uintptr_t) entry->tune_retries;
+		entry->tune_misses = entry->nr_misses;
+		entry->tune_retries = nr_retries;
+		entry->tune_idle = misses[cpu] ? 0 : entry->tune_idle + 1;
+		if (retries > misses[cpu]) {
+			if (entry->batch > 1)
+				entry->batch /= 2;
+		} else if (misses[cpu] >= RSEQ_PERCPU_CACHE_TUNE_BATCH_MISSES &&
+				entry->batch < (size_t) entry->capacity / 2) {
+			entry->batch *= 2;
+		}
+		total += (size_t) entry->capacity;
+	}
+	/* Grow the capacity of CPUs which missed, most misses first. */
+	while ((cpu = cache_tune_hottest(misses)) >= 0) {
+		struct rseq_percpu_cache_entry *entry = &cache->c[cpu];
+		size_t step = cache->max_capacity - (size_t) entry->capacity;
+		int donor;
+
+		misses[cpu] = 0;
+		if (step > entry->batch)
+			step = entry->batch;
+		while (total + step > cache->budget &&
+				(donor = cache_tune_coldest(cache)) >= 0) {
+			struct rseq_percpu_cache_entry *cold = &cache->c[donor];
+			size_t shrink = total + step - cache->budget;
+
+			if (shrink > (size_t) cold->capacity - cache->batch)
+				shrink = (size_t) cold->capacity - cache->batch;
+			rseq_smp_store_release(&cold->capacity, cold->capacity - (intptr_t) shrink);
+			floors[donor] = cold->capacity;
+			total -= shrink;
+		}
+		if (total + step > cache->budget)
+			step = cache->budget > total ? cache->budget - total : 0;
+		rseq_smp_store_release(&entry->capacity, entry->capacity + (intptr_t) step);
+		total += step;
+	}
+	/*
+	 * Release the objects above the capacity of the donors. Without
+	 * rseq membarrier, they stay cached until popped.
+	 */
+	(void) cache_drain(cache, floors);
+end:
+	if (pthread_mutex_unlock(&cache->lock))
+		abort();
+	free(floors);
+	free(misses);
+}
+
+static void cache_mempressure_cb(void *priv, enum rseq_mempressure_event event)
+{
+	struct rseq_percpu_cache *cache = priv;
+
+	switch (event) {
+	case RSEQ_MEMPRESSURE_PRESSURE:
+		(void) rseq_percpu_cache_trim(cache, cache->trim_floor);
+		break;
+	case RSEQ_MEMPRESSURE_TICK:
+		if (cache->idle_timeout_ms)
+			(void) rseq_percpu_cache_trim_idle(cache, cache->idle_timeout_ms);
+		rseq_percpu_cache_tune(cache);
+		break;
+	}
+}
+
+int rseq_percpu_cache_set_mempressure(struct rseq_percpu_cache *cache,
+		struct rseq_mempressure *monitor, size_t floor,
+		unsigned int idle_timeout_ms)
+{
+	if (cache->monitor) {
+		rseq_mempressure_unregister(cache->monitor, cache_mempressure_cb, cache);
+		cache->monitor = NULL;
+	}
+	if (!monitor)
+		return 0;
+	cache->trim_floor = floor;
+	cache->idle_timeout_ms = idle_timeout_ms;
+	if (rseq_mempressure_register(monitor, cache_mempressure_cb, cache))
+		return -1;
+	cache->monitor = monitor;
+	return 0;
+}
+
+size_t rseq_percpu_cache_nr_cached(struct rseq_percpu_cache *cache)
+{
+	size_t nr = 0;
+	int cpu;
+
+	if (pthread_mutex_lock(&cache->lock))
+		abort();
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		intptr_t offset = RSEQ_READ_ONCE(cache->c[cpu].offset);
+
+		if (offset > 0)
+			nr += offset;
+	}
+	nr += cache->depot_len;
+	if (pthread_mutex_unlock(&cache->lock))
+		abort();
+	return nr;
+}
+
+struct rseq_percpu_cache *rseq_percpu_cache_create(const struct rseq_percpu_cache_ops *ops,
+		void *priv, size_t capacity, size_t batch)
+{
+	struct rseq_percpu_cache *cache;
+	int ret;
+
+	if (!ops->free || !capacity || !batch || capacity > INTPTR_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	ret = posix_memalign((void **) &cache, __alignof__(*cache), sizeof(*cache));
+	if (ret) {
+		errno = ret;
+		return NULL;
+	}
+	memset(cache, 0, sizeof(*cache));
+	cache->ops = *ops;
+	cache->priv = priv;
+	cache->max_capacity = capacity;
+	cache->batch = batch;
+	ret = pthread_mutex_init(&cache->lock, NULL);
+	if (ret) {
+		free(cache);
+		errno = ret;
+		return NULL;
+	}
+	return cache;
+}
+
+void rseq_percpu_cache_destroy(struct rseq_percpu_cache *cache)
+{
+	int cpu;
+	intptr_t i;
+
+	(void) rseq_percpu_cache_set_mempressure(cache, NULL, 0, 0);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		struct rseq_percpu_cache_entry *entry = &cache->c[cpu];
+
+		for (i = 0; i < entry->offset; i++)
+			cache->ops.free(entry->objects[i], cache->priv);
+		free(entry->objects);
+	}
+	while (cache->depot_len)
+		cache->ops.free(cache->depot[--cache->depot_len], cache->priv);
+	free(cache->depot);
+	if (pthread_mutex_destroy(&cache->lock))
+		abort();
+	free(cache);
+}
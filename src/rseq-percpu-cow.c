@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-percpu-cow.c
+ *
+ * Per-CPU copy-on-write records.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rseq/percpu-cow.h>
+
+#include "rseq-membarrier.h"
+
+/* Number of busy-waiting attempts before sleeping between polls. */
+#define RSEQ_COW_GP_ACTIVE_ATTEMPTS	100
+#define RSEQ_COW_GP_WAIT_US		10
+
+static void cow_smp_mb_heavy(struct rseq_percpu_cow *cow)
+{
+	if (cow->reader_mb) {
+		rseq_smp_mb();
+		return;
+	}
+	if (rseq_sys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0))
+		abort();
+}
+
+struct rseq_percpu_cow *rseq_percpu_cow_create(void (*free_record)(void *record))
+{
+	struct rseq_percpu_cow *cow;
+	int ret;
+
+	ret = posix_memalign((void **) &cow, __alignof__(*cow), sizeof(*cow));
+	if (ret) {
+		errno = ret;
+		return NULL;
+	}
+	memset(cow, 0, sizeof(*cow));
+	/*
+	 * Use private expedited membarrier to order the memory accesses of
+	 * readers, if the kernel supports it. Otherwise, readers need to
+	 * issue memory barriers.
+	 */
+	cow->reader_mb = !rseq_membarrier_expedited_available();
+	cow->free_record = free_record ? free_record : free;
+	ret = pthread_mutex_init(&cow->gp_lock, NULL);
+	if (ret) {
+		free(cow);
+		errno = ret;
+		return NULL;
+	}
+	return cow;
+}
+
+void rseq_percpu_cow_destroy(struct rseq_percpu_cow *cow)
+{
+	int i;
+
+	if (!cow)
+		return;
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (cow->c[i].record)
+			cow->free_record(cow->c[i].record);
+	}
+	(void) pthread_mutex_destroy(&cow->gp_lock);
+	free(cow);
+}
+
+/*
+ * Unlocks are summed before locks, so the lock of every reader whose
+ * unlock is observed is also observed. Equal sums therefore mean that
+ * no reader which was using @phase before the first sum is still
+ * active.
+ */
+static bool cow_readers_active(struct rseq_percpu_cow *cow, int phase)
+{
+	uintptr_t nr_lock = 0, nr_unlock = 0;
+	int i;
+
+	for (i = 0; i < CPU_SETSIZE; i++)
+		nr_unlock += (uintptr_t) RSEQ_READ_ONCE(cow->c[i].unlock_count[phase]);
+	cow_smp_mb_heavy(cow);
+	for (i = 0; i < CPU_SETSIZE; i++)
+		nr_lock += (uintptr_t) RSEQ_READ_ONCE(cow->c[i].lock_count[phase]);
+	return nr_lock != nr_unlock;
+}
+
+static void cow_wait_for_readers(struct rseq_percpu_cow *cow, int phase)
+{
+	int attempts = 0;
+
+	while (cow_readers_active(cow, phase)) {
+		if (attempts < RSEQ_COW_GP_ACTIVE_ATTEMPTS) {
+			attempts++;
+			sched_yield();
+		} else {
+			(void) usleep(RSEQ_COW_GP_WAIT_US);
+		}
+	}
+}
+
+void rseq_percpu_cow_synchronize(struct rseq_percpu_cow *cow)
+{
+	unsigned long phase;
+
+	if (pthread_mutex_lock(&cow->gp_lock))
+		abort();
+	/* Order prior record publications before reading counters. */
+	cow_smp_mb_heavy(cow);
+	phase = cow->phase;
+	/*
+	 * Readers which loaded the phase before the previous flip may
+	 * still be incrementing the inactive counters: wait for them
+	 * before flipping again.
+	 */
+	cow_wait_for_readers(cow, (phase + 1) & 1);
+	RSEQ_WRITE_ONCE(cow->phase, phase + 1);
+	cow_smp_mb_heavy(cow);
+	cow_wait_for_readers(cow, phase & 1);
+	/* Order reader completion before the caller frees records. */
+	cow_smp_mb_heavy(cow);
+	if (pthread_mutex_unlock(&cow->gp_lock))
+		abort();
+}
+
+int rseq_percpu_cow_update(struct rseq_percpu_cow *cow, size_t size,
+		void (*update)(void *record, void *priv), void *priv)
+{
+	void *oldrec, *newrec;
+	int phase, cpu, ret;
+
+	newrec = malloc(size);
+	if (!newrec)
+		return -1;
+	for (;;) {
+		/*
+		 * Holding the read-side lock until the publication
+		 * prevents the old record from being freed and reused
+		 * meanwhile, which would allow an ABA on the pointer
+		 * comparison.
+		 */
+		phase = rseq_percpu_cow_read_lock(cow);
+		cpu = rseq_cpu_start();
+		oldrec = rseq_percpu_cow_deref(cow, cpu);
+		if (oldrec)
+			memcpy(newrec, oldrec, size);
+		else
+			memset(newrec, 0, size);
+		update(newrec, priv);
+		ret = rseq_percpu_cow_publish(cow, oldrec, newrec, cpu);
+		rseq_percpu_cow_read_unlock(cow, phase);
+		if (rseq_likely(!ret))
+			break;
+		/* Retry if comparison fails or rseq aborts. */
+	}
+	if (oldrec) {
+		rseq_percpu_cow_synchronize(cow);
+		cow->free_record(oldrec);
+	}
+	return 0;
+}
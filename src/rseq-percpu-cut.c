@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-percpu-cut.c
+ *
+ * Consistent snapshots (cuts) of a set of per-CPU counters.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/percpu-cut.h>
+
+#include "rseq-membarrier.h"
+
+int rseq_percpu_cut_init(struct rseq_percpu_cut *cut)
+{
+	int ret;
+
+	if (!rseq_membarrier_rseq_available()) {
+		errno = ENOSYS;
+		return -1;
+	}
+	memset(cut, 0, sizeof(*cut));
+	ret = pthread_mutex_init(&cut->lock, NULL);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+void rseq_percpu_cut_destroy(struct rseq_percpu_cut *cut)
+{
+	if (pthread_mutex_destroy(&cut->lock))
+		abort();
+}
+
+struct rseq_percpu_cut_counter *rseq_percpu_cut_counter_create(void)
+{
+	struct rseq_percpu_cut_counter *counter;
+	int ret;
+
+	ret = posix_memalign((void **) &counter, __alignof__(*counter), sizeof(*counter));
+	if (ret) {
+		errno = ret;
+		return NULL;
+	}
+	memset(counter, 0, sizeof(*counter));
+	return counter;
+}
+
+void rseq_percpu_cut_counter_destroy(struct rseq_percpu_cut_counter *counter)
+{
+	free(counter);
+}
+
+static intptr_t cut_counter_sum(struct rseq_percpu_cut_counter *counter, int half)
+{
+	intptr_t sum = 0;
+	int i;
+
+	for (i = 0; i < CPU_SETSIZE; i++)
+		sum += RSEQ_READ_ONCE(counter->c[i].count[half]);
+	return sum;
+}
+
+void rseq_percpu_cut_snapshot(struct rseq_percpu_cut *cut,
+		struct rseq_percpu_cut_counter *const *counters, size_t nr_counters,
+		intptr_t *values)
+{
+	intptr_t epoch;
+	size_t i;
+
+	if (pthread_mutex_lock(&cut->lock))
+		abort();
+	epoch = cut->epoch;
+	/*
+	 * Halves of the previous epoch have not been updated since the
+	 * membarrier which ended it.
+	 */
+	for (i = 0; i < nr_counters; i++)
+		values[i] = cut_counter_sum(counters[i], (epoch + 1) & 1);
+	RSEQ_WRITE_ONCE(cut->epoch, epoch + 1);
+	/*
+	 * The cut happens here. Critical sections which loaded the old
+	 * epoch either committed, and are visible once membarrier
+	 * returns, or are aborted and restart with the new epoch.
+	 */
+	if (rseq_sys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0))
+		abort();
+	for (i = 0; i < nr_counters; i++)
+		values[i] += cut_counter_sum(counters[i], epoch & 1);
+	if (pthread_mutex_unlock(&cut->lock))
+		abort();
+}
@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-percpu-seq.c
+ *
+ * Per-CPU records with a sequence counter.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <rseq/rseq.h>
+#include <rseq/percpu-seq.h>
+
+#include "rseq-cpu.h"
+
+/* Records of distinct CPUs never share a cache line. */
+#define PERCPU_SEQ_ALIGN	128
+
+/*
+ * Each CPU holds its sequence counter, followed by two copies of its
+ * record. The copy selected by the parity of the sequence counter is
+ * the current one.
+ */
+struct percpu_seq_cpu {
+	intptr_t seq;
+	char copies[];
+};
+
+struct rseq_percpu_seq {
+	int nr_cpus;
+	size_t len;
+	/* Size of a copy, rounded up to a word. */
+	size_t copy_len;
+	size_t stride;
+	char *cpus;
+	size_t cpus_len;
+};
+
+static struct percpu_seq_cpu *percpu_seq_cpu(struct rseq_percpu_seq *ps, int cpu)
+{
+	return (struct percpu_seq_cpu *) (ps->cpus + (size_t) cpu * ps->stride);
+}
+
+static void *percpu_seq_copy(struct rseq_percpu_seq *ps, struct percpu_seq_cpu *c,
+		intptr_t seq)
+{
+	return c->copies + (seq & 1) * ps->copy_len;
+}
+
+struct rseq_percpu_seq *rseq_percpu_seq_create(size_t len)
+{
+	struct rseq_percpu_seq *ps;
+
+	if (!len || len > RSEQ_PERCPU_SEQ_MAX_LEN) {
+		errno = EINVAL;
+		return NULL;
+	}
+	ps = calloc(1, sizeof(*ps));
+	if (!ps)
+		return NULL;
+	ps->nr_cpus = rseq_nr_possible_cpus();
+	ps->len = len;
+	ps->copy_len = (len + sizeof(intptr_t) - 1) & ~(sizeof(intptr_t) - 1);
+	ps->stride = (sizeof(struct percpu_seq_cpu) + 2 * ps->copy_len +
+		      PERCPU_SEQ_ALIGN - 1) & ~((size_t) PERCPU_SEQ_ALIGN - 1);
+	/* Records are only backed by memory once a CPU touches them. */
+	ps->cpus_len = (size_t) ps->nr_cpus * ps->stride;
+	ps->cpus = mmap(NULL, ps->cpus_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ps->cpus == MAP_FAILED) {
+		free(ps);
+		return NULL;
+	}
+	return ps;
+}
+
+void rseq_percpu_seq_destroy(struct rseq_percpu_seq *ps)
+{
+	if (!ps)
+		return;
+	munmap(ps->cpus, ps->cpus_len);
+	free(ps);
+}
+
+int rseq_percpu_seq_nr_cpus(struct rseq_percpu_seq *ps)
+{
+	return ps->nr_cpus;
+}
+
+void rseq_percpu_seq_update(struct rseq_percpu_seq *ps,
+		void (*update)(void *data, void *priv), void *priv)
+{
+	intptr_t buf[RSEQ_PERCPU_SEQ_MAX_LEN / sizeof(intptr_t)];
+
+	for (;;) {
+		struct percpu_seq_cpu *c;
+		intptr_t seq;
+		int cpu;
+
+		cpu = rseq_cpu_start();
+		c = percpu_seq_cpu(ps, cpu);
+		seq = RSEQ_READ_ONCE(c->seq);
+		/*
+		 * Only threads running on @cpu write its copies, and the
+		 * current copy is not written before the sequence counter
+		 * moves past it, which fails the commit below.
+		 */
+		memcpy(buf, percpu_seq_copy(ps, c, seq), ps->len);
+		update(buf, priv);
+		/* Order the previous commit before writing the other copy. */
+		rseq_smp_wmb();
+		if (rseq_likely(!rseq_cmpeqv_trymemcpy_storev_release(&c->seq, seq,
+				percpu_seq_copy(ps, c, seq + 1), buf, ps->len,
+				seq + 1, cpu)))
+			return;
+		/* Retry if comparison fails or rseq aborts. */
+	}
+}
+
+void rseq_percpu_seq_read(struct rseq_percpu_seq *ps, int cpu, void *data)
+{
+	struct percpu_seq_cpu *c = percpu_seq_cpu(ps, cpu);
+	intptr_t seq;
+
+	do {
+		seq = rseq_smp_load_acquire(&c->seq);
+		memcpy(data, percpu_seq_copy(ps, c, seq), ps->len);
+		rseq_smp_rmb();
+	} while (RSEQ_READ_ONCE(c->seq) != seq);
+}
@@ -0,0 +1,281 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-rcu.c
+ *
+ * Read-copy-update with per-CPU reader counters.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rseq/rcu.h>
+
+#include "rseq-cpu.h"
+#include "rseq-membarrier.h"
+
+/* Number of busy-waiting attempts before sleeping between polls. */
+#define RCU_GP_ACTIVE_ATTEMPTS	100
+#define RCU_GP_WAIT_US		10
+
+static void rcu_smp_mb_heavy(struct rseq_rcu *rcu)
+{
+	if (rcu->reader_mb) {
+		rseq_smp_mb();
+		return;
+	}
+	if (rseq_sys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0))
+		abort();
+}
+
+/*
+ * Unlocks are summed before locks, so the lock of every reader whose
+ * unlock is observed is also observed. Equal sums therefore mean that
+ * no reader which was using @phase before the first sum is still
+ * active.
+ */
+static bool rcu_readers_active(struct rseq_rcu *rcu, int phase)
+{
+	uintptr_t nr_lock = 0, nr_unlock = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < rcu->nr_cpus; cpu++)
+		nr_unlock += (uintptr_t) RSEQ_READ_ONCE(rcu->c[cpu].unlock_count[phase]);
+	rcu_smp_mb_heavy(rcu);
+	for (cpu = 0; cpu < rcu->nr_cpus; cpu++)
+		nr_lock += (uintptr_t) RSEQ_READ_ONCE(rcu->c[cpu].lock_count[phase]);
+	return nr_lock != nr_unlock;
+}
+
+static void rcu_wait_for_readers(struct rseq_rcu *rcu, int phase)
+{
+	int attempts = 0;
+
+	while (rcu_readers_active(rcu, phase)) {
+		if (attempts < RCU_GP_ACTIVE_ATTEMPTS) {
+			attempts++;
+			sched_yield();
+		} else {
+			(void) usleep(RCU_GP_WAIT_US);
+		}
+	}
+}
+
+/* Only run by the helper thread. */
+static void rcu_grace_period(struct rseq_rcu *rcu)
+{
+	unsigned long phase = rcu->phase;
+
+	/* Order prior updates before reading counters. */
+	rcu_smp_mb_heavy(rcu);
+	/*
+	 * Readers which loaded the phase before the previous flip may
+	 * still be incrementing the inactive counters: wait for them
+	 * before flipping again.
+	 */
+	rcu_wait_for_readers(rcu, (phase + 1) & 1);
+	RSEQ_WRITE_ONCE(rcu->phase, phase + 1);
+	rcu_smp_mb_heavy(rcu);
+	rcu_wait_for_readers(rcu, phase & 1);
+	/* Order reader completion before callbacks. */
+	rcu_smp_mb_heavy(rcu);
+}
+
+/*
+ * Take every queued callback, wait for a grace period, and invoke them,
+ * until the domain is stopped with an empty queue.
+ */
+static void *rcu_helper(void *arg)
+{
+	struct rseq_rcu *rcu = arg;
+
+	if (pthread_mutex_lock(&rcu->lock))
+		abort();
+	for (;;) {
+		struct rseq_rcu_head *head, *next;
+		uint64_t nr = 0;
+
+		while (!rcu->head && !rcu->stop)
+			pthread_cond_wait(&rcu->cond, &rcu->lock);
+		if (!rcu->head)
+			break;
+		head = rcu->head;
+		rcu->head = NULL;
+		rcu->tail = &rcu->head;
+		if (pthread_mutex_unlock(&rcu->lock))
+			abort();
+
+		rcu_grace_period(rcu);
+		for (; head; head = next) {
+			next = head->next;
+			head->func(head);
+			nr++;
+		}
+
+		if (pthread_mutex_lock(&rcu->lock))
+			abort();
+		rcu->nr_invoked += nr;
+		rcu->nr_grace_periods++;
+		pthread_cond_broadcast(&rcu->cond);
+	}
+	if (pthread_mutex_unlock(&rcu->lock))
+		abort();
+	return NULL;
+}
+
+struct rseq_rcu *rseq_rcu_create(void)
+{
+	struct rseq_rcu *rcu;
+	int ret;
+
+	rcu = calloc(1, sizeof(*rcu));
+	if (!rcu)
+		return NULL;
+	rcu->nr_cpus = rseq_nr_possible_cpus();
+	ret = posix_memalign((void **) &rcu->c, __alignof__(*rcu->c),
+			     rcu->nr_cpus * sizeof(*rcu->c));
+	if (ret) {
+		free(rcu);
+		errno = ret;
+		return NULL;
+	}
+	memset(rcu->c, 0, rcu->nr_cpus * sizeof(*rcu->c));
+	/*
+	 * Use private expedited membarrier to order the memory accesses of
+	 * readers, if the kernel supports it. Otherwise, readers need to
+	 * issue memory barriers.
+	 */
+	rcu->reader_mb = !rseq_membarrier_expedited_available();
+	rcu->tail = &rcu->head;
+	ret = pthread_mutex_init(&rcu->lock, NULL);
+	if (ret)
+		goto error;
+	ret = pthread_cond_init(&rcu->cond, NULL);
+	if (ret) {
+		pthread_mutex_destroy(&rcu->lock);
+		goto error;
+	}
+	ret = pthread_create(&rcu->helper, NULL, rcu_helper, rcu);
+	if (ret) {
+		pthread_cond_destroy(&rcu->cond);
+		pthread_mutex_destroy(&rcu->lock);
+		goto error;
+	}
+	return rcu;
+
+error:
+	free(rcu->c);
+	free(rcu);
+	errno = ret;
+	return NULL;
+}
+
+void rseq_rcu_destroy(struct rseq_rcu *rcu)
+{
+	if (!rcu)
+		return;
+	if (pthread_mutex_lock(&rcu->lock))
+		abort();
+	rcu->stop = true;
+	pthread_cond_broadcast(&rcu->cond);
+	if (pthread_mutex_unlock(&rcu->lock))
+		abort();
+	if (pthread_join(rcu->helper, NULL))
+		abort();
+	(void) pthread_cond_destroy(&rcu->cond);
+	(void) pthread_mutex_destroy(&rcu->lock);
+	free(rcu->c);
+	free(rcu);
+}
+
+/* Queue @head, and return its position in queuing order. */
+static uint64_t rcu_enqueue(struct rseq_rcu *rcu, struct rseq_rcu_head *head,
+		void (*func)(struct rseq_rcu_head *head))
+{
+	uint64_t ticket;
+
+	head->next = NULL;
+	head->func = func;
+	if (pthread_mutex_lock(&rcu->lock))
+		abort();
+	*rcu->tail = head;
+	rcu->tail = &head->next;
+	ticket = ++rcu->nr_queued;
+	/* The helper thread and barrier waiters share the condition. */
+	pthread_cond_broadcast(&rcu->cond);
+	if (pthread_mutex_unlock(&rcu->lock))
+		abort();
+	return ticket;
+}
+
+/* Wait until the first @ticket callbacks have been invoked. */
+static void rcu_wait_invoked(struct rseq_rcu *rcu, uint64_t ticket)
+{
+	if (pthread_mutex_lock(&rcu->lock))
+		abort();
+	while (rcu->nr_invoked < ticket)
+		pthread_cond_wait(&rcu->cond, &rcu->lock);
+	if (pthread_mutex_unlock(&rcu->lock))
+		abort();
+}
+
+void rseq_rcu_call(struct rseq_rcu *rcu, struct rseq_rcu_head *head,
+		void (*func)(struct rseq_rcu_head *head))
+{
+	(void) rcu_enqueue(rcu, head, func);
+}
+
+static void rcu_synchronize_cb(struct rseq_rcu_head *head)
+{
+	(void) head;
+}
+
+void rseq_rcu_synchronize(struct rseq_rcu *rcu)
+{
+	struct rseq_rcu_head head;
+
+	/*
+	 * Callbacks are invoked in order once their grace period is over,
+	 * so waiting for an empty callback waits for a full grace period
+	 * shared with the other callbacks of its batch.
+	 */
+	rcu_wait_invoked(rcu, rcu_enqueue(rcu, &head, rcu_synchronize_cb));
+}
+
+void rseq_rcu_barrier(struct rseq_rcu *rcu)
+{
+	uint64_t ticket;
+
+	if (pthread_mutex_lock(&rcu->lock))
+		abort();
+	ticket = rcu->nr_queued;
+	if (pthread_mutex_unlock(&rcu->lock))
+		abort();
+	rcu_wait_invoked(rcu, ticket);
+}
+
+uint64_t rseq_rcu_nr_grace_periods(struct rseq_rcu *rcu)
+{
+	uint64_t nr;
+
+	if (pthread_mutex_lock(&rcu->lock))
+		abort();
+	nr = rcu->nr_grace_periods;
+	if (pthread_mutex_unlock(&rcu->lock))
+		abort();
+	return nr;
+}
@@ -0,0 +1,323 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-slotmap.c
+ *
+ * Generation-tagged slot map with per-CPU free lists.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/slotmap.h>
+
+#include "rseq-cpu.h"
+
+/*
+ * The generation of a slot is odd while it holds a value, and even
+ * while it is free. Generations start at 0, so handles are never 0.
+ */
+struct slotmap_slot {
+	struct slotmap_slot *next;
+	void *value;
+	uint32_t generation;
+	uint32_t index;
+	int home;
+};
+
+struct slotmap_cpu {
+	/* Free slots, popped and pushed by the CPU with rseq. */
+	struct slotmap_slot *head;
+	/* Free slots pushed by other CPUs. */
+	struct slotmap_slot *inbox __attribute__((aligned(128)));
+} __attribute__((aligned(128)));
+
+struct rseq_slotmap {
+	int nr_cpus;
+	unsigned int chunk_order;
+	size_t max_chunks;
+	struct slotmap_cpu *cpus;
+	struct slotmap_slot **chunks;
+	/* Serializes growth. */
+	pthread_mutex_t lock;
+	size_t nr_chunks;
+};
+
+struct rseq_slotmap *rseq_slotmap_create(size_t chunk_slots, size_t max_slots)
+{
+	struct rseq_slotmap *map;
+	int cpu, ret;
+
+	if (!chunk_slots || (chunk_slots & (chunk_slots - 1)) ||
+			max_slots < chunk_slots || max_slots > UINT32_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return NULL;
+	map->nr_cpus = rseq_nr_possible_cpus();
+	while (((size_t) 1 << map->chunk_order) < chunk_slots)
+		map->chunk_order++;
+	map->max_chunks = max_slots >> map->chunk_order;
+	map->chunks = calloc(map->max_chunks, sizeof(*map->chunks));
+	if (!map->chunks)
+		goto error;
+	ret = posix_memalign((void **) &map->cpus, __alignof__(*map->cpus),
+			     map->nr_cpus * sizeof(*map->cpus));
+	if (ret) {
+		map->cpus = NULL;
+		errno = ret;
+		goto error;
+	}
+	for (cpu = 0; cpu < map->nr_cpus; cpu++)
+		memset(&map->cpus[cpu], 0, sizeof(map->cpus[cpu]));
+	ret = pthread_mutex_init(&map->lock, NULL);
+	if (ret) {
+		errno = ret;
+		goto error;
+	}
+	return map;
+
+error:
+	free(map->cpus);
+	free(map->chunks);
+	free(map);
+	return NULL;
+}
+
+void rseq_slotmap_destroy(struct rseq_slotmap *map)
+{
+	size_t i;
+
+	if (!map)
+		return;
+	(void) pthread_mutex_destroy(&map->lock);
+	for (i = 0; i < map->nr_chunks; i++)
+		free(map->chunks[i]);
+	free(map->cpus);
+	free(map->chunks);
+	free(map);
+}
+
+static struct slotmap_slot *slotmap_slot(struct rseq_slotmap *map,
+		uint32_t index)
+{
+	size_t chunk = index >> map->chunk_order;
+	struct slotmap_slot *slots;
+
+	if (chunk >= map->max_chunks)
+		return NULL;
+	slots = rseq_smp_load_acquire(&map->chunks[chunk]);
+	if (!slots)
+		return NULL;
+	return &slots[index & (((size_t) 1 << map->chunk_order) - 1)];
+}
+
+/* Push the chain of slots from @first to @last on the inbox of @cpu. */
+static void slotmap_inbox_push(struct rseq_slotmap *map, int cpu,
+		struct slotmap_slot *first, struct slotmap_slot *last)
+{
+	struct slotmap_cpu *c = &map->cpus[cpu];
+	struct slotmap_slot *head;
+
+	head = __atomic_load_n(&c->inbox, __ATOMIC_RELAXED);
+	do {
+		last->next = head;
+	} while (!__atomic_compare_exchange_n(&c->inbox, &head, first, false,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Push the chain of slots from @first to @last on the stack of @cpu if
+ * running on it, or on its inbox otherwise.
+ */
+static void slotmap_push(struct rseq_slotmap *map, int cpu,
+		struct slotmap_slot *first, struct slotmap_slot *last)
+{
+	for (;;) {
+		struct slotmap_cpu *c = &map->cpus[cpu];
+		struct slotmap_slot *head;
+
+		if ((int) rseq_cpu_start() != cpu) {
+			slotmap_inbox_push(map, cpu, first, last);
+			return;
+		}
+		head = RSEQ_READ_ONCE(c->head);
+		last->next = head;
+		if (rseq_likely(!rseq_cmpeqv_storev((intptr_t *) &c->head,
+				(intptr_t) head, (intptr_t) first, cpu)))
+			return;
+		/* Retry if comparison fails or rseq aborts. */
+	}
+}
+
+/*
+ * Take a slot from @chain, and push the rest of the chain on the stack
+ * of @cpu, which becomes the home of its slots.
+ */
+static struct slotmap_slot *slotmap_adopt(struct rseq_slotmap *map, int cpu,
+		struct slotmap_slot *chain)
+{
+	struct slotmap_slot *last;
+
+	for (last = chain; ; last = last->next) {
+		last->home = cpu;
+		if (!last->next)
+			break;
+	}
+	if (chain->next)
+		slotmap_push(map, cpu, chain->next, last);
+	return chain;
+}
+
+/* Append a chunk, and hand its slots to @cpu. */
+static struct slotmap_slot *slotmap_grow(struct rseq_slotmap *map, int cpu)
+{
+	size_t chunk_slots = (size_t) 1 << map->chunk_order, i;
+	struct slotmap_slot *slots = NULL;
+
+	if (pthread_mutex_lock(&map->lock))
+		abort();
+	if (map->nr_chunks == map->max_chunks) {
+		errno = ENOSPC;
+		goto unlock;
+	}
+	slots = calloc(chunk_slots, sizeof(*slots));
+	if (!slots)
+		goto unlock;
+	for (i = 0; i < chunk_slots; i++) {
+		slots[i].index = (uint32_t) ((map->nr_chunks << map->chunk_order) + i);
+		slots[i].next = i + 1 < chunk_slots ? &slots[i + 1] : NULL;
+	}
+	rseq_smp_store_release(&map->chunks[map->nr_chunks], slots);
+	map->nr_chunks++;
+unlock:
+	if (pthread_mutex_unlock(&map->lock))
+		abort();
+	if (!slots)
+		return NULL;
+	return slotmap_adopt(map, cpu, slots);
+}
+
+static struct slotmap_slot *slotmap_alloc(struct rseq_slotmap *map)
+{
+	struct slotmap_slot *chain;
+	int cpu, i;
+
+	for (;;) {
+		struct slotmap_cpu *c;
+		intptr_t slot;
+		int ret;
+
+		cpu = rseq_cpu_start();
+		c = &map->cpus[cpu];
+		ret = rseq_cmpnev_storeoffp_load((intptr_t *) &c->head, 0,
+				offsetof(struct slotmap_slot, next), &slot, cpu);
+		if (rseq_likely(!ret))
+			return (struct slotmap_slot *) slot;
+		if (ret > 0)
+			break;
+		/* Retry if rseq aborts. */
+	}
+	chain = __atomic_exchange_n(&map->cpus[cpu].inbox, NULL, __ATOMIC_ACQUIRE);
+	if (chain)
+		return slotmap_adopt(map, cpu, chain);
+	for (i = 1; i < map->nr_cpus; i++) {
+		int victim = (cpu + i) % map->nr_cpus;
+
+		if (!__atomic_load_n(&map->cpus[victim].inbox, __ATOMIC_RELAXED))
+			continue;
+		chain = __atomic_exchange_n(&map->cpus[victim].inbox, NULL,
+					    __ATOMIC_ACQUIRE);
+		if (chain)
+			return slotmap_adopt(map, cpu, chain);
+	}
+	return slotmap_grow(map, cpu);
+}
+
+int rseq_slotmap_insert(struct rseq_slotmap *map, void *value,
+		uint64_t *handle)
+{
+	struct slotmap_slot *slot;
+	uint32_t generation;
+
+	slot = slotmap_alloc(map);
+	if (!slot)
+		return -1;
+	generation = slot->generation + 1;
+	RSEQ_WRITE_ONCE(slot->value, value);
+	/* Publish the value with the generation. */
+	rseq_smp_store_release(&slot->generation, generation);
+	*handle = ((uint64_t) generation << 32) | slot->index;
+	return 0;
+}
+
+void *rseq_slotmap_get(struct rseq_slotmap *map, uint64_t handle)
+{
+	uint32_t generation = rseq_slotmap_handle_generation(handle);
+	struct slotmap_slot *slot;
+	void *value;
+
+	slot = slotmap_slot(map, rseq_slotmap_handle_index(handle));
+	if (!slot || !(generation & 1))
+		return NULL;
+	if (rseq_smp_load_acquire(&slot->generation) != generation)
+		return NULL;
+	value = RSEQ_READ_ONCE(slot->value);
+	/* The slot may have been removed and reused meanwhile. */
+	rseq_smp_rmb();
+	if (RSEQ_READ_ONCE(slot->generation) != generation)
+		return NULL;
+	return value;
+}
+
+int rseq_slotmap_remove(struct rseq_slotmap *map, uint64_t handle,
+		void **value)
+{
+	uint32_t generation = rseq_slotmap_handle_generation(handle);
+	struct slotmap_slot *slot;
+
+	slot = slotmap_slot(map, rseq_slotmap_handle_index(handle));
+	/* Only one of concurrent removals of a handle succeeds. */
+	if (!slot || !(generation & 1) ||
+			!__atomic_compare_exchange_n(&slot->generation, &generation,
+				generation + 1, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (value)
+		*value = RSEQ_READ_ONCE(slot->value);
+	RSEQ_WRITE_ONCE(slot->value, NULL);
+	slotmap_push(map, slot->home, slot, slot);
+	return 0;
+}
+
+size_t rseq_slotmap_nr_slots(struct rseq_slotmap *map)
+{
+	size_t nr_chunks;
+
+	if (pthread_mutex_lock(&map->lock))
+		abort();
+	nr_chunks = map->nr_chunks;
+	if (pthread_mutex_unlock(&map->lock))
+		abort();
+	return nr_chunks << map->chunk_order;
+}
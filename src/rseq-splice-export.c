@@ -0,0 +1,260 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-splice-export.c
+ *
+ * Zero-copy export of completed buffers with vmsplice(2) and splice(2).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <linux/sockios.h>
+
+#include <rseq/splice-export.h>
+
+/* Bounce buffer used to drain the pipe into destinations without splice. */
+#define EXPORT_DRAIN_LEN	4096
+
+struct rseq_splice_export {
+	int fd;
+	int pipe[2];
+	/* The destination keeps spliced pages until SIOCOUTQ drops. */
+	bool stream;
+	/* The destination does not support splice(2). */
+	bool copy;
+
+	/* Serializes submissions. */
+	pthread_mutex_t lock;
+	/* Bytes which left the pipe or were written. */
+	uint64_t submitted;
+	uint64_t nr_copied;
+};
+
+struct rseq_splice_export *rseq_splice_export_create(int fd, size_t pipe_size)
+{
+	struct rseq_splice_export *exp;
+	struct stat st;
+	int ret;
+
+	if (fstat(fd, &st))
+		return NULL;
+	if (pipe_size > INT32_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	exp = calloc(1, sizeof(*exp));
+	if (!exp)
+		return NULL;
+	exp->fd = fd;
+	if (S_ISSOCK(st.st_mode)) {
+		socklen_t optlen = sizeof(ret);
+
+		if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &ret, &optlen))
+			goto error;
+		exp->stream = ret == SOCK_STREAM;
+	}
+	if (pipe2(exp->pipe, O_CLOEXEC))
+		goto error;
+	/* Pipes beyond /proc/sys/fs/pipe-max-size keep their default size. */
+	if (pipe_size && fcntl(exp->pipe[1], F_SETPIPE_SZ, (int) pipe_size) < 0 &&
+			errno != EPERM)
+		goto error_pipe;
+	ret = pthread_mutex_init(&exp->lock, NULL);
+	if (ret) {
+		errno = ret;
+		goto error_pipe;
+	}
+	return exp;
+
+error_pipe:
+	ret = errno;
+	close(exp->pipe[0]);
+	close(exp->pipe[1]);
+	errno = ret;
+error:
+	free(exp);
+	return NULL;
+}
+
+void rseq_splice_export_destroy(struct rseq_splice_export *exp)
+{
+	if (!exp)
+		return;
+	(void) pthread_mutex_destroy(&exp->lock);
+	close(exp->pipe[0]);
+	close(exp->pipe[1]);
+	free(exp);
+}
+
+/* Wait until a non-blocking destination can be written again. */
+static int export_wait_writable(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		return -1;
+	return 0;
+}
+
+static int export_write_all(struct rseq_splice_export *exp, const char *buf,
+		size_t len)
+{
+	while (len) {
+		ssize_t ret = write(exp->fd, buf, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && !export_wait_writable(exp->fd))
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+		__atomic_add_fetch(&exp->submitted, ret, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&exp->nr_copied, ret, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+/*
+ * Copy the @len bytes left in the pipe to a destination which refused
+ * splice(2).
+ */
+static int export_drain_copy(struct rseq_splice_export *exp, size_t len)
+{
+	char buf[EXPORT_DRAIN_LEN];
+
+	while (len) {
+		ssize_t ret = read(exp->pipe[0], buf,
+				   len < sizeof(buf) ? len : sizeof(buf));
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (export_write_all(exp, buf, ret))
+			return -1;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Splice the @len bytes in the pipe to the destination. */
+static int export_splice_out(struct rseq_splice_export *exp, size_t len)
+{
+	while (len) {
+		ssize_t ret = splice(exp->pipe[0], NULL, exp->fd, NULL, len,
+				     SPLICE_F_MOVE);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && !export_wait_writable(exp->fd))
+				continue;
+			if (errno == EINVAL) {
+				exp->copy = true;
+				return export_drain_copy(exp, len);
+			}
+			return -1;
+		}
+		len -= ret;
+		__atomic_add_fetch(&exp->submitted, ret, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+static int export_splice(struct rseq_splice_export *exp, const char *buf,
+		size_t len)
+{
+	while (len && !exp->copy) {
+		struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+		ssize_t ret;
+
+		/*
+		 * The pipe is empty here. Without SPLICE_F_NONBLOCK,
+		 * vmsplice() would wait for room in the pipe until the
+		 * whole buffer is mapped, while only we drain it.
+		 */
+		ret = vmsplice(exp->pipe[1], &iov, 1, SPLICE_F_NONBLOCK);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOSYS) {
+				exp->copy = true;
+				break;
+			}
+			return -1;
+		}
+		if (export_splice_out(exp, ret))
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	if (len)
+		return export_write_all(exp, buf, len);
+	return 0;
+}
+
+int rseq_splice_export_submit(struct rseq_splice_export *exp,
+		const void *buf, size_t len, uint64_t *end)
+{
+	int ret;
+
+	if (pthread_mutex_lock(&exp->lock))
+		abort();
+	if (exp->copy)
+		ret = export_write_all(exp, buf, len);
+	else
+		ret = export_splice(exp, buf, len);
+	if (!ret && end)
+		*end = exp->submitted;
+	if (pthread_mutex_unlock(&exp->lock))
+		abort();
+	return ret;
+}
+
+uint64_t rseq_splice_export_released(struct rseq_splice_export *exp)
+{
+	/*
+	 * Load the position before the queue length, so bytes spliced in
+	 * between only lower the result.
+	 */
+	uint64_t submitted = __atomic_load_n(&exp->submitted, __ATOMIC_ACQUIRE);
+	int outq;
+
+	if (!exp->stream)
+		return submitted;
+	/* Keep every page when the queue length is unknown. */
+	if (ioctl(exp->fd, SIOCOUTQ, &outq) || outq < 0)
+		return 0;
+	if ((uint64_t) outq > submitted)
+		return 0;
+	return submitted - outq;
+}
+
+uint64_t rseq_splice_export_nr_copied(struct rseq_splice_export *exp)
+{
+	return __atomic_load_n(&exp->nr_copied, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,373 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-syscall-prof.c
+ *
+ * System call latency profiler, interposed with LD_PRELOAD.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rseq/rseq.h>
+#include <rseq/syscall-prof.h>
+
+#include "rseq-cpu.h"
+
+/* Buckets per power of two, as a number of bits. */
+#define PROF_SUB_BITS		3
+#define PROF_SUB_BUCKETS	(1U << PROF_SUB_BITS)
+
+#define PROF_ROW_LEN	(RSEQ_SYSCALL_PROF_NR_CALLS * RSEQ_SYSCALL_PROF_NR_BUCKETS)
+
+enum prof_thread_state {
+	PROF_THREAD_UNKNOWN = 0,
+	PROF_THREAD_RSEQ,
+	PROF_THREAD_ATOMIC,
+};
+
+static const char *prof_call_names[RSEQ_SYSCALL_PROF_NR_CALLS] = {
+	[RSEQ_SYSCALL_PROF_READ] = "read",
+	[RSEQ_SYSCALL_PROF_WRITE] = "write",
+	[RSEQ_SYSCALL_PROF_RECVMSG] = "recvmsg",
+	[RSEQ_SYSCALL_PROF_SENDMSG] = "sendmsg",
+	[RSEQ_SYSCALL_PROF_EPOLL_WAIT] = "epoll_wait",
+	[RSEQ_SYSCALL_PROF_FUTEX] = "futex",
+};
+
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_recvmsg)(int, struct msghdr *, int);
+static ssize_t (*real_sendmsg)(int, const struct msghdr *, int);
+static int (*real_epoll_wait)(int, struct epoll_event *, int, int);
+static long (*real_syscall)(long, ...);
+
+/*
+ * One row of histograms per possible CPU, only backed by memory once
+ * the CPU records a call.
+ */
+static intptr_t *prof_rows;
+static int prof_nr_cpus;
+
+static pthread_once_t prof_once = PTHREAD_ONCE_INIT;
+static pthread_key_t prof_key;
+static __thread enum prof_thread_state prof_thread_state;
+
+static void *prof_resolve(const char *symbol)
+{
+	void *fn = dlsym(RTLD_NEXT, symbol);
+
+	if (!fn)
+		abort();
+	return fn;
+}
+
+static void prof_thread_exit(void *arg)
+{
+	(void) arg;
+	/* Later destructors of the thread may still make calls. */
+	prof_thread_state = PROF_THREAD_ATOMIC;
+	(void) rseq_unregister_current_thread();
+}
+
+static void prof_init(void)
+{
+	real_read = prof_resolve("read");
+	real_write = prof_resolve("write");
+	real_recvmsg = prof_resolve("recvmsg");
+	real_sendmsg = prof_resolve("sendmsg");
+	real_epoll_wait = prof_resolve("epoll_wait");
+	real_syscall = prof_resolve("syscall");
+	prof_nr_cpus = rseq_nr_possible_cpus();
+	prof_rows = mmap(NULL, (size_t) prof_nr_cpus * PROF_ROW_LEN * sizeof(*prof_rows),
+			 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (prof_rows == MAP_FAILED)
+		abort();
+	if (pthread_key_create(&prof_key, prof_thread_exit))
+		abort();
+}
+
+static unsigned int prof_bucket(uint64_t ns)
+{
+	unsigned int order, bucket;
+
+	if (ns < PROF_SUB_BUCKETS)
+		return ns;
+	order = 63 - __builtin_clzll(ns);
+	bucket = (order - PROF_SUB_BITS + 1) * PROF_SUB_BUCKETS +
+		(unsigned int) (ns >> (order - PROF_SUB_BITS)) - PROF_SUB_BUCKETS;
+	if (bucket >= RSEQ_SYSCALL_PROF_NR_BUCKETS)
+		bucket = RSEQ_SYSCALL_PROF_NR_BUCKETS - 1;
+	return bucket;
+}
+
+uint64_t rseq_syscall_prof_bucket_floor(unsigned int bucket)
+{
+	unsigned int order;
+
+	if (bucket < PROF_SUB_BUCKETS)
+		return bucket;
+	order = bucket / PROF_SUB_BUCKETS + PROF_SUB_BITS - 1;
+	return (uint64_t) (bucket % PROF_SUB_BUCKETS + PROF_SUB_BUCKETS) <<
+		(order - PROF_SUB_BITS);
+}
+
+const char *rseq_syscall_prof_call_name(enum rseq_syscall_prof_call call)
+{
+	if ((unsigned int) call >= RSEQ_SYSCALL_PROF_NR_CALLS)
+		return NULL;
+	return prof_call_names[call];
+}
+
+static inline uint64_t prof_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void prof_thread_init(void)
+{
+	if (!rseq_register_current_thread()) {
+		prof_thread_state = PROF_THREAD_RSEQ;
+		/* Unregister when the thread exits. */
+		(void) pthread_setspecific(prof_key, (void *) 1);
+	} else {
+		prof_thread_state = PROF_THREAD_ATOMIC;
+	}
+}
+
+static void prof_record(enum rseq_syscall_prof_call call, uint64_t start)
+{
+	size_t offset = call * RSEQ_SYSCALL_PROF_NR_BUCKETS +
+		prof_bucket(prof_now() - start);
+	int saved_errno = errno;
+	int cpu;
+
+	if (rseq_unlikely(prof_thread_state == PROF_THREAD_UNKNOWN))
+		prof_thread_init();
+	if (rseq_likely(prof_thread_state == PROF_THREAD_RSEQ)) {
+		do {
+			cpu = rseq_cpu_start();
+		} while (rseq_unlikely(rseq_addv(&prof_rows[cpu * PROF_ROW_LEN + offset],
+				1, cpu)));
+	} else {
+		cpu = sched_getcpu();
+		if (cpu < 0 || cpu >= prof_nr_cpus)
+			cpu = 0;
+		__atomic_add_fetch(&prof_rows[cpu * PROF_ROW_LEN + offset], 1,
+				   __ATOMIC_RELAXED);
+	}
+	errno = saved_errno;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	uint64_t start;
+	ssize_t ret;
+
+	pthread_once(&prof_once, prof_init);
+	start = prof_now();
+	ret = real_read(fd, buf, count);
+	prof_record(RSEQ_SYSCALL_PROF_READ, start);
+	return ret;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	uint64_t start;
+	ssize_t ret;
+
+	pthread_once(&prof_once, prof_init);
+	start = prof_now();
+	ret = real_write(fd, buf, count);
+	prof_record(RSEQ_SYSCALL_PROF_WRITE, start);
+	return ret;
+}
+
+ssize_t recvmsg(int fd, struct msghdr *msg, int flags)
+{
+	uint64_t start;
+	ssize_t ret;
+
+	pthread_once(&prof_once, prof_init);
+	start = prof_now();
+	ret = real_recvmsg(fd, msg, flags);
+	prof_record(RSEQ_SYSCALL_PROF_RECVMSG, start);
+	return ret;
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	uint64_t start;
+	ssize_t ret;
+
+	pthread_once(&prof_once, prof_init);
+	start = prof_now();
+	ret = real_sendmsg(fd, msg, flags);
+	prof_record(RSEQ_SYSCALL_PROF_SENDMSG, start);
+	return ret;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	uint64_t start;
+	int ret;
+
+	pthread_once(&prof_once, prof_init);
+	start = prof_now();
+	ret = real_epoll_wait(epfd, events, maxevents, timeout);
+	prof_record(RSEQ_SYSCALL_PROF_EPOLL_WAIT, start);
+	return ret;
+}
+
+/* futex(2) has no C library wrapper: only time it through syscall(2). */
+long syscall(long number, ...)
+{
+	long a1, a2, a3, a4, a5, a6, ret;
+	uint64_t start;
+	va_list ap;
+
+	va_start(ap, number);
+	a1 = va_arg(ap, long);
+	a2 = va_arg(ap, long);
+	a3 = va_arg(ap, long);
+	a4 = va_arg(ap, long);
+	a5 = va_arg(ap, long);
+	a6 = va_arg(ap, long);
+	va_end(ap);
+	pthread_once(&prof_once, prof_init);
+	if (number != SYS_futex)
+		return real_syscall(number, a1, a2, a3, a4, a5, a6);
+	start = prof_now();
+	ret = real_syscall(number, a1, a2, a3, a4, a5, a6);
+	prof_record(RSEQ_SYSCALL_PROF_FUTEX, start);
+	return ret;
+}
+
+void rseq_syscall_prof_snapshot(
+		uint64_t buckets[RSEQ_SYSCALL_PROF_NR_CALLS][RSEQ_SYSCALL_PROF_NR_BUCKETS])
+{
+	int call, cpu;
+	unsigned int i;
+
+	pthread_once(&prof_once, prof_init);
+	memset(buckets, 0, sizeof(uint64_t) * PROF_ROW_LEN);
+	for (cpu = 0; cpu < prof_nr_cpus; cpu++) {
+		const intptr_t *row = &prof_rows[cpu * PROF_ROW_LEN];
+
+		for (call = 0; call < RSEQ_SYSCALL_PROF_NR_CALLS; call++) {
+			for (i = 0; i < RSEQ_SYSCALL_PROF_NR_BUCKETS; i++)
+				buckets[call][i] += (uint64_t) RSEQ_READ_ONCE(
+					row[call * RSEQ_SYSCALL_PROF_NR_BUCKETS + i]);
+		}
+	}
+}
+
+/* Floor of the bucket holding the @q quantile, in per mille. */
+static uint64_t prof_quantile(const uint64_t *buckets, uint64_t count,
+		unsigned int q)
+{
+	uint64_t rank = (count * q + 999) / 1000, seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < RSEQ_SYSCALL_PROF_NR_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	return rseq_syscall_prof_bucket_floor(i);
+}
+
+int rseq_syscall_prof_dump(int fd)
+{
+	uint64_t (*buckets)[RSEQ_SYSCALL_PROF_NR_BUCKETS];
+	int call, ret = 0;
+	unsigned int i;
+
+	buckets = malloc(sizeof(uint64_t) * PROF_ROW_LEN);
+	if (!buckets)
+		return -1;
+	rseq_syscall_prof_snapshot(buckets);
+	for (call = 0; call < RSEQ_SYSCALL_PROF_NR_CALLS && !ret; call++) {
+		uint64_t count = 0;
+
+		for (i = 0; i < RSEQ_SYSCALL_PROF_NR_BUCKETS; i++)
+			count += buckets[call][i];
+		if (!count)
+			continue;
+		if (dprintf(fd, "%s: count=%" PRIu64 " p50=%" PRIu64 " p90=%" PRIu64
+				" p99=%" PRIu64 " p99.9=%" PRIu64 " ns\n",
+				prof_call_names[call], count,
+				prof_quantile(buckets[call], count, 500),
+				prof_quantile(buckets[call], count, 900),
+				prof_quantile(buckets[call], count, 990),
+				prof_quantile(buckets[call], count, 999)) < 0) {
+			ret = -1;
+			break;
+		}
+		for (i = 0; i < RSEQ_SYSCALL_PROF_NR_BUCKETS; i++) {
+			if (!buckets[call][i])
+				continue;
+			if (dprintf(fd, "  >= %" PRIu64 " ns: %" PRIu64 "\n",
+					rseq_syscall_prof_bucket_floor(i),
+					buckets[call][i]) < 0) {
+				ret = -1;
+				break;
+			}
+		}
+	}
+	free(buckets);
+	return ret;
+}
+
+static __attribute__((constructor))
+void prof_constructor(void)
+{
+	pthread_once(&prof_once, prof_init);
+}
+
+static __attribute__((destructor))
+void prof_destructor(void)
+{
+	const char *path = getenv("RSEQ_SYSCALL_PROF_OUTPUT");
+	int fd;
+
+	if (!path || !*path)
+		return;
+	if (!strcmp(path, "-")) {
+		(void) rseq_syscall_prof_dump(STDERR_FILENO);
+		return;
+	}
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	(void) rseq_syscall_prof_dump(fd);
+	close(fd);
+}
@@ -0,0 +1,507 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * rseq-wal.c
+ *
+ * Write-ahead log with per-CPU staging buffers and group commit.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; only
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <rseq/rseq.h>
+#include <rseq/wal.h>
+
+#include "rseq-cpu.h"
+#include "rseq-membarrier.h"
+
+/*
+ * The state word of a CPU is committed by every append. It holds the
+ * offset of the active staging buffer, the number of LSNs used from
+ * the active lease, the active lease slot and the active buffer.
+ */
+#define WAL_OFFSET_BITS		21
+#define WAL_USED_SHIFT		WAL_OFFSET_BITS
+#define WAL_USED_BITS		9
+#define WAL_SLOT_SHIFT		(WAL_USED_SHIFT + WAL_USED_BITS)
+#define WAL_HALF_SHIFT		(WAL_SLOT_SHIFT + 1)
+
+#define WAL_OFFSET_MASK		(((uintptr_t) 1 << WAL_OFFSET_BITS) - 1)
+#define WAL_USED_MASK		((((uintptr_t) 1 << WAL_USED_BITS) - 1) << WAL_USED_SHIFT)
+#define WAL_SLOT		((uintptr_t) 1 << WAL_SLOT_SHIFT)
+#define WAL_HALF		((uintptr_t) 1 << WAL_HALF_SHIFT)
+
+/* State of a CPU being switched to its other buffer by a flush. */
+#define WAL_STATE_LOCKED	((intptr_t) -1)
+
+#define WAL_ALIGN(len)		(((len) + 7) & ~(size_t) 7)
+
+#define wal_state_offset(w)	((size_t) ((uintptr_t) (w) & WAL_OFFSET_MASK))
+#define wal_state_used(w)	((unsigned int) (((uintptr_t) (w) & WAL_USED_MASK) >> WAL_USED_SHIFT))
+#define wal_state_slot(w)	(!!((uintptr_t) (w) & WAL_SLOT))
+#define wal_state_half(w)	(!!((uintptr_t) (w) & WAL_HALF))
+
+struct wal_cpu {
+	intptr_t state;
+	/*
+	 * Lease indexes. Refills write the inactive slot, so a refill
+	 * aborted after its try store leaves the active lease intact.
+	 */
+	intptr_t lease[2];
+} __attribute__((aligned(128)));
+
+struct wal_entry {
+	uint64_t lsn;
+	const struct rseq_wal_record *record;
+};
+
+struct rseq_wal {
+	int fd;
+	int nr_cpus;
+	size_t buf_size;
+	unsigned int lease_size;
+	struct wal_cpu *cpus;
+	/* Two staging buffers of buf_size bytes per possible CPU. */
+	char *buffers;
+	size_t buffers_len;
+
+	uint64_t next_lease;
+	/* Leases obtained by appends which could not install them. */
+	pthread_mutex_t lease_lock;
+	intptr_t *spare_leases;
+	size_t nr_spare_leases;
+	size_t alloc_spare_leases;
+
+	/* Group commit. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool flushing;
+	uint64_t nr_started;
+	uint64_t nr_done;
+	int error;
+	uint64_t nr_syncs;
+
+	/* Flusher state, only used by the thread flushing. */
+	intptr_t *locked;
+	struct wal_entry *entries;
+	size_t alloc_entries;
+	struct iovec *iov;
+};
+
+static inline char *wal_buffer(struct rseq_wal *wal, int cpu, int half)
+{
+	return wal->buffers + ((size_t) cpu * 2 + half) * wal->buf_size;
+}
+
+struct rseq_wal *rseq_wal_create(int fd, size_t buf_size,
+		unsigned int lease_size)
+{
+	struct rseq_wal *wal;
+	int cpu, ret;
+
+	if (buf_size < RSEQ_WAL_MAX_RECORD || buf_size > RSEQ_WAL_MAX_BUFFER ||
+			!lease_size || lease_size > RSEQ_WAL_MAX_LEASE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!rseq_membarrier_rseq_available()) {
+		errno = ENOSYS;
+		return NULL;
+	}
+	wal = calloc(1, sizeof(*wal));
+	if (!wal)
+		return NULL;
+	wal->fd = fd;
+	wal->nr_cpus = rseq_nr_possible_cpus();
+	wal->buf_size = WAL_ALIGN(buf_size);
+	wal->lease_size = lease_size;
+	ret = posix_memalign((void **) &wal->cpus, __alignof__(*wal->cpus),
+			     wal->nr_cpus * sizeof(*wal->cpus));
+	if (ret) {
+		wal->cpus = NULL;
+		errno = ret;
+		goto error;
+	}
+	/* Leases start exhausted, so the first append of a CPU refills. */
+	for (cpu = 0; cpu < wal->nr_cpus; cpu++) {
+		memset(&wal->cpus[cpu], 0, sizeof(wal->cpus[cpu]));
+		wal->cpus[cpu].state = (intptr_t) ((uintptr_t) lease_size << WAL_USED_SHIFT);
+	}
+	wal->locked = calloc(wal->nr_cpus, sizeof(*wal->locked));
+	wal->iov = calloc(IOV_MAX, sizeof(*wal->iov));
+	if (!wal->locked || !wal->iov)
+		goto error;
+	/* Buffers are only backed by memory once a CPU appends. */
+	wal->buffers_len = (size_t) wal->nr_cpus * 2 * wal->buf_size;
+	wal->buffers = mmap(NULL, wal->buffers_len, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (wal->buffers == MAP_FAILED)
+		goto error;
+	ret = pthread_mutex_init(&wal->lease_lock, NULL);
+	if (ret)
+		goto error_errno;
+	ret = pthread_mutex_init(&wal->lock, NULL);
+	if (ret) {
+		pthread_mutex_destroy(&wal->lease_lock);
+		goto error_errno;
+	}
+	ret = pthread_cond_init(&wal->cond, NULL);
+	if (ret) {
+		pthread_mutex_destroy(&wal->lock);
+		pthread_mutex_destroy(&wal->lease_lock);
+		goto error_errno;
+	}
+	return wal;
+
+error_errno:
+	munmap(wal->buffers, wal->buffers_len);
+	errno = ret;
+error:
+	ret = errno;
+	free(wal->iov);
+	free(wal->locked);
+	free(wal->cpus);
+	free(wal);
+	errno = ret;
+	return NULL;
+}
+
+void rseq_wal_destroy(struct rseq_wal *wal)
+{
+	if (!wal)
+		return;
+	(void) pthread_cond_destroy(&wal->cond);
+	(void) pthread_mutex_destroy(&wal->lock);
+	(void) pthread_mutex_destroy(&wal->lease_lock);
+	munmap(wal->buffers, wal->buffers_len);
+	free(wal->entries);
+	free(wal->iov);
+	free(wal->locked);
+	free(wal->spare_leases);
+	free(wal->cpus);
+	free(wal);
+}
+
+static intptr_t wal_lease_get(struct rseq_wal *wal)
+{
+	intptr_t lease = -1;
+
+	if (__atomic_load_n(&wal->nr_spare_leases, __ATOMIC_RELAXED)) {
+		if (pthread_mutex_lock(&wal->lease_lock))
+			abort();
+		if (wal->nr_spare_leases)
+			lease = wal->spare_leases[--wal->nr_spare_leases];
+		if (pthread_mutex_unlock(&wal->lease_lock))
+			abort();
+	}
+	if (lease < 0)
+		lease = (intptr_t) __atomic_fetch_add(&wal->next_lease, 1,
+						      __ATOMIC_RELAXED);
+	return lease;
+}
+
+/* Keep an unused lease for a later refill, so its LSNs are not lost. */
+static void wal_lease_put(struct rseq_wal *wal, intptr_t lease)
+{
+	if (pthread_mutex_lock(&wal->lease_lock))
+		abort();
+	if (wal->nr_spare_leases == wal->alloc_spare_leases) {
+		size_t alloc = wal->alloc_spare_leases ? 2 * wal->alloc_spare_leases : 16;
+		intptr_t *leases;
+
+		leases = realloc(wal->spare_leases, alloc * sizeof(*leases));
+		if (!leases)
+			goto unlock;	/* Leave a gap in LSNs. */
+		wal->spare_leases = leases;
+		wal->alloc_spare_leases = alloc;
+	}
+	wal->spare_leases[wal->nr_spare_leases++] = lease;
+unlock:
+	if (pthread_mutex_unlock(&wal->lease_lock))
+		abort();
+}
+
+int rseq_wal_append(struct rseq_wal *wal, const void *data, size_t len,
+		uint64_t *lsn)
+{
+	union {
+		struct rseq_wal_record header;
+		char bytes[RSEQ_WAL_MAX_RECORD];
+	} record;
+	size_t record_len = WAL_ALIGN(sizeof(record.header) + len);
+	intptr_t spare = -1;
+	int ret = 0;
+
+	if (len > RSEQ_WAL_MAX_RECORD - sizeof(record.header)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&record.header, 0, sizeof(record.header));
+	record.header.len = len;
+	memcpy(record.bytes + sizeof(record.header), data, len);
+	memset(record.bytes + sizeof(record.header) + len, 0,
+	       record_len - sizeof(record.header) - len);
+
+	for (;;) {
+		struct wal_cpu *c;
+		intptr_t state, newstate;
+		unsigned int used;
+		size_t offset;
+		int cpu, slot;
+
+		cpu = rseq_cpu_start();
+		c = &wal->cpus[cpu];
+		state = RSEQ_READ_ONCE(c->state);
+		if (rseq_unlikely(state == WAL_STATE_LOCKED)) {
+			/* A flush is switching buffers. */
+			sched_yield();
+			continue;
+		}
+		used = wal_state_used(state);
+		slot = wal_state_slot(state);
+		if (rseq_unlikely(used == wal->lease_size)) {
+			if (spare < 0)
+				spare = wal_lease_get(wal);
+			newstate = (intptr_t) (((uintptr_t) state & ~WAL_USED_MASK) ^ WAL_SLOT);
+			if (rseq_likely(!rseq_cmpeqv_trystorev_storev(&c->state, state,
+					&c->lease[!slot], spare, newstate, cpu)))
+				spare = -1;
+			/* Retry if comparison fails or rseq aborts. */
+			continue;
+		}
+		offset = wal_state_offset(state);
+		if (rseq_unlikely(offset + record_len > wal->buf_size)) {
+			ret = rseq_wal_sync(wal);
+			if (ret)
+				break;
+			continue;
+		}
+		record.header.lsn = (uint64_t) RSEQ_READ_ONCE(c->lease[slot]) *
+			wal->lease_size + used;
+		newstate = (intptr_t) ((uintptr_t) state + record_len +
+				       ((uintptr_t) 1 << WAL_USED_SHIFT));
+		if (rseq_likely(!rseq_cmpeqv_trymemcpy_storev(&c->state, state,
+				wal_buffer(wal, cpu, wal_state_half(state)) + offset,
+				&record, record_len, newstate, cpu))) {
+			if (lsn)
+				*lsn = record.header.lsn;
+			break;
+		}
+		/* Retry if comparison fails or rseq aborts. */
+	}
+	if (spare >= 0)
+		wal_lease_put(wal, spare);
+	return ret;
+}
+
+static int wal_entry_cmp(const void *a, const void *b)
+{
+	const struct wal_entry *ea = a, *eb = b;
+
+	if (ea->lsn != eb->lsn)
+		return ea->lsn < eb->lsn ? -1 : 1;
+	return 0;
+}
+
+/* Append the records of a staging buffer to the flush batch. */
+static int wal_gather(struct rseq_wal *wal, const char *buf, size_t len,
+		size_t *nr_entries)
+{
+	size_t offset = 0;
+
+	while (offset < len) {
+		const struct rseq_wal_record *record =
+			(const struct rseq_wal_record *) (buf + offset);
+
+		if (*nr_entries == wal->alloc_entries) {
+			size_t alloc = wal->alloc_entries ? 2 * wal->alloc_entries : 1024;
+			struct wal_entry *entries;
+
+			entries = realloc(wal->entries, alloc * sizeof(*entries));
+			if (!entries)
+				return -1;
+			wal->entries = entries;
+			wal->alloc_entries = alloc;
+		}
+		wal->entries[*nr_entries].lsn = record->lsn;
+		wal->entries[*nr_entries].record = record;
+		(*nr_entries)++;
+		offset += WAL_ALIGN(sizeof(*record) + record->len);
+	}
+	return 0;
+}
+
+static int wal_writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t len = writev(fd, iov, iovcnt);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (iovcnt && (size_t) len >= iov->iov_len) {
+			len -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *) iov->iov_base + len;
+			iov->iov_len -= len;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Switch every CPU with staged records to its other buffer, then write
+ * the records of the previous buffers in LSN order and fdatasync.
+ */
+static int wal_flush(struct rseq_wal *wal)
+{
+	size_t nr_entries = 0, i;
+	bool retry;
+	int cpu, ret = 0;
+
+	do {
+		bool locked = false;
+
+		for (cpu = 0; cpu < wal->nr_cpus; cpu++) {
+			struct wal_cpu *c = &wal->cpus[cpu];
+			intptr_t state = RSEQ_READ_ONCE(c->state);
+
+			wal->locked[cpu] = 0;
+			do {
+				if (state == WAL_STATE_LOCKED ||
+						!wal_state_offset(state))
+					break;
+			} while (!__atomic_compare_exchange_n(&c->state, &state,
+					WAL_STATE_LOCKED, false,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+			if (state == WAL_STATE_LOCKED || !wal_state_offset(state))
+				continue;
+			wal->locked[cpu] = state;
+			locked = true;
+		}
+		if (!locked)
+			break;
+		/*
+		 * Abort appends which loaded the state before it was
+		 * locked. An append which committed in the meantime has
+		 * overwritten the lock: retry for that CPU.
+		 */
+		if (rseq_sys_membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0))
+			abort();
+		retry = false;
+		for (cpu = 0; cpu < wal->nr_cpus; cpu++) {
+			struct wal_cpu *c = &wal->cpus[cpu];
+			intptr_t state = wal->locked[cpu];
+
+			if (!state)
+				continue;
+			if (RSEQ_READ_ONCE(c->state) != WAL_STATE_LOCKED) {
+				retry = true;
+				continue;
+			}
+			if (!ret && wal_gather(wal, wal_buffer(wal, cpu, wal_state_half(state)),
+					wal_state_offset(state), &nr_entries))
+				ret = -1;
+			/*
+			 * The previous buffer is only reused after the next
+			 * flush switches back to it, so appends can resume
+			 * while it is written.
+			 */
+			rseq_smp_store_release(&c->state, (intptr_t)
+				(((uintptr_t) state & ~WAL_OFFSET_MASK) ^ WAL_HALF));
+		}
+	} while (retry);
+	if (ret || !nr_entries)
+		return ret;
+
+	qsort(wal->entries, nr_entries, sizeof(*wal->entries), wal_entry_cmp);
+	for (i = 0; i < nr_entries; ) {
+		int iovcnt = 0;
+
+		for (; i < nr_entries && iovcnt < IOV_MAX; i++, iovcnt++) {
+			const struct rseq_wal_record *record = wal->entries[i].record;
+
+			wal->iov[iovcnt].iov_base = (void *) record;
+			wal->iov[iovcnt].iov_len = WAL_ALIGN(sizeof(*record) + record->len);
+		}
+		if (wal_writev_all(wal->fd, wal->iov, iovcnt))
+			return -1;
+	}
+	if (fdatasync(wal->fd))
+		return -1;
+	__atomic_add_fetch(&wal->nr_syncs, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int rseq_wal_sync(struct rseq_wal *wal)
+{
+	uint64_t target;
+	int ret = 0;
+
+	if (pthread_mutex_lock(&wal->lock))
+		abort();
+	/*
+	 * A flush in progress may have switched the buffer of our CPU
+	 * already: wait for a flush starting after this call.
+	 */
+	target = wal->nr_started + 1;
+	while (wal->nr_done < target && !wal->error) {
+		if (wal->flushing) {
+			if (pthread_cond_wait(&wal->cond, &wal->lock))
+				abort();
+			continue;
+		}
+		wal->flushing = true;
+		wal->nr_started++;
+		if (pthread_mutex_unlock(&wal->lock))
+			abort();
+		ret = wal_flush(wal);
+		if (ret)
+			ret = errno;
+		if (pthread_mutex_lock(&wal->lock))
+			abort();
+		wal->flushing = false;
+		wal->nr_done = wal->nr_started;
+		if (ret)
+			wal->error = ret;
+		if (pthread_cond_broadcast(&wal->cond))
+			abort();
+	}
+	ret = wal->error;
+	if (pthread_mutex_unlock(&wal->lock))
+		abort();
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+uint64_t rseq_wal_nr_syncs(struct rseq_wal *wal)
+{
+	return __atomic_load_n(&wal->nr_syncs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Adaptive counters test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/adaptive-counter.h>
+
+#include "tap.h"
+
+#define NR_TESTS 8
+
+struct adaptive_counter_test_data {
+	struct rseq_adaptive_counter *counter;
+	long long reps;
+	int done;
+};
+
+void *test_adaptive_counter_thread(void *arg)
+{
+	struct adaptive_counter_test_data *data = arg;
+	long long i, reps;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	reps = data->reps;
+	for (i = 0; i < reps; i++) {
+		rseq_adaptive_counter_add(data->counter, 1);
+		if (!(i % 64))
+			sched_yield();
+	}
+	__atomic_add_fetch(&data->done, 1, __ATOMIC_RELAXED);
+
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+
+/*
+ * Concurrent increments while the counter is repeatedly promoted and
+ * demoted, checking that no increment is lost across mode changes.
+ */
+void test_adaptive_counter(void)
+{
+	const int num_threads = 16;
+	int i, nr_promotions = 0, nr_demotions = 0;
+	pthread_t test_threads[num_threads];
+	struct adaptive_counter_test_data data;
+	struct rseq_adaptive_counter counter;
+
+	diag("adaptive counter");
+
+	ok(rseq_adaptive_counter_init(&counter) == 0, "Initialize counter");
+	ok(!rseq_adaptive_counter_is_percpu(&counter), "Counter starts in shared mode");
+
+	rseq_adaptive_counter_add(&counter, 3);
+	ok(rseq_adaptive_counter_promote(&counter) == 0 &&
+	   rseq_adaptive_counter_is_percpu(&counter), "Promote counter");
+	rseq_adaptive_counter_add(&counter, 2);
+	ok(rseq_adaptive_counter_read(&counter) == 5, "Read sums shared and per-CPU values");
+
+	/* Demote at the first poll which sees less than 2^20 increments. */
+	rseq_adaptive_counter_set_thresholds(&counter, 1, 1 << 20, 1);
+
+	memset(&data, 0, sizeof(data));
+	data.counter = &counter;
+	data.reps = 100000;
+
+	for (i = 0; i < num_threads; i++)
+		pthread_create(&test_threads[i], NULL,
+			       test_adaptive_counter_thread, &data);
+
+	while (__atomic_load_n(&data.done, __ATOMIC_RELAXED) < num_threads) {
+		if (!rseq_adaptive_counter_is_percpu(&counter)) {
+			if (rseq_adaptive_counter_promote(&counter))
+				abort();
+			nr_promotions++;
+		}
+		sched_yield();
+		if (!rseq_adaptive_counter_poll(&counter))
+			nr_demotions++;
+	}
+
+	for (i = 0; i < num_threads; i++)
+		pthread_join(test_threads[i], NULL);
+
+	diag("%d promotions, %d demotions", nr_promotions, nr_demotions);
+	ok(rseq_adaptive_counter_read(&counter) ==
+	   (intptr_t) data.reps * num_threads + 5, "No increment lost across mode changes");
+	if (nr_demotions) {
+		ok(!rseq_adaptive_counter_poll(&counter) &&
+		   !rseq_adaptive_counter_is_percpu(&counter), "Idle counter is demoted");
+	} else {
+		skip(1, "membarrier MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ is unavailable");
+	}
+	rseq_adaptive_counter_destroy(&counter);
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+
+	test_adaptive_counter();
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
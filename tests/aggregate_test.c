@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Per-CPU partial aggregation test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/aggregate.h>
+
+#include "tap.h"
+
+#define NR_TESTS 9
+
+#define NR_KEYS		1000
+#define NR_THREADS	8
+#define REPS		100
+
+/*
+ * Thread @t adds REPS rounds of events for every key. The value of an
+ * event of key k is in [k - t - REPS, k + t + REPS), so the minimum and
+ * maximum of a key come from the first and last threads.
+ */
+struct aggregate_test_data {
+	struct rseq_aggregate *aggr;
+	int thread;
+};
+
+void *test_aggregate_thread(void *arg)
+{
+	struct aggregate_test_data *data = arg;
+	int i, k;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	for (i = 0; i < REPS; i++) {
+		for (k = 0; k < NR_KEYS; k++) {
+			intptr_t v = (i & 1) ? k + data->thread + i :
+					       k - data->thread - i;
+
+			if (rseq_aggregate_add(data->aggr, k, v))
+				abort();
+		}
+	}
+
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+
+static bool test_check_snapshot(const struct rseq_aggregate_snapshot *snapshot)
+{
+	bool seen[NR_KEYS] = { 0 };
+	size_t i;
+
+	if (snapshot->nr_keys != NR_KEYS)
+		return false;
+	for (i = 0; i < snapshot->nr_keys; i++) {
+		intptr_t k = (intptr_t) snapshot->keys[i];
+
+		if (k < 0 || k >= NR_KEYS || seen[k])
+			return false;
+		seen[k] = true;
+		/* Odd and even rounds cancel out beyond the key. */
+		if (snapshot->count[i] != NR_THREADS * REPS ||
+				snapshot->sum[i] != k * NR_THREADS * REPS +
+					NR_THREADS * REPS / 2 ||
+				snapshot->min[i] != k - (NR_THREADS - 1) - (REPS - 2) ||
+				snapshot->max[i] != k + (NR_THREADS - 1) + (REPS - 1))
+			return false;
+	}
+	return true;
+}
+
+static void test_aggregate_concurrent(void)
+{
+	struct aggregate_test_data data[NR_THREADS];
+	struct rseq_aggregate_snapshot snapshot;
+	pthread_t test_threads[NR_THREADS];
+	struct rseq_aggregate *aggr;
+	int i;
+
+	aggr = rseq_aggregate_create(NR_KEYS);
+	ok(aggr != NULL, "Create aggregation");
+	if (!aggr)
+		abort();
+	for (i = 0; i < NR_THREADS; i++) {
+		data[i].aggr = aggr;
+		data[i].thread = i;
+		pthread_create(&test_threads[i], NULL, test_aggregate_thread, &data[i]);
+	}
+	for (i = 0; i < NR_THREADS; i++)
+		pthread_join(test_threads[i], NULL);
+
+	memset(&snapshot, 0, sizeof(snapshot));
+	ok(!rseq_aggregate_merge(aggr, &snapshot) &&
+	   rseq_aggregate_nr_keys(aggr) == NR_KEYS, "Merge all CPUs");
+	ok(test_check_snapshot(&snapshot),
+	   "Merged sums, counts, minimums and maximums are exact");
+
+	ok(rseq_aggregate_add(aggr, NR_KEYS, 1) == -1 && errno == ENOSPC &&
+	   rseq_aggregate_nr_keys(aggr) == NR_KEYS,
+	   "New keys are rejected once the aggregation is full");
+	ok(!rseq_aggregate_add(aggr, 0, INTPTR_MIN) &&
+	   !rseq_aggregate_add(aggr, 0, INTPTR_MAX) &&
+	   !rseq_aggregate_merge(aggr, &snapshot), "Add extreme values");
+	for (i = 0; i < (int) snapshot.nr_keys; i++) {
+		if (!snapshot.keys[i])
+			break;
+	}
+	ok(snapshot.min[i] == INTPTR_MIN && snapshot.max[i] == INTPTR_MAX,
+	   "Minimums and maximums cover the full range");
+
+	rseq_aggregate_snapshot_fini(&snapshot);
+	rseq_aggregate_destroy(aggr);
+}
+
+static int nr_periodic;
+
+static void test_periodic_cb(void *priv, const struct rseq_aggregate_snapshot *snapshot)
+{
+	uint64_t key = *(uint64_t *) priv;
+
+	if (snapshot->nr_keys == 1 && snapshot->keys[0] == key &&
+			snapshot->count[0] == 3 && snapshot->sum[0] == 6)
+		__atomic_add_fetch(&nr_periodic, 1, __ATOMIC_RELAXED);
+}
+
+/* Periodic merges on the ticks of a memory pressure monitor. */
+static void test_aggregate_periodic(void)
+{
+	struct rseq_mempressure *monitor;
+	struct rseq_aggregate *aggr;
+	uint64_t key = UINT64_MAX;
+	int i;
+
+	monitor = rseq_mempressure_create(NULL, RSEQ_MEMPRESSURE_STALL_US,
+			RSEQ_MEMPRESSURE_WINDOW_US, 10);
+	aggr = rseq_aggregate_create(1);
+	if (!monitor || !aggr)
+		abort();
+	for (i = 1; i <= 3; i++) {
+		if (rseq_aggregate_add(aggr, key, i))
+			abort();
+	}
+	ok(!rseq_aggregate_set_periodic(aggr, monitor, test_periodic_cb, &key),
+	   "Merge on monitor ticks");
+	for (i = 0; i < 500 && __atomic_load_n(&nr_periodic, __ATOMIC_RELAXED) < 2; i++)
+		poll(NULL, 0, 10);
+	ok(__atomic_load_n(&nr_periodic, __ATOMIC_RELAXED) >= 2,
+	   "Periodic merges deliver merged aggregates");
+	rseq_aggregate_destroy(aggr);
+	rseq_mempressure_destroy(monitor);
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	}
+
+	diag("per-CPU aggregation");
+	test_aggregate_concurrent();
+	test_aggregate_periodic();
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
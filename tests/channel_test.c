@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Per-CPU blocking channel test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/channel.h>
+
+#include "tap.h"
+
+#define NR_TESTS 9
+
+#define NR_SENDERS	4
+#define NR_RECEIVERS	4
+#define NR_ITEMS	50000
+#define CAPACITY	16
+
+/*
+ * Senders send items encoding their index and a sequence number, and
+ * receivers count every item they receive until the channel is closed.
+ */
+static struct rseq_channel *test_chan;
+static uint8_t received[NR_SENDERS][NR_ITEMS];
+static int nr_send_errors;
+
+static void test_register(void)
+{
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+}
+
+static void test_unregister(void)
+{
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+}
+
+void *test_sender_thread(void *arg)
+{
+	uintptr_t sender = (uintptr_t) arg, i;
+
+	test_register();
+	for (i = 0; i < NR_ITEMS; i++) {
+		if (rseq_channel_send(test_chan, (void *) (sender * NR_ITEMS + i + 1)))
+			__atomic_add_fetch(&nr_send_errors, 1, __ATOMIC_RELAXED);
+	}
+	test_unregister();
+	return NULL;
+}
+
+void *test_receiver_thread(void *arg)
+{
+	void *item;
+
+	(void) arg;
+	test_register();
+	while (!rseq_channel_recv(test_chan, &item)) {
+		uintptr_t v = (uintptr_t) item - 1;
+
+		__atomic_add_fetch(&received[v / NR_ITEMS][v % NR_ITEMS], 1,
+				   __ATOMIC_RELAXED);
+	}
+	if (errno != EPIPE)
+		abort();
+	test_unregister();
+	return NULL;
+}
+
+static void test_channel_concurrent(void)
+{
+	pthread_t senders[NR_SENDERS], receivers[NR_RECEIVERS];
+	int i, j, nr_bad = 0;
+
+	test_chan = rseq_channel_create(CAPACITY);
+	ok(test_chan != NULL, "Create channel");
+	if (!test_chan)
+		abort();
+	for (i = 0; i < NR_RECEIVERS; i++)
+		pthread_create(&receivers[i], NULL, test_receiver_thread, NULL);
+	for (i = 0; i < NR_SENDERS; i++)
+		pthread_create(&senders[i], NULL, test_sender_thread,
+			       (void *) (uintptr_t) i);
+	for (i = 0; i < NR_SENDERS; i++)
+		pthread_join(senders[i], NULL);
+	rseq_channel_close(test_chan);
+	for (i = 0; i < NR_RECEIVERS; i++)
+		pthread_join(receivers[i], NULL);
+
+	for (i = 0; i < NR_SENDERS; i++) {
+		for (j = 0; j < NR_ITEMS; j++) {
+			if (received[i][j] != 1)
+				nr_bad++;
+		}
+	}
+	ok(!nr_send_errors, "Concurrent sends");
+	ok(!nr_bad, "Every item is received exactly once");
+	rseq_channel_destroy(test_chan);
+}
+
+static void test_channel_nonblocking(void)
+{
+	struct rseq_channel *chan;
+	cpu_set_t allowed, pinned;
+	void *item = NULL;
+	uintptr_t i;
+	int nr_errors = 0;
+
+	/* Stay on one CPU, so every item goes to the same lane. */
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		abort();
+	CPU_ZERO(&pinned);
+	CPU_SET(rseq_current_cpu(), &pinned);
+	if (sched_setaffinity(0, sizeof(pinned), &pinned))
+		abort();
+	chan = rseq_channel_create(CAPACITY);
+	if (!chan)
+		abort();
+	ok(rseq_channel_try_recv(chan, &item) == -1 && errno == EAGAIN,
+	   "Receiving from an empty channel fails with EAGAIN");
+	for (i = 0; i < CAPACITY; i++) {
+		if (rseq_channel_try_send(chan, (void *) i))
+			nr_errors++;
+	}
+	ok(!nr_errors && rseq_channel_try_send(chan, NULL) == -1 && errno == EAGAIN,
+	   "Sending to a full channel fails with EAGAIN");
+	/* Items of a lane are received in order. */
+	for (i = 0; i < CAPACITY; i++) {
+		if (rseq_channel_try_recv(chan, &item) || (uintptr_t) item != i)
+			nr_errors++;
+	}
+	ok(!nr_errors && !rseq_channel_try_send(chan, (void *) 42),
+	   "Received items free capacity");
+	rseq_channel_close(chan);
+	ok(rseq_channel_send(chan, NULL) == -1 && errno == EPIPE,
+	   "Sending to a closed channel fails with EPIPE");
+	ok(!rseq_channel_recv(chan, &item) && (uintptr_t) item == 42 &&
+	   rseq_channel_recv(chan, &item) == -1 && errno == EPIPE,
+	   "Closed channels are drained, then fail with EPIPE");
+	rseq_channel_destroy(chan);
+	if (sched_setaffinity(0, sizeof(allowed), &allowed))
+		abort();
+}
+
+int main(void)
+{
+	struct rseq_channel *chan;
+
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	chan = rseq_channel_create(CAPACITY);
+	if (!chan && errno == ENOSYS) {
+		skip(NR_TESTS, "rseq membarrier is unavailable");
+		goto end;
+	}
+	rseq_channel_destroy(chan);
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	}
+
+	diag("per-CPU channel");
+	test_channel_concurrent();
+	test_channel_nonblocking();
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Hierarchical per-CPU counters test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/counter-tree.h>
+
+#include "tap.h"
+
+#define NR_TESTS 9
+
+#define NR_TENANTS	4
+#define NR_SERVICES	16	/* Per tenant. */
+#define NR_ENDPOINTS	32	/* Per service. */
+#define NR_LEAVES	(NR_TENANTS * NR_SERVICES * NR_ENDPOINTS)
+
+struct counter_tree_test_data {
+	struct rseq_counter_tree_node *leaves;
+	long long reps;
+};
+
+void *test_counter_tree_thread(void *arg)
+{
+	struct counter_tree_test_data *data = arg;
+	long long i;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	for (i = 0; i < data->reps; i++)
+		rseq_counter_tree_inc(&data->leaves[i % NR_LEAVES]);
+
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+
+static void test_counter_tree_small(struct rseq_counter_tree *tree)
+{
+	struct rseq_counter_tree_node root, a, b, c, bogus;
+
+	rseq_counter_tree_root(tree, &root);
+	ok(!rseq_counter_tree_add_child(tree, &root, &a) &&
+	   !rseq_counter_tree_add_child(tree, &a, &b) &&
+	   !rseq_counter_tree_add_child(tree, &root, &c) &&
+	   rseq_counter_tree_nr_nodes(tree) == 4, "Add children");
+	bogus.index = 1000;
+	bogus.slots = NULL;
+	ok(rseq_counter_tree_add_child(tree, &bogus, &bogus) == -1 && errno == EINVAL,
+	   "Unknown parents are rejected");
+
+	rseq_counter_tree_add(&b, 3);
+	rseq_counter_tree_add(&a, 2);
+	rseq_counter_tree_inc(&c);
+	ok(rseq_counter_tree_read(tree, &b) == 3 &&
+	   rseq_counter_tree_read(tree, &a) == 5 &&
+	   rseq_counter_tree_read(tree, &c) == 1 &&
+	   rseq_counter_tree_read(tree, &root) == 6,
+	   "Reads roll up descendants");
+	ok(rseq_counter_tree_read_self(tree, &a) == 2 &&
+	   rseq_counter_tree_read_self(tree, &root) == 0,
+	   "Self reads exclude descendants");
+}
+
+/*
+ * Concurrent increments of leaves spanning several chunks, checked at
+ * each level of a three-level hierarchy.
+ */
+static void test_counter_tree_concurrent(void)
+{
+	const int num_threads = 8;
+	struct rseq_counter_tree_node root, tenants[NR_TENANTS], *services, *leaves;
+	struct counter_tree_test_data data;
+	struct rseq_counter_tree *tree;
+	pthread_t test_threads[num_threads];
+	bool leaves_ok = true, services_ok = true, tenants_ok = true;
+	size_t i;
+
+	tree = rseq_counter_tree_create();
+	assert(tree);
+	services = calloc(NR_TENANTS * NR_SERVICES, sizeof(*services));
+	leaves = calloc(NR_LEAVES, sizeof(*leaves));
+	assert(services && leaves);
+	rseq_counter_tree_root(tree, &root);
+	for (i = 0; i < NR_TENANTS; i++) {
+		if (rseq_counter_tree_add_child(tree, &root, &tenants[i]))
+			abort();
+	}
+	for (i = 0; i < NR_TENANTS * NR_SERVICES; i++) {
+		if (rseq_counter_tree_add_child(tree, &tenants[i / NR_SERVICES],
+				&services[i]))
+			abort();
+	}
+	for (i = 0; i < NR_LEAVES; i++) {
+		if (rseq_counter_tree_add_child(tree, &services[i / NR_ENDPOINTS],
+				&leaves[i]))
+			abort();
+	}
+	ok(rseq_counter_tree_nr_nodes(tree) ==
+	   1 + NR_TENANTS + NR_TENANTS * NR_SERVICES + NR_LEAVES,
+	   "Build a tree spanning several chunks");
+
+	data.leaves = leaves;
+	data.reps = 10 * NR_LEAVES;
+	for (i = 0; i < (size_t) num_threads; i++)
+		pthread_create(&test_threads[i], NULL, test_counter_tree_thread, &data);
+	for (i = 0; i < (size_t) num_threads; i++)
+		pthread_join(test_threads[i], NULL);
+
+	for (i = 0; i < NR_LEAVES; i++) {
+		if (rseq_counter_tree_read(tree, &leaves[i]) != 10 * num_threads)
+			leaves_ok = false;
+	}
+	for (i = 0; i < NR_TENANTS * NR_SERVICES; i++) {
+		if (rseq_counter_tree_read(tree, &services[i]) !=
+				10 * num_threads * NR_ENDPOINTS)
+			services_ok = false;
+	}
+	for (i = 0; i < NR_TENANTS; i++) {
+		if (rseq_counter_tree_read(tree, &tenants[i]) !=
+				10 * num_threads * NR_ENDPOINTS * NR_SERVICES)
+			tenants_ok = false;
+	}
+	ok(leaves_ok && services_ok && tenants_ok &&
+	   rseq_counter_tree_read(tree, &root) == (intptr_t) data.reps * num_threads,
+	   "Concurrent increments are counted by every ancestor");
+
+	free(leaves);
+	free(services);
+	rseq_counter_tree_destroy(tree);
+}
+
+int main(void)
+{
+	struct rseq_counter_tree *tree;
+
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+
+	diag("counter tree");
+	tree = rseq_counter_tree_create();
+	ok(tree != NULL, "Create tree");
+	if (!tree)
+		abort();
+	test_counter_tree_small(tree);
+	rseq_counter_tree_destroy(tree);
+	test_counter_tree_concurrent();
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
@@ -0,0 +1,206 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Per-CPU extent allocator test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/extent-alloc.h>
+
+#include "tap.h"
+
+#define NR_TESTS 7
+
+#define SPACE_SIZE	(1ULL << 20)
+#define LEASE_LEN	256
+#define NR_THREADS	4
+#define NR_EXTENTS	2000	/* Per thread. */
+#define ENOSPC_SIZE	(64 * LEASE_LEN + 17)
+
+struct extent_alloc_test_data {
+	struct rseq_extent_alloc *ea;
+	struct rseq_extent extents[NR_EXTENTS];
+	unsigned int seed;
+	int nr_errors;
+};
+
+static int test_extent_cmp(const void *a, const void *b)
+{
+	const struct rseq_extent *ea = a, *eb = b;
+
+	if (ea->offset != eb->offset)
+		return ea->offset < eb->offset ? -1 : 1;
+	return 0;
+}
+
+/* Lengths mostly fit in a lease, with a few larger ones. */
+static uint64_t test_extent_len(unsigned int *seed)
+{
+	unsigned int r = rand_r(seed);
+
+	if (!(r % 64))
+		return LEASE_LEN + r % (4 * LEASE_LEN);
+	return 1 + r % 32;
+}
+
+void *test_extent_alloc_thread(void *arg)
+{
+	struct extent_alloc_test_data *data = arg;
+	int i, round;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	for (i = 0; i < NR_EXTENTS; i++) {
+		data->extents[i].len = test_extent_len(&data->seed);
+		if (rseq_extent_alloc_get(data->ea, data->extents[i].len,
+				&data->extents[i].offset))
+			data->nr_errors++;
+	}
+	/* Free and reallocate every other extent, a few times. */
+	for (round = 0; round < 4; round++) {
+		for (i = round & 1; i < NR_EXTENTS; i += 2)
+			rseq_extent_alloc_put(data->ea, data->extents[i].offset,
+					      data->extents[i].len);
+		for (i = round & 1; i < NR_EXTENTS; i += 2) {
+			data->extents[i].len = test_extent_len(&data->seed);
+			if (rseq_extent_alloc_get(data->ea, data->extents[i].len,
+					&data->extents[i].offset))
+				data->nr_errors++;
+		}
+	}
+
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+
+static void test_extent_alloc_concurrent(void)
+{
+	static struct extent_alloc_test_data data[NR_THREADS];
+	static struct rseq_extent all[NR_THREADS * NR_EXTENTS];
+	pthread_t test_threads[NR_THREADS];
+	struct rseq_extent_alloc *ea;
+	uint64_t nr_extents, end = 0;
+	bool disjoint = true;
+	int i, j, nr_errors = 0;
+
+	ea = rseq_extent_alloc_create(SPACE_SIZE, LEASE_LEN);
+	if (!ea)
+		abort();
+	for (i = 0; i < NR_THREADS; i++) {
+		data[i].ea = ea;
+		data[i].seed = i + 1;
+		pthread_create(&test_threads[i], NULL, test_extent_alloc_thread, &data[i]);
+	}
+	for (i = 0; i < NR_THREADS; i++) {
+		pthread_join(test_threads[i], NULL);
+		nr_errors += data[i].nr_errors;
+		memcpy(&all[i * NR_EXTENTS], data[i].extents, sizeof(data[i].extents));
+	}
+	ok(!nr_errors, "Concurrent allocations and frees");
+
+	qsort(all, NR_THREADS * NR_EXTENTS, sizeof(all[0]), test_extent_cmp);
+	for (i = 0; i < NR_THREADS * NR_EXTENTS; i++) {
+		if (all[i].offset < end || all[i].offset + all[i].len > SPACE_SIZE)
+			disjoint = false;
+		end = all[i].offset + all[i].len;
+	}
+	ok(disjoint, "Allocated extents are disjoint");
+
+	for (i = 0; i < NR_THREADS; i++) {
+		for (j = 0; j < NR_EXTENTS; j++)
+			rseq_extent_alloc_put(ea, data[i].extents[j].offset,
+					      data[i].extents[j].len);
+	}
+	rseq_extent_alloc_flush(ea);
+	ok(rseq_extent_alloc_free_blocks(ea, &nr_extents) == SPACE_SIZE &&
+	   nr_extents == 1, "Flushed frees coalesce into the whole space");
+	rseq_extent_alloc_destroy(ea);
+}
+
+static void test_extent_alloc_enospc(void)
+{
+	static uint64_t offsets[ENOSPC_SIZE / 3];
+	struct rseq_extent_alloc *ea;
+	uint64_t offset, total = 0;
+	size_t nr = 0, i;
+
+	ea = rseq_extent_alloc_create(ENOSPC_SIZE, LEASE_LEN);
+	if (!ea)
+		abort();
+	ok(rseq_extent_alloc_get(ea, 0, &offset) == -1 && errno == EINVAL,
+	   "Empty extents are rejected");
+	while (!rseq_extent_alloc_get(ea, 3, &offset))
+		offsets[nr++] = offset;
+	/* Leave holes in leases and batches of freed extents. */
+	for (i = 0; i < nr; i++) {
+		if (offsets[i] % 5)
+			total += 3;
+		else
+			rseq_extent_alloc_put(ea, offsets[i], 3);
+	}
+	while (!rseq_extent_alloc_get(ea, 1, &offset))
+		total++;
+	ok(errno == ENOSPC && total == ENOSPC_SIZE,
+	   "Every block is allocated before running out of space");
+	rseq_extent_alloc_destroy(ea);
+}
+
+int main(void)
+{
+	struct rseq_extent_alloc *ea;
+
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	ea = rseq_extent_alloc_create(SPACE_SIZE, LEASE_LEN);
+	if (!ea && errno == ENOSYS) {
+		skip(NR_TESTS, "rseq membarrier is unavailable");
+		goto end;
+	}
+	rseq_extent_alloc_destroy(ea);
+	ok(!rseq_extent_alloc_create(SPACE_SIZE, 0) && errno == EINVAL &&
+	   !rseq_extent_alloc_create(SPACE_SIZE, RSEQ_EXTENT_ALLOC_MAX_LEASE + 1) &&
+	   errno == EINVAL, "Invalid lease lengths are rejected");
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	}
+
+	diag("per-CPU extent allocator");
+	test_extent_alloc_concurrent();
+	test_extent_alloc_enospc();
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
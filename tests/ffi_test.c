@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Out-of-line FFI entry points test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/ffi.h>
+
+#include "tap.h"
+
+#define NR_TESTS 6
+
+#define NR_FIELDS	4
+#define BATCH_LEN	64
+
+struct ffi_test_row {
+	intptr_t fields[NR_FIELDS];
+} __attribute__((aligned(128)));
+
+struct ffi_test_data {
+	struct ffi_test_row rows[CPU_SETSIZE];
+	long long reps;
+};
+
+void *test_ffi_thread(void *arg)
+{
+	struct ffi_test_data *data = arg;
+	off_t offsets[BATCH_LEN];
+	intptr_t counts[BATCH_LEN];
+	long long i;
+	int j;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	for (j = 0; j < BATCH_LEN; j++) {
+		offsets[j] = offsetof(struct ffi_test_row, fields[j % NR_FIELDS]);
+		counts[j] = 1 + j % NR_FIELDS;
+	}
+	for (i = 0; i < data->reps; i++)
+		rseq_ffi_percpu_add_batch(data->rows, sizeof(data->rows[0]),
+				offsets, counts, BATCH_LEN);
+
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+
+static void test_ffi_add_batch(void)
+{
+	const int num_threads = 8;
+	struct ffi_test_data *data;
+	pthread_t test_threads[num_threads];
+	bool sums_ok = true;
+	int i, j;
+
+	data = calloc(1, sizeof(*data));
+	if (!data)
+		abort();
+	data->reps = 5000;
+	for (i = 0; i < num_threads; i++)
+		pthread_create(&test_threads[i], NULL, test_ffi_thread, data);
+	for (i = 0; i < num_threads; i++)
+		pthread_join(test_threads[i], NULL);
+
+	for (j = 0; j < NR_FIELDS; j++) {
+		intptr_t sum = 0;
+
+		for (i = 0; i < CPU_SETSIZE; i++)
+			sum += data->rows[i].fields[j];
+		if (sum != (intptr_t) (j + 1) * (BATCH_LEN / NR_FIELDS) *
+				data->reps * num_threads)
+			sums_ok = false;
+	}
+	ok(sums_ok, "Batched per-CPU adds are all applied");
+	free(data);
+}
+
+static void test_ffi_primitive(void)
+{
+	intptr_t v = 1;
+	int cpu, ret;
+
+	do {
+		cpu = rseq_ffi_cpu_start();
+		ret = rseq_ffi_cmpeqv_storev(&v, 1, 2, cpu);
+	} while (ret == -1);
+	ok(ret == 0 && v == 2 && rseq_ffi_cmpeqv_storev(&v, 1, 3, cpu) != 0 && v == 2,
+	   "Out-of-line compare-and-store");
+}
+
+static void test_objs_free(void *obj, void *priv __attribute__((unused)))
+{
+	free(obj);
+}
+
+static void *test_objs_alloc(void *priv __attribute__((unused)))
+{
+	return malloc(1);
+}
+
+static int test_ptr_cmp(const void *a, const void *b)
+{
+	uintptr_t pa = (uintptr_t) *(void *const *) a, pb = (uintptr_t) *(void *const *) b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+static void test_ffi_cache_batch(void)
+{
+	static const struct rseq_percpu_cache_ops ops = {
+		.alloc = test_objs_alloc,
+		.free = test_objs_free,
+	};
+	struct rseq_percpu_cache *cache;
+	void *objs[BATCH_LEN], *again[BATCH_LEN];
+	size_t nr;
+	int i;
+
+	cache = rseq_percpu_cache_create(&ops, NULL, BATCH_LEN, 8);
+	if (!cache)
+		abort();
+	nr = rseq_ffi_percpu_cache_pop_batch(cache, objs, BATCH_LEN);
+	ok(nr == BATCH_LEN, "Pop a batch of objects");
+	rseq_ffi_percpu_cache_push_batch(cache, objs, BATCH_LEN);
+	nr = rseq_ffi_percpu_cache_pop_batch(cache, again, BATCH_LEN);
+	qsort(objs, BATCH_LEN, sizeof(objs[0]), test_ptr_cmp);
+	qsort(again, nr, sizeof(again[0]), test_ptr_cmp);
+	for (i = 0; i < (int) nr; i++) {
+		if (again[i] != objs[i])
+			nr = 0;
+	}
+	ok(nr == BATCH_LEN, "Pushed batch is popped back");
+	rseq_ffi_percpu_cache_push_batch(cache, again, BATCH_LEN);
+	rseq_percpu_cache_destroy(cache);
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+
+	diag("ffi entry points");
+	test_ffi_primitive();
+	test_ffi_add_batch();
+	test_ffi_cache_batch();
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
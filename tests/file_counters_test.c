@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * File-backed per-CPU counters test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <rseq/rseq.h>
+#include <rseq/file-counters.h>
+
+#include "tap.h"
+
+#define NR_TESTS 10
+
+#define NR_COUNTERS	4
+#define NR_THREADS	8
+#define NR_ADDS		100000
+
+/* File layout, for the tests corrupting or shrinking a file. */
+#define HEADER_LEN		4096
+#define HEADER_NR_ROWS_OFFSET	20
+#define ROW_LEN			128
+
+struct file_counters_test_data {
+	struct rseq_file_counters *fc;
+	int thread;
+};
+
+static void *test_file_counters_thread(void *arg)
+{
+	struct file_counters_test_data *data = arg;
+	int i;
+
+	if (rseq_register_current_thread())
+		abort();
+	for (i = 0; i < NR_ADDS; i++) {
+		rseq_file_counters_inc(data->fc, 0);
+		rseq_file_counters_add(data->fc, 1 + data->thread % (NR_COUNTERS - 1), 2);
+	}
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+static bool test_counters_equal(struct rseq_file_counters *fc,
+		const intptr_t *expect)
+{
+	int i;
+
+	for (i = 0; i < NR_COUNTERS; i++) {
+		if (rseq_file_counters_read(fc, i) != expect[i])
+			return false;
+	}
+	return true;
+}
+
+static void test_file_counters_concurrent(struct rseq_file_counters *fc,
+		intptr_t *expect)
+{
+	struct file_counters_test_data data[NR_THREADS];
+	pthread_t threads[NR_THREADS];
+	int i;
+
+	for (i = 0; i < NR_THREADS; i++) {
+		data[i].fc = fc;
+		data[i].thread = i;
+		if (pthread_create(&threads[i], NULL, test_file_counters_thread, &data[i]))
+			abort();
+	}
+	for (i = 0; i < NR_THREADS; i++) {
+		if (pthread_join(threads[i], NULL))
+			abort();
+		expect[0] += NR_ADDS;
+		expect[1 + i % (NR_COUNTERS - 1)] += 2 * NR_ADDS;
+	}
+	ok(test_counters_equal(fc, expect), "Concurrent additions are counted");
+}
+
+/* Add to the counters from a child process killed before it exits. */
+static void test_file_counters_crash(struct rseq_file_counters *fc,
+		intptr_t *expect)
+{
+	int status, i;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		abort();
+	if (!pid) {
+		for (i = 0; i < NR_ADDS; i++)
+			rseq_file_counters_add(fc, 3, -1);
+		kill(getpid(), SIGKILL);
+		_exit(1);
+	}
+	if (waitpid(pid, &status, 0) != pid)
+		abort();
+	expect[3] -= NR_ADDS;
+	ok(WIFSIGNALED(status) && test_counters_equal(fc, expect),
+	   "Additions of a crashed process are kept");
+}
+
+static int test_file_nr_rows(int fd)
+{
+	off_t len = lseek(fd, 0, SEEK_END);
+
+	return (int) ((len - HEADER_LEN) / ROW_LEN);
+}
+
+static void test_file_counters(void)
+{
+	char path[] = "/tmp/rseq-file-counters-test-XXXXXX";
+	intptr_t expect[NR_COUNTERS] = { 0 };
+	struct rseq_file_counters *fc;
+	uint32_t nr_rows = 1;
+	int fd, i;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		abort();
+
+	errno = 0;
+	ok(!rseq_file_counters_open(path, 0) && errno == EINVAL,
+	   "Files without counters are refused");
+
+	fc = rseq_file_counters_open(path, NR_COUNTERS);
+	ok(fc && test_counters_equal(fc, expect) && !rseq_file_counters_nr_checkpoints(fc),
+	   "New file holds zeroed counters");
+	if (!fc)
+		abort();
+	test_file_counters_concurrent(fc, expect);
+	test_file_counters_crash(fc, expect);
+	ok(!rseq_file_counters_checkpoint(fc) && rseq_file_counters_nr_checkpoints(fc) == 1,
+	   "Checkpoint writes the counters back");
+	rseq_file_counters_close(fc);
+
+	fc = rseq_file_counters_open(path, NR_COUNTERS);
+	ok(fc && test_counters_equal(fc, expect) &&
+	   rseq_file_counters_nr_checkpoints(fc) == 1,
+	   "Counters are recovered when reopening the file");
+	rseq_file_counters_close(fc);
+
+	errno = 0;
+	ok(!rseq_file_counters_open(path, NR_COUNTERS + 1) && errno == EINVAL,
+	   "Files of another number of counters are refused");
+
+	/* Keep the row of CPU 0 only, as if created on a single CPU. */
+	if (pwrite(fd, &nr_rows, sizeof(nr_rows), HEADER_NR_ROWS_OFFSET) != sizeof(nr_rows) ||
+			ftruncate(fd, HEADER_LEN + ROW_LEN))
+		abort();
+	fc = rseq_file_counters_open(path, NR_COUNTERS);
+	if (!fc)
+		abort();
+	rseq_file_counters_inc(fc, 0);
+	for (i = 0; i < NR_COUNTERS; i++)
+		expect[i] = rseq_file_counters_read(fc, i);
+	rseq_file_counters_close(fc);
+	fc = rseq_file_counters_open(path, NR_COUNTERS);
+	ok(fc && fc->nr_rows == test_file_nr_rows(fd) &&
+	   test_counters_equal(fc, expect),
+	   "Files are grown to one row per possible CPU");
+	rseq_file_counters_close(fc);
+
+	if (pwrite(fd, "garbage!", 8, 0) != 8)
+		abort();
+	errno = 0;
+	ok(!rseq_file_counters_open(path, NR_COUNTERS) && errno == EINVAL,
+	   "Files which are not counter files are refused");
+
+	close(fd);
+	unlink(path);
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	}
+
+	diag("file-backed per-CPU counters");
+	test_file_counters();
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
@@ -0,0 +1,155 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Per-CPU in-flight request tracker test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/inflight.h>
+
+#include "tap.h"
+
+#define NR_TESTS 7
+
+#define NR_BACKENDS	8
+
+struct inflight_test_data {
+	struct rseq_inflight *inflight;
+	long long reps;
+};
+
+void *test_inflight_thread(void *arg)
+{
+	struct inflight_test_data *data = arg;
+	size_t pending[4];
+	long long i;
+	int j;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	for (i = 0; i < data->reps; i++) {
+		for (j = 0; j < 4; j++) {
+			pending[j] = rseq_inflight_select(data->inflight);
+			rseq_inflight_begin(data->inflight, pending[j]);
+		}
+		for (j = 0; j < 4; j++)
+			rseq_inflight_end(data->inflight, pending[j]);
+	}
+
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+
+static void test_inflight_concurrent(struct rseq_inflight *inflight)
+{
+	const int num_threads = 8;
+	struct inflight_test_data data;
+	pthread_t test_threads[num_threads];
+	bool balanced = true;
+	int i;
+
+	data.inflight = inflight;
+	data.reps = 20000;
+	for (i = 0; i < num_threads; i++)
+		pthread_create(&test_threads[i], NULL, test_inflight_thread, &data);
+	for (i = 0; i < num_threads; i++)
+		pthread_join(test_threads[i], NULL);
+	for (i = 0; i < NR_BACKENDS; i++) {
+		if (rseq_inflight_read(inflight, i) != 0)
+			balanced = false;
+	}
+	ok(balanced, "Completions cancel requests across CPUs");
+}
+
+static void test_inflight_select(struct rseq_inflight *inflight)
+{
+	cpu_set_t cpuset, old_cpuset;
+	int i, nr_loaded = 0;
+
+	for (i = 0; i < 1000; i++)
+		rseq_inflight_begin(inflight, 0);
+	rseq_inflight_refresh(inflight);
+	ok(rseq_inflight_read(inflight, 0) == 1000, "Read sums all CPUs");
+	for (i = 0; i < 1000; i++) {
+		if (rseq_inflight_select(inflight) == 0)
+			nr_loaded++;
+	}
+	ok(nr_loaded == 0, "Loaded backend is never chosen over another one");
+
+	/* Requests from the current CPU count before the next refresh. */
+	if (sched_getaffinity(0, sizeof(old_cpuset), &old_cpuset))
+		abort();
+	CPU_ZERO(&cpuset);
+	CPU_SET(sched_getcpu(), &cpuset);
+	if (sched_setaffinity(0, sizeof(cpuset), &cpuset))
+		abort();
+	for (i = 0; i < 2000; i++)
+		rseq_inflight_end(inflight, 0);
+	for (i = 0; i < 1000; i++) {
+		if (rseq_inflight_select(inflight) == 0)
+			nr_loaded++;
+	}
+	ok(nr_loaded > 0, "Local completions are seen before the next refresh");
+	if (sched_setaffinity(0, sizeof(old_cpuset), &old_cpuset))
+		abort();
+	for (i = 0; i < 1000; i++)
+		rseq_inflight_begin(inflight, 0);
+}
+
+int main(void)
+{
+	struct rseq_inflight *inflight;
+
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+
+	diag("inflight tracker");
+	/* Refreshes are explicit within the test. */
+	inflight = rseq_inflight_create(NR_BACKENDS, UINT32_MAX);
+	ok(inflight != NULL, "Create in-flight tracker");
+	if (!inflight)
+		abort();
+	test_inflight_select(inflight);
+	test_inflight_concurrent(inflight);
+	rseq_inflight_destroy(inflight);
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Timestamp-ordered merge iterator test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/merge-iter.h>
+
+#include "tap.h"
+
+#define NR_TESTS 10
+
+#define NR_CPUS		8
+#define NR_EVENTS	1000
+
+struct test_event {
+	uint64_t timestamp;
+	int cpu;
+};
+
+struct test_buffer {
+	struct test_event events[NR_EVENTS];
+	int head;
+	int tail;
+};
+
+static struct test_buffer buffers[NR_CPUS];
+
+static const void *test_peek(void *priv, int cpu, uint64_t *timestamp)
+{
+	struct test_buffer *buf = &((struct test_buffer *) priv)[cpu];
+
+	if (buf->head == buf->tail)
+		return NULL;
+	*timestamp = buf->events[buf->head].timestamp;
+	return &buf->events[buf->head];
+}
+
+static void test_consume(void *priv, int cpu)
+{
+	((struct test_buffer *) priv)[cpu].head++;
+}
+
+static const struct rseq_merge_source test_source = {
+	.peek = test_peek,
+	.consume = test_consume,
+};
+
+static void test_append(int cpu, uint64_t timestamp)
+{
+	struct test_buffer *buf = &buffers[cpu];
+
+	buf->events[buf->tail].timestamp = timestamp;
+	buf->events[buf->tail].cpu = cpu;
+	buf->tail++;
+}
+
+/* Merge buffers filled in advance with interleaved timestamps. */
+static void test_merge_all(void)
+{
+	struct rseq_merge_iter *iter;
+	const struct test_event *event;
+	uint64_t last = 0, timestamp;
+	int i, j, cpu, nr = 0;
+	bool ordered = true, in_place = true;
+
+	memset(buffers, 0, sizeof(buffers));
+	srand(42);
+	for (i = 0; i < NR_CPUS; i++) {
+		uint64_t t = 0;
+
+		for (j = 0; j < NR_EVENTS; j++) {
+			t += 1 + rand() % 100;
+			test_append(i, t);
+		}
+	}
+
+	iter = rseq_merge_iter_create(&test_source, buffers, NR_CPUS, 0);
+	ok(iter != NULL, "Create merge iterator");
+	if (!iter)
+		abort();
+	for (;;) {
+		event = rseq_merge_iter_next(iter, false, &cpu, &timestamp);
+		if (!event)
+			event = rseq_merge_iter_next(iter, true, &cpu, &timestamp);
+		if (!event)
+			break;
+		if (timestamp < last || event->timestamp != timestamp)
+			ordered = false;
+		if (event != &buffers[cpu].events[buffers[cpu].head])
+			in_place = false;
+		last = timestamp;
+		nr++;
+	}
+	ok(nr == NR_CPUS * NR_EVENTS, "All events merged");
+	ok(ordered && rseq_merge_iter_nr_out_of_order(iter) == 0,
+	   "Events merged in timestamp order");
+	ok(in_place, "Events are returned in place");
+	rseq_merge_iter_destroy(iter);
+}
+
+static uint64_t test_next_timestamp(struct rseq_merge_iter *iter, bool flush)
+{
+	uint64_t timestamp;
+
+	if (!rseq_merge_iter_next(iter, flush, NULL, &timestamp))
+		return 0;
+	return timestamp;
+}
+
+/* Streaming merge with buffers filled while iterating. */
+static void test_merge_stream(void)
+{
+	struct rseq_merge_iter *iter;
+
+	memset(buffers, 0, sizeof(buffers));
+	iter = rseq_merge_iter_create(&test_source, buffers, 2, 50);
+	if (!iter)
+		abort();
+
+	test_append(0, 100);
+	ok(test_next_timestamp(iter, false) == 0,
+	   "Event within the window of an empty buffer is held");
+	test_append(1, 90);
+	ok(test_next_timestamp(iter, false) == 90,
+	   "Oldest event is returned once all buffers have events");
+	test_append(1, 200);
+	ok(test_next_timestamp(iter, false) == 100,
+	   "Event out of the window is returned");
+	ok(test_next_timestamp(iter, false) == 0 &&
+	   test_next_timestamp(iter, true) == 200,
+	   "Flush ignores the window");
+	test_append(0, 150);
+	ok(test_next_timestamp(iter, true) == 150 &&
+	   rseq_merge_iter_nr_out_of_order(iter) == 1,
+	   "Late events are counted as out of order");
+	ok(test_next_timestamp(iter, true) == 0, "Buffers are drained");
+	rseq_merge_iter_destroy(iter);
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	diag("merge iterator");
+	test_merge_all();
+	test_merge_stream();
+
+	exit(exit_status());
+}
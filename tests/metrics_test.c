@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Labeled metrics registry test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/metrics.h>
+
+#include "tap.h"
+
+#define NR_TESTS 11
+
+#define NR_ENDPOINTS	3000
+
+struct metrics_test_data {
+	struct rseq_metrics_counter *counters;
+	int nr_counters;
+	long long reps;
+};
+
+void *test_metrics_thread(void *arg)
+{
+	struct metrics_test_data *data = arg;
+	long long i;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	for (i = 0; i < data->reps; i++)
+		rseq_metrics_counter_inc(&data->counters[i % data->nr_counters]);
+
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+
+static void test_metrics_lookup(struct rseq_metrics_registry *registry)
+{
+	struct rseq_metrics_label labels[] = {
+		{ "method", "GET" },
+		{ "code", "200" },
+	};
+	struct rseq_metrics_label reversed[] = {
+		{ "code", "200" },
+		{ "method", "GET" },
+	};
+	struct rseq_metrics_label duplicate[] = {
+		{ "code", "200" },
+		{ "code", "500" },
+	};
+	struct rseq_metrics_counter a, b, c;
+
+	ok(!rseq_metrics_counter_get(registry, "requests", labels, 2, &a) &&
+	   !rseq_metrics_counter_get(registry, "requests", reversed, 2, &b) &&
+	   a.slots == b.slots, "Labels are matched regardless of their order");
+	ok(!rseq_metrics_counter_get(registry, "requests", labels, 1, &c) &&
+	   c.slots != a.slots, "Different label sets are different series");
+	ok(rseq_metrics_counter_get(registry, "requests", duplicate, 2, &c) == -1 &&
+	   errno == EINVAL, "Duplicate label keys are rejected");
+}
+
+/*
+ * Concurrent increments of series spanning several chunks, checked
+ * through snapshots and their deltas.
+ */
+static void test_metrics_snapshot(struct rseq_metrics_registry *registry)
+{
+	const int num_threads = 8;
+	struct rseq_metrics_counter *counters, again;
+	struct rseq_metrics_snapshot snapshot;
+	struct metrics_test_data data;
+	pthread_t test_threads[num_threads];
+	size_t i, base;
+	bool stable = true, values_ok = true, deltas_ok = true;
+	char value[16];
+
+	counters = calloc(NR_ENDPOINTS, sizeof(*counters));
+	assert(counters);
+	base = rseq_metrics_registry_nr_series(registry);
+	for (i = 0; i < NR_ENDPOINTS; i++) {
+		struct rseq_metrics_label label = { "endpoint", value };
+
+		snprintf(value, sizeof(value), "/%zu", i);
+		if (rseq_metrics_counter_get(registry, "latency_count", &label, 1,
+				&counters[i]))
+			abort();
+	}
+	for (i = 0; i < NR_ENDPOINTS; i++) {
+		struct rseq_metrics_label label = { "endpoint", value };
+
+		snprintf(value, sizeof(value), "/%zu", i);
+		if (rseq_metrics_counter_get(registry, "latency_count", &label, 1,
+				&again) || again.slots != counters[i].slots)
+			stable = false;
+	}
+	ok(stable && rseq_metrics_registry_nr_series(registry) == base + NR_ENDPOINTS,
+	   "Series handles are stable across lookups");
+
+	data.counters = counters;
+	data.nr_counters = NR_ENDPOINTS;
+	data.reps = 10 * NR_ENDPOINTS;
+	for (i = 0; i < (size_t) num_threads; i++)
+		pthread_create(&test_threads[i], NULL, test_metrics_thread, &data);
+	for (i = 0; i < (size_t) num_threads; i++)
+		pthread_join(test_threads[i], NULL);
+
+	memset(&snapshot, 0, sizeof(snapshot));
+	ok(!rseq_metrics_snapshot_take(registry, &snapshot) &&
+	   snapshot.nr_samples == base + NR_ENDPOINTS, "Take snapshot");
+	for (i = base; i < snapshot.nr_samples; i++) {
+		if (snapshot.samples[i].value != 10 * num_threads ||
+				snapshot.samples[i].delta != 10 * num_threads)
+			values_ok = false;
+	}
+	ok(values_ok && !strcmp(snapshot.samples[base].name, "latency_count") &&
+	   snapshot.samples[base].nr_labels == 1 &&
+	   !strcmp(snapshot.samples[base].labels[0].value, "/0"),
+	   "Snapshot values sum all CPUs");
+
+	rseq_metrics_counter_add(&counters[7], 5);
+	ok(!rseq_metrics_snapshot_take(registry, &snapshot), "Take second snapshot");
+	for (i = base; i < snapshot.nr_samples; i++) {
+		if (snapshot.samples[i].delta != (i == base + 7 ? 5 : 0))
+			deltas_ok = false;
+	}
+	ok(deltas_ok, "Snapshot deltas are relative to the previous snapshot");
+
+	rseq_metrics_snapshot_fini(&snapshot);
+	free(counters);
+}
+
+int main(void)
+{
+	struct rseq_metrics_registry *registry;
+
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+
+	diag("metrics registry");
+	registry = rseq_metrics_registry_create();
+	ok(registry != NULL, "Create registry");
+	if (!registry)
+		abort();
+	test_metrics_lookup(registry);
+	test_metrics_snapshot(registry);
+	rseq_metrics_registry_destroy(registry);
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
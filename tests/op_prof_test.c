@@ -0,0 +1,153 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Sampled rseq operation instrumentation test, built with RSEQ_OP_PROF.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/metrics.h>
+#include <rseq/op-prof.h>
+
+#include "tap.h"
+
+#define NR_TESTS 7
+
+#define PERIOD		4
+#define NR_OPS		4000
+
+static uint64_t test_nr_samples(const char *name)
+{
+	struct rseq_op_prof_snapshot snapshot;
+	uint64_t count = 0;
+	size_t i, j;
+
+	memset(&snapshot, 0, sizeof(snapshot));
+	if (rseq_op_prof_snapshot_take(&snapshot))
+		abort();
+	for (i = 0; i < snapshot.nr_sites; i++) {
+		if (strcmp(snapshot.names[i], name))
+			continue;
+		for (j = 0; j < RSEQ_OP_PROF_NR_BUCKETS; j++)
+			count += snapshot.buckets[i][j];
+	}
+	rseq_op_prof_snapshot_fini(&snapshot);
+	return count;
+}
+
+static void test_custom_op(intptr_t *v)
+{
+	RSEQ_OP_PROF_BEGIN("custom");
+	int cpu;
+
+	do {
+		cpu = rseq_cpu_start();
+	} while (rseq_unlikely(rseq_addv(v, 1, cpu)));
+	RSEQ_OP_PROF_END();
+}
+
+/* Another site with the same name. */
+static void test_custom_op_again(intptr_t *v)
+{
+	RSEQ_OP_PROF_BEGIN("custom");
+	int cpu;
+
+	do {
+		cpu = rseq_cpu_start();
+	} while (rseq_unlikely(rseq_addv(v, 1, cpu)));
+	RSEQ_OP_PROF_END();
+}
+
+static bool test_sampled(uint64_t nr_samples, uint64_t nr_ops)
+{
+	/* Migrations start countdowns of other CPUs. */
+	return nr_samples >= nr_ops / PERIOD && nr_samples <= nr_ops / PERIOD + 16;
+}
+
+static void test_op_prof(void)
+{
+	struct rseq_metrics_registry *registry;
+	struct rseq_metrics_counter counter;
+	intptr_t v = 0;
+	uint64_t nr;
+	int i;
+
+	registry = rseq_metrics_registry_create();
+	if (!registry || rseq_metrics_counter_get(registry, "ops", NULL, 0, &counter))
+		abort();
+
+	ok(!rseq_op_prof_enable(PERIOD), "Enable sampling");
+	for (i = 0; i < NR_OPS; i++)
+		rseq_metrics_counter_inc(&counter);
+	nr = test_nr_samples("metrics_counter_add");
+	ok(test_sampled(nr, NR_OPS),
+	   "One in %d library operations is sampled (%llu samples)",
+	   PERIOD, (unsigned long long) nr);
+
+	for (i = 0; i < NR_OPS; i++) {
+		test_custom_op(&v);
+		test_custom_op_again(&v);
+	}
+	nr = test_nr_samples("custom");
+	ok(test_sampled(nr, 2 * NR_OPS) && v == 2 * NR_OPS,
+	   "Sites with the same name share their histograms (%llu samples)",
+	   (unsigned long long) nr);
+
+	ok(!rseq_op_prof_enable(0), "Disable sampling");
+	for (i = 0; i < NR_OPS; i++)
+		test_custom_op(&v);
+	ok(test_nr_samples("custom") == nr, "Disabled sites are not sampled");
+
+	rseq_metrics_registry_destroy(registry);
+}
+
+static void test_op_prof_buckets(void)
+{
+	unsigned int i;
+	bool monotonic = true;
+
+	for (i = 1; i < RSEQ_OP_PROF_NR_BUCKETS; i++) {
+		if (rseq_op_prof_bucket_floor(i) <= rseq_op_prof_bucket_floor(i - 1))
+			monotonic = false;
+	}
+	ok(monotonic && rseq_op_prof_bucket_floor(8) == 8 &&
+	   rseq_op_prof_bucket_floor(16) == 16 && rseq_op_prof_bucket_floor(17) == 18,
+	   "Buckets are log-linear");
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	}
+
+	diag("rseq operation sampling");
+	test_op_prof();
+	test_op_prof_buckets();
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
@@ -13,7 +13,10 @@
 #include <unistd.h>
 #include <poll.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <signal.h>
+#include <time.h>
 #include <errno.h>
 #include <stddef.h>
 
@@ -36,7 +39,8 @@ static int opt_modulo, verbose;
 
 static int opt_yield, opt_signal, opt_sleep,
 		opt_disable_rseq, opt_threads = 200,
-		opt_disable_mod = 0, opt_test = 's', opt_mb = 0;
+		opt_disable_mod = 0, opt_test = 's', opt_mb = 0,
+		opt_procs = 0, opt_sync = 'r';
 
 #ifndef RSEQ_SKIP_FASTPATH
 static long long opt_reps = 5000;
@@ -47,10 +51,13 @@ static long long opt_reps = 100;
 static __thread __attribute__((tls_model("initial-exec")))
 unsigned int signals_delivered;
 
+static __thread __attribute__((tls_model("initial-exec"), unused))
+int nr_abort;
+
 #ifndef BENCHMARK
 
 static __thread __attribute__((tls_model("initial-exec"), unused))
-int yield_mod_cnt, nr_abort;
+int yield_mod_cnt;
 
 #define printf_verbose(fmt, ...)			\
 	do {						\
@@ -237,10 +244,19 @@ int yield_mod_cnt, nr_abort;
 	} \
 }
 
+#define printf_report	printf_verbose
+
 #else
 
 #define printf_verbose(fmt, ...)
 
+/* Only the abort path is instrumented, to report abort rates. */
+#define RSEQ_INJECT_FAILED \
+	nr_abort++;
+
+#define printf_report(fmt, ...)				\
+	printf(fmt, ## __VA_ARGS__)
+
 #endif /* BENCHMARK */
 
 #include <rseq/rseq.h>
@@ -324,6 +340,33 @@ struct percpu_memcpy_buffer {
 	struct percpu_memcpy_buffer_entry c[CPU_SETSIZE];
 };
 
+#define REGION_WORDS	8
+
+/*
+ * Each record holds REGION_WORDS copies of its version. A record is
+ * only consistent when every word matches.
+ */
+struct percpu_region_record {
+	intptr_t words[REGION_WORDS];
+};
+
+struct percpu_region_entry {
+	struct percpu_region_record rec;
+	intptr_t version;
+	intptr_t validated;
+} __attribute__((aligned(128)));
+
+struct percpu_region {
+	struct percpu_region_entry c[CPU_SETSIZE];
+};
+
+struct region_thread_test_data {
+	struct percpu_region *data;
+	long long reps;
+	long long nr_updates;
+	long long nr_validations;
+};
+
 /* A simple percpu spinlock. Grabs lock on current cpu. */
 static int rseq_this_cpu_lock(struct percpu_lock *lock)
 {
@@ -1102,6 +1145,505 @@ void test_percpu_memcpy_buffer(void)
 	assert(sum == expected_sum);
 }
 
+/*
+ * Publish a new version of the record on the current CPU: the record
+ * words are copied within the critical section, and the version is
+ * the final store.
+ */
+static void this_cpu_region_update(struct percpu_region *region)
+{
+	for (;;) {
+		struct percpu_region_record newrec;
+		intptr_t version;
+		int i, ret, cpu;
+
+		cpu = rseq_cpu_start();
+		version = RSEQ_READ_ONCE(region->c[cpu].version);
+		for (i = 0; i < REGION_WORDS; i++)
+			newrec.words[i] = version + 1;
+		ret = rseq_cmpeqv_trymemcpy_storev(&region->c[cpu].version,
+			version, &region->c[cpu].rec, &newrec, sizeof(newrec),
+			version + 1, cpu);
+		if (rseq_likely(!ret))
+			break;
+		/* Retry if comparison fails or rseq aborts. */
+	}
+}
+
+/*
+ * Snapshot the record on the current CPU, and count it as validated
+ * only if the snapshot is still current at commit. Return the value
+ * returned by rseq_cmpeqv_cmpeqm_storev(), or 1 if the snapshot is
+ * torn by a concurrent (aborted) update.
+ */
+static int this_cpu_region_validate(struct percpu_region *region,
+				    bool corrupt)
+{
+	struct percpu_region_record snapshot;
+	intptr_t validated;
+	int i, cpu;
+
+	cpu = rseq_cpu_start();
+	validated = RSEQ_READ_ONCE(region->c[cpu].validated);
+	for (i = 0; i < REGION_WORDS; i++)
+		snapshot.words[i] = RSEQ_READ_ONCE(region->c[cpu].rec.words[i]);
+	for (i = 1; i < REGION_WORDS; i++) {
+		if (snapshot.words[i] != snapshot.words[0])
+			return 1;
+	}
+	/* Validation against a stale snapshot must never succeed. */
+	if (corrupt)
+		snapshot.words[REGION_WORDS - 1]++;
+	return rseq_cmpeqv_cmpeqm_storev(&region->c[cpu].validated,
+			validated, &region->c[cpu].rec, &snapshot,
+			sizeof(snapshot), validated + 1, cpu);
+}
+
+void *test_percpu_region_thread(void *arg)
+{
+	struct region_thread_test_data *thread_data = arg;
+	struct percpu_region *region = thread_data->data;
+	long long i, reps;
+
+	if (!opt_disable_rseq && rseq_register_current_thread())
+		abort();
+
+	reps = thread_data->reps;
+	for (i = 0; i < reps; i++) {
+		int ret;
+
+		if (i & 1) {
+			this_cpu_region_update(region);
+			thread_data->nr_updates++;
+		} else {
+			bool corrupt = !(i % 8);
+
+			ret = this_cpu_region_validate(region, corrupt);
+			if (corrupt && !ret)
+				abort();
+			if (!ret)
+				thread_data->nr_validations++;
+		}
+		if (opt_yield)
+			sched_yield();  /* encourage shuffling */
+	}
+
+	printf_verbose("tid %d: number of rseq abort: %d, signals delivered: %u\n",
+		       (int) rseq_gettid(), nr_abort, signals_delivered);
+	if (!opt_disable_rseq && rseq_unregister_current_thread())
+		abort();
+
+	return NULL;
+}
+
+/*
+ * Concurrent multi-word record updates and optimistic validations of
+ * per-cpu records from many threads.
+ */
+void test_percpu_region(void)
+{
+	const int num_threads = opt_threads;
+	int i, j, ret;
+	uint64_t nr_updates = 0, nr_validations = 0;
+	uint64_t sum_version = 0, sum_validated = 0;
+	struct percpu_region *region;
+	pthread_t test_threads[num_threads];
+	struct region_thread_test_data thread_data[num_threads];
+
+	region = calloc(1, sizeof(*region));
+	assert(region);
+
+	for (i = 0; i < num_threads; i++) {
+		thread_data[i].data = region;
+		thread_data[i].reps = opt_reps;
+		thread_data[i].nr_updates = 0;
+		thread_data[i].nr_validations = 0;
+		ret = pthread_create(&test_threads[i], NULL,
+				     test_percpu_region_thread,
+				     &thread_data[i]);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			abort();
+		}
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		ret = pthread_join(test_threads[i], NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_join");
+			abort();
+		}
+		nr_updates += thread_data[i].nr_updates;
+		nr_validations += thread_data[i].nr_validations;
+	}
+
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		struct percpu_region_entry *entry = &region->c[i];
+
+		/* Every committed version leaves a consistent record. */
+		for (j = 0; j < REGION_WORDS; j++)
+			assert(entry->rec.words[j] == entry->version);
+		sum_version += entry->version;
+		sum_validated += entry->validated;
+	}
+	free(region);
+
+	assert(sum_version == nr_updates);
+	assert(sum_validated == nr_validations);
+}
+
+/*
+ * Cross-process tests: prefork-style worker processes share per-cpu
+ * data in MAP_SHARED memory, so context switches between processes on
+ * the same cpu abort rseq critical sections. The rseq fast paths are
+ * compared against per-cpu process-shared pthread mutexes and per-cpu
+ * atomics on the same data layout.
+ */
+struct proc_lock_entry {
+	pthread_mutex_t mutex;
+	int spin;
+} __attribute__((aligned(128)));
+
+struct proc_test_stats {
+	long long nr_ops;
+	long long nr_abort;
+} __attribute__((aligned(128)));
+
+struct proc_test_data {
+	struct proc_lock_entry lock[CPU_SETSIZE];
+	struct inc_test_data inc;
+	struct percpu_list list;
+	struct percpu_buffer buffer;
+	int go;
+};
+
+static void *shared_zmalloc(size_t len)
+{
+	void *p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		abort();
+	}
+	return p;
+}
+
+static void shared_free(void *p, size_t len)
+{
+	if (munmap(p, len)) {
+		perror("munmap");
+		abort();
+	}
+}
+
+/* Lock the per-cpu data of the current cpu, for the mutex and atomic modes. */
+static int proc_lock(struct proc_test_data *data)
+{
+	int cpu = rseq_current_cpu();
+
+	if (opt_sync == 'm') {
+		if (pthread_mutex_lock(&data->lock[cpu].mutex))
+			abort();
+	} else {
+		while (__atomic_exchange_n(&data->lock[cpu].spin, 1,
+					   __ATOMIC_ACQUIRE)) {
+			while (RSEQ_READ_ONCE(data->lock[cpu].spin))
+				;
+		}
+	}
+	return cpu;
+}
+
+static void proc_unlock(struct proc_test_data *data, int cpu)
+{
+	if (opt_sync == 'm') {
+		if (pthread_mutex_unlock(&data->lock[cpu].mutex))
+			abort();
+	} else {
+		__atomic_store_n(&data->lock[cpu].spin, 0, __ATOMIC_RELEASE);
+	}
+}
+
+static void proc_test_inc(struct proc_test_data *data)
+{
+	int cpu, ret;
+
+	switch (opt_sync) {
+	case 'r':
+		do {
+			cpu = rseq_cpu_start();
+			ret = rseq_addv(&data->inc.c[cpu].count, 1, cpu);
+		} while (rseq_unlikely(ret));
+		break;
+	case 'a':
+		cpu = rseq_current_cpu();
+		__atomic_add_fetch(&data->inc.c[cpu].count, 1,
+				   __ATOMIC_RELAXED);
+		break;
+	default:
+		cpu = proc_lock(data);
+		data->inc.c[cpu].count++;
+		proc_unlock(data, cpu);
+		break;
+	}
+}
+
+static void proc_test_list(struct proc_test_data *data)
+{
+	struct percpu_list *list = &data->list;
+	struct percpu_list_node *node;
+	int cpu;
+
+	if (opt_sync == 'r') {
+		node = this_cpu_list_pop(list, NULL);
+		if (opt_yield)
+			sched_yield();  /* encourage shuffling */
+		if (node)
+			this_cpu_list_push(list, node, NULL);
+		return;
+	}
+	cpu = proc_lock(data);
+	node = __percpu_list_pop(list, cpu);
+	proc_unlock(data, cpu);
+	if (opt_yield)
+		sched_yield();  /* encourage shuffling */
+	if (!node)
+		return;
+	cpu = proc_lock(data);
+	node->next = list->c[cpu].head;
+	list->c[cpu].head = node;
+	proc_unlock(data, cpu);
+}
+
+static void proc_test_buffer(struct proc_test_data *data)
+{
+	struct percpu_buffer *buffer = &data->buffer;
+	struct percpu_buffer_node *node;
+	int cpu;
+
+	if (opt_sync == 'r') {
+		node = this_cpu_buffer_pop(buffer, NULL);
+		if (opt_yield)
+			sched_yield();  /* encourage shuffling */
+		if (node && !this_cpu_buffer_push(buffer, node, NULL)) {
+			/* Should increase buffer size. */
+			abort();
+		}
+		return;
+	}
+	cpu = proc_lock(data);
+	node = __percpu_buffer_pop(buffer, cpu);
+	proc_unlock(data, cpu);
+	if (opt_yield)
+		sched_yield();  /* encourage shuffling */
+	if (!node)
+		return;
+	cpu = proc_lock(data);
+	if (buffer->c[cpu].offset == buffer->c[cpu].buflen) {
+		/* Should increase buffer size. */
+		abort();
+	}
+	buffer->c[cpu].array[buffer->c[cpu].offset++] = node;
+	proc_unlock(data, cpu);
+}
+
+/*
+ * Worker process body. The rseq registration of the forking thread is
+ * inherited by the child, so the worker does not register again.
+ */
+static void test_percpu_process_worker(struct proc_test_data *data,
+				       struct proc_test_stats *stats)
+{
+	long long i, reps = opt_reps;
+
+	while (!__atomic_load_n(&data->go, __ATOMIC_ACQUIRE))
+		sched_yield();
+	for (i = 0; i < reps; i++) {
+		switch (opt_test) {
+		case 'i':
+			proc_test_inc(data);
+			break;
+		case 'l':
+			proc_test_list(data);
+			break;
+		case 'b':
+			proc_test_buffer(data);
+			break;
+		}
+	}
+	stats->nr_ops = reps;
+	stats->nr_abort = nr_abort;
+	printf_verbose("pid %d: number of rseq abort: %d, signals delivered: %u\n",
+		       (int) getpid(), nr_abort, signals_delivered);
+	fflush(stdout);
+	_exit(EXIT_SUCCESS);
+}
+
+/*
+ * Run the increment, list or buffer test in opt_procs forked processes
+ * sharing the per-cpu data, and report throughput and rseq abort rate.
+ */
+void test_percpu_process(void)
+{
+	const int num_procs = opt_procs;
+	int i, j, ret, nr_cpus = 0;
+	uint64_t sum = 0, expected_sum = 0;
+	long long nr_ops = 0, nr_abort_total = 0;
+	size_t stats_len, nodes_len, arrays_len, buflen;
+	struct proc_test_data *data;
+	struct proc_test_stats *stats;
+	struct percpu_list_node *list_nodes = NULL;
+	struct percpu_buffer_node *buffer_nodes = NULL, **arrays = NULL;
+	pthread_mutexattr_t attr;
+	pid_t pids[num_procs];
+	struct timespec begin, end;
+	cpu_set_t allowed_cpus;
+	double elapsed;
+
+	sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus);
+	nr_cpus = CPU_COUNT(&allowed_cpus);
+
+	data = shared_zmalloc(sizeof(*data));
+	stats_len = sizeof(*stats) * num_procs;
+	stats = shared_zmalloc(stats_len);
+	/* Worse-case is every item in same CPU. */
+	buflen = nr_cpus * BUFFER_ITEM_PER_CPU;
+	if (opt_test == 'b') {
+		nodes_len = sizeof(*buffer_nodes) * buflen;
+		buffer_nodes = shared_zmalloc(nodes_len);
+		arrays_len = sizeof(*arrays) * buflen * nr_cpus;
+		arrays = shared_zmalloc(arrays_len);
+	} else {
+		nodes_len = sizeof(*list_nodes) * buflen;
+		list_nodes = shared_zmalloc(nodes_len);
+	}
+
+	if (pthread_mutexattr_init(&attr) ||
+	    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED))
+		abort();
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (pthread_mutex_init(&data->lock[i].mutex, &attr))
+			abort();
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	/*
+	 * Generate list and buffer entries for every usable cpu, within
+	 * shared memory so they can move between processes.
+	 */
+	for (i = 0, j = 0; i < CPU_SETSIZE; i++) {
+		struct percpu_buffer_entry *entry = &data->buffer.c[i];
+		int k;
+
+		if (!CPU_ISSET(i, &allowed_cpus))
+			continue;
+		if (arrays) {
+			entry->array = &arrays[j * buflen];
+			entry->buflen = buflen;
+		}
+		for (k = 1; k <= BUFFER_ITEM_PER_CPU; k++) {
+			int index = j * BUFFER_ITEM_PER_CPU + k - 1;
+
+			expected_sum += k;
+			if (arrays) {
+				buffer_nodes[index].data = k;
+				entry->array[entry->offset++] =
+					&buffer_nodes[index];
+			} else {
+				list_nodes[index].data = k;
+				list_nodes[index].next = data->list.c[i].head;
+				data->list.c[i].head = &list_nodes[index];
+			}
+		}
+		j++;
+	}
+
+	for (i = 0; i < num_procs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			perror("fork");
+			abort();
+		}
+		if (!pids[i])
+			test_percpu_process_worker(data, &stats[i]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	__atomic_store_n(&data->go, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < num_procs; i++) {
+		int status;
+
+		ret = waitpid(pids[i], &status, 0);
+		if (ret < 0) {
+			perror("waitpid");
+			abort();
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "Worker process %d failed\n",
+				(int) pids[i]);
+			abort();
+		}
+		nr_ops += stats[i].nr_ops;
+		nr_abort_total += stats[i].nr_abort;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - begin.tv_sec) +
+		  (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+	switch (opt_test) {
+	case 'i':
+		for (i = 0; i < CPU_SETSIZE; i++)
+			sum += data->inc.c[i].count;
+		expected_sum = (uint64_t)opt_reps * num_procs;
+		break;
+	case 'l':
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			struct percpu_list_node *node;
+
+			while ((node = __percpu_list_pop(&data->list, i)))
+				sum += node->data;
+		}
+		break;
+	case 'b':
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			struct percpu_buffer_node *node;
+
+			while ((node = __percpu_buffer_pop(&data->buffer, i)))
+				sum += node->data;
+		}
+		break;
+	}
+
+	printf_report("%c %s: %d processes, %lld ops in %.3f s, %.0f ops/s, "
+		      "%lld rseq aborts (%.4f%%)\n",
+		      opt_test, opt_sync == 'r' ? "rseq" :
+		      opt_sync == 'm' ? "mutex" : "atomic",
+		      num_procs, nr_ops, elapsed,
+		      elapsed > 0 ? nr_ops / elapsed : 0.0, nr_abort_total,
+		      nr_ops ? 100.0 * nr_abort_total / nr_ops : 0.0);
+
+	for (i = 0; i < CPU_SETSIZE; i++)
+		pthread_mutex_destroy(&data->lock[i].mutex);
+	if (arrays) {
+		shared_free(arrays, arrays_len);
+		shared_free(buffer_nodes, nodes_len);
+	} else {
+		shared_free(list_nodes, nodes_len);
+	}
+	shared_free(stats, stats_len);
+	shared_free(data, sizeof(*data));
+
+	/*
+	 * All entries should now be accounted for (unless some external
+	 * actor is interfering with our allowed affinity while this
+	 * test is running).
+	 */
+	assert(sum == expected_sum);
+}
 
 static void test_signal_interrupt_handler(__attribute__ ((unused)) int signo)
 {
@@ -1156,8 +1698,10 @@ static void show_usage(char **argv)
 	printf("	[-r N] Number of repetitions per thread (default 5000)\n");
 	printf("	[-d] Disable rseq system call (no initialization)\n");
 	printf("	[-D M] Disable rseq for each M threads\n");
-	printf("	[-T test] Choose test: (s)pinlock, (l)ist, (b)uffer, (m)emcpy, (i)ncrement\n");
+	printf("	[-T test] Choose test: (s)pinlock, (l)ist, (b)uffer, (m)emcpy, (i)ncrement, (r)egion compare\n");
 	printf("	[-M] Push into buffer and memcpy buffer with memory barriers.\n");
+	printf("	[-P N] Run the list, buffer or increment test in N processes sharing memory (-t is ignored)\n");
+	printf("	[-S sync] Synchronization for -P: (r)seq (default), (m)utex, (a)tomic\n");
 	printf("	[-c] Check if the rseq syscall is available.\n");
 	printf("	[-v] Verbose output.\n");
 	printf("	[-h] Show this help.\n");
@@ -1272,6 +1816,7 @@ int main(int argc, char **argv)
 			case 'i':
 			case 'b':
 			case 'm':
+			case 'r':
 				break;
 			default:
 				show_usage(argv);
@@ -1285,6 +1830,35 @@ int main(int argc, char **argv)
 		case 'M':
 			opt_mb = 1;
 			break;
+		case 'P':
+			if (argc < i + 2) {
+				show_usage(argv);
+				goto error;
+			}
+			opt_procs = atol(argv[i + 1]);
+			if (opt_procs < 0) {
+				show_usage(argv);
+				goto error;
+			}
+			i++;
+			break;
+		case 'S':
+			if (argc < i + 2) {
+				show_usage(argv);
+				goto error;
+			}
+			opt_sync = *argv[i + 1];
+			switch (opt_sync) {
+			case 'r':
+			case 'm':
+			case 'a':
+				break;
+			default:
+				show_usage(argv);
+				goto error;
+			}
+			i++;
+			break;
 		case 'c':
 			if (rseq_available()) {
 				printf_verbose("The rseq syscall is available.\n");
@@ -1309,8 +1883,19 @@ int main(int argc, char **argv)
 	if (set_signal_handler())
 		goto error;
 
+	if (opt_procs && opt_test != 'l' && opt_test != 'b' &&
+	    opt_test != 'i') {
+		show_usage(argv);
+		goto error;
+	}
+
 	if (!opt_disable_rseq && rseq_register_current_thread())
 		goto error;
+	if (opt_procs) {
+		printf_verbose("processes\n");
+		test_percpu_process();
+		goto unregister;
+	}
 	switch (opt_test) {
 	case 's':
 		printf_verbose("spinlock\n");
@@ -1332,7 +1917,12 @@ int main(int argc, char **argv)
 		printf_verbose("counter increment\n");
 		test_percpu_inc();
 		break;
+	case 'r':
+		printf_verbose("region compare\n");
+		test_percpu_region();
+		break;
 	}
+unregister:
 	if (!opt_disable_rseq && rseq_unregister_current_thread())
 		abort();
 end:
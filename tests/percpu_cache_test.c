@@ -0,0 +1,260 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Per-CPU object cache and memory pressure trimming test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rseq/rseq.h>
+#include <rseq/percpu-cache.h>
+
+#include "tap.h"
+
+#define NR_TESTS 12
+
+#define NR_HELD		16
+#define CAPACITY	64
+#define BATCH		8
+
+struct test_object {
+	int owned;
+};
+
+static long nr_live;
+
+static void *test_alloc(void *priv __attribute__((unused)))
+{
+	__atomic_add_fetch(&nr_live, 1, __ATOMIC_RELAXED);
+	return calloc(1, sizeof(struct test_object));
+}
+
+static void test_free(void *obj, void *priv __attribute__((unused)))
+{
+	__atomic_sub_fetch(&nr_live, 1, __ATOMIC_RELAXED);
+	free(obj);
+}
+
+static const struct rseq_percpu_cache_ops test_ops = {
+	.alloc = test_alloc,
+	.free = test_free,
+};
+
+struct cache_test_data {
+	struct rseq_percpu_cache *cache;
+	long long reps;
+	int nr_double_owned;
+	int stop;
+};
+
+void *test_percpu_cache_thread(void *arg)
+{
+	struct cache_test_data *data = arg;
+	struct test_object *held[NR_HELD];
+	long long i;
+	int j;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	for (i = 0; i < data->reps; i++) {
+		int nr = 1 + i % NR_HELD;
+
+		for (j = 0; j < nr; j++) {
+			held[j] = rseq_percpu_cache_pop(data->cache);
+			if (!held[j])
+				abort();
+			if (__atomic_exchange_n(&held[j]->owned, 1, __ATOMIC_RELAXED))
+				__atomic_add_fetch(&data->nr_double_owned, 1, __ATOMIC_RELAXED);
+		}
+		for (j = 0; j < nr; j++) {
+			__atomic_store_n(&held[j]->owned, 0, __ATOMIC_RELAXED);
+			rseq_percpu_cache_push(data->cache, held[j]);
+		}
+	}
+
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+
+void *test_trim_thread(void *arg)
+{
+	struct cache_test_data *data = arg;
+
+	while (!__atomic_load_n(&data->stop, __ATOMIC_ACQUIRE)) {
+		if (rseq_percpu_cache_trim(data->cache, BATCH))
+			abort();
+		usleep(100);
+	}
+	return NULL;
+}
+
+/* Concurrent pops and pushes racing with remote trims. */
+static void test_percpu_cache_trim(void)
+{
+	const int num_threads = 8;
+	struct cache_test_data data;
+	pthread_t test_threads[num_threads], trim_thread;
+	int i;
+
+	memset(&data, 0, sizeof(data));
+	data.cache = rseq_percpu_cache_create(&test_ops, NULL, CAPACITY, BATCH);
+	ok(data.cache != NULL, "Create per-CPU cache");
+	if (!data.cache)
+		abort();
+	data.reps = 20000;
+
+	pthread_create(&trim_thread, NULL, test_trim_thread, &data);
+	for (i = 0; i < num_threads; i++)
+		pthread_create(&test_threads[i], NULL, test_percpu_cache_thread, &data);
+	for (i = 0; i < num_threads; i++)
+		pthread_join(test_threads[i], NULL);
+	__atomic_store_n(&data.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(trim_thread, NULL);
+
+	ok(data.nr_double_owned == 0, "No object handed out twice");
+	ok(rseq_percpu_cache_nr_cached(data.cache) == (size_t) nr_live,
+	   "No object lost by concurrent trims");
+	ok(!rseq_percpu_cache_trim(data.cache, 0) &&
+	   rseq_percpu_cache_nr_cached(data.cache) == 0 && nr_live == 0,
+	   "Trim releases all cached objects");
+	rseq_percpu_cache_destroy(data.cache);
+}
+
+static bool test_wait_nr_cached(struct rseq_percpu_cache *cache, size_t nr)
+{
+	int i;
+
+	for (i = 0; i < 2000; i++) {
+		if (rseq_percpu_cache_nr_cached(cache) <= nr)
+			return true;
+		usleep(1000);
+	}
+	return false;
+}
+
+/* Trimming driven by the memory pressure monitor. */
+static void test_percpu_cache_mempressure(void)
+{
+	struct rseq_mempressure *monitor;
+	struct rseq_percpu_cache *cache;
+	void *objs[CAPACITY];
+	int i;
+
+	monitor = rseq_mempressure_create(NULL, RSEQ_MEMPRESSURE_STALL_US,
+			RSEQ_MEMPRESSURE_WINDOW_US, 10);
+	cache = rseq_percpu_cache_create(&test_ops, NULL, CAPACITY, BATCH);
+	if (!monitor || !cache)
+		abort();
+	diag("memory pressure source: %d", (int) rseq_mempressure_get_source(monitor));
+
+	for (i = 0; i < CAPACITY; i++)
+		objs[i] = rseq_percpu_cache_pop(cache);
+	for (i = 0; i < CAPACITY; i++)
+		rseq_percpu_cache_push(cache, objs[i]);
+	ok(!rseq_percpu_cache_set_mempressure(cache, monitor, 4, 0) &&
+	   rseq_percpu_cache_nr_cached(cache) >= CAPACITY, "Attach cache to monitor");
+	rseq_mempressure_trigger(monitor);
+	ok(test_wait_nr_cached(cache, 4), "Pressure trims the cache to its floor");
+
+	ok(!rseq_percpu_cache_set_mempressure(cache, monitor, 4, 20) &&
+	   test_wait_nr_cached(cache, 0), "Idle CPUs are trimmed after a timeout");
+
+	rseq_percpu_cache_destroy(cache);
+	rseq_mempressure_destroy(monitor);
+}
+
+/*
+ * A CPU cycling through a working set larger than its initial capacity
+ * misses until tuning grows its capacity.
+ */
+static void test_percpu_cache_tune(void)
+{
+	const int working_set = 48, budget = 64;
+	struct rseq_percpu_cache_entry *entry;
+	struct rseq_percpu_cache *cache;
+	cpu_set_t cpuset, old_cpuset;
+	uint64_t misses = 0;
+	void *objs[working_set];
+	int i, round;
+
+	cache = rseq_percpu_cache_create(&test_ops, NULL, 4 * CAPACITY, 4);
+	if (!cache)
+		abort();
+	rseq_percpu_cache_set_tuning(cache, budget);
+	/* Stay on one CPU, so all misses are accounted to it. */
+	if (sched_getaffinity(0, sizeof(old_cpuset), &old_cpuset))
+		abort();
+	CPU_ZERO(&cpuset);
+	CPU_SET(sched_getcpu(), &cpuset);
+	if (sched_setaffinity(0, sizeof(cpuset), &cpuset))
+		abort();
+	entry = &cache->c[rseq_current_cpu()];
+
+	for (round = 0; round < 50; round++) {
+		misses = entry->nr_misses;
+		for (i = 0; i < working_set; i++)
+			objs[i] = rseq_percpu_cache_pop(cache);
+		for (i = 0; i < working_set; i++)
+			rseq_percpu_cache_push(cache, objs[i]);
+		misses = entry->nr_misses - misses;
+		rseq_percpu_cache_tune(cache);
+	}
+	ok(entry->capacity >= working_set && entry->capacity <= budget,
+	   "Capacity of a missing CPU grows within the budget");
+	ok(entry->batch > cache->batch, "Batch size of a CPU missing often grows");
+	ok(misses == 0, "Tuned CPU stops missing");
+
+	if (sched_setaffinity(0, sizeof(old_cpuset), &old_cpuset))
+		abort();
+	rseq_percpu_cache_destroy(cache);
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+
+	diag("percpu cache");
+	test_percpu_cache_trim();
+	test_percpu_cache_mempressure();
+	test_percpu_cache_tune();
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Per-CPU copy-on-write records test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/percpu-cow.h>
+
+#include "tap.h"
+
+#define NR_TESTS 6
+
+#define RECORD_WORDS	64
+#define POISON		((intptr_t) 0xdeadbeef)
+
+/* Records larger than what a memcpy critical section should copy. */
+struct test_record {
+	intptr_t version[RECORD_WORDS];
+};
+
+struct cow_test_data {
+	struct rseq_percpu_cow *cow;
+	long long reps;
+	long long nr_updates;
+	long long nr_bad_reads;
+};
+
+static uint64_t nr_freed;
+
+static void test_free_record(void *p)
+{
+	struct test_record *rec = p;
+	int i;
+
+	/* Catch readers accessing retired records. */
+	for (i = 0; i < RECORD_WORDS; i++)
+		RSEQ_WRITE_ONCE(rec->version[i], POISON);
+	__atomic_add_fetch(&nr_freed, 1, __ATOMIC_RELAXED);
+	free(rec);
+}
+
+static void test_update_record(void *p, __attribute__ ((unused)) void *priv)
+{
+	struct test_record *rec = p;
+	int i;
+
+	for (i = 0; i < RECORD_WORDS; i++)
+		rec->version[i]++;
+}
+
+/*
+ * A record is consistent if all its words hold the same version.
+ */
+static bool test_read_record(struct rseq_percpu_cow *cow)
+{
+	struct test_record *rec;
+	bool consistent = true;
+	int phase, i;
+
+	phase = rseq_percpu_cow_read_lock(cow);
+	rec = rseq_percpu_cow_deref(cow, rseq_cpu_start());
+	if (rec) {
+		for (i = 0; i < RECORD_WORDS; i++) {
+			intptr_t v = RSEQ_READ_ONCE(rec->version[i]);
+
+			if (v == POISON || v != rec->version[0])
+				consistent = false;
+		}
+	}
+	rseq_percpu_cow_read_unlock(cow, phase);
+	return consistent;
+}
+
+void *test_percpu_cow_thread(void *arg)
+{
+	struct cow_test_data *data = arg;
+	long long i, reps;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	reps = data->reps;
+	for (i = 0; i < reps; i++) {
+		if (!(i % 4)) {
+			if (rseq_percpu_cow_update(data->cow,
+					sizeof(struct test_record),
+					test_update_record, NULL))
+				abort();
+			data->nr_updates++;
+		} else if (!test_read_record(data->cow)) {
+			data->nr_bad_reads++;
+		}
+	}
+
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+
+/*
+ * Concurrent updates of large per-CPU records, each update incrementing
+ * every word of the record of the current CPU, while readers check
+ * that the records they access are consistent and not yet freed.
+ */
+void test_percpu_cow(void)
+{
+	const int num_threads = 16;
+	int i;
+	uint64_t sum = 0, nr_updates = 0, nr_bad_reads = 0;
+	pthread_t test_threads[num_threads];
+	struct cow_test_data data[num_threads];
+	struct rseq_percpu_cow *cow;
+
+	diag("percpu cow");
+
+	cow = rseq_percpu_cow_create(test_free_record);
+	ok(cow != NULL, "Create per-CPU copy-on-write records");
+	if (!cow)
+		abort();
+
+	for (i = 0; i < num_threads; i++) {
+		data[i].cow = cow;
+		data[i].reps = 2000;
+		data[i].nr_updates = 0;
+		data[i].nr_bad_reads = 0;
+		pthread_create(&test_threads[i], NULL,
+			       test_percpu_cow_thread, &data[i]);
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(test_threads[i], NULL);
+		nr_updates += data[i].nr_updates;
+		nr_bad_reads += data[i].nr_bad_reads;
+	}
+
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		struct test_record *rec = rseq_percpu_cow_deref(cow, i);
+
+		if (rec)
+			sum += rec->version[RECORD_WORDS - 1];
+	}
+
+	ok(nr_bad_reads == 0, "No inconsistent or freed record read");
+	ok(sum == nr_updates, "Sum of record versions matches updates");
+	rseq_percpu_cow_destroy(cow);
+	ok(nr_freed == nr_updates, "All record versions freed");
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+
+	test_percpu_cow();
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
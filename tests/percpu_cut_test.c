@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Per-CPU counters consistent snapshot test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/percpu-cut.h>
+
+#include "tap.h"
+
+#define NR_TESTS 6
+
+#define NR_SNAPSHOTS	1000
+
+struct cut_test_data {
+	struct rseq_percpu_cut cut;
+	struct rseq_percpu_cut_counter *counters[2];	/* Allocated, freed. */
+	long long reps;
+	int stop;
+};
+
+void *test_percpu_cut_thread(void *arg)
+{
+	struct cut_test_data *data = arg;
+	long long i;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	for (i = 0; i < data->reps; i++) {
+		/* Each thread owns at most one object at any time. */
+		rseq_percpu_cut_counter_add(&data->cut, data->counters[0], 1);
+		rseq_percpu_cut_counter_add(&data->cut, data->counters[1], 1);
+	}
+
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+
+/*
+ * Snapshots taken while threads allocate and free objects never show
+ * more frees than allocations, nor more live objects than threads.
+ */
+static void test_percpu_cut(void)
+{
+	const int num_threads = 8;
+	struct cut_test_data data;
+	pthread_t test_threads[num_threads];
+	intptr_t values[2], last[2] = { 0, 0 };
+	bool consistent = true, monotonic = true;
+	int i;
+
+	memset(&data, 0, sizeof(data));
+	if (rseq_percpu_cut_init(&data.cut)) {
+		if (errno != ENOSYS)
+			abort();
+		skip(4, "MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ is unavailable");
+		return;
+	}
+	pass("Initialized cut domain");
+	data.counters[0] = rseq_percpu_cut_counter_create();
+	data.counters[1] = rseq_percpu_cut_counter_create();
+	if (!data.counters[0] || !data.counters[1])
+		abort();
+	data.reps = 200000;
+
+	for (i = 0; i < num_threads; i++)
+		pthread_create(&test_threads[i], NULL, test_percpu_cut_thread, &data);
+	for (i = 0; i < NR_SNAPSHOTS; i++) {
+		rseq_percpu_cut_snapshot(&data.cut, data.counters, 2, values);
+		if (values[1] > values[0] || values[0] - values[1] > num_threads)
+			consistent = false;
+		if (values[0] < last[0] || values[1] < last[1])
+			monotonic = false;
+		last[0] = values[0];
+		last[1] = values[1];
+	}
+	for (i = 0; i < num_threads; i++)
+		pthread_join(test_threads[i], NULL);
+
+	ok(consistent, "Snapshots are consistent across counters");
+	ok(monotonic, "Snapshots are monotonic");
+	rseq_percpu_cut_snapshot(&data.cut, data.counters, 2, values);
+	ok(values[0] == data.reps * num_threads && values[1] == values[0],
+	   "Final snapshot sums all updates");
+
+	rseq_percpu_cut_counter_destroy(data.counters[0]);
+	rseq_percpu_cut_counter_destroy(data.counters[1]);
+	rseq_percpu_cut_destroy(&data.cut);
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+
+	diag("percpu cut");
+	test_percpu_cut();
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
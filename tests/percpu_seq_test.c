@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Per-CPU records with a sequence counter test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/percpu-seq.h>
+
+#include "tap.h"
+
+#define NR_TESTS 7
+
+#define NR_FIELDS	8
+
+/* Every field holds (index + 1) times the number of updates. */
+struct percpu_seq_test_record {
+	intptr_t fields[NR_FIELDS];
+};
+
+struct percpu_seq_test_data {
+	struct rseq_percpu_seq *ps;
+	long long reps;
+	int stop;
+	long long nr_torn;
+	long long nr_reads;
+};
+
+static void test_update_record(void *data, void *priv)
+{
+	struct percpu_seq_test_record *record = data;
+	int i;
+
+	(void) priv;
+	for (i = 0; i < NR_FIELDS; i++)
+		record->fields[i] += i + 1;
+}
+
+static bool test_record_consistent(const struct percpu_seq_test_record *record)
+{
+	int i;
+
+	for (i = 1; i < NR_FIELDS; i++) {
+		if (record->fields[i] != (i + 1) * record->fields[0])
+			return false;
+	}
+	return true;
+}
+
+void *test_percpu_seq_writer(void *arg)
+{
+	struct percpu_seq_test_data *data = arg;
+	long long i;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	for (i = 0; i < data->reps; i++)
+		rseq_percpu_seq_update(data->ps, test_update_record, NULL);
+
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+
+void *test_percpu_seq_reader(void *arg)
+{
+	struct percpu_seq_test_data *data = arg;
+	struct percpu_seq_test_record record;
+	int cpu;
+
+	while (!__atomic_load_n(&data->stop, __ATOMIC_ACQUIRE)) {
+		for (cpu = 0; cpu < rseq_percpu_seq_nr_cpus(data->ps); cpu++) {
+			rseq_percpu_seq_read(data->ps, cpu, &record);
+			if (!test_record_consistent(&record))
+				data->nr_torn++;
+			data->nr_reads++;
+		}
+	}
+	return NULL;
+}
+
+static void test_percpu_seq_concurrent(void)
+{
+	const int num_threads = 4;
+	struct percpu_seq_test_record record;
+	struct percpu_seq_test_data data;
+	pthread_t writers[num_threads], reader;
+	intptr_t total = 0;
+	int i, cpu;
+
+	memset(&data, 0, sizeof(data));
+	data.ps = rseq_percpu_seq_create(sizeof(struct percpu_seq_test_record));
+	if (!data.ps)
+		abort();
+	data.reps = 200000;
+	pthread_create(&reader, NULL, test_percpu_seq_reader, &data);
+	for (i = 0; i < num_threads; i++)
+		pthread_create(&writers[i], NULL, test_percpu_seq_writer, &data);
+	for (i = 0; i < num_threads; i++)
+		pthread_join(writers[i], NULL);
+	__atomic_store_n(&data.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(reader, NULL);
+	ok(!data.nr_torn && data.nr_reads,
+	   "Remote reads are never torn (%lld reads)", data.nr_reads);
+
+	for (cpu = 0; cpu < rseq_percpu_seq_nr_cpus(data.ps); cpu++) {
+		rseq_percpu_seq_read(data.ps, cpu, &record);
+		total += record.fields[0];
+	}
+	ok(total == num_threads * data.reps, "Updates are committed exactly once");
+	rseq_percpu_seq_destroy(data.ps);
+}
+
+int main(void)
+{
+	struct percpu_seq_test_record record;
+	struct rseq_percpu_seq *ps;
+	int cpu;
+
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Registered current thread with rseq");
+	}
+
+	diag("per-CPU sequence counter");
+	ok(!rseq_percpu_seq_create(0) && errno == EINVAL &&
+	   !rseq_percpu_seq_create(RSEQ_PERCPU_SEQ_MAX_LEN + 1) && errno == EINVAL,
+	   "Invalid record sizes are rejected");
+	ps = rseq_percpu_seq_create(sizeof(record));
+	ok(ps != NULL && rseq_percpu_seq_nr_cpus(ps) > 0, "Create records");
+	if (!ps)
+		abort();
+	rseq_percpu_seq_update(ps, test_update_record, NULL);
+	rseq_percpu_seq_update(ps, test_update_record, NULL);
+	cpu = rseq_current_cpu_raw();
+	rseq_percpu_seq_read(ps, cpu, &record);
+	ok(record.fields[0] == 2 && test_record_consistent(&record),
+	   "Read the record of the current CPU");
+	rseq_percpu_seq_destroy(ps);
+
+	test_percpu_seq_concurrent();
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
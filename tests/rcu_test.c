@@ -0,0 +1,245 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Per-CPU reader counters RCU test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rseq/rseq.h>
+#include <rseq/rcu.h>
+
+#include "tap.h"
+
+#define NR_TESTS 8
+
+#define NR_READERS	16
+#define NR_UPDATES	2000
+#define NR_SYNCHRONIZERS	8
+
+struct rcu_test_node {
+	struct rseq_rcu_head head;
+	int alive;
+	/* Retired nodes are kept until the end of the test. */
+	struct rcu_test_node *retired_next;
+};
+
+struct rcu_test_data {
+	struct rseq_rcu *rcu;
+	struct rcu_test_node *current;
+	int stop;
+	long long nr_dead;
+	long long nr_reads;
+	/* Only accessed from callbacks, on the helper thread. */
+	struct rcu_test_node *retired;
+	long long nr_retired;
+};
+
+static struct rcu_test_data test_data;
+
+static void test_rcu_retire(struct rseq_rcu_head *head)
+{
+	struct rcu_test_node *node = (struct rcu_test_node *) ((char *) head -
+			offsetof(struct rcu_test_node, head));
+
+	RSEQ_WRITE_ONCE(node->alive, 0);
+	node->retired_next = test_data.retired;
+	test_data.retired = node;
+	test_data.nr_retired++;
+}
+
+void *test_rcu_reader(void *arg)
+{
+	struct rcu_test_data *data = arg;
+	long long nr_dead = 0, nr_reads = 0;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	while (!__atomic_load_n(&data->stop, __ATOMIC_ACQUIRE)) {
+		struct rcu_test_node *node;
+		int phase;
+
+		phase = rseq_rcu_read_lock(data->rcu);
+		node = __atomic_load_n(&data->current, __ATOMIC_CONSUME);
+		sched_yield();
+		if (!RSEQ_READ_ONCE(node->alive))
+			nr_dead++;
+		rseq_rcu_read_unlock(data->rcu, phase);
+		nr_reads++;
+	}
+	__atomic_add_fetch(&data->nr_dead, nr_dead, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&data->nr_reads, nr_reads, __ATOMIC_RELAXED);
+
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+
+/* Replace the current node, and retire the old one with rseq_rcu_call(). */
+static void test_rcu_call(void)
+{
+	pthread_t readers[NR_READERS];
+	struct rcu_test_node *node;
+	uint64_t nr_gp;
+	int i;
+
+	test_data.current = calloc(1, sizeof(*test_data.current));
+	if (!test_data.current)
+		abort();
+	test_data.current->alive = 1;
+	for (i = 0; i < NR_READERS; i++)
+		pthread_create(&readers[i], NULL, test_rcu_reader, &test_data);
+	for (i = 0; i < NR_UPDATES; i++) {
+		struct rcu_test_node *old = test_data.current;
+
+		node = calloc(1, sizeof(*node));
+		if (!node)
+			abort();
+		node->alive = 1;
+		__atomic_store_n(&test_data.current, node, __ATOMIC_RELEASE);
+		rseq_rcu_call(test_data.rcu, &old->head, test_rcu_retire);
+		if (!(i % 64))
+			sched_yield();
+	}
+	rseq_rcu_barrier(test_data.rcu);
+	__atomic_store_n(&test_data.stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < NR_READERS; i++)
+		pthread_join(readers[i], NULL);
+
+	ok(test_data.nr_retired == NR_UPDATES,
+	   "Barrier waits for every queued callback");
+	ok(!test_data.nr_dead && test_data.nr_reads,
+	   "Readers never see retired nodes (%lld reads)", test_data.nr_reads);
+	nr_gp = rseq_rcu_nr_grace_periods(test_data.rcu);
+	ok(nr_gp >= 1 && nr_gp < NR_UPDATES,
+	   "Callbacks are batched (%llu grace periods for %d callbacks)",
+	   (unsigned long long) nr_gp, NR_UPDATES);
+
+	while (test_data.retired) {
+		node = test_data.retired;
+		test_data.retired = node->retired_next;
+		free(node);
+	}
+	free(test_data.current);
+}
+
+struct rcu_test_holder {
+	struct rseq_rcu *rcu;
+	int locked;
+	int release;
+};
+
+void *test_rcu_holder(void *arg)
+{
+	struct rcu_test_holder *holder = arg;
+	int phase;
+
+	if (rseq_register_current_thread())
+		abort();
+	phase = rseq_rcu_read_lock(holder->rcu);
+	__atomic_store_n(&holder->locked, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&holder->release, __ATOMIC_ACQUIRE))
+		usleep(1000);
+	rseq_rcu_read_unlock(holder->rcu, phase);
+	if (rseq_unregister_current_thread())
+		abort();
+	return NULL;
+}
+
+void *test_rcu_synchronizer(void *arg)
+{
+	struct rcu_test_holder *holder = arg;
+
+	rseq_rcu_synchronize(holder->rcu);
+	/* The reader must have left its critical section. */
+	if (!__atomic_load_n(&holder->release, __ATOMIC_ACQUIRE))
+		abort();
+	return NULL;
+}
+
+/* Concurrent synchronizations wait for a reader holding its lock. */
+static void test_rcu_synchronize(struct rseq_rcu *rcu)
+{
+	struct rcu_test_holder holder = { .rcu = rcu };
+	pthread_t reader, synchronizers[NR_SYNCHRONIZERS];
+	uint64_t nr_gp;
+	int i;
+
+	pthread_create(&reader, NULL, test_rcu_holder, &holder);
+	while (!__atomic_load_n(&holder.locked, __ATOMIC_ACQUIRE))
+		usleep(1000);
+	nr_gp = rseq_rcu_nr_grace_periods(rcu);
+	for (i = 0; i < NR_SYNCHRONIZERS; i++)
+		pthread_create(&synchronizers[i], NULL, test_rcu_synchronizer, &holder);
+	usleep(50000);
+	ok(rseq_rcu_nr_grace_periods(rcu) == nr_gp,
+	   "Grace periods wait for pre-existing readers");
+	__atomic_store_n(&holder.release, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < NR_SYNCHRONIZERS; i++)
+		pthread_join(synchronizers[i], NULL);
+	pthread_join(reader, NULL);
+	ok(rseq_rcu_nr_grace_periods(rcu) - nr_gp <= 2,
+	   "Concurrent synchronizations share grace periods");
+}
+
+int main(void)
+{
+	int phase, nested;
+
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	}
+
+	diag("per-CPU reader counters RCU");
+	test_data.rcu = rseq_rcu_create();
+	ok(test_data.rcu != NULL, "Create RCU domain");
+	if (!test_data.rcu)
+		abort();
+	phase = rseq_rcu_read_lock(test_data.rcu);
+	nested = rseq_rcu_read_lock(test_data.rcu);
+	rseq_rcu_read_unlock(test_data.rcu, nested);
+	rseq_rcu_read_unlock(test_data.rcu, phase);
+	rseq_rcu_synchronize(test_data.rcu);
+	ok(rseq_rcu_nr_grace_periods(test_data.rcu) == 1,
+	   "Synchronize after nested critical sections");
+
+	test_rcu_call();
+	test_rcu_synchronize(test_data.rcu);
+	rseq_rcu_destroy(test_data.rcu);
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Generation-tagged slot map test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rseq/rseq.h>
+#include <rseq/slotmap.h>
+
+#include "tap.h"
+
+#define NR_TESTS 9
+
+#define NR_THREADS	8
+#define NR_LIVE		256
+#define REPS		20000
+#define CHUNK_SLOTS	64
+
+/*
+ * Each thread keeps NR_LIVE values in the map, replacing one at random
+ * on each repetition. Half of the removals are done by the next thread,
+ * through a mailbox, so slots are often freed away from their home CPU.
+ */
+struct slotmap_test_data {
+	struct rseq_slotmap *map;
+	int thread;
+	int nr_errors;
+	uint64_t mailbox;
+};
+
+static struct slotmap_test_data test_data[NR_THREADS];
+static int nr_done;
+
+static void *test_value(int thread, int i)
+{
+	return (void *) (((uintptr_t) thread << 24) | (uintptr_t) i << 1 | 1);
+}
+
+static void test_drain_mailbox(struct slotmap_test_data *data)
+{
+	uint64_t mail = __atomic_exchange_n(&data->mailbox, 0, __ATOMIC_ACQUIRE);
+
+	if (mail && rseq_slotmap_remove(data->map, mail, NULL))
+		data->nr_errors++;
+}
+
+/* Wait for the next thread to take the last handle handed over. */
+static void test_wait_mailbox(struct slotmap_test_data *data,
+		struct slotmap_test_data *next)
+{
+	while (__atomic_load_n(&next->mailbox, __ATOMIC_ACQUIRE)) {
+		test_drain_mailbox(data);
+		sched_yield();
+	}
+}
+
+void *test_slotmap_thread(void *arg)
+{
+	struct slotmap_test_data *data = arg;
+	struct slotmap_test_data *next = &test_data[(data->thread + 1) % NR_THREADS];
+	uint64_t handles[NR_LIVE];
+	unsigned int seed = data->thread;
+	int i;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	for (i = 0; i < NR_LIVE; i++) {
+		if (rseq_slotmap_insert(data->map, test_value(data->thread, i), &handles[i]))
+			data->nr_errors++;
+	}
+	for (i = 0; i < REPS; i++) {
+		int k = rand_r(&seed) % NR_LIVE;
+		uint64_t stale = handles[k];
+		void *value;
+
+		if (rseq_slotmap_get(data->map, stale) != test_value(data->thread, k))
+			data->nr_errors++;
+		if (i & 1) {
+			/* Hand the removal over to the next thread. */
+			test_wait_mailbox(data, next);
+			__atomic_store_n(&next->mailbox, stale, __ATOMIC_RELEASE);
+		} else if (rseq_slotmap_remove(data->map, stale, &value) ||
+				value != test_value(data->thread, k)) {
+			data->nr_errors++;
+		}
+		test_drain_mailbox(data);
+		if (rseq_slotmap_insert(data->map, test_value(data->thread, k), &handles[k]))
+			data->nr_errors++;
+		if (handles[k] == stale)
+			data->nr_errors++;
+	}
+	test_wait_mailbox(data, next);
+	__atomic_add_fetch(&nr_done, 1, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&nr_done, __ATOMIC_ACQUIRE) < NR_THREADS) {
+		test_drain_mailbox(data);
+		sched_yield();
+	}
+	test_drain_mailbox(data);
+	for (i = 0; i < NR_LIVE; i++) {
+		if (rseq_slotmap_remove(data->map, handles[i], NULL))
+			data->nr_errors++;
+	}
+
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+
+static void test_slotmap_concurrent(void)
+{
+	pthread_t test_threads[NR_THREADS];
+	struct rseq_slotmap *map;
+	int i, nr_errors = 0;
+
+	map = rseq_slotmap_create(CHUNK_SLOTS, 1U << 20);
+	ok(map != NULL, "Create slot map");
+	if (!map)
+		abort();
+	for (i = 0; i < NR_THREADS; i++) {
+		test_data[i].map = map;
+		test_data[i].thread = i;
+		pthread_create(&test_threads[i], NULL, test_slotmap_thread, &test_data[i]);
+	}
+	for (i = 0; i < NR_THREADS; i++) {
+		pthread_join(test_threads[i], NULL);
+		nr_errors += test_data[i].nr_errors;
+	}
+	ok(!nr_errors, "Concurrent inserts, lookups and local and remote removals");
+	/* Removed slots are reused, so the map stays near its live size. */
+	ok(rseq_slotmap_nr_slots(map) <= 4 * NR_THREADS * NR_LIVE,
+	   "Free slots are reused (%zu slots)", rseq_slotmap_nr_slots(map));
+	rseq_slotmap_destroy(map);
+}
+
+static void test_slotmap_stale(void)
+{
+	struct rseq_slotmap *map;
+	uint64_t handle, handle2, handles[2 * CHUNK_SLOTS];
+	int a, b, i, nr_errors = 0;
+
+	map = rseq_slotmap_create(CHUNK_SLOTS, 2 * CHUNK_SLOTS);
+	if (!map)
+		abort();
+	ok(rseq_slotmap_create(3, 16) == NULL && errno == EINVAL,
+	   "Chunk sizes must be powers of two");
+	if (rseq_slotmap_insert(map, &a, &handle))
+		abort();
+	ok(handle != RSEQ_SLOTMAP_INVALID && rseq_slotmap_get(map, handle) == &a,
+	   "Lookup of an inserted value");
+	ok(!rseq_slotmap_remove(map, handle, NULL) &&
+	   rseq_slotmap_get(map, handle) == NULL &&
+	   rseq_slotmap_remove(map, handle, NULL) == -1 && errno == ENOENT,
+	   "Stale handles are not found");
+	if (rseq_slotmap_insert(map, &b, &handle2))
+		abort();
+	ok(rseq_slotmap_get(map, handle) == NULL && rseq_slotmap_get(map, handle2) == &b &&
+	   rseq_slotmap_get(map, RSEQ_SLOTMAP_INVALID) == NULL,
+	   "Reused slots do not match stale handles");
+	if (rseq_slotmap_remove(map, handle2, NULL))
+		abort();
+	for (i = 0; i < 2 * CHUNK_SLOTS; i++) {
+		if (rseq_slotmap_insert(map, &a, &handles[i]))
+			nr_errors++;
+	}
+	ok(!nr_errors && rseq_slotmap_insert(map, &a, &handle) == -1 && errno == ENOSPC &&
+	   rseq_slotmap_nr_slots(map) == 2 * CHUNK_SLOTS,
+	   "Full maps fail with ENOSPC");
+	rseq_slotmap_destroy(map);
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	}
+
+	diag("slot map");
+	test_slotmap_concurrent();
+	test_slotmap_stale();
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}
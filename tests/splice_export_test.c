@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Zero-copy buffer export test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rseq/splice-export.h>
+
+#include "tap.h"
+
+#define NR_TESTS 7
+
+#define NR_BUFFERS	3
+#define SOCKET_LEN	65536
+
+static const size_t buffer_lens[NR_BUFFERS] = { (1U << 20) + 3, 100, 70000 };
+
+static void pattern_init(unsigned char *buf, size_t len, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (unsigned char) (i * 31 + seed);
+}
+
+static bool pattern_check(const unsigned char *buf, size_t len, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] != (unsigned char) (i * 31 + seed))
+			return false;
+	}
+	return true;
+}
+
+static bool read_all(int fd, unsigned char *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = read(fd, buf, len);
+
+		if (ret <= 0)
+			return false;
+		buf += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+/*
+ * Export the buffers to @fd, then overwrite them, and check that the
+ * file holds their contents at the time of the export.
+ */
+static bool test_export_file(int fd, struct rseq_splice_export *exp)
+{
+	unsigned char *buffers[NR_BUFFERS], *check;
+	uint64_t end, total = 0;
+	bool ok = true;
+	int i;
+
+	for (i = 0; i < NR_BUFFERS; i++) {
+		/* Start the first buffer in the middle of a page. */
+		buffers[i] = malloc(buffer_lens[i] + 3);
+		if (!buffers[i])
+			abort();
+		pattern_init(buffers[i] + 3, buffer_lens[i], i);
+		if (rseq_splice_export_submit(exp, buffers[i] + 3, buffer_lens[i], &end))
+			ok = false;
+		total += buffer_lens[i];
+		if (end != total || rseq_splice_export_released(exp) != total)
+			ok = false;
+		memset(buffers[i] + 3, 0xff, buffer_lens[i]);
+	}
+	if (lseek(fd, 0, SEEK_SET))
+		abort();
+	for (i = 0; i < NR_BUFFERS; i++) {
+		check = malloc(buffer_lens[i]);
+		if (!check)
+			abort();
+		if (!read_all(fd, check, buffer_lens[i]) ||
+				!pattern_check(check, buffer_lens[i], i))
+			ok = false;
+		free(check);
+		free(buffers[i]);
+	}
+	return ok;
+}
+
+static void test_splice_export_file(void)
+{
+	char path[] = "/tmp/rseq-splice-export-test-XXXXXX";
+	struct rseq_splice_export *exp;
+	int fd, append_fd;
+
+	errno = 0;
+	ok(!rseq_splice_export_create(-1, 0) && errno == EBADF,
+	   "Exporting to an invalid file descriptor fails with EBADF");
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		abort();
+	exp = rseq_splice_export_create(fd, 1U << 16);
+	if (!exp)
+		abort();
+	ok(test_export_file(fd, exp), "Buffers spliced to a file may be reused on return");
+	ok(!rseq_splice_export_nr_copied(exp), "Files are written without copies");
+	rseq_splice_export_destroy(exp);
+
+	/* splice(2) refuses files opened with O_APPEND. */
+	if (ftruncate(fd, 0))
+		abort();
+	append_fd = open(path, O_RDWR | O_APPEND);
+	if (append_fd < 0)
+		abort();
+	exp = rseq_splice_export_create(append_fd, 0);
+	if (!exp)
+		abort();
+	ok(test_export_file(append_fd, exp) &&
+	   rseq_splice_export_nr_copied(exp) == rseq_splice_export_released(exp),
+	   "Destinations refusing splice are written with copies");
+	rseq_splice_export_destroy(exp);
+	close(append_fd);
+	close(fd);
+	unlink(path);
+}
+
+static void test_splice_export_socket(void)
+{
+	const struct timespec delay = { .tv_nsec = 1000000 };
+	struct rseq_splice_export *exp;
+	unsigned char *buf, *check;
+	uint64_t end;
+	bool released;
+	int sv[2], i;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		abort();
+	buf = malloc(SOCKET_LEN);
+	check = malloc(SOCKET_LEN);
+	if (!buf || !check)
+		abort();
+	pattern_init(buf, SOCKET_LEN, 7);
+	exp = rseq_splice_export_create(sv[0], 0);
+	if (!exp)
+		abort();
+	ok(!rseq_splice_export_submit(exp, buf, SOCKET_LEN, &end) &&
+	   end == SOCKET_LEN && rseq_splice_export_released(exp) < end,
+	   "Buffers queued on a stream socket are not released");
+	ok(read_all(sv[1], check, SOCKET_LEN) && pattern_check(check, SOCKET_LEN, 7),
+	   "Stream socket receives the exported buffer");
+	/* The peer frees the socket buffers after the read returns. */
+	released = false;
+	for (i = 0; i < 1000 && !released; i++) {
+		released = rseq_splice_export_released(exp) == end;
+		if (!released)
+			nanosleep(&delay, NULL);
+	}
+	ok(released, "Buffers are released once consumed by the peer");
+	rseq_splice_export_destroy(exp);
+	free(check);
+	free(buf);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	diag("zero-copy buffer export");
+	test_splice_export_file();
+	test_splice_export_socket();
+
+	exit(exit_status());
+}
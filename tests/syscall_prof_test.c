@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * System call latency profiler test.
+ *
+ * The profiler is linked into the test, which interposes the wrapped
+ * calls as LD_PRELOAD would.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <rseq/syscall-prof.h>
+
+#include "tap.h"
+
+#define NR_TESTS 7
+
+#define NR_CALLS	1000
+
+static uint64_t buckets[RSEQ_SYSCALL_PROF_NR_CALLS][RSEQ_SYSCALL_PROF_NR_BUCKETS];
+
+static uint64_t test_count(enum rseq_syscall_prof_call call)
+{
+	uint64_t count = 0;
+	unsigned int i;
+
+	for (i = 0; i < RSEQ_SYSCALL_PROF_NR_BUCKETS; i++)
+		count += buckets[call][i];
+	return count;
+}
+
+static void test_calls(void)
+{
+	int null_fd, zero_fd, epfd, sv[2], futex_word = 0, i, nr_errors = 0;
+	struct epoll_event event;
+	char c = 0;
+	struct iovec iov = { .iov_base = &c, .iov_len = 1 };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	null_fd = open("/dev/null", O_WRONLY);
+	zero_fd = open("/dev/zero", O_RDONLY);
+	epfd = epoll_create1(0);
+	if (null_fd < 0 || zero_fd < 0 || epfd < 0 ||
+			socketpair(AF_UNIX, SOCK_DGRAM, 0, sv))
+		abort();
+	for (i = 0; i < NR_CALLS; i++) {
+		if (write(null_fd, &c, 1) != 1 || read(zero_fd, &c, 1) != 1 ||
+				sendmsg(sv[0], &msg, 0) != 1 || recvmsg(sv[1], &msg, 0) != 1 ||
+				epoll_wait(epfd, &event, 1, 0) != 0 ||
+				syscall(SYS_futex, &futex_word, FUTEX_WAKE_PRIVATE, 1,
+					NULL, NULL, 0) != 0)
+			nr_errors++;
+	}
+	ok(!nr_errors, "Interposed calls return the results of the real calls");
+	errno = 0;
+	ok(read(-1, &c, 1) == -1 && errno == EBADF, "Interposed calls preserve errno");
+	close(sv[0]);
+	close(sv[1]);
+	close(epfd);
+	close(zero_fd);
+	close(null_fd);
+
+	rseq_syscall_prof_snapshot(buckets);
+	nr_errors = 0;
+	for (i = 0; i < RSEQ_SYSCALL_PROF_NR_CALLS; i++) {
+		if (test_count(i) < NR_CALLS)
+			nr_errors++;
+	}
+	ok(!nr_errors, "Every call is recorded");
+}
+
+static void test_buckets(void)
+{
+	unsigned int i;
+	int nr_errors = 0;
+
+	for (i = 1; i < RSEQ_SYSCALL_PROF_NR_BUCKETS; i++) {
+		uint64_t floor = rseq_syscall_prof_bucket_floor(i);
+		uint64_t prev = rseq_syscall_prof_bucket_floor(i - 1);
+
+		/* Buckets cover at most an eighth of their floor. */
+		if (floor <= prev || (prev >= 8 && (floor - prev) * 8 > prev))
+			nr_errors++;
+	}
+	ok(!nr_errors && rseq_syscall_prof_bucket_floor(8) == 8 &&
+	   rseq_syscall_prof_bucket_floor(16) == 16,
+	   "Buckets are log-linear");
+	ok(!strcmp(rseq_syscall_prof_call_name(RSEQ_SYSCALL_PROF_EPOLL_WAIT), "epoll_wait") &&
+	   rseq_syscall_prof_call_name(RSEQ_SYSCALL_PROF_NR_CALLS) == NULL,
+	   "Call names");
+}
+
+static void test_dump(void)
+{
+	char buf[65536];
+	FILE *f;
+	size_t len;
+
+	f = tmpfile();
+	if (!f)
+		abort();
+	ok(!rseq_syscall_prof_dump(fileno(f)), "Dump histograms");
+	rewind(f);
+	len = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[len] = '\0';
+	ok(strstr(buf, "write: count=") && strstr(buf, "futex: count=") &&
+	   strstr(buf, " ns: "), "Dump holds counts and buckets");
+	fclose(f);
+}
+
+int main(void)
+{
+	plan_tests(NR_TESTS);
+
+	diag("syscall profiler");
+	test_calls();
+	test_buckets();
+	test_dump();
+
+	exit(exit_status());
+}
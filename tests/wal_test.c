@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: LGPL-2.1-only
+/*
+ * Per-CPU write-ahead log test.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rseq/rseq.h>
+#include <rseq/wal.h>
+
+#include "tap.h"
+
+#define NR_TESTS 9
+
+#define NR_THREADS	8
+#define NR_RECORDS	2000
+#define SYNC_INTERVAL	100
+
+/*
+ * Each record holds its thread and sequence number, followed by a
+ * pattern of a length varying with the sequence number.
+ */
+struct wal_payload {
+	uint32_t thread;
+	uint32_t seq;
+	unsigned char pattern[64];
+};
+
+struct wal_test_data {
+	struct rseq_wal *wal;
+	int thread;
+	int nr_errors;
+	uint64_t lsn[NR_RECORDS];
+};
+
+static size_t payload_len(uint32_t seq)
+{
+	return offsetof(struct wal_payload, pattern) + seq % 64;
+}
+
+static void payload_init(struct wal_payload *payload, uint32_t thread, uint32_t seq)
+{
+	payload->thread = thread;
+	payload->seq = seq;
+	memset(payload->pattern, (unsigned char) (thread + seq), seq % 64);
+}
+
+void *test_wal_thread(void *arg)
+{
+	struct wal_test_data *data = arg;
+	struct wal_payload payload;
+	uint32_t i;
+
+	if (rseq_register_current_thread()) {
+		fprintf(stderr, "Error: rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	for (i = 0; i < NR_RECORDS; i++) {
+		payload_init(&payload, data->thread, i);
+		if (rseq_wal_append(data->wal, &payload, payload_len(i), &data->lsn[i]))
+			data->nr_errors++;
+		if (!((i + 1) % SYNC_INTERVAL) && rseq_wal_sync(data->wal))
+			data->nr_errors++;
+	}
+
+	if (rseq_unregister_current_thread()) {
+		fprintf(stderr, "Error: rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		abort();
+	}
+
+	return NULL;
+}
+
+/*
+ * Read back the log file and check that every record was written once,
+ * intact, with the LSN returned by its append.
+ */
+static void test_check_log(int fd, struct wal_test_data *data)
+{
+	static bool seen[NR_THREADS][NR_RECORDS];
+	size_t nr_records = 0, nr_bad = 0;
+	unsigned char *buf;
+	off_t len, offset;
+
+	len = lseek(fd, 0, SEEK_END);
+	buf = malloc(len ? len : 1);
+	if (!buf || pread(fd, buf, len, 0) != len)
+		abort();
+	for (offset = 0; offset + (off_t) sizeof(struct rseq_wal_record) <= len; ) {
+		struct rseq_wal_record record;
+		struct wal_payload payload, expect;
+
+		memcpy(&record, buf + offset, sizeof(record));
+		memset(&payload, 0, sizeof(payload));
+		memcpy(&payload, buf + offset + sizeof(record),
+		       record.len < sizeof(payload) ? record.len : sizeof(payload));
+		offset += (sizeof(record) + record.len + 7) & ~(size_t) 7;
+		nr_records++;
+		if (payload.thread >= NR_THREADS || payload.seq >= NR_RECORDS ||
+				seen[payload.thread][payload.seq]) {
+			nr_bad++;
+			continue;
+		}
+		seen[payload.thread][payload.seq] = true;
+		memset(&expect, 0, sizeof(expect));
+		payload_init(&expect, payload.thread, payload.seq);
+		if (record.len != payload_len(payload.seq) ||
+				memcmp(&payload, &expect, sizeof(payload)) ||
+				record.lsn != data[payload.thread].lsn[payload.seq])
+			nr_bad++;
+	}
+	ok(offset == len && nr_records == NR_THREADS * NR_RECORDS,
+	   "Log holds every record appended");
+	ok(!nr_bad, "Records are intact, written once, with their LSN");
+	free(buf);
+}
+
+static int test_lsn_cmp(const void *a, const void *b)
+{
+	uint64_t la = *(const uint64_t *) a, lb = *(const uint64_t *) b;
+
+	return la < lb ? -1 : la > lb;
+}
+
+static void test_wal_concurrent(int fd)
+{
+	static struct wal_test_data data[NR_THREADS];
+	static uint64_t lsn[NR_THREADS * NR_RECORDS];
+	pthread_t test_threads[NR_THREADS];
+	struct rseq_wal *wal;
+	int i, nr_errors = 0, nr_dup = 0;
+
+	errno = 0;
+	ok(!rseq_wal_create(fd, RSEQ_WAL_MAX_RECORD / 2, 16) && errno == EINVAL,
+	   "Buffers smaller than a record are rejected");
+
+	/* Small buffers, so appends also flush when they are full. */
+	wal = rseq_wal_create(fd, RSEQ_WAL_MAX_RECORD, 16);
+	ok(wal != NULL, "Create log");
+	if (!wal)
+		abort();
+	for (i = 0; i < NR_THREADS; i++) {
+		data[i].wal = wal;
+		data[i].thread = i;
+		pthread_create(&test_threads[i], NULL, test_wal_thread, &data[i]);
+	}
+	for (i = 0; i < NR_THREADS; i++) {
+		pthread_join(test_threads[i], NULL);
+		nr_errors += data[i].nr_errors;
+	}
+	ok(!nr_errors && !rseq_wal_sync(wal), "Concurrent appends and syncs");
+
+	for (i = 0; i < NR_THREADS; i++)
+		memcpy(&lsn[i * NR_RECORDS], data[i].lsn, sizeof(data[i].lsn));
+	qsort(lsn, NR_THREADS * NR_RECORDS, sizeof(lsn[0]), test_lsn_cmp);
+	for (i = 1; i < NR_THREADS * NR_RECORDS; i++) {
+		if (lsn[i] == lsn[i - 1])
+			nr_dup++;
+	}
+	ok(!nr_dup, "LSNs are unique");
+	test_check_log(fd, data);
+	ok(rseq_wal_nr_syncs(wal) >= 1, "Log file synced");
+
+	errno = 0;
+	ok(rseq_wal_append(wal, data, RSEQ_WAL_MAX_RECORD, NULL) == -1 &&
+	   errno == EINVAL, "Oversized records are rejected");
+	rseq_wal_destroy(wal);
+}
+
+int main(void)
+{
+	char path[] = "/tmp/rseq-wal-test-XXXXXX";
+	struct rseq_wal *wal;
+	int fd;
+
+	plan_tests(NR_TESTS);
+
+	if (!rseq_available()) {
+		skip(NR_TESTS, "The rseq syscall is unavailable");
+		goto end;
+	}
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		abort();
+	unlink(path);
+
+	wal = rseq_wal_create(fd, RSEQ_WAL_MAX_RECORD, 16);
+	if (!wal && errno == ENOSYS) {
+		skip(NR_TESTS, "rseq membarrier is unavailable");
+		goto end;
+	}
+	rseq_wal_destroy(wal);
+
+	if (rseq_register_current_thread()) {
+		fail("rseq_register_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	}
+
+	diag("per-CPU write-ahead log");
+	test_wal_concurrent(fd);
+	close(fd);
+
+	if (rseq_unregister_current_thread()) {
+		fail("rseq_unregister_current_thread(...) failed(%d): %s\n",
+			errno, strerror(errno));
+		goto end;
+	} else {
+		pass("Unregistered current thread with rseq");
+	}
+
+end:
+	exit(exit_status());
+}